@@ -22,4 +22,4 @@ include $(APRIL_PATH)/src/raytracer/Rules.mk
 include $(APRIL_PATH)/src/velodyne/Rules.mk
 #include $(APRIL_PATH)/src/viewer/Rules.mk
 include $(APRIL_PATH)/src/vx/Rules.mk
-#include $(APRIL_PATH)/src/sim/Rules.mk
+include $(APRIL_PATH)/src/sim/Rules.mk
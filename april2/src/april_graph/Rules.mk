@@ -17,3 +17,5 @@ graph_clean:
 all: graph
 
 clean: graph_clean
+
+include $(APRIL_PATH)/src/april_graph/test/Rules.mk
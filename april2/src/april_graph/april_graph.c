@@ -29,6 +29,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/math_util.h"
 #include "common/string_util.h"
 #include "common/timeprofile.h"
+#include "common/instrument.h"
 #include "common/smatd.h"
 #include "common/doubles.h"
 
@@ -317,8 +318,13 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
         memcpy(&param, _param, sizeof(april_graph_cholesky_param_t));
     }
 
-    timeprofile_t *tp = timeprofile_create();
-    timeprofile_stamp(tp, "begin");
+    // stages always feed the instrumentation histograms; the detailed
+    // profile is only kept when asked for.
+    timeprofile_t *tp = param.show_timing ? timeprofile_create() : NULL;
+    if (tp)
+        timeprofile_stamp(tp, "begin");
+    INSTRUMENT_SPAN_BEGIN(ns_begin);
+    INSTRUMENT_SPAN_BEGIN(ns_stage);
 
     int *allocated_ordering = NULL; // we'll free this one.
     int *use_ordering = param.ordering; // this could be from .param or one we create.
@@ -337,7 +343,8 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
             }
         }
 
-        timeprofile_stamp(tp, "make symbolic");
+        if (tp)
+            timeprofile_stamp(tp, "make symbolic");
 
         allocated_ordering = exact_minimum_degree_ordering(Asym);
         use_ordering = allocated_ordering;
@@ -359,26 +366,38 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
     if (allocated_ordering)
         free(allocated_ordering);
 
-    timeprofile_stamp(tp, "compute ordering");
+    if (tp)
+        timeprofile_stamp(tp, "compute ordering");
+    INSTRUMENT_SPAN_NEXT("april_graph.cholesky.ordering", ns_stage);
 
     // we'll solve normal equations, Ax = B
     smatd_t *A = smatd_create(xlen, xlen);
     double  *B = calloc(xlen, sizeof(double));
 
+    // parsed once; temporaries are only resized when the factor
+    // dimensions change.
+    matd_plan_t *JatW_plan = matd_op_compile("M'*M");
+    matd_plan_t *JatWJb_plan = matd_op_compile("M*M");
+    matd_plan_t *JatWr_plan = matd_op_compile("M*M");
+
     for (int i = 0; i < zarray_size(graph->factors); i++) {
         april_graph_factor_t *factor;
         zarray_get(graph->factors, i, &factor);
         april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
 
+        matd_t *R = matd_create_data(eval->length, 1, eval->r);
+
         for (int z0 = 0; z0 < factor->nnodes; z0++) {
             int n0 = factor->nodes[z0];
 
-            matd_t *JatW = matd_op("M'*M", eval->jacobians[z0], eval->W);
+            matd_t *JatW = matd_plan_eval(JatW_plan, NULL, eval->jacobians[z0], eval->W);
+            assert(JatW != NULL);
 
             for (int z1 = 0; z1 < factor->nnodes; z1++) {
                 int n1 = factor->nodes[z1];
 
-                matd_t *JatWJb = matd_op("M*M", JatW, eval->jacobians[z1]);
+                matd_t *JatWJb = matd_plan_eval(JatWJb_plan, NULL, JatW, eval->jacobians[z1]);
+                assert(JatWJb != NULL);
 
                 for (int row = 0; row < JatWJb->nrows; row++) {
                     for (int col = 0; col < JatWJb->ncols; col++) {
@@ -387,22 +406,22 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
                     }
                 }
 
-                matd_destroy(JatWJb);
             }
 
-            matd_t *R = matd_create_data(eval->length, 1, eval->r);
-            matd_t *JatWr = matd_op("M*M", JatW, R);
+            matd_t *JatWr = matd_plan_eval(JatWr_plan, NULL, JatW, R);
+            assert(JatWr != NULL);
             for (int row = 0; row < JatWr->nrows; row++)
                 B[idxs[n0]+row] += MATD_EL(JatWr, row, 0);
-
-            matd_destroy(R);
-            matd_destroy(JatW);
-            matd_destroy(JatWr);
         }
 
+        matd_destroy(R);
         april_graph_factor_eval_destroy(eval);
     }
 
+    matd_plan_destroy(JatW_plan);
+    matd_plan_destroy(JatWJb_plan);
+    matd_plan_destroy(JatWr_plan);
+
     // tikhanov regularization
     // Ensure a maximum condition number of no more than maxcond.
     // trace(A) = sum of eigenvalues. worst-case scenario is that
@@ -430,7 +449,9 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
         }
     }
 
-    timeprofile_stamp(tp, "build A, B");
+    if (tp)
+        timeprofile_stamp(tp, "build A, B");
+    INSTRUMENT_SPAN_NEXT("april_graph.cholesky.build", ns_stage);
 
     smatd_chol_t *chol = smatd_chol(A);
     double *x = calloc(xlen, sizeof(double));
@@ -443,7 +464,9 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
         node->update(node, &x[idxs[i]]);
     }
 
-    timeprofile_stamp(tp, "solve");
+    if (tp)
+        timeprofile_stamp(tp, "solve");
+    INSTRUMENT_SPAN_END("april_graph.cholesky.solve", ns_stage);
 
     smatd_chol_destroy(chol);
     smatd_destroy(A);
@@ -452,9 +475,12 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
     free(x);
     free(idxs);
 
-    if (param.show_timing)
+    INSTRUMENT_SPAN_END("april_graph.cholesky", ns_begin);
+
+    if (tp) {
         timeprofile_display(tp);
-    timeprofile_destroy(tp);
+        timeprofile_destroy(tp);
+    }
 }
 
 april_graph_gauss_seidel_info_t *april_graph_gauss_seidel_info_create(april_graph_t *graph)
@@ -465,28 +491,112 @@ april_graph_gauss_seidel_info_t *april_graph_gauss_seidel_info_create(april_grap
     int nfactors = zarray_size(graph->factors);
 
     /////////////////////////////////////////////////////
-    // make a list of the factors that affect each node.
-    zarray_t *allneighbors = zarray_create(sizeof(zarray_t*));
-    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++) {
-        zarray_t *neighbors = zarray_create(sizeof(int));
-        zarray_add(allneighbors, &neighbors);
+    // make a list of the factors that affect each node, stored
+    // contiguously by node (counting pass, then filling pass).
+    int *adj_offsets = calloc(nnodes + 1, sizeof(int));
+
+    for (int factoridx = 0; factoridx < nfactors; factoridx++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, factoridx, &factor);
+
+        for (int z0 = 0; z0 < factor->nnodes; z0++)
+            adj_offsets[factor->nodes[z0] + 1]++;
     }
 
+    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++)
+        adj_offsets[nodeidx + 1] += adj_offsets[nodeidx];
+
+    int nadj = adj_offsets[nnodes];
+    int *adj_factors = malloc((nadj + 1) * sizeof(int));
+    int *adj_z = malloc((nadj + 1) * sizeof(int));
+    int *fill = malloc((nnodes + 1) * sizeof(int));
+    memcpy(fill, adj_offsets, nnodes * sizeof(int));
+
     for (int factoridx = 0; factoridx < nfactors; factoridx++) {
         april_graph_factor_t *factor;
         zarray_get(graph->factors, factoridx, &factor);
 
         for (int z0 = 0; z0 < factor->nnodes; z0++) {
-            int n0 = factor->nodes[z0];
-            zarray_t *neighbors;
-            zarray_get(allneighbors, n0, &neighbors);
-            zarray_add(neighbors, &factoridx);
+            int a = fill[factor->nodes[z0]]++;
+            adj_factors[a] = factoridx;
+            adj_z[a] = z0;
+        }
+    }
+
+    /////////////////////////////////////////////////////
+    // greedy coloring in node order: each node takes the smallest
+    // color not used by a node it shares a factor with.
+    int *colors = malloc((nnodes + 1) * sizeof(int));
+    int *used = malloc((nnodes + 1) * sizeof(int)); // used[c] == nodeidx: taken
+    int ncolors = 0;
+
+    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++) {
+        colors[nodeidx] = -1;
+        used[nodeidx] = -1;
+    }
+
+    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++) {
+        for (int a = adj_offsets[nodeidx]; a < adj_offsets[nodeidx + 1]; a++) {
+            april_graph_factor_t *factor;
+            zarray_get(graph->factors, adj_factors[a], &factor);
+
+            for (int z1 = 0; z1 < factor->nnodes; z1++) {
+                int c = colors[factor->nodes[z1]];
+                if (c >= 0)
+                    used[c] = nodeidx;
+            }
         }
+
+        int c = 0;
+        while (used[c] == nodeidx)
+            c++;
+        colors[nodeidx] = c;
+        ncolors = imax(ncolors, c + 1);
     }
 
-    info->allneighbors = allneighbors;
+    // bucket the nodes by color, keeping node order within a color.
+    int *color_offsets = calloc(ncolors + 1, sizeof(int));
+    int *color_nodes = malloc((nnodes + 1) * sizeof(int));
+
+    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++)
+        color_offsets[colors[nodeidx] + 1]++;
+    for (int c = 0; c < ncolors; c++)
+        color_offsets[c + 1] += color_offsets[c];
+
+    memcpy(fill, color_offsets, ncolors * sizeof(int));
+    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++)
+        color_nodes[fill[colors[nodeidx]]++] = nodeidx;
+
+    free(used);
+    free(colors);
+    free(fill);
+
+    /////////////////////////////////////////////////////
+    // per-node accumulators, packed together in one arena.
+    info->arena = arena_create(0);
+    info->JtWJ = calloc(nnodes + 1, sizeof(matd_t*));
+    info->JtWr = calloc(nnodes + 1, sizeof(matd_t*));
+
+    arena_t *old = matd_use_arena(info->arena);
+    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, nodeidx, &node);
+
+        info->JtWJ[nodeidx] = matd_create(node->length, node->length);
+        info->JtWr[nodeidx] = matd_create(node->length, 1);
+    }
+    matd_use_arena(old);
+
+    info->nnodes = nnodes;
+    info->adj_offsets = adj_offsets;
+    info->adj_factors = adj_factors;
+    info->adj_z = adj_z;
+    info->ncolors = ncolors;
+    info->color_offsets = color_offsets;
+    info->color_nodes = color_nodes;
     info->nevals = nfactors;
     info->evals = calloc(nfactors, sizeof(april_graph_factor_eval_t*));
+    info->nthreads = 1;
 
     return info;
 }
@@ -496,12 +606,18 @@ void april_graph_gauss_seidel_info_destroy(april_graph_gauss_seidel_info_t *info
     if (!info)
         return;
 
-    for (int i = 0; i < zarray_size(info->allneighbors); i++) {
-        zarray_t *neighbors;
-        zarray_get(info->allneighbors, i, &neighbors);
-        zarray_destroy(neighbors);
-    }
-    zarray_destroy(info->allneighbors);
+    workerpool_destroy(info->wp);
+
+    free(info->adj_offsets);
+    free(info->adj_factors);
+    free(info->adj_z);
+    free(info->color_offsets);
+    free(info->color_nodes);
+
+    // the accumulators themselves live in the arena.
+    free(info->JtWJ);
+    free(info->JtWr);
+    arena_destroy(info->arena);
 
     for (int i = 0; i < info->nevals; i++)
         april_graph_factor_eval_destroy(info->evals[i]);
@@ -509,105 +625,133 @@ void april_graph_gauss_seidel_info_destroy(april_graph_gauss_seidel_info_t *info
     free(info);
 }
 
-void april_graph_gauss_seidel(april_graph_t *graph, april_graph_gauss_seidel_info_t *info)
+// Moves one node to the minimum of its factors. Reads the neighbors'
+// state, and writes only this node and the evals of its factors, so
+// nodes of one color can run concurrently.
+static void gauss_seidel_node(april_graph_t *graph, april_graph_gauss_seidel_info_t *info, int nodeidx)
 {
-    int nnodes = zarray_size(graph->nodes);
-    int nfactors = zarray_size(graph->factors);
+    int a0 = info->adj_offsets[nodeidx], a1 = info->adj_offsets[nodeidx + 1];
 
-    zarray_t *allneighbors = info->allneighbors;
+    // it won't be solvable if there are no constraints. This is a
+    // sufficient but not necessary condition to eliminate
+    // under-constrained solves.
+    if (a0 == a1)
+        return;
 
-    /////////////////////////////////////////////////////
-    // TODO: What is a better order for evaluating nodes?
-    for (int nodeidx = 0; nodeidx < nnodes; nodeidx++) {
-        april_graph_node_t *node;
-        zarray_get(graph->nodes, nodeidx, &node);
+    april_graph_node_t *node;
+    zarray_get(graph->nodes, nodeidx, &node);
 
-        matd_t *JtWJ = matd_create(node->length, node->length);
-        matd_t *JtWr = matd_create(node->length, 1);
+    matd_t *JtWJ = info->JtWJ[nodeidx];
+    matd_t *JtWr = info->JtWr[nodeidx];
+    int N = node->length;
 
-        zarray_t *neighbors;
-        zarray_get(allneighbors, nodeidx, &neighbors);
+    memset(JtWJ->data, 0, N*N*sizeof(double));
+    memset(JtWr->data, 0, N*sizeof(double));
 
-        // it won't be solvable if there are no constraints. This is a
-        // sufficient but not necessary condition to eliminate
-        // under-constrained solves.
-        if (zarray_size(neighbors) == 0)
-            continue;
+    for (int a = a0; a < a1; a++) {
+        int factoridx = info->adj_factors[a];
+        int z0 = info->adj_z[a];
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, factoridx, &factor);
 
-        int nn = min(100, zarray_size(neighbors));
+        // try to recycle "eval" objects as much as we can, noting that
+        // we can only recycle eval objects on factors of the same type.
+        april_graph_factor_eval_t *eval = info->evals[factoridx];
+        eval = factor->eval(factor, graph, eval);
+        info->evals[factoridx] = eval;
+
+        // M: observation dimension
+        // N: state dimension
+        //
+        // J: M x N,  J': N x M
+        // W: M x M
+        // R: M x 1
+        // J'W: N x M
+        // J'WR: N x 1
+        // J'WJ: N x N
+        int M = factor->length;
+
+        double thisJtW[N*M], thisJtWJ[N*N], thisJtWr[N];
+
+        doubles_mat_AtB(eval->jacobians[z0]->data, M, N, eval->W->data, M, M,
+                        thisJtW, N, M);
+        doubles_mat_AB(thisJtW, N, M, eval->jacobians[z0]->data, M, N,
+                       thisJtWJ, N, N);
+        doubles_mat_Ab(thisJtW, N, M, eval->r, M, thisJtWr, N);
+
+        doubles_mat_add(JtWJ->data, N, N, thisJtWJ, N, N,
+                        JtWJ->data, N, N);
+        doubles_mat_add(JtWr->data, N, 1, thisJtWr, N, 1,
+                        JtWr->data, N, 1);
+    }
 
-        for (int neighboridx = 0; neighboridx < nn; neighboridx++) {
-            int factoridx;
-            zarray_get(neighbors, neighboridx, &factoridx);
-            april_graph_factor_t *factor;
-            zarray_get(graph->factors, factoridx, &factor);
-
-            for (int z0 = 0; z0 < factor->nnodes; z0++) {
-                int n0 = factor->nodes[z0];
-                if (n0 == nodeidx) {
-
-                    // try to recycle "eval" objects as much as we can, noting that
-                    // we can only recycle eval objects on factors of the same type.
-                    april_graph_factor_eval_t *eval = info->evals[factoridx];
-                    eval = factor->eval(factor, graph, eval);
-                    info->evals[factoridx] = eval;
-
-                    if (0) {
-                        matd_t *thisJtW = matd_op("M'*M", eval->jacobians[z0], eval->W);
-                        matd_t *thisJtWJ = matd_op("M*M", thisJtW, eval->jacobians[z0]);
-                        matd_t *thisR = matd_create_data(eval->length, 1, eval->r);
-                        matd_t *thisJtWr = matd_op("M*M", thisJtW, thisR);
-
-                        matd_add_inplace(JtWJ, thisJtWJ);
-                        matd_add_inplace(JtWr, thisJtWr);
-
-                        matd_destroy(thisJtW);
-                        matd_destroy(thisJtWJ);
-                        matd_destroy(thisR);
-                        matd_destroy(thisJtWr);
-                    } else {
-                        // M: observation dimension
-                        // N: state dimension
-                        //
-                        // J: M x N,  J': N x M
-                        // W: M x M
-                        // R: M x 1
-                        // J'W: N x M
-                        // J'WR: N x 1
-                        // J'WJ: N x N
-                        int N = node->length;
-                        int M = factor->length;
-
-                        double thisJtW[N*M], thisJtWJ[N*N], thisJtWr[N];
-
-                        doubles_mat_AtB(eval->jacobians[z0]->data, M, N, eval->W->data, M, M,
-                                        thisJtW, N, M);
-                        doubles_mat_AB(thisJtW, N, M, eval->jacobians[z0]->data, M, N,
-                                       thisJtWJ, N, N);
-                        doubles_mat_Ab(thisJtW, N, M, eval->r, M, thisJtWr, N);
-
-                        doubles_mat_add(JtWJ->data, N, N, thisJtWJ, N, N,
-                                        JtWJ->data, N, N);
-                        doubles_mat_add(JtWr->data, N, 1, thisJtWr, N, 1,
-                                        JtWr->data, N, 1);
-                    }
-                }
-            }
-        }
+    // the solve's temporaries stay in this thread's arena.
+    arena_t *tmp = arena_thread();
+    arena_checkpoint_t cp = arena_checkpoint(tmp);
+    arena_t *old = matd_use_arena(tmp);
 
-        matd_t *dx = matd_solve(JtWJ, JtWr);
+    matd_t *dx = matd_solve(JtWJ, JtWr);
 
-        // over-relaxation
-        if (0) {
-            for (int i = 0; i < dx->nrows; i++)
-                MATD_EL(dx, i, 0) *= 1.1;
+    matd_use_arena(old);
+
+    node->update(node, dx->data);
+
+    if (old != tmp)
+        arena_restore(tmp, cp);
+}
+
+struct gauss_seidel_task
+{
+    april_graph_t *graph;
+    april_graph_gauss_seidel_info_t *info;
+    int i0, i1; // range of info->color_nodes
+};
+
+static void gauss_seidel_task(void *p)
+{
+    struct gauss_seidel_task *task = p;
+
+    for (int i = task->i0; i < task->i1; i++)
+        gauss_seidel_node(task->graph, task->info, task->info->color_nodes[i]);
+}
+
+void april_graph_gauss_seidel(april_graph_t *graph, april_graph_gauss_seidel_info_t *info)
+{
+    assert(info->nnodes == zarray_size(graph->nodes));
+
+    if (info->nthreads > 1 && (info->wp == NULL || info->nthreads != workerpool_get_nthreads(info->wp))) {
+        workerpool_destroy(info->wp);
+        info->wp = workerpool_create(info->nthreads);
+    }
+
+    // colors smaller than this aren't worth handing to the pool.
+    const int min_chunk = 16;
+
+    for (int c = 0; c < info->ncolors; c++) {
+        int i0 = info->color_offsets[c], i1 = info->color_offsets[c + 1];
+        int n = i1 - i0;
+
+        if (info->nthreads <= 1 || n < 2*min_chunk) {
+            struct gauss_seidel_task task = { .graph = graph, .info = info, .i0 = i0, .i1 = i1 };
+            gauss_seidel_task(&task);
+            continue;
         }
 
-        node->update(node, dx->data);
-        matd_destroy(dx);
+        // a few chunks per thread, to balance nodes of uneven degree.
+        int ntasks = imin(4*info->nthreads, n / min_chunk);
+        struct gauss_seidel_task tasks[ntasks];
+
+        for (int t = 0; t < ntasks; t++) {
+            tasks[t] = (struct gauss_seidel_task) {
+                .graph = graph,
+                .info = info,
+                .i0 = i0 + (int) ((int64_t) n * t / ntasks),
+                .i1 = i0 + (int) ((int64_t) n * (t + 1) / ntasks),
+            };
+            workerpool_add_task(info->wp, gauss_seidel_task, &tasks[t]);
+        }
 
-        matd_destroy(JtWJ);
-        matd_destroy(JtWr);
+        workerpool_run(info->wp);
     }
 }
 
@@ -717,7 +861,7 @@ static void attr_add(april_graph_attr_t **attr, const stype_t *stype, const char
     if (*attr == NULL)
         *attr = april_graph_attr_create();
 
-    zhash_t *hash = (*attr)->hash;
+    april_graph_attr_hash_t *hash = (*attr)->hash;
 
     struct april_graph_attr_record record = { .stype = stype,
                                               .value = value };
@@ -726,7 +870,7 @@ static void attr_add(april_graph_attr_t **attr, const stype_t *stype, const char
     char *oldkey;
     struct april_graph_attr_record oldrecord;
 
-    if (zhash_put(hash, &keycopy, &record, &oldkey, &oldrecord)) {
+    if (april_graph_attr_hash_put(hash, &keycopy, &record, &oldkey, &oldrecord)) {
         // free the old value
         if (oldrecord.value == NULL) {
             // nothing to do when adding a value when only a NULL
@@ -747,7 +891,7 @@ static void *attr_get(april_graph_attr_t *attr, const char *key)
         return NULL;
 
     struct april_graph_attr_record record;
-    if (zhash_get(attr->hash, &key, &record))
+    if (april_graph_attr_hash_get(attr->hash, (char**) &key, &record))
         return record.value;
 
     return NULL;
@@ -792,11 +936,11 @@ static void april_graph_attr_encode(const stype_t *stype, uint8_t *data, uint32_
 {
     const april_graph_attr_t *attr = obj;
 
-    zhash_iterator_t zit;
-    zhash_iterator_init(attr->hash, &zit);
+    april_graph_attr_hash_iterator_t it;
+    april_graph_attr_hash_iterator_init(attr->hash, &it);
     char *name;
     struct april_graph_attr_record record;
-    while (zhash_iterator_next(&zit, &name, &record)) {
+    while (april_graph_attr_hash_iterator_next(&it, &name, &record)) {
         if (record.stype) {
             encode_u8(data, datapos, 1); // pompeil flag
             encode_string_u32(data, datapos, name);
@@ -818,7 +962,7 @@ static void *april_graph_attr_decode(const stype_t *stype, const uint8_t *data,
         char *key = decode_string_u32(data, datapos, datalen);
         record.value = stype_decode_object(data, datapos, datalen, &record.stype);
 
-        zhash_put(attr->hash, &key, &record, NULL, NULL);
+        april_graph_attr_hash_put(attr->hash, &key, &record, NULL, NULL);
     }
 
     return attr;
@@ -833,8 +977,7 @@ april_graph_attr_t *april_graph_attr_create()
 {
     april_graph_attr_t *attr = calloc(1, sizeof(april_graph_attr_t));
     attr->stype = &stype_april_graph_attr;
-    attr->hash = zhash_create(sizeof(char*), sizeof(struct april_graph_attr_record),
-                              zhash_str_hash, zhash_str_equals);
+    attr->hash = april_graph_attr_hash_create();
     return attr;
 }
 
@@ -843,7 +986,7 @@ void april_graph_attr_destroy(april_graph_attr_t *attr)
     if (!attr)
         return;
 
-    zhash_destroy(attr->hash);
+    april_graph_attr_hash_destroy(attr->hash);
     free(attr);
 }
 
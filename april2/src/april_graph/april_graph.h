@@ -25,7 +25,9 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include "common/zarray.h"
 #include "common/zhash.h"
+#include "common/hash_util.h"
 #include "common/matd.h"
+#include "common/workerpool.h"
 #include "common/stype.h"
 
 /////////////////////////////////////////////////////////////
@@ -37,10 +39,22 @@ struct april_graph_attr_record
     void          *value;
 };
 
+#define TNAME april_graph_attr_hash
+#define TKEYTYPE char*
+#define TVALTYPE struct april_graph_attr_record
+#define TKEYHASH(pk) hash_str(*(pk))
+#define TKEYEQUAL(pka, pkb) (!strcmp(*(pka), *(pkb)))
+#include "common/tswiss_impl.h"
+#undef TKEYEQUAL
+#undef TKEYHASH
+#undef TVALTYPE
+#undef TKEYTYPE
+#undef TNAME
+
 typedef struct april_graph_attr april_graph_attr_t;
 struct april_graph_attr
 {
-    zhash_t *hash;
+    april_graph_attr_hash_t *hash; // char* => struct april_graph_attr_record
     const stype_t *stype;
 };
 
@@ -196,17 +210,49 @@ void april_graph_destroy(april_graph_t *graph);
 
 void april_graph_factor_eval_destroy(april_graph_factor_eval_t *eval);
 
+// Precomputed structure for Gauss-Seidel sweeps over a graph whose
+// nodes and factors don't change (rebuild it when they do).
 typedef struct april_graph_gauss_seidel_info april_graph_gauss_seidel_info_t;
 struct april_graph_gauss_seidel_info
 {
-    zarray_t *allneighbors;
+    // The factors touching each node, stored contiguously by node:
+    // node n owns entries [adj_offsets[n], adj_offsets[n+1]) of
+    // adj_factors (factor index) and adj_z (n's position in that
+    // factor's nodes).
+    int nnodes;
+    int *adj_offsets;
+    int *adj_factors;
+    int *adj_z;
+
+    // Nodes grouped by color: nodes of one color never share a
+    // factor, so they can be updated in parallel. Color c holds
+    // color_nodes[color_offsets[c] .. color_offsets[c+1]).
+    int ncolors;
+    int *color_offsets;
+    int *color_nodes;
+
+    // per-node normal equations, allocated once from 'arena'.
+    matd_t **JtWJ;
+    matd_t **JtWr;
+    arena_t *arena;
+
     int nevals;
     april_graph_factor_eval_t **evals;
+
+    // Threads used to update each color (default 1). May be changed
+    // between sweeps.
+    int nthreads;
+    workerpool_t *wp;
 };
 
 april_graph_gauss_seidel_info_t *april_graph_gauss_seidel_info_create(april_graph_t *graph);
 void april_graph_gauss_seidel_info_destroy(april_graph_gauss_seidel_info_t *info);
 
+// One Gauss-Seidel sweep: every constrained node is moved to the
+// minimum of its factors with its neighbors held fixed, one color at
+// a time. The result does not depend on info->nthreads. Cheap enough
+// to run as a real-time approximate solver, or for a few sweeps as a
+// warm start before april_graph_cholesky() on large graphs.
 void april_graph_gauss_seidel(april_graph_t *graph, april_graph_gauss_seidel_info_t *info);
 
 typedef struct april_graph_cholesky_param april_graph_cholesky_param_t;
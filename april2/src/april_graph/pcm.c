@@ -0,0 +1,323 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "pcm.h"
+
+/////////////////////////////////////////////////
+// consistency graph: one bitset row per candidate
+struct graph
+{
+    int n;
+    int words;      // 64-bit words per row
+    uint64_t *adj;  // n * words
+    int *degree;
+
+    int (*consistent)(int a, int b, void *user);
+    void *user;
+
+    // size of the best clique found so far, shared between tasks
+    int best;
+};
+
+static inline uint64_t *row(struct graph *g, int i)
+{
+    return &g->adj[(size_t) i * g->words];
+}
+
+static inline int has_edge(struct graph *g, int i, int j)
+{
+    return (row(g, i)[j >> 6] >> (j & 63)) & 1;
+}
+
+struct task
+{
+    struct graph *g;
+    int first, stride;
+
+    // clique search scratch and result
+    uint64_t *cand;
+    int *clique;
+    int *best_clique;
+    int best_size;
+};
+
+// Fills the upper triangle of the rows owned by the task. Rows are
+// strided across tasks so the triangle's work is balanced.
+static void build_task(void *p)
+{
+    struct task *t = p;
+    struct graph *g = t->g;
+
+    for (int i = t->first; i < g->n; i += t->stride) {
+        uint64_t *r = row(g, i);
+        for (int j = i + 1; j < g->n; j++) {
+            if (g->consistent(i, j, g->user))
+                r[j >> 6] |= 1ULL << (j & 63);
+        }
+    }
+}
+
+static void search_task(void *p)
+{
+    struct task *t = p;
+    struct graph *g = t->g;
+
+    for (int v = t->first; v < g->n; v += t->stride) {
+        int best = __atomic_load_n(&g->best, __ATOMIC_RELAXED);
+
+        // a clique through v has at most degree+1 members
+        if (g->degree[v] + 1 <= best)
+            continue;
+
+        int ncand = 0;
+        uint64_t *rv = row(g, v);
+        for (int w = 0; w < g->words; w++) {
+            uint64_t bits = rv[w];
+            uint64_t keep = 0;
+            while (bits) {
+                int b = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (g->degree[w*64 + b] + 1 > best)
+                    keep |= 1ULL << b;
+            }
+            t->cand[w] = keep;
+            ncand += __builtin_popcountll(keep);
+        }
+
+        int size = 0;
+        t->clique[size++] = v;
+
+        while (ncand > 0 && size + ncand > best) {
+            // greedily take the candidate of highest degree
+            int u = -1;
+            for (int w = 0; w < g->words; w++) {
+                uint64_t bits = t->cand[w];
+                while (bits) {
+                    int b = __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    int c = w*64 + b;
+                    if (u < 0 || g->degree[c] > g->degree[u])
+                        u = c;
+                }
+            }
+
+            t->clique[size++] = u;
+
+            uint64_t *ru = row(g, u);
+            ncand = 0;
+            for (int w = 0; w < g->words; w++) {
+                t->cand[w] &= ru[w];
+                ncand += __builtin_popcountll(t->cand[w]);
+            }
+        }
+
+        if (size > best && size > t->best_size) {
+            t->best_size = size;
+            memcpy(t->best_clique, t->clique, sizeof(int) * size);
+
+            // publish, unless another task got further meanwhile
+            int cur = __atomic_load_n(&g->best, __ATOMIC_RELAXED);
+            while (size > cur &&
+                   !__atomic_compare_exchange_n(&g->best, &cur, size, 0,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        }
+    }
+}
+
+static int int_compare(const void *a, const void *b)
+{
+    return *(const int*) a - *(const int*) b;
+}
+
+// lexicographic comparison of two int arrays of length n
+static int memcmp_ints(const int *a, const int *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+pcm_t *pcm_create(int nthreads)
+{
+    // workerpool_get_nprocs() reports the highest processor index
+    if (nthreads <= 0)
+        nthreads = workerpool_get_nprocs() + 1;
+
+    pcm_t *pcm = calloc(1, sizeof(pcm_t));
+    pcm->wp = workerpool_create(nthreads);
+    pcm->min_parallel = 64;
+    return pcm;
+}
+
+void pcm_destroy(pcm_t *pcm)
+{
+    if (pcm == NULL)
+        return;
+
+    workerpool_destroy(pcm->wp);
+    free(pcm);
+}
+
+zarray_t *pcm_max_clique(pcm_t *pcm, int n,
+                         int (*consistent)(int a, int b, void *user), void *user)
+{
+    zarray_t *inliers = zarray_create(sizeof(int));
+    if (n <= 0)
+        return inliers;
+
+    struct graph g = { .n = n,
+                       .words = (n + 63) / 64,
+                       .consistent = consistent,
+                       .user = user,
+                       .best = 0 };
+    g.adj = calloc((size_t) n * g.words, sizeof(uint64_t));
+    g.degree = calloc(n, sizeof(int));
+
+    int parallel = n >= pcm->min_parallel;
+    int ntasks = parallel ? 4 * workerpool_get_nthreads(pcm->wp) : 1;
+    if (ntasks > n)
+        ntasks = n;
+
+    struct task *tasks = calloc(ntasks, sizeof(struct task));
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].g = &g;
+        tasks[i].first = i;
+        tasks[i].stride = ntasks;
+    }
+
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(pcm->wp, build_task, &tasks[i]);
+    if (parallel)
+        workerpool_run(pcm->wp);
+    else
+        workerpool_run_single(pcm->wp);
+
+    // mirror the upper triangle and count degrees
+    for (int i = 0; i < n; i++) {
+        uint64_t *r = row(&g, i);
+        for (int w = (i + 1) >> 6; w < g.words; w++) {
+            uint64_t bits = r[w];
+            while (bits) {
+                int j = w*64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                if (j <= i)
+                    continue;
+                row(&g, j)[i >> 6] |= 1ULL << (i & 63);
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        uint64_t *r = row(&g, i);
+        for (int w = 0; w < g.words; w++)
+            g.degree[i] += __builtin_popcountll(r[w]);
+    }
+
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].cand = calloc(g.words, sizeof(uint64_t));
+        tasks[i].clique = calloc(n, sizeof(int));
+        tasks[i].best_clique = calloc(n, sizeof(int));
+        workerpool_add_task(pcm->wp, search_task, &tasks[i]);
+    }
+    if (parallel)
+        workerpool_run(pcm->wp);
+    else
+        workerpool_run_single(pcm->wp);
+
+    // Ties go to the lowest sorted index set, not to whichever task
+    // happened to finish first. (Which cliques the tasks find still
+    // depends on timing through the shared bound; see pcm.h.)
+    struct task *best = &tasks[0];
+    for (int i = 0; i < ntasks; i++)
+        qsort(tasks[i].best_clique, tasks[i].best_size, sizeof(int), int_compare);
+    for (int i = 1; i < ntasks; i++) {
+        if (tasks[i].best_size > best->best_size ||
+            (tasks[i].best_size == best->best_size &&
+             memcmp_ints(tasks[i].best_clique, best->best_clique, best->best_size) < 0))
+            best = &tasks[i];
+    }
+
+    for (int i = 0; i < best->best_size; i++)
+        zarray_add(inliers, &best->best_clique[i]);
+
+    for (int i = 0; i < ntasks; i++) {
+        free(tasks[i].cand);
+        free(tasks[i].clique);
+        free(tasks[i].best_clique);
+    }
+    free(tasks);
+    free(g.adj);
+    free(g.degree);
+
+    return inliers;
+}
+
+/////////////////////////////////////////////////
+struct factor_consistency
+{
+    const zarray_t *factors;
+    int (*consistent)(const april_graph_factor_t *a, const april_graph_factor_t *b, void *user);
+    void *user;
+};
+
+static int factor_consistent(int a, int b, void *user)
+{
+    struct factor_consistency *fc = user;
+    april_graph_factor_t *fa, *fb;
+    zarray_get(fc->factors, a, &fa);
+    zarray_get(fc->factors, b, &fb);
+    return fc->consistent(fa, fb, fc->user);
+}
+
+zarray_t *pcm_select_factors(pcm_t *pcm, const zarray_t *factors,
+                             int (*consistent)(const april_graph_factor_t *a,
+                                               const april_graph_factor_t *b,
+                                               void *user),
+                             void *user)
+{
+    struct factor_consistency fc = { .factors = factors,
+                                     .consistent = consistent,
+                                     .user = user };
+
+    zarray_t *idxs = pcm_max_clique(pcm, zarray_size(factors), factor_consistent, &fc);
+
+    zarray_t *inliers = zarray_create(sizeof(april_graph_factor_t*));
+    for (int i = 0; i < zarray_size(idxs); i++) {
+        int idx;
+        zarray_get(idxs, i, &idx);
+        april_graph_factor_t *factor;
+        zarray_get(factors, idx, &factor);
+        zarray_add(inliers, &factor);
+    }
+    zarray_destroy(idxs);
+
+    return inliers;
+}
@@ -0,0 +1,80 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _PCM_H
+#define _PCM_H
+
+#include "april_graph.h"
+#include "common/zarray.h"
+#include "common/workerpool.h"
+
+// Pairwise consistency maximization (PCM) for outlier rejection.
+//
+// Given n candidate measurements and a test telling whether two of
+// them can both be correct, PCM keeps the largest subset in which
+// every pair is consistent, i.e. the maximum clique of the
+// consistency graph. Building the graph and searching for the clique
+// are both spread over a workerpool.
+//
+// The clique search is the greedy heuristic of Pattabiraman et al.:
+// grow a clique from every vertex, always adding the candidate of
+// highest degree, and prune vertices whose degree cannot beat the
+// best clique so far. It is exact on most outlier-rejection problems
+// and never returns a set that is not a clique.
+//
+// With more than one thread the pruning bound is shared between the
+// tasks as they run, so which cliques are found, and hence which one
+// is returned when the heuristic is not exact, can vary from run to
+// run. Problems below min_parallel, and any pcm created with one
+// thread, are searched deterministically.
+
+typedef struct pcm pcm_t;
+struct pcm
+{
+    workerpool_t *wp;
+
+    // problems with fewer candidates run on the calling thread; the
+    // workerpool overhead dominates below this.
+    int min_parallel;
+};
+
+// nthreads <= 0 uses one thread per processor.
+pcm_t *pcm_create(int nthreads);
+void pcm_destroy(pcm_t *pcm);
+
+// Returns the indices (int, ascending) of the largest mutually
+// consistent subset of candidates [0, n) that the search found,
+// preferring the lowest index set among equally large ones. consistent() must be
+// symmetric and safe to call from several threads at once. The
+// caller destroys the returned zarray.
+zarray_t *pcm_max_clique(pcm_t *pcm, int n,
+                         int (*consistent)(int a, int b, void *user), void *user);
+
+// Convenience wrapper for april_graph factors. Returns the inlier
+// factors (april_graph_factor_t*), in their original order.
+zarray_t *pcm_select_factors(pcm_t *pcm, const zarray_t *factors,
+                             int (*consistent)(const april_graph_factor_t *a,
+                                               const april_graph_factor_t *b,
+                                               void *user),
+                             void *user);
+
+#endif
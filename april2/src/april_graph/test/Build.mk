@@ -0,0 +1,17 @@
+CFLAGS := $(CFLAGS_STD) $(CFLAGS_COMMON) $(CFLAGS_GRAPH)
+LDFLAGS := $(LDFLAGS_STD) $(LDFLAGS_GRAPH)
+DEPS := $(DEPS_STD) $(DEPS_GRAPH)
+
+include $(BUILD_COMMON)
+
+all: pcm_test gauss_seidel_test
+	@true
+
+pcm_test: pcm_test.o $(DEPS)
+	@$(LD) -o $@ $^ $(LDFLAGS)
+
+gauss_seidel_test: gauss_seidel_test.o $(DEPS)
+	@$(LD) -o $@ $^ $(LDFLAGS)
+
+clean:
+	@rm -rf *.o pcm_test gauss_seidel_test
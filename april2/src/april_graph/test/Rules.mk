@@ -0,0 +1,15 @@
+.PHONY: graph_test graph_test_clean
+
+graph_test: graph
+
+graph_test:
+	@echo $@
+	@$(MAKE) -C $(APRIL_PATH)/src/april_graph/test -f Build.mk
+
+graph_test_clean:
+	@echo $@
+	@$(MAKE) -C $(APRIL_PATH)/src/april_graph/test -f Build.mk clean
+
+all: graph_test
+
+clean: graph_test_clean
@@ -0,0 +1,186 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "april_graph/april_graph.h"
+#include "common/doubles.h"
+#include "common/time_util.h"
+
+// Checks the colored Gauss-Seidel solver on a grid of xyt poses with
+// odometry and loop-closure factors: the coloring is valid, sweeps
+// are identical whatever the thread count, and they converge.
+
+static double uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * (random() / (double) RAND_MAX);
+}
+
+// a 'w' x 'h' grid of poses, each tied to its right and lower
+// neighbors with exact relative measurements, plus a prior on node 0.
+static april_graph_t *make_graph(int w, int h, unsigned int seed)
+{
+    srandom(seed);
+
+    april_graph_t *graph = april_graph_create();
+    double truth[w*h][3];
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double *t = truth[y*w + x];
+            t[0] = x;
+            t[1] = y;
+            t[2] = uniform(-M_PI, M_PI);
+
+            double init[3] = { t[0] + uniform(-0.3, 0.3), t[1] + uniform(-0.3, 0.3), t[2] + uniform(-0.2, 0.2) };
+            if (x == 0 && y == 0)
+                memcpy(init, t, sizeof(init));
+
+            april_graph_node_t *node = april_graph_node_xyt_create(init, init, t);
+            zarray_add(graph->nodes, &node);
+        }
+    }
+
+    matd_t *W = matd_identity(3);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int a = y*w + x;
+            int bs[2] = { x + 1 < w ? a + 1 : -1, y + 1 < h ? a + w : -1 };
+
+            for (int i = 0; i < 2; i++) {
+                if (bs[i] < 0)
+                    continue;
+                double z[3];
+                doubles_xyt_inv_mul(truth[a], truth[bs[i]], z);
+                april_graph_factor_t *factor = april_graph_factor_xyt_create(a, bs[i], z, z, W);
+                zarray_add(graph->factors, &factor);
+            }
+        }
+    }
+
+    april_graph_factor_t *prior = april_graph_factor_xytpos_create(0, truth[0], truth[0], W);
+    zarray_add(graph->factors, &prior);
+    matd_destroy(W);
+
+    return graph;
+}
+
+static void check_coloring(april_graph_t *graph, april_graph_gauss_seidel_info_t *info)
+{
+    int nnodes = zarray_size(graph->nodes);
+    int color[nnodes];
+    for (int i = 0; i < nnodes; i++)
+        color[i] = -1;
+
+    for (int c = 0; c < info->ncolors; c++) {
+        for (int i = info->color_offsets[c]; i < info->color_offsets[c+1]; i++) {
+            int n = info->color_nodes[i];
+            assert(color[n] == -1);
+            color[n] = c;
+        }
+    }
+
+    for (int i = 0; i < nnodes; i++)
+        assert(color[i] >= 0);
+
+    for (int i = 0; i < zarray_size(graph->factors); i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        for (int z0 = 0; z0 < factor->nnodes; z0++)
+            for (int z1 = z0 + 1; z1 < factor->nnodes; z1++)
+                assert(color[factor->nodes[z0]] != color[factor->nodes[z1]]);
+    }
+}
+
+static void test_threads()
+{
+    april_graph_t *g1 = make_graph(30, 20, 1);
+    april_graph_t *g4 = make_graph(30, 20, 1);
+
+    april_graph_gauss_seidel_info_t *info1 = april_graph_gauss_seidel_info_create(g1);
+    april_graph_gauss_seidel_info_t *info4 = april_graph_gauss_seidel_info_create(g4);
+    info4->nthreads = 4;
+
+    check_coloring(g1, info1);
+    printf("%d nodes, %d colors\n", zarray_size(g1->nodes), info1->ncolors);
+
+    double chi2 = april_graph_chi2(g1);
+    for (int iter = 0; iter < 20; iter++) {
+        april_graph_gauss_seidel(g1, info1);
+        april_graph_gauss_seidel(g4, info4);
+
+        double c = april_graph_chi2(g1);
+        assert(c <= chi2 * (1 + 1e-9));
+        chi2 = c;
+    }
+
+    for (int i = 0; i < zarray_size(g1->nodes); i++) {
+        april_graph_node_t *n1, *n4;
+        zarray_get(g1->nodes, i, &n1);
+        zarray_get(g4->nodes, i, &n4);
+        assert(!memcmp(n1->state, n4->state, 3*sizeof(double)));
+    }
+
+    // as a warm start, cholesky finishes the job.
+    for (int iter = 0; iter < 5; iter++)
+        april_graph_cholesky(g1, NULL);
+    printf("chi2: after gauss-seidel %g, after cholesky %g\n", chi2, april_graph_chi2(g1));
+    assert(april_graph_chi2(g1) < 1e-6);
+
+    april_graph_gauss_seidel_info_destroy(info1);
+    april_graph_gauss_seidel_info_destroy(info4);
+    april_graph_destroy(g1);
+    april_graph_destroy(g4);
+}
+
+static void test_timing()
+{
+    april_graph_t *graph = make_graph(150, 100, 2);
+    april_graph_gauss_seidel_info_t *info = april_graph_gauss_seidel_info_create(graph);
+
+    int nthreads[] = { 1, 2, 4 };
+    for (int i = 0; i < 3; i++) {
+        info->nthreads = nthreads[i];
+        int64_t t0 = utime_now();
+        for (int iter = 0; iter < 5; iter++)
+            april_graph_gauss_seidel(graph, info);
+        int64_t t1 = utime_now();
+        printf("%d nodes, %d threads: %.3f ms / sweep\n", zarray_size(graph->nodes), nthreads[i],
+               (t1 - t0) / 5.0 / 1000.0);
+    }
+
+    april_graph_gauss_seidel_info_destroy(info);
+    april_graph_destroy(graph);
+}
+
+int main(int argc, char *argv[])
+{
+    test_threads();
+    test_timing();
+
+    printf("ok\n");
+    return 0;
+}
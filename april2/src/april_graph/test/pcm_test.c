@@ -0,0 +1,127 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include "april_graph/pcm.h"
+#include "common/zarray.h"
+
+#define NINLIERS 30
+#define NOUTLIERS 200
+#define TOLERANCE 0.1
+
+static double pts[NINLIERS + NOUTLIERS][2];
+
+static int close_enough(int a, int b, void *user)
+{
+    double dx = pts[a][0] - pts[b][0];
+    double dy = pts[a][1] - pts[b][1];
+    return sqrt(dx*dx + dy*dy) < TOLERANCE;
+}
+
+static double uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * (random() / (double) RAND_MAX);
+}
+
+static void check_clique(zarray_t *clique)
+{
+    for (int i = 0; i < zarray_size(clique); i++) {
+        int a, b;
+        zarray_get(clique, i, &a);
+        for (int j = i + 1; j < zarray_size(clique); j++) {
+            zarray_get(clique, j, &b);
+            assert(a < b);
+            assert(close_enough(a, b, NULL));
+        }
+    }
+}
+
+// inliers sit within TOLERANCE/2 of each other, outliers are spread
+// over a large area and may form small cliques of their own.
+static void planted_test(pcm_t *pcm, int n)
+{
+    int ninliers = n < NINLIERS ? n : NINLIERS;
+    for (int i = 0; i < n; i++) {
+        if (i < ninliers) {
+            double r = uniform(0, 0.4 * TOLERANCE), t = uniform(-M_PI, M_PI);
+            pts[i][0] = 3 + r * cos(t);
+            pts[i][1] = 4 + r * sin(t);
+        } else {
+            pts[i][0] = uniform(-2, 2);
+            pts[i][1] = uniform(-2, 2);
+        }
+    }
+
+    zarray_t *clique = pcm_max_clique(pcm, n, close_enough, NULL);
+    check_clique(clique);
+    assert(zarray_size(clique) == ninliers);
+    for (int i = 0; i < ninliers; i++) {
+        int idx;
+        zarray_get(clique, i, &idx);
+        assert(idx == i);
+    }
+    zarray_destroy(clique);
+}
+
+static void degenerate_test(pcm_t *pcm)
+{
+    zarray_t *clique = pcm_max_clique(pcm, 0, close_enough, NULL);
+    assert(zarray_size(clique) == 0);
+    zarray_destroy(clique);
+
+    // no edges: any single candidate is a maximum clique
+    for (int i = 0; i < 5; i++) {
+        pts[i][0] = i;
+        pts[i][1] = 0;
+    }
+    clique = pcm_max_clique(pcm, 5, close_enough, NULL);
+    assert(zarray_size(clique) == 1);
+    zarray_destroy(clique);
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(0);
+
+    pcm_t *serial = pcm_create(1);
+    pcm_t *parallel = pcm_create(4);
+    parallel->min_parallel = 1;
+
+    degenerate_test(serial);
+    degenerate_test(parallel);
+
+    for (int iter = 0; iter < 50; iter++) {
+        int n = 1 + random() % (NINLIERS + NOUTLIERS);
+        planted_test(serial, n);
+        planted_test(parallel, n);
+    }
+
+    pcm_destroy(serial);
+    pcm_destroy(parallel);
+
+    printf("pcm_test: OK\n");
+    return 0;
+}
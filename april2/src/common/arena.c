@@ -0,0 +1,226 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64*1024)
+
+static arena_block_t *block_create(size_t size)
+{
+    arena_block_t *b = malloc(sizeof(arena_block_t) + size);
+    b->prev = NULL;
+    b->size = size;
+    b->pos = 0;
+    return b;
+}
+
+arena_t *arena_create(size_t block_size)
+{
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    arena->block_size = block_size > 0 ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    arena->block = block_create(arena->block_size);
+    arena->nmallocs = 1;
+    return arena;
+}
+
+static void blocks_free(arena_block_t *b)
+{
+    while (b) {
+        arena_block_t *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (!arena)
+        return;
+
+    blocks_free(arena->block);
+    blocks_free(arena->spare);
+    free(arena);
+}
+
+size_t arena_used(const arena_t *arena)
+{
+    size_t used = 0;
+    for (arena_block_t *b = arena->block; b; b = b->prev)
+        used += b->pos;
+    return used;
+}
+
+void *arena_alloc_slow(arena_t *arena, size_t sz)
+{
+    // the current block's remainder is abandoned until the next
+    // restore or reset.
+    size_t used = arena_used(arena);
+    if (used + sz > arena->high_water)
+        arena->high_water = used + sz;
+
+    // take a spare block if one is large enough
+    arena_block_t **pb = &arena->spare;
+    while (*pb && (*pb)->size < sz)
+        pb = &(*pb)->prev;
+
+    arena_block_t *b = *pb;
+    if (b) {
+        *pb = b->prev;
+    } else {
+        size_t size = arena->block_size;
+        while (size < sz)
+            size *= 2;
+        b = block_create(size);
+        arena->nmallocs++;
+    }
+
+    b->pos = sz;
+    b->prev = arena->block;
+    arena->block = b;
+    return b->data;
+}
+
+void *arena_calloc(arena_t *arena, size_t n, size_t sz)
+{
+    void *p = arena_alloc(arena, n * sz);
+    memset(p, 0, n * sz);
+    return p;
+}
+
+void *arena_realloc(arena_t *arena, void *p, size_t oldsz, size_t newsz)
+{
+    if (p == NULL)
+        return arena_alloc(arena, newsz);
+
+    arena_block_t *b = arena->block;
+    if ((char*) p + oldsz == &b->data[b->pos] && (char*) p - b->data + newsz <= b->size) {
+        b->pos = (char*) p - b->data + newsz;
+        return p;
+    }
+
+    if (newsz <= oldsz)
+        return p;
+
+    void *q = arena_alloc(arena, newsz);
+    memcpy(q, p, oldsz);
+    return q;
+}
+
+char *arena_strdup(arena_t *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p = arena_alloc(arena, len);
+    memcpy(p, s, len);
+    return p;
+}
+
+int arena_owns(const arena_t *arena, const void *p)
+{
+    for (const arena_block_t *b = arena->block; b; b = b->prev) {
+        if ((const char*) p >= b->data && (const char*) p < b->data + b->pos)
+            return 1;
+    }
+    return 0;
+}
+
+void arena_restore(arena_t *arena, arena_checkpoint_t cp)
+{
+    size_t used = arena_used(arena);
+    if (used > arena->high_water)
+        arena->high_water = used;
+
+    while (arena->block != cp.block) {
+        arena_block_t *b = arena->block;
+        assert(b->prev != NULL); // checkpoint isn't from this arena, or was already released
+        arena->block = b->prev;
+
+        b->pos = 0;
+        b->prev = arena->spare;
+        arena->spare = b;
+    }
+
+    assert(cp.pos <= arena->block->pos);
+    arena->block->pos = cp.pos;
+}
+
+void arena_reset(arena_t *arena)
+{
+    size_t used = arena_used(arena);
+    if (used > arena->high_water)
+        arena->high_water = used;
+
+    if (arena->block->prev == NULL && arena->spare == NULL) {
+        arena->block->pos = 0;
+        return;
+    }
+
+    // merge: one block large enough for the high-water mark
+    blocks_free(arena->block);
+    blocks_free(arena->spare);
+    arena->spare = NULL;
+
+    size_t size = arena->block_size;
+    while (size < arena->high_water)
+        size *= 2;
+    arena->block = block_create(size);
+    arena->nmallocs++;
+}
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread arena_t *thread_arena;
+
+static void thread_arena_destroy(void *p)
+{
+    arena_destroy(p);
+}
+
+static void thread_key_create(void)
+{
+    pthread_key_create(&thread_key, thread_arena_destroy);
+}
+
+arena_t *arena_thread(void)
+{
+    if (thread_arena == NULL) {
+        pthread_once(&thread_key_once, thread_key_create);
+        thread_arena = arena_create(0);
+        pthread_setspecific(thread_key, thread_arena);
+    }
+
+    return thread_arena;
+}
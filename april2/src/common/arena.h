@@ -0,0 +1,147 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A bump allocator for memory that lives for one processing step
+// (e.g., one message). Allocations are never freed individually;
+// instead, the whole arena is reset (or rolled back to a checkpoint)
+// once the step is done:
+//
+//    arena_checkpoint_t cp = arena_checkpoint(arena);
+//    zarray_t *za = zarray_create_arena(arena, sizeof(float[2]));
+//    ...
+//    arena_restore(arena, cp);   // za is gone
+//
+// The arena grows by adding blocks. arena_reset() merges them into a
+// single block, so once a step's high-water mark has been reached,
+// later steps do not call malloc at all.
+//
+// An arena must only be used by one thread at a time.
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_block arena_block_t;
+struct arena_block
+{
+    arena_block_t *prev;
+    size_t size;  // bytes in data
+    size_t pos;   // bytes used
+    char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+typedef struct arena arena_t;
+struct arena
+{
+    arena_block_t *block;   // current block (never NULL)
+    arena_block_t *spare;   // blocks released by arena_restore, for reuse
+
+    size_t block_size;      // minimum size of new blocks
+
+    // statistics
+    int nmallocs;           // blocks allocated over the arena's life
+    size_t high_water;      // most bytes in use at once
+};
+
+typedef struct arena_checkpoint arena_checkpoint_t;
+struct arena_checkpoint
+{
+    arena_block_t *block;
+    size_t pos;
+};
+
+arena_t *arena_create(size_t block_size);
+void arena_destroy(arena_t *arena);
+
+// allocation that didn't fit in the current block.
+void *arena_alloc_slow(arena_t *arena, size_t sz);
+
+// Returns ARENA_ALIGN-aligned, uninitialized memory.
+static inline void *arena_alloc(arena_t *arena, size_t sz)
+{
+    arena_block_t *b = arena->block;
+    size_t pos = (b->pos + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (sz <= b->size && pos <= b->size - sz) {
+        b->pos = pos + sz;
+        return &b->data[pos];
+    }
+
+    return arena_alloc_slow(arena, sz);
+}
+
+void *arena_calloc(arena_t *arena, size_t n, size_t sz);
+
+// Grows (or shrinks) an allocation of oldsz bytes at p. The
+// allocation is extended in place if it is the most recent one.
+void *arena_realloc(arena_t *arena, void *p, size_t oldsz, size_t newsz);
+
+char *arena_strdup(arena_t *arena, const char *s);
+
+// Returns non-zero if p was allocated from arena (and not released
+// since).
+int arena_owns(const arena_t *arena, const void *p);
+
+static inline arena_checkpoint_t arena_checkpoint(arena_t *arena)
+{
+    arena_checkpoint_t cp = { .block = arena->block, .pos = arena->block->pos };
+    return cp;
+}
+
+// Releases everything allocated since the checkpoint was taken.
+void arena_restore(arena_t *arena, arena_checkpoint_t cp);
+
+// Releases everything, and merges the blocks into one.
+void arena_reset(arena_t *arena);
+
+// Bytes currently allocated from the arena.
+size_t arena_used(const arena_t *arena);
+
+// A scratch arena for the calling thread, created on first use and
+// destroyed when the thread exits. Callers should checkpoint and
+// restore around their use of it, since other code on the same
+// thread uses it too.
+arena_t *arena_thread(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -305,7 +305,7 @@ static inline void TFN(s_quat_to_mat44)(const TNAME q[4], TNAME r[16])
     r[15] = 1;
 }
 
-static inline void TFN(s_angleaxis_to_mat44)(const TNAME aa[4], TNAME r[4])
+static inline void TFN(s_angleaxis_to_mat44)(const TNAME aa[4], TNAME r[16])
 {
     TNAME q[4];
 
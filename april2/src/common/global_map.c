@@ -2,28 +2,74 @@
 #include <math.h>
 #include "global_map.h"
 #include "common/zhash.h"
-#include "common/image_u8x3.h"
+#include "common/hash_util.h"
+#include "common/zarray.h"
 #include "common/image_u8.h"
 #include "common/gridmap.h"
 #include "common/math_util.h"
 #include "common/time_util.h"
 
-#define PAD_M 5
+// The map is stored as square chunks of CHUNK_SIZE pixels, created
+// on demand and keyed by their chunk coordinates. Chunk (cx, cy)
+// covers global pixels [cx*CHUNK_SIZE, (cx+1)*CHUNK_SIZE), where
+// global pixel i spans [i, i+1)*meters_per_pixel. Adding, moving or
+// removing a gridmap only touches the chunks it overlaps; the
+// exported grid_map_t is only rebuilt, lazily, for the chunks that
+// changed.
+#define CHUNK_BITS 6
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+
+struct chunk {
+    int cx, cy;
+
+    // per pixel: traversable, obstacle, slammable vote counts
+    uint8_t counts[CHUNK_SIZE*CHUNK_SIZE*3];
+
+    // true if counts changed since the chunk was last exported
+    bool dirty;
+};
+
+#define TNAME chunk_hash
+#define TKEYTYPE uint64_t
+#define TVALTYPE struct chunk*
+#define TKEYHASH(pk) hash_u64(*(pk))
+#define TKEYEQUAL(pka, pkb) (*(pka) == *(pkb))
+#include "common/tswiss_impl.h"
+#undef TKEYEQUAL
+#undef TKEYHASH
+#undef TVALTYPE
+#undef TKEYTYPE
+#undef TNAME
 
 struct global_map {
     zhash_t * gms;
-    image_u8x3_t * map3;
+
+    chunk_hash_t * chunks;  // uint64_t chunk_key => struct chunk*
+    zarray_t * dirty;  // struct chunk*
+
+    // chunk coordinate bounds (inclusive) of the map. Empty if cx0 > cx1.
+    int cx0, cy0, cx1, cy1;
 
     //Be VERY carfeul with these two, I'm sharing
     //the data buf between them
     image_u8_t * out_map;
     grid_map_t * out_gm;
+    int out_cx0, out_cy0, out_cx1, out_cy1; // bounds of out_map
+
     int64_t last_update_utime;
     bool updated;
 
-    double x0, y0, meters_per_pixel;
+    double meters_per_pixel;
+
+    // last chunk looked up, since consecutive pixels usually share one.
+    struct chunk * last_chunk;
 };
 
+static inline uint64_t chunk_key(int cx, int cy)
+{
+    return ((uint64_t) (uint32_t) cx << 32) | (uint32_t) cy;
+}
+
 global_map_t * global_map_create(double meters_per_pixel)
 {
     global_map_t * glm = calloc(1,sizeof(global_map_t));
@@ -31,14 +77,18 @@ global_map_t * global_map_create(double meters_per_pixel)
     glm->gms = zhash_create(sizeof(grid_map_t*), sizeof(double[3]),
                             zhash_ptr_hash, zhash_ptr_equals);
 
-    glm->map3    = image_u8x3_create_alignment(16,16,16);
+    glm->chunks = chunk_hash_create();
+    glm->dirty = zarray_create(sizeof(struct chunk*));
+
+    glm->cx0 = glm->cy0 = 0;
+    glm->cx1 = glm->cy1 = -1;
 
     glm->out_map = image_u8_create_alignment(16,16,16);
+    glm->out_cx0 = glm->out_cy0 = 0;
+    glm->out_cx1 = glm->out_cy1 = -1;
 
     glm->out_gm  = calloc(1,sizeof(grid_map_t));
 
-    glm->x0 = 0;
-    glm->y0 = 0;
     glm->meters_per_pixel = meters_per_pixel;
 
     return glm;
@@ -46,88 +96,73 @@ global_map_t * global_map_create(double meters_per_pixel)
 
 void global_map_destroy(global_map_t * glm)
 {
+    chunk_hash_iterator_t it;
+    chunk_hash_iterator_init(glm->chunks, &it);
+    struct chunk * chunk;
+    while (chunk_hash_iterator_next(&it, NULL, &chunk))
+        free(chunk);
+    chunk_hash_destroy(glm->chunks);
+    zarray_destroy(glm->dirty);
     zhash_destroy(glm->gms);
-    image_u8x3_destroy(glm->map3);
     image_u8_destroy(glm->out_map);
     free(glm->out_gm);
 
     free(glm);
 }
 
-void ensure_index(global_map_t * glm, int * ix, int * iy) {
-
-    int PPM = 1.0/glm->meters_per_pixel;
-    int PAD = PPM * PAD_M; // this is a gross fixed padding
-    image_u8x3_t * map3 = glm->map3;
-
-    int upx = 0, downx = 0, upy = 0, downy = 0;
-
-    if (*ix < 0) {
-        downx = -(*ix) + PAD;
-        downx -= downx % PPM;
-    } else if (*ix >= map3->width) {
-        upx = (*ix - map3->width) + PAD;
-        upx -= upx % PPM;
-    }
-    if (*iy < 0) {
-        downy = -(*iy) + PAD;
-        downy -= downy % PPM;
-    } else if (*iy >= map3->height) {
-        upy = (*iy - map3->height) + PAD;
-        upy -= upy % PPM;
-    }
-
-    if(!upx && !downx && !upy && !downy)
-        return;
-
-    int new_width = downx + map3->width + upx;
-    int new_height = downy + map3->height + upy;
-    image_u8x3_t * new3 = image_u8x3_create_alignment(new_width, new_height, new_width);
-
-    assert (new3->width == new3->stride/3);
-    assert (new3->width && new3->height);
-
-    for(int y = 0; y < map3->height; y++) {
-        memcpy(&new3->buf[(downy+y)*new3->stride + 3*downx],
-               &map3->buf[y*map3->stride],
-               map3->stride);
+static struct chunk * get_chunk(global_map_t * glm, int cx, int cy, bool create)
+{
+    struct chunk * chunk = glm->last_chunk;
+    if (chunk && chunk->cx == cx && chunk->cy == cy)
+        return chunk;
+
+    uint64_t key = chunk_key(cx, cy);
+    chunk = NULL;
+    if (!chunk_hash_get(glm->chunks, &key, &chunk)) {
+        if (!create)
+            return NULL;
+
+        chunk = calloc(1, sizeof(struct chunk));
+        chunk->cx = cx;
+        chunk->cy = cy;
+        chunk_hash_put(glm->chunks, &key, &chunk, NULL, NULL);
+
+        if (glm->cx0 > glm->cx1) {
+            glm->cx0 = glm->cx1 = cx;
+            glm->cy0 = glm->cy1 = cy;
+        } else {
+            glm->cx0 = min(glm->cx0, cx);
+            glm->cy0 = min(glm->cy0, cy);
+            glm->cx1 = max(glm->cx1, cx);
+            glm->cy1 = max(glm->cy1, cy);
+        }
     }
 
-    glm->map3 = new3;
-    glm->x0 -= (glm->meters_per_pixel * downx);
-    glm->y0 -= (glm->meters_per_pixel * downy);
-
-    image_u8x3_destroy(map3);
+    glm->last_chunk = chunk;
+    return chunk;
 }
 
-
-static void map_add(global_map_t * glm, const grid_map_t * gm, double * xyt)
+// adds delta (+1 or -1) to the vote for value v in every pixel
+// covered by gm at xyt, saturating at [0, 255].
+static void map_update(global_map_t * glm, const grid_map_t * gm, double * xyt, int delta)
 {
     glm->updated = true;
     glm->last_update_utime = utime_now();
     double c = cos(xyt[2]), s = sin(xyt[2]);
 
-    for(int iy = 0; iy <= gm->height; iy += gm->height){
-        for (int ix = 0; ix <= gm->width; ix += gm->width) {
-            double x = gm->x0 + ix*gm->meters_per_pixel;
-            double y = gm->y0 + iy*gm->meters_per_pixel;
-
-            double tx = x*c - y*s + xyt[0];
-            double ty = x*s + y*c + xyt[1];
-
-            int out_ix = (tx - glm->x0) / glm->meters_per_pixel;
-            int out_iy = (ty - glm->y0) / glm->meters_per_pixel;
-
-            ensure_index(glm, &out_ix, &out_iy);
-        }
-    }
-
     for (int iy = 0; iy < gm->height; iy++) {
         for (int ix = 0; ix < gm->width; ix++) {
             uint8_t v = gm->data[iy*gm->width + ix];
 
-            if (v == GRID_VAL_UNKNOWN) continue;
-            if (v == GRID_VAL_OTHER) continue;
+            int channel;
+            if (v == GRID_VAL_TRAVERSABLE)
+                channel = 0;
+            else if (v == GRID_VAL_OBSTACLE)
+                channel = 1;
+            else if (v == GRID_VAL_SLAMMABLE)
+                channel = 2;
+            else
+                continue;
 
             double x = gm->x0 + ix*gm->meters_per_pixel;
             double y = gm->y0 + iy*gm->meters_per_pixel;
@@ -135,61 +170,39 @@ static void map_add(global_map_t * glm, const grid_map_t * gm, double * xyt)
             double tx = x*c - y*s + xyt[0];
             double ty = x*s + y*c + xyt[1];
 
-            int out_ix = (tx - glm->x0) / glm->meters_per_pixel;
-            int out_iy = (ty - glm->y0) / glm->meters_per_pixel;
-
-            if (v == GRID_VAL_TRAVERSABLE &&
-                glm->map3->buf[out_iy*glm->map3->stride + 3*out_ix + 0] < 255)
-                glm->map3->buf[out_iy*glm->map3->stride + 3*out_ix + 0] += 1;
-            else if (v == GRID_VAL_OBSTACLE &&
-                     glm->map3->buf[out_iy*glm->map3->stride + 3*out_ix + 1] < 255)
-                glm->map3->buf[out_iy*glm->map3->stride + 3*out_ix + 1] += 1;
-            else if (v == GRID_VAL_SLAMMABLE &&
-                     glm->map3->buf[out_iy*glm->map3->stride + 3*out_ix + 2] < 255)
-                glm->map3->buf[out_iy*glm->map3->stride + 3*out_ix + 2] += 1;
-        }
-    }
-}
-
-static void map_remove(global_map_t * glm, const grid_map_t * gm, double * xyt)
-{
-    glm->updated = true;
-    image_u8x3_t * map3 = glm->map3;
-
-    double c = cos(xyt[2]), s = sin(xyt[2]);
-    for (int iy = 0; iy < gm->height; iy++) {
-        for (int ix = 0; ix < gm->width; ix++) {
-            uint8_t v = gm->data[iy*gm->width + ix];
+            int gx = (int) floor(tx / glm->meters_per_pixel);
+            int gy = (int) floor(ty / glm->meters_per_pixel);
 
-            if (v == GRID_VAL_UNKNOWN) continue;
-            if (v == GRID_VAL_OTHER) continue;
-
-            double x = gm->x0 + ix*gm->meters_per_pixel;
-            double y = gm->y0 + iy*gm->meters_per_pixel;
-
-            double tx = x*c - y*s + xyt[0];
-            double ty = x*s + y*c + xyt[1];
-
-            int out_ix = (tx - glm->x0) / glm->meters_per_pixel;
-            int out_iy = (ty - glm->y0) / glm->meters_per_pixel;
+            struct chunk * chunk = get_chunk(glm, gx >> CHUNK_BITS, gy >> CHUNK_BITS, delta > 0);
+            if (chunk == NULL)
+                continue;
 
-            if(out_ix < 0 || out_ix >= map3->width
-               || out_iy < 0 || out_iy >= map3->height)
+            uint8_t * count = &chunk->counts[3*((gy & (CHUNK_SIZE-1))*CHUNK_SIZE + (gx & (CHUNK_SIZE-1))) + channel];
+            if (delta > 0 && *count < 255)
+                *count += 1;
+            else if (delta < 0 && *count > 0)
+                *count -= 1;
+            else
                 continue;
 
-            if (v == GRID_VAL_TRAVERSABLE &&
-                map3->buf[out_iy*map3->stride + 3*out_ix + 0] > 0)
-                map3->buf[out_iy*map3->stride + 3*out_ix + 0] -= 1;
-            else if (v == GRID_VAL_OBSTACLE &&
-                     map3->buf[out_iy*map3->stride + 3*out_ix + 1] > 0)
-                map3->buf[out_iy*map3->stride + 3*out_ix + 1] -= 1;
-            else if (v == GRID_VAL_SLAMMABLE &&
-                     map3->buf[out_iy*map3->stride + 3*out_ix + 2] > 0)
-                map3->buf[out_iy*map3->stride + 3*out_ix + 2] -= 1;
+            if (!chunk->dirty) {
+                chunk->dirty = true;
+                zarray_add(glm->dirty, &chunk);
+            }
         }
     }
 }
 
+static void map_add(global_map_t * glm, const grid_map_t * gm, double * xyt)
+{
+    map_update(glm, gm, xyt, 1);
+}
+
+static void map_remove(global_map_t * glm, const grid_map_t * gm, double * xyt)
+{
+    map_update(glm, gm, xyt, -1);
+}
+
 void global_map_add_gridmap(global_map_t * glm, const grid_map_t * gm, double * xyt)
 {
     assert(!zhash_contains(glm->gms,&gm));
@@ -226,40 +239,86 @@ void global_map_get_xyt(global_map_t * glm, const grid_map_t * gm, double *xyt)
     assert(zhash_get(glm->gms, &gm, xyt));
 }
 
+// writes the most likely value of each of the chunk's pixels into out_map.
+static void export_chunk(global_map_t * glm, struct chunk * chunk)
+{
+    image_u8_t * out = glm->out_map;
+    int x0 = (chunk->cx - glm->out_cx0) * CHUNK_SIZE;
+    int y0 = (chunk->cy - glm->out_cy0) * CHUNK_SIZE;
+
+    for (int y = 0; y < CHUNK_SIZE; y++) {
+        uint8_t * row = &out->buf[out->stride*(y0 + y) + x0];
+
+        for (int x = 0; x < CHUNK_SIZE; x++) {
+            const uint8_t * count = &chunk->counts[3*(y*CHUNK_SIZE + x)];
+            uint8_t vtr = count[0];
+            uint8_t vob = count[1];
+            uint8_t vsl = count[2];
+
+            if(vsl + vob > vtr)
+            {
+                if(vob > vsl)
+                    row[x] = GRID_VAL_OBSTACLE;
+                else
+                    row[x] = GRID_VAL_SLAMMABLE;
+            }
+            else if(vtr > 0)
+                row[x] = GRID_VAL_TRAVERSABLE;
+            else
+                row[x] = GRID_VAL_UNKNOWN;
+        }
+    }
+
+    chunk->dirty = false;
+}
+
 const grid_map_t * global_map_get_map(global_map_t * glm)
 {
     if (glm->updated) {
         glm->updated = false;
         glm->out_gm->utime = glm->last_update_utime;
-        if (glm->out_map)
+
+        int cx0 = glm->cx0, cy0 = glm->cy0, cx1 = glm->cx1, cy1 = glm->cy1;
+        if (cx0 > cx1) {
+            cx0 = cy0 = 0;
+            cx1 = cy1 = -1;
+        }
+
+        if (cx0 != glm->out_cx0 || cy0 != glm->out_cy0 ||
+            cx1 != glm->out_cx1 || cy1 != glm->out_cy1) {
+            // the bounds changed: rebuild the whole output
+            glm->out_cx0 = cx0;
+            glm->out_cy0 = cy0;
+            glm->out_cx1 = cx1;
+            glm->out_cy1 = cy1;
+
+            int width = (cx1 - cx0 + 1) * CHUNK_SIZE;
+            int height = (cy1 - cy0 + 1) * CHUNK_SIZE;
+
             image_u8_destroy(glm->out_map);
-        glm->out_map = image_u8_create_alignment(glm->map3->width,
-                                                 glm->map3->height,
-                                                 glm->map3->width);
-
-        for (int y = 0; y < glm->map3->height; y++) {
-            for (int x = 0; x < glm->map3->width; x++) {
-                uint8_t vtr = glm->map3->buf[glm->map3->stride*y + 3*x + 0];
-                uint8_t vob = glm->map3->buf[glm->map3->stride*y + 3*x + 1];
-                uint8_t vsl = glm->map3->buf[glm->map3->stride*y + 3*x + 2];
-
-                if(vsl + vob > vtr)
-                {
-                    if(vob > vsl)
-                        glm->out_map->buf[glm->out_map->stride*y + x] = GRID_VAL_OBSTACLE;
-                    else if ( vsl > 0 )
-                        glm->out_map->buf[glm->out_map->stride*y + x] = GRID_VAL_SLAMMABLE;
-                }
-                else if(vtr > 0)
-                    glm->out_map->buf[glm->out_map->stride*y + x] = GRID_VAL_TRAVERSABLE;
-                else
-                    glm->out_map->buf[glm->out_map->stride*y + x] = GRID_VAL_UNKNOWN;
+            glm->out_map = image_u8_create_alignment(width > 0 ? width : 16,
+                                                     height > 0 ? height : 16,
+                                                     width > 0 ? width : 16);
+            memset(glm->out_map->buf, GRID_VAL_UNKNOWN, glm->out_map->stride * glm->out_map->height);
+
+            chunk_hash_iterator_t it;
+            chunk_hash_iterator_init(glm->chunks, &it);
+            struct chunk * chunk;
+            while (chunk_hash_iterator_next(&it, NULL, &chunk))
+                export_chunk(glm, chunk);
+        } else {
+            for (int i = 0; i < zarray_size(glm->dirty); i++) {
+                struct chunk * chunk;
+                zarray_get(glm->dirty, i, &chunk);
+                export_chunk(glm, chunk);
             }
         }
+
+        zarray_clear(glm->dirty);
     }
 
-    glm->out_gm->x0 = glm->x0;
-    glm->out_gm->y0 = glm->y0;
+    glm->out_gm->x0 = glm->out_cx0 * CHUNK_SIZE * glm->meters_per_pixel;
+    glm->out_gm->y0 = glm->out_cy0 * CHUNK_SIZE * glm->meters_per_pixel;
     glm->out_gm->meters_per_pixel = glm->meters_per_pixel;
     glm->out_gm->width = glm->out_map->width;
     glm->out_gm->height = glm->out_map->height;
@@ -276,68 +335,57 @@ grid_map_t * global_map_get_map_copy(global_map_t * glm)
 
 void global_map_crop(global_map_t * glm)
 {
-    int PPM = 1.0/glm->meters_per_pixel;
-    int PAD = PPM * PAD_M;
-
-    image_u8x3_t *map3 = glm->map3;
-    int minx = map3->width;
-    int maxx = 0;
-    int miny = map3->height;
-    int maxy = 0;
-
-    if (map3->width == 0 || map3->height == 0)
-        return;
-
-    for (int y = 0; y < map3->height; y++) {
-        for (int x = 0; x < map3->width; x++) {
-            uint8_t *pix = &map3->buf[y*map3->stride + 3*x];
-
-            if (!(pix[0] || pix[1] || pix[2]))
-                continue;
-
-            minx = min(minx, x);
-            miny = min(miny, y);
+    // discard chunks that no longer hold any votes and shrink the
+    // bounds to the remaining ones.
+    zarray_t * empty = zarray_create(sizeof(struct chunk*));
+
+    int cx0 = 0, cy0 = 0, cx1 = -1, cy1 = -1;
+
+    chunk_hash_iterator_t it;
+    chunk_hash_iterator_init(glm->chunks, &it);
+    struct chunk * chunk;
+    while (chunk_hash_iterator_next(&it, NULL, &chunk)) {
+        bool used = false;
+        for (int i = 0; i < CHUNK_SIZE*CHUNK_SIZE*3 && !used; i++)
+            used = chunk->counts[i] != 0;
+
+        if (!used) {
+            zarray_add(empty, &chunk);
+            continue;
+        }
 
-            maxx = max(maxx, x);
-            maxy = max(maxy, y);
+        if (cx0 > cx1) {
+            cx0 = cx1 = chunk->cx;
+            cy0 = cy1 = chunk->cy;
+        } else {
+            cx0 = min(cx0, chunk->cx);
+            cy0 = min(cy0, chunk->cy);
+            cx1 = max(cx1, chunk->cx);
+            cy1 = max(cy1, chunk->cy);
         }
     }
 
-    if (minx > maxx || miny > maxy)
-        return;
-
-    // Retain padding
-    minx = max(0, minx - PAD);
-    miny = max(0, miny - PAD);
-    maxx = min(map3->width-1, maxx+PAD);
-    maxy = min(map3->height-1, maxy+PAD);
-
-    int new_width = maxx - minx + 1;
-    int new_height = maxy - miny + 1;
-
-    int dw = map3->width - new_width;
-    int dh = map3->height - new_height;
-
-    // Nothing to do. Map is as small as reasonable
-    if (dw <= 0 && dh <= 0)
+    if (zarray_size(empty) == 0) {
+        zarray_destroy(empty);
         return;
-
-    glm->updated = true;
-    image_u8x3_t *new3 = image_u8x3_create_alignment(new_width, new_height, new_width);
-    assert (new3->width == new3->stride/3);
-
-    for (int y = 0; y < new3->height; y++) {
-        int idx0 = y*new3->stride;
-        int idx1 = (y+miny)*map3->stride + 3*minx;
-        memcpy(&new3->buf[idx0],
-               &map3->buf[idx1],
-               new3->stride);
     }
 
-    glm->map3 = new3;
-    glm->x0 += (glm->meters_per_pixel * minx);
-    glm->y0 += (glm->meters_per_pixel * miny);
+    for (int i = 0; i < zarray_size(empty); i++) {
+        zarray_get(empty, i, &chunk);
+        uint64_t key = chunk_key(chunk->cx, chunk->cy);
+        chunk_hash_remove(glm->chunks, &key, NULL, NULL);
 
-    image_u8x3_destroy(map3);
+        // might be on the dirty list.
+        zarray_remove_value(glm->dirty, &chunk, 0);
+        free(chunk);
+    }
+    zarray_destroy(empty);
+
+    glm->last_chunk = NULL;
+    glm->out_cx1 = glm->out_cx0 - 2; // force a full export
+    glm->cx0 = cx0;
+    glm->cy0 = cy0;
+    glm->cx1 = cx1;
+    glm->cy1 = cy1;
+    glm->updated = true;
 }
-
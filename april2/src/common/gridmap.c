@@ -30,10 +30,15 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/time_util.h"
 #include "common/math_util.h"
 #include "common/zqueue.h"
+#include "common/workerpool.h"
 #include "lcmtypes/grid_map_t.h"
 
 #include "gridmap.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 grid_map_t *gridmap_make_meters(double x0, double y0, double sizex, double sizey,
                                 double meters_per_pixel, uint8_t default_fill)
 {
@@ -425,60 +430,336 @@ int gridmap_has_neighbor(const grid_map_t* gm, int ix, int iy, uint8_t v)
     return 0;
 }
 
-void gridmap_dilate(grid_map_t* gm, uint8_t v, int iterations)
+////////////////////////////////////////////////////////////
+// Byte kernels for the morphological operations below. The max/min
+// filters use the van Herk/Gil-Werman running max, which costs three
+// comparisons per pixel regardless of the window size. Vertical
+// passes operate on whole rows at a time, so they vectorize.
+
+// dst[i] = max(a[i], b[i])
+static inline void bytes_max(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
 {
-    int height = gm->height;
-    int width = gm->width;
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i*) &dst[i], _mm_max_epu8(_mm_loadu_si128((const __m128i*) &a[i]),
+                                                          _mm_loadu_si128((const __m128i*) &b[i])));
+#endif
+    for (; i < n; i++)
+        dst[i] = a[i] > b[i] ? a[i] : b[i];
+}
 
-    grid_map_t *bef = gm;
-    grid_map_t *aft = gridmap_copy (gm);
+// dst[i] = min(a[i], b[i])
+static inline void bytes_min(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i*) &dst[i], _mm_min_epu8(_mm_loadu_si128((const __m128i*) &a[i]),
+                                                          _mm_loadu_si128((const __m128i*) &b[i])));
+#endif
+    for (; i < n; i++)
+        dst[i] = a[i] < b[i] ? a[i] : b[i];
+}
 
-    for (int iter = 0; iter < iterations; iter++) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                if (aft->data[y*width+x]==v)
-                    continue;
-                if (gridmap_has_neighbor(bef, x, y, v))
-                    aft->data[y*width+x] = v;
-            }
-        }
+// out[i] = max(in[2i], in[2i+1]), i in [0, n)
+static inline void pairs_max(const uint8_t *in, uint8_t *out, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi16(0x00ff);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) &in[2*i]);
+        __m128i b = _mm_loadu_si128((const __m128i*) &in[2*i + 16]);
+        a = _mm_and_si128(_mm_max_epu8(a, _mm_srli_epi16(a, 8)), lo);
+        b = _mm_and_si128(_mm_max_epu8(b, _mm_srli_epi16(b, 8)), lo);
+        _mm_storeu_si128((__m128i*) &out[i], _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = in[2*i] > in[2*i+1] ? in[2*i] : in[2*i+1];
+}
 
-        memcpy (bef->data, aft->data, aft->datalen * sizeof(*aft->data));
+// out[i] = min(in[2i], in[2i+1]), i in [0, n)
+static inline void pairs_min(const uint8_t *in, uint8_t *out, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi16(0x00ff);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) &in[2*i]);
+        __m128i b = _mm_loadu_si128((const __m128i*) &in[2*i + 16]);
+        a = _mm_and_si128(_mm_min_epu8(a, _mm_srli_epi16(a, 8)), lo);
+        b = _mm_and_si128(_mm_min_epu8(b, _mm_srli_epi16(b, 8)), lo);
+        _mm_storeu_si128((__m128i*) &out[i], _mm_packus_epi16(a, b));
     }
+#endif
+    for (; i < n; i++)
+        out[i] = in[2*i] < in[2*i+1] ? in[2*i] : in[2*i+1];
+}
 
-    gridmap_destroy (aft);
+// out[i] = max(in[i-offset ... i-offset+k-1]) for i in [0, n), where
+// values outside of in[0, n) count as 0. g and h are scratch of
+// n+k-1 bytes.
+static void running_max(const uint8_t *in, int n, int k, int offset, uint8_t *out,
+                        uint8_t *g, uint8_t *h)
+{
+    int len = n + k - 1;
+
+    // g: max from the start of each k-block; h: max to its end.
+    for (int i = 0, b = 0; i < len; i++, b++) {
+        int j = i - offset;
+        uint8_t x = (j >= 0 && j < n) ? in[j] : 0;
+        if (b == k)
+            b = 0;
+        g[i] = (b == 0 || x > g[i-1]) ? x : g[i-1];
+    }
+
+    for (int i = len - 1; i >= 0; i--) {
+        int j = i - offset;
+        uint8_t x = (j >= 0 && j < n) ? in[j] : 0;
+        h[i] = (i % k == k - 1 || i == len - 1 || x > h[i+1]) ? x : h[i+1];
+    }
+
+    for (int i = 0; i < n; i++)
+        out[i] = h[i] > g[i+k-1] ? h[i] : g[i+k-1];
 }
 
-void gridmap_convolve_centered_disc_max (grid_map_t *gm, int radius)
+// As running_max, but down the columns [0, width) of an image with
+// the given stride. g and h are scratch of (height+k-1)*width bytes;
+// zero is a row of width zeros.
+static void running_max_rows(const uint8_t *in, int stride, int width, int height, int k, int offset,
+                             uint8_t *out, uint8_t *g, uint8_t *h, const uint8_t *zero)
 {
-    grid_map_t *bef = gm;
-    grid_map_t *aft = gridmap_copy (gm);
+    int len = height + k - 1;
+
+    for (int i = 0, b = 0; i < len; i++, b++) {
+        int j = i - offset;
+        const uint8_t *x = (j >= 0 && j < height) ? &in[j*stride] : zero;
+        if (b == k)
+            b = 0;
+        if (b == 0)
+            memcpy(&g[i*width], x, width);
+        else
+            bytes_max(&g[i*width], &g[(i-1)*width], x, width);
+    }
+
+    for (int i = len - 1; i >= 0; i--) {
+        int j = i - offset;
+        const uint8_t *x = (j >= 0 && j < height) ? &in[j*stride] : zero;
+        if (i % k == k - 1 || i == len - 1)
+            memcpy(&h[i*width], x, width);
+        else
+            bytes_max(&h[i*width], &h[(i+1)*width], x, width);
+    }
 
-    for (int k = -radius; k <= radius; ++k) {
-        for (int l = -radius; l <= radius; ++l) {
-            // is it within radius?
-            if (k*k + l*l > radius*radius)
+    for (int i = 0; i < height; i++)
+        bytes_max(&out[i*stride], &h[i*width], &g[(i+k-1)*width], width);
+}
+
+struct max_filter_task
+{
+    const uint8_t *in;
+    uint8_t *out;
+    int width, height;
+    int k, offset;
+    int lo, hi;   // rows (horizontal pass) or columns (vertical pass)
+};
+
+static void max_filter_rows_task(void *_task)
+{
+    struct max_filter_task *task = _task;
+    uint8_t *g = malloc(task->width + task->k);
+    uint8_t *h = malloc(task->width + task->k);
+
+    for (int y = task->lo; y < task->hi; y++)
+        running_max(&task->in[y*task->width], task->width, task->k, task->offset,
+                    &task->out[y*task->width], g, h);
+
+    free(g);
+    free(h);
+}
+
+static void max_filter_cols_task(void *_task)
+{
+    struct max_filter_task *task = _task;
+    int width = task->hi - task->lo;
+    uint8_t *g = malloc((task->height + task->k) * width);
+    uint8_t *h = malloc((task->height + task->k) * width);
+    uint8_t *zero = calloc(1, width);
+
+    running_max_rows(&task->in[task->lo], task->width, width, task->height, task->k, task->offset,
+                     &task->out[task->lo], g, h, zero);
+
+    free(g);
+    free(h);
+    free(zero);
+}
+
+// Runs f over ntasks tasks splitting [0, n), on wp if provided.
+static void max_filter_run(workerpool_t *wp, void (*f)(void*), struct max_filter_task *proto, int n)
+{
+    int ntasks = wp ? workerpool_get_nthreads(wp) : 1;
+    if (ntasks > n)
+        ntasks = n;
+    if (ntasks < 1)
+        return;
+
+    struct max_filter_task tasks[ntasks];
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i] = *proto;
+        tasks[i].lo = n * i / ntasks;
+        tasks[i].hi = n * (i + 1) / ntasks;
+    }
+
+    if (wp && ntasks > 1) {
+        for (int i = 0; i < ntasks; i++)
+            workerpool_add_task(wp, f, &tasks[i]);
+        workerpool_run(wp);
+    } else {
+        for (int i = 0; i < ntasks; i++)
+            f(&tasks[i]);
+    }
+}
+
+// out = max over the window [x-offx, x-offx+kx) x [y-offy, y-offy+ky)
+// of in. (in and out may be the same.)
+static void max_filter(workerpool_t *wp, const uint8_t *in, uint8_t *out, int width, int height,
+                       int kx, int offx, int ky, int offy)
+{
+    uint8_t *tmp = malloc(width * height);
+
+    struct max_filter_task task = { .in = in, .out = tmp, .width = width, .height = height,
+                                    .k = kx, .offset = offx };
+    max_filter_run(wp, max_filter_rows_task, &task, height);
+
+    task = (struct max_filter_task) { .in = tmp, .out = out, .width = width, .height = height,
+                                      .k = ky, .offset = offy };
+    max_filter_run(wp, max_filter_cols_task, &task, width);
+
+    free(tmp);
+}
+
+void gridmap_dilate_wp(workerpool_t *wp, grid_map_t* gm, uint8_t v, int iterations)
+{
+    if (iterations <= 0)
+        return;
+
+    // 'iterations' rounds of 8-connected dilation reach exactly the
+    // (2*iterations+1)^2 square around each cell.
+    int n = gm->width * gm->height;
+    uint8_t *mask = malloc(n);
+    for (int i = 0; i < n; i++)
+        mask[i] = (gm->data[i] == v);
+
+    int k = 2*iterations + 1;
+    max_filter(wp, mask, mask, gm->width, gm->height, k, iterations, k, iterations);
+
+    for (int i = 0; i < n; i++) {
+        if (mask[i])
+            gm->data[i] = v;
+    }
+
+    free(mask);
+}
+
+void gridmap_dilate(grid_map_t* gm, uint8_t v, int iterations)
+{
+    gridmap_dilate_wp(NULL, gm, v, iterations);
+}
+
+struct disc_max_task
+{
+    const uint8_t *rowmax; // horizontal max of half-width w
+    uint8_t *out;
+    int width, height;
+    const int *dys;        // the row offsets whose half-width is w
+    int ndys;
+    int lo, hi;            // output rows
+};
+
+static void disc_max_task(void *_task)
+{
+    struct disc_max_task *task = _task;
+
+    for (int y = task->lo; y < task->hi; y++) {
+        for (int i = 0; i < task->ndys; i++) {
+            int sy = y + task->dys[i];
+            if (sy < 0 || sy >= task->height)
                 continue;
+            bytes_max(&task->out[y*task->width], &task->out[y*task->width],
+                      &task->rowmax[sy*task->width], task->width);
+        }
+    }
+}
+
+void gridmap_convolve_centered_disc_max_wp(workerpool_t *wp, grid_map_t *gm, int radius)
+{
+    if (radius <= 0)
+        return;
 
-            int ymin = fmax (0, 0-k);
-            int ymax = fmin (gm->height, gm->height-k);
-            int xmin = fmax (0, 0-l);
-            int xmax = fmin (gm->width, gm->width-l);
+    int width = gm->width, height = gm->height;
+
+    // the disc is a stack of centered horizontal spans: row offset dy
+    // spans half-width w(dy) = floor(sqrt(r^2 - dy^2)). For each
+    // distinct w, take the horizontal max once and fold it into the
+    // output rows at the offsets that use it.
+    int hw[2*radius + 1];
+    for (int dy = -radius; dy <= radius; dy++) {
+        int w = 0;
+        while ((w+1)*(w+1) + dy*dy <= radius*radius)
+            w++;
+        hw[dy + radius] = w;
+    }
 
-            for (int y = ymin; y < ymax; ++y) {
-                int n = (y+k)*gm->width + (xmin+l);
-                int o = y*gm->width + xmin;
+    uint8_t *out = calloc(1, width * height);
+    uint8_t *rowmax = malloc(width * height);
+    int dys[2*radius + 1];
 
-                for (int x = xmin; x < xmax; ++x) {
-                    aft->data[o] = (bef->data[n] > aft->data[o]) ? bef->data[n] : aft->data[o];
-                    n++; o++;
-                }
-            }
+    for (int w = 0; w <= radius; w++) {
+        int ndys = 0;
+        for (int dy = -radius; dy <= radius; dy++) {
+            if (hw[dy + radius] == w)
+                dys[ndys++] = dy;
+        }
+        if (ndys == 0)
+            continue;
+
+        struct max_filter_task rows = { .in = gm->data, .out = rowmax, .width = width, .height = height,
+                                        .k = 2*w + 1, .offset = w };
+        max_filter_run(wp, max_filter_rows_task, &rows, height);
+
+        int ntasks = wp ? workerpool_get_nthreads(wp) : 1;
+        if (ntasks > height)
+            ntasks = height;
+        if (ntasks < 1)
+            ntasks = 1;
+
+        struct disc_max_task tasks[ntasks];
+        for (int i = 0; i < ntasks; i++) {
+            tasks[i] = (struct disc_max_task) { .rowmax = rowmax, .out = out, .width = width, .height = height,
+                                                .dys = dys, .ndys = ndys,
+                                                .lo = height * i / ntasks, .hi = height * (i + 1) / ntasks };
+        }
+
+        if (wp && ntasks > 1) {
+            for (int i = 0; i < ntasks; i++)
+                workerpool_add_task(wp, disc_max_task, &tasks[i]);
+            workerpool_run(wp);
+        } else {
+            for (int i = 0; i < ntasks; i++)
+                disc_max_task(&tasks[i]);
         }
     }
 
-    memcpy (bef->data, aft->data, aft->datalen * sizeof(*aft->data));
-    gridmap_destroy (aft);
+    memcpy(gm->data, out, width * height);
+    free(out);
+    free(rowmax);
+}
+
+void gridmap_convolve_centered_disc_max (grid_map_t *gm, int radius)
+{
+    gridmap_convolve_centered_disc_max_wp(NULL, gm, radius);
 }
 
 void gridmap_convolve_separable_max (grid_map_t *gm, int dim, double *filter, double padding)
@@ -525,77 +806,21 @@ void gridmap_convolve_separable_max (grid_map_t *gm, int dim, double *filter, do
     gridmap_destroy (aft);
 }
 
-static void max_convolution(uint8_t *in, int in_offset, int width, int k, uint8_t *out, int out_offset){
-
-    int run_length = 0;
-    int run_value  = 0;
-
-    for(int x = 0; x < width; x++){
-        int v = 0;
-        int cnt = fmin(k, width - x);
-
-        // if the last convolution step was all zeros, and the
-        // right-most position is a zero, then we know the result
-        // for this pixel will be zero.
-        int right = in[in_offset + x + cnt - 1] & 0xff;
-
-        if (right == run_value){
-            run_length++;
-        }
-        else{
-            run_length = 1;
-            run_value = right;
-        }
-
-        if(run_length >= k){
-            out[out_offset + x] = (uint8_t) run_value;
-            continue;
-        }
-
-        //do the dumb convolution.
-        for(int i = 0; i < cnt; i++){
-            v = fmax(v, in[in_offset + x + i] & 0xff);
-            if(v == 255){
-                break;
-            }
-        }
-
-        out[out_offset + x] = (uint8_t) v;
-    }
-}
-
-grid_map_t * gridmap_max_convolution(const grid_map_t *gm_in, int k){
-
-
+grid_map_t *gridmap_max_convolution_wp(workerpool_t *wp, const grid_map_t *gm_in, int k)
+{
     grid_map_t *gm = gridmap_copy(gm_in);
-    int width = gm_in->width;
-    int height = gm_in->height;
-    for(int y = 0; y < gm->height; y++){
-        max_convolution(gm_in->data, y *width, width, k, gm->data, y * width);
-    }
-
-    uint8_t *tmp  = (uint8_t*)malloc(sizeof(uint8_t) * height);
-    uint8_t *tmp2 = (uint8_t*)malloc(sizeof(uint8_t) * height);
 
-    for(int x = 0; x < gm_in->width; x++){
-
-        //copy column into 1d array for locality
-        for(int y = 0; y < gm_in->height; y++){
-            tmp[y] = gm->data[y * width + x];
-        }
-        max_convolution(tmp, 0, gm_in->height, k, tmp2, 0);
-
-        //copy back
-        for(int y = 0; y < height; y++){
-            gm->data[y * width + x] = tmp2[y];
-        }
-    }
-
-    free(tmp);
-    free(tmp2);
+    // each pixel takes the max of the k x k window extending right
+    // and up from it, clipped to the map.
+    if (k > 1)
+        max_filter(wp, gm_in->data, gm->data, gm_in->width, gm_in->height, k, 0, k, 0);
 
     return gm;
+}
 
+grid_map_t * gridmap_max_convolution(const grid_map_t *gm_in, int k)
+{
+    return gridmap_max_convolution_wp(NULL, gm_in, k);
 }
 
 grid_map_t *gridmap_decimate_max(const grid_map_t *gm, int factor)
@@ -607,29 +832,34 @@ grid_map_t *gridmap_decimate_max(const grid_map_t *gm, int factor)
                                              new_height,
                                              gm->meters_per_pixel * factor,
                                              0, true);
-    // loop over input rows
-    for (int iy = 0; iy < gm->height; iy++) {
-        // which output row should this affect?
-        int oy = iy/factor;
 
-        // loop over input columns
-        for (int ix = 0; ix < gm->width; ix+= factor) {
-            // destination column?
-            int ox = ix/factor;
+    uint8_t *rowmax = malloc(new_width);
 
-            int maxv = 0;
-            int maxdx = min(factor, gm->width - ox*factor);
-
-            // loop over the input pixels that all map to (ox,oy)
-            for (int dx = 0; dx < maxdx; dx++)
-                maxv = max(maxv,
-                           (gm->data[iy*gm->width + ox*factor + dx]&0xff));
-
-            // update output column
-            gm_out->data[oy*gm_out->width + ox] = (uint8_t) max((gm_out->data[oy*gm_out->width + ox]&0xff), maxv);
+    // loop over input rows
+    for (int iy = 0; iy < gm->height; iy++) {
+        const uint8_t *in = &gm->data[iy*gm->width];
+
+        // max over each group of 'factor' columns
+        if (factor == 2) {
+            pairs_max(in, rowmax, gm->width / 2);
+            if (gm->width & 1)
+                rowmax[new_width - 1] = in[gm->width - 1];
+        } else {
+            for (int ox = 0; ox < new_width; ox++) {
+                int maxv = 0;
+                int maxdx = min(factor, gm->width - ox*factor);
+                for (int dx = 0; dx < maxdx; dx++)
+                    maxv = max(maxv, in[ox*factor + dx]);
+                rowmax[ox] = maxv;
+            }
         }
+
+        // which output row should this affect?
+        uint8_t *out = &gm_out->data[(iy/factor)*gm_out->width];
+        bytes_max(out, out, rowmax, new_width);
     }
 
+    free(rowmax);
     return gm_out;
 }
 
@@ -638,20 +868,16 @@ grid_map_t *gridmap_downsample_mean (const grid_map_t *gm)
     grid_map_t *downsampled = gridmap_make_pixels (gm->x0, gm->y0,
             gm->width/2, gm->height/2, gm->meters_per_pixel*2, 0, 0);
 
-    double sum;
     for (int j = 0; j < downsampled->height; ++j) {
-        for (int i = 0; i < downsampled->width; ++i) {
-            uint8_t a = gm->data[(2*j + 0)*gm->width + (2*i + 0)];
-            uint8_t b = gm->data[(2*j + 0)*gm->width + (2*i + 1)];
-            uint8_t c = gm->data[(2*j + 1)*gm->width + (2*i + 0)];
-            uint8_t d = gm->data[(2*j + 1)*gm->width + (2*i + 1)];
+        const uint8_t *r0 = &gm->data[(2*j + 0)*gm->width];
+        const uint8_t *r1 = &gm->data[(2*j + 1)*gm->width];
+        uint8_t *out = &downsampled->data[j*downsampled->width];
 
-            sum = a;
-            sum += b;
-            sum += c;
-            sum += d;
+        for (int i = 0; i < downsampled->width; ++i) {
+            int sum = r0[2*i] + r0[2*i + 1] + r1[2*i] + r1[2*i + 1];
 
-            downsampled->data[j*downsampled->width + i] = round( sum / 4.0 );
+            // round(sum / 4.0) for non-negative sums
+            out[i] = (sum + 2) >> 2;
         }
     }
 
@@ -663,21 +889,14 @@ grid_map_t *gridmap_downsample_min (const grid_map_t *gm)
     grid_map_t *downsampled = gridmap_make_pixels (gm->x0, gm->y0,
             gm->width/2, gm->height/2, gm->meters_per_pixel*2, 0, 0);
 
-    for (int j = 0; j < downsampled->height; ++j) {
-        for (int i = 0; i < downsampled->width; ++i) {
-            uint8_t a = gm->data[(2*j + 0)*gm->width + (2*i + 0)];
-            uint8_t b = gm->data[(2*j + 0)*gm->width + (2*i + 1)];
-            uint8_t c = gm->data[(2*j + 1)*gm->width + (2*i + 0)];
-            uint8_t d = gm->data[(2*j + 1)*gm->width + (2*i + 1)];
-
-            uint8_t minv = (a > b) ? b : a;
-            minv = (minv > c) ? c : minv;
-            minv = (minv > d) ? d : minv;
+    uint8_t *tmp = malloc(2*downsampled->width + 1);
 
-            downsampled->data[j*downsampled->width + i] = minv;
-        }
+    for (int j = 0; j < downsampled->height; ++j) {
+        bytes_min(tmp, &gm->data[(2*j + 0)*gm->width], &gm->data[(2*j + 1)*gm->width], 2*downsampled->width);
+        pairs_min(tmp, &downsampled->data[j*downsampled->width], downsampled->width);
     }
 
+    free(tmp);
     return downsampled;
 }
 
@@ -686,21 +905,14 @@ grid_map_t *gridmap_downsample_max (const grid_map_t *gm)
     grid_map_t *downsampled = gridmap_make_pixels (gm->x0, gm->y0,
             gm->width/2, gm->height/2, gm->meters_per_pixel*2, 0, 0);
 
-    for (int j = 0; j < downsampled->height; ++j) {
-        for (int i = 0; i < downsampled->width; ++i) {
-            uint8_t a = gm->data[(2*j + 0)*gm->width + (2*i + 0)];
-            uint8_t b = gm->data[(2*j + 0)*gm->width + (2*i + 1)];
-            uint8_t c = gm->data[(2*j + 1)*gm->width + (2*i + 0)];
-            uint8_t d = gm->data[(2*j + 1)*gm->width + (2*i + 1)];
-
-            uint8_t maxv = (a < b) ? b : a;
-            maxv = (maxv < c) ? c : maxv;
-            maxv = (maxv < d) ? d : maxv;
+    uint8_t *tmp = malloc(2*downsampled->width + 1);
 
-            downsampled->data[j*downsampled->width + i] = maxv;
-        }
+    for (int j = 0; j < downsampled->height; ++j) {
+        bytes_max(tmp, &gm->data[(2*j + 0)*gm->width], &gm->data[(2*j + 1)*gm->width], 2*downsampled->width);
+        pairs_max(tmp, &downsampled->data[j*downsampled->width], downsampled->width);
     }
 
+    free(tmp);
     return downsampled;
 }
 
@@ -709,26 +921,22 @@ void gridmap_downsample_min_and_max (const grid_map_t *gm, grid_map_t **gmin, gr
     grid_map_t *tmp_gmin = gridmap_make_pixels (gm->x0, gm->y0, gm->width/2, gm->height/2, gm->meters_per_pixel*2, 0, 0);
     grid_map_t *tmp_gmax = gridmap_make_pixels (gm->x0, gm->y0, gm->width/2, gm->height/2, gm->meters_per_pixel*2, 0, 0);
 
+    int width = tmp_gmin->width;
+    uint8_t *tmp = malloc(2*width + 1);
+
     for (int j = 0; j < tmp_gmin->height; ++j) {
-        for (int i = 0; i < tmp_gmin->width; ++i) {
-            uint8_t a = gm->data[(2*j + 0)*gm->width + (2*i + 0)];
-            uint8_t b = gm->data[(2*j + 0)*gm->width + (2*i + 1)];
-            uint8_t c = gm->data[(2*j + 1)*gm->width + (2*i + 0)];
-            uint8_t d = gm->data[(2*j + 1)*gm->width + (2*i + 1)];
-
-            uint8_t minv = (a > b) ? b : a;
-            minv = (minv > c) ? c : minv;
-            minv = (minv > d) ? d : minv;
-
-            uint8_t maxv = (a < b) ? b : a;
-            maxv = (maxv < c) ? c : maxv;
-            maxv = (maxv < d) ? d : maxv;
-
-            tmp_gmin->data[j*tmp_gmin->width + i] = minv;
-            tmp_gmax->data[j*tmp_gmax->width + i] = maxv;
-        }
+        const uint8_t *r0 = &gm->data[(2*j + 0)*gm->width];
+        const uint8_t *r1 = &gm->data[(2*j + 1)*gm->width];
+
+        bytes_min(tmp, r0, r1, 2*width);
+        pairs_min(tmp, &tmp_gmin->data[j*width], width);
+
+        bytes_max(tmp, r0, r1, 2*width);
+        pairs_max(tmp, &tmp_gmax->data[j*width], width);
     }
 
+    free(tmp);
+
     *gmin = tmp_gmin;
     *gmax = tmp_gmax;
 }
@@ -43,6 +43,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "lcmtypes/grid_map_t.h"
 #include "common/image_u8.h"
 #include "common/image_u8x4.h"
+#include "common/workerpool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -148,6 +149,14 @@ void gridmap_convolve_separable_max (grid_map_t *gm, int dim, double *filter, do
 
 grid_map_t *gridmap_max_convolution(const grid_map_t *gm_in, int k);
 
+/**
+ * As above, splitting the work by rows (and columns) across wp. (wp
+ * may be NULL.)
+ **/
+void gridmap_dilate_wp(workerpool_t *wp, grid_map_t* gm, uint8_t v, int iterations);
+void gridmap_convolve_centered_disc_max_wp(workerpool_t *wp, grid_map_t *gm, int radius);
+grid_map_t *gridmap_max_convolution_wp(workerpool_t *wp, const grid_map_t *gm_in, int k);
+
 grid_map_t *gridmap_decimate_max(const grid_map_t *gm, int k);
 
 grid_map_t *gridmap_downsample_mean (const grid_map_t *gm); // downsample by doubling meter_per_pixel
@@ -0,0 +1,122 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _HASH_UTIL_H
+#define _HASH_UTIL_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Hash functions for the templated hash tables (tswiss_impl.h,
+// thash_impl.h). Every bit of the input affects every bit of the
+// output, so tables may use the low and the high bits independently.
+//
+// Floats are hashed by their bit pattern, so the result does not
+// depend on how the compiler evaluates floating point expressions;
+// -0 and +0 hash the same so that the hash agrees with ==.
+
+// murmur3 64 bit finalizer
+static inline uint64_t hash_u64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline uint64_t hash_u32x2(uint32_t a, uint32_t b)
+{
+    return hash_u64(((uint64_t) a << 32) | b);
+}
+
+static inline uint64_t hash_ptr(const void *p)
+{
+    return hash_u64((uintptr_t) p);
+}
+
+static inline uint64_t hash_float(float f)
+{
+    if (f == 0)
+        f = 0;
+
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return hash_u64(bits);
+}
+
+static inline uint64_t hash_double(double f)
+{
+    if (f == 0)
+        f = 0;
+
+    uint64_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return hash_u64(bits);
+}
+
+// Combines the hashes of a struct's fields, in order.
+static inline uint64_t hash_combine(uint64_t h, uint64_t v)
+{
+    return hash_u64(h ^ (v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2)));
+}
+
+static inline uint64_t hash_bytes(const void *_p, size_t len)
+{
+    const uint8_t *p = _p;
+    uint64_t h = 0xcbf29ce484222325ull ^ len;
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 0x100000001b3ull;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        h = (h ^ *p) * 0x100000001b3ull;
+        p++;
+        len--;
+    }
+
+    return hash_u64(h);
+}
+
+static inline uint64_t hash_str(const char *s)
+{
+    return hash_bytes(s, strlen(s));
+}
+
+#endif
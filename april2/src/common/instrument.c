@@ -0,0 +1,314 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "instrument.h"
+
+// One per thread that has recorded anything. Never freed, so that
+// what exited threads recorded still counts.
+struct instrument_thread
+{
+    // allocated by the owning thread on its first record of each span
+    // in ticks (see instrument_ticks), converted to ns only when read
+    uint64_t *hist[INSTRUMENT_MAX_SPANS];   // INSTRUMENT_NBUCKETS counts
+    uint64_t sum_ticks[INSTRUMENT_MAX_SPANS];
+    int64_t counters[INSTRUMENT_MAX_COUNTERS];
+
+    struct instrument_thread *next;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *span_names[INSTRUMENT_MAX_SPANS];
+static int nspans;
+static char *counter_names[INSTRUMENT_MAX_COUNTERS];
+static int ncounters;
+
+static struct instrument_thread *threads;
+
+static __thread struct instrument_thread *self;
+
+int instrument_use_tsc;
+static double ns_per_tick = 1;
+
+// Runs before main, so every span is timed with the same ticks.
+__attribute__((constructor)) static void calibrate_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // invariant TSC: constant rate, and keeps counting in deep C-states
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+        return;
+
+    uint64_t ns0 = instrument_now_ns(), tsc0 = __rdtsc();
+    uint64_t ns1, tsc1;
+    do {
+        ns1 = instrument_now_ns();
+        tsc1 = __rdtsc();
+    } while (ns1 - ns0 < 2000000);
+
+    if (tsc1 <= tsc0)
+        return;
+
+    ns_per_tick = (double) (ns1 - ns0) / (tsc1 - tsc0);
+    instrument_use_tsc = 1;
+#endif
+}
+
+static int lookup(char **names, int *n, int max, const char *name)
+{
+    pthread_mutex_lock(&registry_mutex);
+
+    int id = -1;
+    for (int i = 0; i < *n; i++) {
+        if (!strcmp(names[i], name)) {
+            id = i;
+            break;
+        }
+    }
+
+    if (id < 0 && *n < max) {
+        id = *n;
+        names[id] = strdup(name);
+        __atomic_store_n(n, id + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&registry_mutex);
+    return id;
+}
+
+int instrument_span_id(const char *name)
+{
+    return lookup(span_names, &nspans, INSTRUMENT_MAX_SPANS, name);
+}
+
+int instrument_counter_id(const char *name)
+{
+    return lookup(counter_names, &ncounters, INSTRUMENT_MAX_COUNTERS, name);
+}
+
+// get_self, bucket_of and record_ticks are on every span's path, so they
+// are inlined even in unoptimized builds.
+#define INSTRUMENT_INLINE static inline __attribute__((always_inline))
+
+static struct instrument_thread *add_self(void)
+{
+    struct instrument_thread *t = calloc(1, sizeof(struct instrument_thread));
+
+    pthread_mutex_lock(&registry_mutex);
+    t->next = threads;
+    __atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_mutex);
+
+    self = t;
+    return t;
+}
+
+INSTRUMENT_INLINE struct instrument_thread *get_self(void)
+{
+    return self ? self : add_self();
+}
+
+INSTRUMENT_INLINE int bucket_of(uint64_t v)
+{
+    if (v < INSTRUMENT_SUB_BUCKETS)
+        return v;
+
+    // position of the leading bit, then the next three bits
+    int e = 63 - __builtin_clzll(v);
+    int sub = (v >> (e - 3)) & (INSTRUMENT_SUB_BUCKETS - 1);
+    int b = (e - 2) * INSTRUMENT_SUB_BUCKETS + sub;
+    return b < INSTRUMENT_NBUCKETS ? b : INSTRUMENT_NBUCKETS - 1;
+}
+
+// largest value that falls in bucket b
+static uint64_t bucket_upper(int b)
+{
+    if (b < INSTRUMENT_SUB_BUCKETS)
+        return b;
+
+    int e = b / INSTRUMENT_SUB_BUCKETS + 2;
+    uint64_t sub = b % INSTRUMENT_SUB_BUCKETS;
+    return ((INSTRUMENT_SUB_BUCKETS + sub + 1) << (e - 3)) - 1;
+}
+
+// Only the owning thread writes its histograms, so plain increments
+// suffice; the atomic stores just keep readers from seeing torn values.
+INSTRUMENT_INLINE void record_ticks(int id, uint64_t ticks)
+{
+    if (id < 0)
+        return;
+
+    struct instrument_thread *t = get_self();
+    uint64_t *hist = t->hist[id];
+    if (!hist) {
+        hist = calloc(INSTRUMENT_NBUCKETS, sizeof(uint64_t));
+        __atomic_store_n(&t->hist[id], hist, __ATOMIC_RELEASE);
+    }
+
+    int b = bucket_of(ticks);
+    __atomic_store_n(&hist[b], hist[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->sum_ticks[id], t->sum_ticks[id] + ticks, __ATOMIC_RELAXED);
+}
+
+void instrument_span_record(int id, uint64_t ns)
+{
+    // rounded up, so the reported bucket edge is never below ns
+    record_ticks(id, (uint64_t) ceil(ns / ns_per_tick));
+}
+
+void instrument_span_end(int id, uint64_t begin_ticks)
+{
+    record_ticks(id, instrument_ticks() - begin_ticks);
+}
+
+uint64_t instrument_span_lap(int id, uint64_t begin_ticks)
+{
+    uint64_t now = instrument_ticks();
+    record_ticks(id, now - begin_ticks);
+    return now;
+}
+
+void instrument_counter_add(int id, int64_t delta)
+{
+    if (id < 0)
+        return;
+
+    struct instrument_thread *t = get_self();
+    __atomic_store_n(&t->counters[id], t->counters[id] + delta, __ATOMIC_RELAXED);
+}
+
+struct instrument_window
+{
+    // totals as of the previous read
+    uint64_t hist[INSTRUMENT_MAX_SPANS][INSTRUMENT_NBUCKETS];
+    uint64_t sum_ticks[INSTRUMENT_MAX_SPANS];
+    int64_t counters[INSTRUMENT_MAX_COUNTERS];
+};
+
+instrument_window_t *instrument_window_create(void)
+{
+    return calloc(1, sizeof(instrument_window_t));
+}
+
+void instrument_window_destroy(instrument_window_t *w)
+{
+    free(w);
+}
+
+static int64_t bucket_upper_ns(int b)
+{
+    return (int64_t) ceil(bucket_upper(b) * ns_per_tick);
+}
+
+void instrument_window_read(instrument_window_t *w, zarray_t *spans, zarray_t *counters)
+{
+    zarray_clear(spans);
+    zarray_clear(counters);
+
+    int n = __atomic_load_n(&nspans, __ATOMIC_ACQUIRE);
+    int nc = __atomic_load_n(&ncounters, __ATOMIC_ACQUIRE);
+
+    uint64_t hist[INSTRUMENT_NBUCKETS];
+
+    for (int id = 0; id < n; id++) {
+        memset(hist, 0, sizeof(hist));
+        uint64_t sum_ticks = 0;
+
+        for (struct instrument_thread *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+            uint64_t *th = __atomic_load_n(&t->hist[id], __ATOMIC_ACQUIRE);
+            if (!th)
+                continue;
+            for (int b = 0; b < INSTRUMENT_NBUCKETS; b++)
+                hist[b] += __atomic_load_n(&th[b], __ATOMIC_RELAXED);
+            sum_ticks += __atomic_load_n(&t->sum_ticks[id], __ATOMIC_RELAXED);
+        }
+
+        // this window's counts
+        int64_t count = 0;
+        for (int b = 0; b < INSTRUMENT_NBUCKETS; b++) {
+            uint64_t total = hist[b];
+            hist[b] -= w->hist[id][b];
+            w->hist[id][b] = total;
+            count += hist[b];
+        }
+
+        uint64_t window_sum_ticks = sum_ticks - w->sum_ticks[id];
+        w->sum_ticks[id] = sum_ticks;
+
+        if (count == 0)
+            continue;
+
+        instrument_span_stats_t stats = { .name = span_names[id],
+                                          .count = count,
+                                          .mean_ns = window_sum_ticks * ns_per_tick / count };
+
+        int64_t acc = 0;
+        int have_p50 = 0, have_p99 = 0;
+        for (int b = 0; b < INSTRUMENT_NBUCKETS; b++) {
+            if (!hist[b])
+                continue;
+            acc += hist[b];
+            if (!have_p50 && 2 * acc >= count) {
+                stats.p50_ns = bucket_upper_ns(b);
+                have_p50 = 1;
+            }
+            if (!have_p99 && 100 * acc >= 99 * count) {
+                stats.p99_ns = bucket_upper_ns(b);
+                have_p99 = 1;
+            }
+            stats.max_ns = bucket_upper_ns(b);
+        }
+
+        zarray_add(spans, &stats);
+    }
+
+    for (int id = 0; id < nc; id++) {
+        int64_t total = 0;
+        for (struct instrument_thread *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next)
+            total += __atomic_load_n(&t->counters[id], __ATOMIC_RELAXED);
+
+        instrument_counter_stats_t stats = { .name = counter_names[id],
+                                             .delta = total - w->counters[id],
+                                             .total = total };
+        w->counters[id] = total;
+        zarray_add(counters, &stats);
+    }
+}
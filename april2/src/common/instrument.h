@@ -0,0 +1,193 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _INSTRUMENT_H
+#define _INSTRUMENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "zarray.h"
+
+// Always-on, low overhead instrumentation of named spans (latencies)
+// and counters.
+//
+// Each thread records into its own histograms, so recording takes no
+// locks and shares no cache lines with other threads; only the first
+// use of a name, or the first record by a new thread, takes a lock.
+// Readers (see instrument_window_read, or instrument_lcm.h to publish
+// periodically) sum over all threads at any time.
+//
+// Latencies go into fixed log-linear buckets, 8 per power of two, so
+// percentiles are reported to within 12.5%.
+//
+//    INSTRUMENT_SPAN_BEGIN(t);
+//    ... work ...
+//    INSTRUMENT_SPAN_END("pf.update", t);
+//
+// A span costs two timestamps plus about 7 ns of bookkeeping. Where
+// reading the TSC is slow (about 20 ns on some virtual machines), that
+// is at or over 50 ns; consecutive stages avoid half of it by sharing
+// timestamps, one stage ending where the next begins:
+//
+//    INSTRUMENT_SPAN_BEGIN(t);
+//    ... stage one ...
+//    INSTRUMENT_SPAN_NEXT("solve.build", t);
+//    ... stage two ...
+//    INSTRUMENT_SPAN_END("solve.solve", t);
+//
+//    INSTRUMENT_COUNT("pf.resampled", 1);
+
+#define INSTRUMENT_MAX_SPANS    128
+#define INSTRUMENT_MAX_COUNTERS 128
+
+// log-linear buckets covering 0 .. 2^44 ns (about 4.9 hours)
+#define INSTRUMENT_SUB_BUCKETS  8
+#define INSTRUMENT_NBUCKETS     (42 * INSTRUMENT_SUB_BUCKETS)
+
+static inline uint64_t instrument_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Span timestamps. Where the TSC is invariant, a tick is a TSC count
+// (calibrated against CLOCK_MONOTONIC once, at load), which is several
+// times cheaper to read than the clock; otherwise it is a nanosecond
+// of instrument_now_ns(). Only differences of ticks are meaningful.
+extern int instrument_use_tsc;
+
+static inline uint64_t instrument_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (instrument_use_tsc)
+        return __rdtsc();
+#endif
+    return instrument_now_ns();
+}
+
+// Returns the id for a name, registering it on first use. Ids are
+// stable for the life of the process. Returns -1 if the table is full.
+int instrument_span_id(const char *name);
+int instrument_counter_id(const char *name);
+
+void instrument_span_record(int id, uint64_t ns);
+
+// Records the time since begin_ticks (from instrument_ticks()).
+void instrument_span_end(int id, uint64_t begin_ticks);
+
+// As instrument_span_end, and returns the ticks it ended at.
+uint64_t instrument_span_lap(int id, uint64_t begin_ticks);
+void instrument_counter_add(int id, int64_t delta);
+
+// The macros cache the id in a static, so each call site looks its
+// name up only once.
+#define INSTRUMENT_SPAN_BEGIN(var) uint64_t var = instrument_ticks()
+
+#define INSTRUMENT_SPAN_END(name, var)                                  \
+    do {                                                                \
+        static int _instrument_id = -1;                                 \
+        int _id = __atomic_load_n(&_instrument_id, __ATOMIC_RELAXED);  \
+        if (_id < 0) {                                                  \
+            _id = instrument_span_id(name);                             \
+            __atomic_store_n(&_instrument_id, _id, __ATOMIC_RELAXED);  \
+        }                                                               \
+        instrument_span_end(_id, (var));                                \
+    } while (0)
+
+// ends the span begun at var and begins the next one in var
+#define INSTRUMENT_SPAN_NEXT(name, var)                                 \
+    do {                                                                \
+        static int _instrument_id = -1;                                 \
+        int _id = __atomic_load_n(&_instrument_id, __ATOMIC_RELAXED);  \
+        if (_id < 0) {                                                  \
+            _id = instrument_span_id(name);                             \
+            __atomic_store_n(&_instrument_id, _id, __ATOMIC_RELAXED);  \
+        }                                                               \
+        (var) = instrument_span_lap(_id, (var));                        \
+    } while (0)
+
+#define INSTRUMENT_COUNT(name, delta)                                   \
+    do {                                                                \
+        static int _instrument_id = -1;                                 \
+        int _id = __atomic_load_n(&_instrument_id, __ATOMIC_RELAXED);  \
+        if (_id < 0) {                                                  \
+            _id = instrument_counter_id(name);                          \
+            __atomic_store_n(&_instrument_id, _id, __ATOMIC_RELAXED);  \
+        }                                                               \
+        instrument_counter_add(_id, (delta));                           \
+    } while (0)
+
+typedef struct instrument_span_stats instrument_span_stats_t;
+struct instrument_span_stats
+{
+    const char *name;       // owned by the registry
+    int64_t count;
+    double mean_ns;
+    int64_t p50_ns, p99_ns; // upper edges of the percentile's bucket
+    int64_t max_ns;         // upper edge of the highest non-empty bucket
+};
+
+typedef struct instrument_counter_stats instrument_counter_stats_t;
+struct instrument_counter_stats
+{
+    const char *name;
+    int64_t delta;          // since the previous read
+    int64_t total;
+};
+
+// A reader's view: each read reports what was recorded since the
+// previous read by the same window.
+typedef struct instrument_window instrument_window_t;
+
+instrument_window_t *instrument_window_create(void);
+void instrument_window_destroy(instrument_window_t *w);
+
+// Clears and fills 'spans' (instrument_span_stats_t) with every span
+// recorded since the previous read, and 'counters'
+// (instrument_counter_stats_t) with every registered counter.
+void instrument_window_read(instrument_window_t *w, zarray_t *spans, zarray_t *counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
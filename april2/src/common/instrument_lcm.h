@@ -0,0 +1,188 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _INSTRUMENT_LCM_H
+#define _INSTRUMENT_LCM_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <lcm/lcm.h>
+
+#include "common/instrument.h"
+#include "common/math_util.h"
+#include "common/time_util.h"
+#include "lcmtypes/instrument_report_t.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Publishes this process's instrumentation (see instrument.h) as
+// instrument_report_t messages, so it can be watched with lcm-spy.
+//
+//    instrument_publisher_t *ip =
+//        instrument_publisher_create(lcm, INSTRUMENT_CHANNEL, "FLAG-pf", 1.0);
+//    ...
+//    instrument_publisher_destroy(ip);
+
+#define INSTRUMENT_CHANNEL "INSTRUMENT"
+
+// Publishes one report covering everything recorded since the
+// previous report made with the same window.
+static inline void instrument_publish(lcm_t *lcm, const char *channel, const char *process,
+                                      instrument_window_t *w)
+{
+    zarray_t *spans = zarray_create(sizeof(instrument_span_stats_t));
+    zarray_t *counters = zarray_create(sizeof(instrument_counter_stats_t));
+    instrument_window_read(w, spans, counters);
+
+    int ns = zarray_size(spans), nc = zarray_size(counters);
+
+    instrument_report_t msg = { .utime = utime_now(),
+                                .process = (char*) process,
+                                .nspans = ns,
+                                .ncounters = nc };
+
+    msg.span_names = malloc(sizeof(char*) * (ns + 1));
+    msg.span_count = malloc(sizeof(int64_t) * (ns + 1));
+    msg.span_mean_ns = malloc(sizeof(double) * (ns + 1));
+    msg.span_p50_ns = malloc(sizeof(int64_t) * (ns + 1));
+    msg.span_p99_ns = malloc(sizeof(int64_t) * (ns + 1));
+    msg.span_max_ns = malloc(sizeof(int64_t) * (ns + 1));
+    for (int i = 0; i < ns; i++) {
+        instrument_span_stats_t *s;
+        zarray_get_volatile(spans, i, &s);
+        msg.span_names[i] = (char*) s->name;
+        msg.span_count[i] = s->count;
+        msg.span_mean_ns[i] = s->mean_ns;
+        msg.span_p50_ns[i] = s->p50_ns;
+        msg.span_p99_ns[i] = s->p99_ns;
+        msg.span_max_ns[i] = s->max_ns;
+    }
+
+    msg.counter_names = malloc(sizeof(char*) * (nc + 1));
+    msg.counter_delta = malloc(sizeof(int64_t) * (nc + 1));
+    msg.counter_total = malloc(sizeof(int64_t) * (nc + 1));
+    for (int i = 0; i < nc; i++) {
+        instrument_counter_stats_t *s;
+        zarray_get_volatile(counters, i, &s);
+        msg.counter_names[i] = (char*) s->name;
+        msg.counter_delta[i] = s->delta;
+        msg.counter_total[i] = s->total;
+    }
+
+    instrument_report_t_publish(lcm, channel, &msg);
+
+    free(msg.span_names);
+    free(msg.span_count);
+    free(msg.span_mean_ns);
+    free(msg.span_p50_ns);
+    free(msg.span_p99_ns);
+    free(msg.span_max_ns);
+    free(msg.counter_names);
+    free(msg.counter_delta);
+    free(msg.counter_total);
+    zarray_destroy(spans);
+    zarray_destroy(counters);
+}
+
+typedef struct instrument_publisher instrument_publisher_t;
+struct instrument_publisher
+{
+    lcm_t *lcm;
+    char *channel;
+    char *process;
+    int64_t period_us;
+
+    instrument_window_t *window;
+    pthread_t thread;
+    int stop;
+};
+
+static void *instrument_publisher_run(void *user)
+{
+    instrument_publisher_t *ip = (instrument_publisher_t*) user;
+
+    int64_t next_utime = utime_now() + ip->period_us;
+    while (!__atomic_load_n(&ip->stop, __ATOMIC_RELAXED)) {
+        int64_t now = utime_now();
+        if (now < next_utime) {
+            // short sleeps so destroy doesn't wait a whole period
+            usleep(imin(next_utime - now, 50000));
+            continue;
+        }
+
+        instrument_publish(ip->lcm, ip->channel, ip->process, ip->window);
+        next_utime += ip->period_us;
+        if (next_utime < now)
+            next_utime = now + ip->period_us;
+    }
+
+    return NULL;
+}
+
+// Starts a thread publishing a report 'hz' times per second.
+static inline instrument_publisher_t *instrument_publisher_create(lcm_t *lcm, const char *channel,
+                                                                  const char *process, double hz)
+{
+    instrument_publisher_t *ip = (instrument_publisher_t*) calloc(1, sizeof(instrument_publisher_t));
+    ip->lcm = lcm;
+    ip->channel = strdup(channel);
+    ip->process = strdup(process);
+    ip->period_us = 1.0E6 / (hz > 1E-3 ? hz : 1E-3);
+    ip->window = instrument_window_create();
+
+    pthread_create(&ip->thread, NULL, instrument_publisher_run, ip);
+    return ip;
+}
+
+static inline void instrument_publisher_destroy(instrument_publisher_t *ip)
+{
+    if (!ip)
+        return;
+
+    __atomic_store_n(&ip->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(ip->thread, NULL);
+
+    instrument_window_destroy(ip->window);
+    free(ip->channel);
+    free(ip->process);
+    free(ip);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
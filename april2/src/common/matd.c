@@ -38,6 +38,12 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <math.h>
 #include <float.h>
 
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "common/math_util.h"
 #include "common/svd22.h"
 #include "common/matd.h"
@@ -47,6 +53,23 @@ either expressed or implied, of the Regents of The University of Michigan.
 // to ease creating mati, matf, etc. in the future.
 #define TYPE double
 
+// see matd_use_arena()
+static __thread arena_t *matd_arena;
+
+static inline matd_t *matd_alloc(size_t sz)
+{
+    if (matd_arena)
+        return arena_calloc(matd_arena, 1, sz);
+    return calloc(1, sz);
+}
+
+arena_t *matd_use_arena(arena_t *arena)
+{
+    arena_t *old = matd_arena;
+    matd_arena = arena;
+    return old;
+}
+
 matd_t *matd_create(int rows, int cols)
 {
     assert(rows >= 0);
@@ -55,7 +78,7 @@ matd_t *matd_create(int rows, int cols)
     if (rows == 0 || cols == 0)
         return matd_create_scalar(0);
 
-    matd_t *m = calloc(1, sizeof(matd_t) + (rows*cols*sizeof(double)));
+    matd_t *m = matd_alloc(sizeof(matd_t) + (rows*cols*sizeof(double)));
     m->nrows = rows;
     m->ncols = cols;
 
@@ -64,7 +87,7 @@ matd_t *matd_create(int rows, int cols)
 
 matd_t *matd_create_scalar(TYPE v)
 {
-    matd_t *m = calloc(1, sizeof(matd_t) + sizeof(double));
+    matd_t *m = matd_alloc(sizeof(matd_t) + sizeof(double));
     m->nrows = 0;
     m->ncols = 0;
     m->data[0] = v;
@@ -228,10 +251,183 @@ void matd_destroy(matd_t *m)
     if (!m)
         return;
 
-    assert(m != NULL);
+    if (matd_arena && arena_owns(matd_arena, m))
+        return;
+
     free(m);
 }
 
+////////////////////////////////////////////////////////////////////
+// Dense kernels. matd_gemm() computes C += A*B on row-major blocks:
+// C is covered by MATD_MR x MATD_NR register tiles, and the k and j
+// loops are blocked so that the active slice of B stays in cache.
+// Tiles use AVX2/FMA or SSE2 when the compiler targets them.
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define MATD_NR 8
+#else
+#define MATD_NR 4
+#endif
+#define MATD_MR 4
+#define MATD_KC 128
+#define MATD_NC 512
+
+// C[0:MR, 0:NR] += A[0:MR, 0:K] * B[0:K, 0:NR]
+static inline void matd_gemm_tile(int K, const double *A, int lda, const double *B, int ldb,
+                                  double *C, int ldc)
+{
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256d c00 = _mm256_loadu_pd(&C[0*ldc]), c01 = _mm256_loadu_pd(&C[0*ldc+4]);
+    __m256d c10 = _mm256_loadu_pd(&C[1*ldc]), c11 = _mm256_loadu_pd(&C[1*ldc+4]);
+    __m256d c20 = _mm256_loadu_pd(&C[2*ldc]), c21 = _mm256_loadu_pd(&C[2*ldc+4]);
+    __m256d c30 = _mm256_loadu_pd(&C[3*ldc]), c31 = _mm256_loadu_pd(&C[3*ldc+4]);
+
+    for (int k = 0; k < K; k++) {
+        __m256d b0 = _mm256_loadu_pd(&B[k*ldb]), b1 = _mm256_loadu_pd(&B[k*ldb+4]);
+        __m256d a;
+        a = _mm256_broadcast_sd(&A[0*lda+k]);
+        c00 = _mm256_fmadd_pd(a, b0, c00); c01 = _mm256_fmadd_pd(a, b1, c01);
+        a = _mm256_broadcast_sd(&A[1*lda+k]);
+        c10 = _mm256_fmadd_pd(a, b0, c10); c11 = _mm256_fmadd_pd(a, b1, c11);
+        a = _mm256_broadcast_sd(&A[2*lda+k]);
+        c20 = _mm256_fmadd_pd(a, b0, c20); c21 = _mm256_fmadd_pd(a, b1, c21);
+        a = _mm256_broadcast_sd(&A[3*lda+k]);
+        c30 = _mm256_fmadd_pd(a, b0, c30); c31 = _mm256_fmadd_pd(a, b1, c31);
+    }
+
+    _mm256_storeu_pd(&C[0*ldc], c00); _mm256_storeu_pd(&C[0*ldc+4], c01);
+    _mm256_storeu_pd(&C[1*ldc], c10); _mm256_storeu_pd(&C[1*ldc+4], c11);
+    _mm256_storeu_pd(&C[2*ldc], c20); _mm256_storeu_pd(&C[2*ldc+4], c21);
+    _mm256_storeu_pd(&C[3*ldc], c30); _mm256_storeu_pd(&C[3*ldc+4], c31);
+#elif defined(__SSE2__)
+    __m128d c00 = _mm_loadu_pd(&C[0*ldc]), c01 = _mm_loadu_pd(&C[0*ldc+2]);
+    __m128d c10 = _mm_loadu_pd(&C[1*ldc]), c11 = _mm_loadu_pd(&C[1*ldc+2]);
+    __m128d c20 = _mm_loadu_pd(&C[2*ldc]), c21 = _mm_loadu_pd(&C[2*ldc+2]);
+    __m128d c30 = _mm_loadu_pd(&C[3*ldc]), c31 = _mm_loadu_pd(&C[3*ldc+2]);
+
+    for (int k = 0; k < K; k++) {
+        __m128d b0 = _mm_loadu_pd(&B[k*ldb]), b1 = _mm_loadu_pd(&B[k*ldb+2]);
+        __m128d a;
+        a = _mm_set1_pd(A[0*lda+k]);
+        c00 = _mm_add_pd(c00, _mm_mul_pd(a, b0)); c01 = _mm_add_pd(c01, _mm_mul_pd(a, b1));
+        a = _mm_set1_pd(A[1*lda+k]);
+        c10 = _mm_add_pd(c10, _mm_mul_pd(a, b0)); c11 = _mm_add_pd(c11, _mm_mul_pd(a, b1));
+        a = _mm_set1_pd(A[2*lda+k]);
+        c20 = _mm_add_pd(c20, _mm_mul_pd(a, b0)); c21 = _mm_add_pd(c21, _mm_mul_pd(a, b1));
+        a = _mm_set1_pd(A[3*lda+k]);
+        c30 = _mm_add_pd(c30, _mm_mul_pd(a, b0)); c31 = _mm_add_pd(c31, _mm_mul_pd(a, b1));
+    }
+
+    _mm_storeu_pd(&C[0*ldc], c00); _mm_storeu_pd(&C[0*ldc+2], c01);
+    _mm_storeu_pd(&C[1*ldc], c10); _mm_storeu_pd(&C[1*ldc+2], c11);
+    _mm_storeu_pd(&C[2*ldc], c20); _mm_storeu_pd(&C[2*ldc+2], c21);
+    _mm_storeu_pd(&C[3*ldc], c30); _mm_storeu_pd(&C[3*ldc+2], c31);
+#else
+    double c[MATD_MR][MATD_NR];
+    for (int i = 0; i < MATD_MR; i++)
+        for (int j = 0; j < MATD_NR; j++)
+            c[i][j] = C[i*ldc+j];
+
+    for (int k = 0; k < K; k++) {
+        for (int i = 0; i < MATD_MR; i++) {
+            double a = A[i*lda+k];
+            for (int j = 0; j < MATD_NR; j++)
+                c[i][j] += a * B[k*ldb+j];
+        }
+    }
+
+    for (int i = 0; i < MATD_MR; i++)
+        for (int j = 0; j < MATD_NR; j++)
+            C[i*ldc+j] = c[i][j];
+#endif
+}
+
+// partial tiles at the bottom and right edges.
+static void matd_gemm_edge(int mr, int nr, int K, const double *A, int lda, const double *B, int ldb,
+                           double *C, int ldc)
+{
+    for (int i = 0; i < mr; i++) {
+        for (int k = 0; k < K; k++) {
+            double a = A[i*lda+k];
+            for (int j = 0; j < nr; j++)
+                C[i*ldc+j] += a * B[k*ldb+j];
+        }
+    }
+}
+
+static void matd_gemm(int M, int N, int K, const double *A, int lda, const double *B, int ldb,
+                      double *C, int ldc)
+{
+    for (int k0 = 0; k0 < K; k0 += MATD_KC) {
+        int kc = imin(MATD_KC, K - k0);
+
+        for (int j0 = 0; j0 < N; j0 += MATD_NC) {
+            int j1 = imin(N, j0 + MATD_NC);
+
+            for (int i = 0; i < M; i += MATD_MR) {
+                int mr = imin(MATD_MR, M - i);
+
+                for (int j = j0; j < j1; j += MATD_NR) {
+                    int nr = imin(MATD_NR, j1 - j);
+                    const double *a = &A[i*lda + k0];
+                    const double *b = &B[k0*ldb + j];
+                    double *c = &C[i*ldc + j];
+
+                    if (mr == MATD_MR && nr == MATD_NR)
+                        matd_gemm_tile(kc, a, lda, b, ldb, c, ldc);
+                    else
+                        matd_gemm_edge(mr, nr, kc, a, lda, b, ldb, c, ldc);
+                }
+            }
+        }
+    }
+}
+
+// Products with every dimension <= 6 (poses, jacobians, camera
+// intrinsics) skip the tiling; a constant inner dimension lets the
+// compiler unroll the dot products.
+#define MATD_FIXED_MAX 6
+
+#define MATD_MUL_FIXED(K)                                               \
+    static void matd_mul_fixed_##K(int M, int N, const double *A, const double *B, double *C) \
+    {                                                                   \
+        for (int i = 0; i < M; i++) {                                   \
+            for (int j = 0; j < N; j++) {                               \
+                double acc = 0;                                         \
+                for (int k = 0; k < K; k++)                             \
+                    acc += A[i*K+k] * B[k*N+j];                         \
+                C[i*N+j] = acc;                                         \
+            }                                                           \
+        }                                                               \
+    }
+
+MATD_MUL_FIXED(1)
+MATD_MUL_FIXED(2)
+MATD_MUL_FIXED(3)
+MATD_MUL_FIXED(4)
+MATD_MUL_FIXED(5)
+MATD_MUL_FIXED(6)
+
+// m = a*b for non-scalar a, b; m must already have the right shape.
+static void matd_multiply_into(matd_t *m, const matd_t *a, const matd_t *b)
+{
+    int M = a->nrows, N = b->ncols, K = a->ncols;
+
+    if (M <= MATD_FIXED_MAX && N <= MATD_FIXED_MAX && K <= MATD_FIXED_MAX) {
+        switch (K) {
+            case 1: matd_mul_fixed_1(M, N, a->data, b->data, m->data); return;
+            case 2: matd_mul_fixed_2(M, N, a->data, b->data, m->data); return;
+            case 3: matd_mul_fixed_3(M, N, a->data, b->data, m->data); return;
+            case 4: matd_mul_fixed_4(M, N, a->data, b->data, m->data); return;
+            case 5: matd_mul_fixed_5(M, N, a->data, b->data, m->data); return;
+            case 6: matd_mul_fixed_6(M, N, a->data, b->data, m->data); return;
+        }
+    }
+
+    memset(m->data, 0, M*N*sizeof(TYPE));
+    matd_gemm(M, N, K, a->data, K, b->data, N, m->data, N);
+}
+
 matd_t *matd_multiply(const matd_t *a, const matd_t *b)
 {
     assert(a != NULL);
@@ -244,16 +440,7 @@ matd_t *matd_multiply(const matd_t *a, const matd_t *b)
 
     assert(a->ncols == b->nrows);
     matd_t *m = matd_create(a->nrows, b->ncols);
-
-    for (int i = 0; i < m->nrows; i++) {
-        for (int j = 0; j < m->ncols; j++) {
-            TYPE acc = 0;
-            for (int k = 0; k < a->ncols; k++) {
-                acc += MATD_EL(a, i, k) * MATD_EL(b, k, j);
-            }
-            MATD_EL(m, i, j) = acc;
-        }
-    }
+    matd_multiply_into(m, a, b);
 
     return m;
 }
@@ -479,6 +666,57 @@ double matd_det(const matd_t *a)
     return 0;
 }
 
+// Gauss-Jordan elimination with partial pivoting, in place on the
+// stack, for matrices up to MATD_FIXED_MAX. Pivots are those of
+// matd_plu(), and so is the singularity test.
+static matd_t *matd_inverse_small(const matd_t *x)
+{
+    int n = x->nrows;
+    assert(n <= MATD_FIXED_MAX);
+
+    double a[MATD_FIXED_MAX*MATD_FIXED_MAX], inv[MATD_FIXED_MAX*MATD_FIXED_MAX];
+    memcpy(a, x->data, n*n*sizeof(double));
+    memset(inv, 0, n*n*sizeof(double));
+    for (int i = 0; i < n; i++)
+        inv[i*n+i] = 1;
+
+    for (int j = 0; j < n; j++) {
+        int p = j;
+        for (int i = j+1; i < n; i++) {
+            if (fabs(a[i*n+j]) > fabs(a[p*n+j]))
+                p = i;
+        }
+
+        if (fabs(a[p*n+j]) < MATD_EPS)
+            return NULL;
+
+        if (p != j) {
+            for (int k = 0; k < n; k++) {
+                double t = a[p*n+k]; a[p*n+k] = a[j*n+k]; a[j*n+k] = t;
+                t = inv[p*n+k]; inv[p*n+k] = inv[j*n+k]; inv[j*n+k] = t;
+            }
+        }
+
+        double s = 1.0 / a[j*n+j];
+        for (int k = 0; k < n; k++) {
+            a[j*n+k] *= s;
+            inv[j*n+k] *= s;
+        }
+
+        for (int i = 0; i < n; i++) {
+            double f = a[i*n+j];
+            if (i == j || f == 0)
+                continue;
+            for (int k = 0; k < n; k++) {
+                a[i*n+k] -= f*a[j*n+k];
+                inv[i*n+k] -= f*inv[j*n+k];
+            }
+        }
+    }
+
+    return matd_create_data(n, n, inv);
+}
+
 // returns NULL if the matrix is (exactly) singular. Caller is
 // otherwise responsible for knowing how to cope with badly
 // conditioned matrices.
@@ -524,6 +762,12 @@ matd_t *matd_inverse(const matd_t *x)
             return m;
         }
 
+        case 3:
+        case 4:
+        case 5:
+        case 6:
+            return matd_inverse_small(x);
+
         default: {
             matd_plu_t *plu = matd_plu(x);
 
@@ -832,18 +1076,547 @@ matd_t *matd_op(const char *expr, ...)
     matd_t *garb[2*exprlen]; // can't create more than 2 new result per character
                              // one result, and possibly one argument to free
 
+    // temporaries come from the thread's scratch arena, unless the
+    // caller already allocates from it.
+    arena_t *tmp = arena_thread();
+    arena_checkpoint_t cp = arena_checkpoint(tmp);
+    arena_t *old = matd_use_arena(tmp);
+
     matd_t *res = matd_op_recurse(expr, &pos, NULL, args, &argpos, garb, &garbpos, 0);
 
+    matd_use_arena(old);
+
     // 'res' may need to be freed as part of garbage collection (i.e. expr = "F")
     matd_t *res_copy = (res ? matd_copy(res) : NULL);
 
+    // only 'F' arguments remain to be freed
     for (int i = 0; i < garbpos; i++) {
-        matd_destroy(garb[i]);
+        if (!arena_owns(tmp, garb[i]))
+            matd_destroy(garb[i]);
     }
 
+    if (old != tmp)
+        arena_restore(tmp, cp);
+
     return res_copy;
 }
 
+////////////////////////////////////////////////////////////////////
+// Compiled expressions. The parser below mirrors matd_op_recurse(),
+// but instead of evaluating it emits one instruction per operation,
+// each writing into its own slot. Slots [0, nargs) are the arguments.
+
+enum { MATD_PLAN_CONST, MATD_PLAN_COPY, MATD_PLAN_MUL, MATD_PLAN_ADD, MATD_PLAN_SUB,
+       MATD_PLAN_NEG, MATD_PLAN_TRANSPOSE, MATD_PLAN_INVERSE };
+
+struct matd_plan_inst
+{
+    int op;
+    int a, b;     // operand slots (b = -1 for unary operations)
+    int dst;
+    double s;     // value of a MATD_PLAN_CONST
+    int pos;      // position in the expression, for error messages
+};
+
+struct matd_plan
+{
+    char *expr;
+    int nargs;
+    uint8_t *isfree; // 'F' arguments, destroyed after evaluation
+
+    int ninsts;
+    struct matd_plan_inst *insts;
+
+    int nslots;
+    int result;
+
+    // slot shapes (0x0 for scalars) and storage. Temporaries are sized
+    // for the last checked argument shapes and live in 'arena'.
+    int checked;
+    int *rows, *cols;
+    matd_t **mats;
+    arena_t *arena;
+};
+
+static int matd_plan_emit(matd_plan_t *plan, int op, int a, int b, int pos)
+{
+    struct matd_plan_inst *inst = &plan->insts[plan->ninsts++];
+    inst->op = op;
+    inst->a = a;
+    inst->b = b;
+    inst->dst = plan->nslots++;
+    inst->s = 0;
+    inst->pos = pos;
+    return inst->dst;
+}
+
+static int matd_plan_gobble_right(matd_plan_t *plan, const char *expr, int *pos, int acc)
+{
+    while (expr[*pos] != 0) {
+
+        switch (expr[*pos]) {
+
+            case '\'': {
+                assert(acc >= 0);
+                acc = matd_plan_emit(plan, MATD_PLAN_TRANSPOSE, acc, -1, *pos);
+                (*pos)++;
+                break;
+            }
+
+            case '^': {
+                assert(acc >= 0);
+                assert(expr[*pos+1] == '-');
+                assert(expr[*pos+2] == '1');
+                acc = matd_plan_emit(plan, MATD_PLAN_INVERSE, acc, -1, *pos);
+                (*pos)+=3;
+                break;
+            }
+
+            default:
+                return acc;
+        }
+    }
+
+    return acc;
+}
+
+// multiply 'rhs' onto the accumulated term, if any.
+static inline int matd_plan_juxtapose(matd_plan_t *plan, int acc, int rhs, int pos)
+{
+    if (acc < 0)
+        return rhs;
+    return matd_plan_emit(plan, MATD_PLAN_MUL, acc, rhs, pos);
+}
+
+static int matd_plan_recurse(matd_plan_t *plan, const char *expr, int *pos, int acc, int *argpos, int oneterm)
+{
+    while (expr[*pos] != 0) {
+
+        switch (expr[*pos]) {
+
+            case '(': {
+                if (oneterm && acc >= 0)
+                    return acc;
+                int p = (*pos)++;
+                int rhs = matd_plan_recurse(plan, expr, pos, -1, argpos, 0);
+                rhs = matd_plan_gobble_right(plan, expr, pos, rhs);
+                acc = matd_plan_juxtapose(plan, acc, rhs, p);
+                break;
+            }
+
+            case ')': {
+                if (oneterm)
+                    return acc;
+                (*pos)++;
+                return acc;
+            }
+
+            case '*': {
+                int p = (*pos)++;
+                int rhs = matd_plan_recurse(plan, expr, pos, -1, argpos, 1);
+                rhs = matd_plan_gobble_right(plan, expr, pos, rhs);
+                acc = matd_plan_juxtapose(plan, acc, rhs, p);
+                break;
+            }
+
+            case 'F':
+            case 'M': {
+                int p = *pos;
+                plan->isfree[*argpos] = (expr[*pos] == 'F');
+                int rhs = (*argpos)++;
+                (*pos)++;
+                rhs = matd_plan_gobble_right(plan, expr, pos, rhs);
+                acc = matd_plan_juxtapose(plan, acc, rhs, p);
+                break;
+            }
+
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+            case '.': {
+                int p = *pos;
+                const char *start = &expr[*pos];
+                char *end;
+                double s = strtod(start, &end);
+                (*pos) += (end - start);
+                int rhs = matd_plan_emit(plan, MATD_PLAN_CONST, -1, -1, p);
+                plan->insts[plan->ninsts-1].s = s;
+                rhs = matd_plan_gobble_right(plan, expr, pos, rhs);
+                acc = matd_plan_juxtapose(plan, acc, rhs, p);
+                break;
+            }
+
+            case '+': {
+                if (oneterm && acc >= 0)
+                    return acc;
+
+                // don't support unary plus
+                assert(acc >= 0);
+                int p = (*pos)++;
+                int rhs = matd_plan_recurse(plan, expr, pos, -1, argpos, 1);
+                rhs = matd_plan_gobble_right(plan, expr, pos, rhs);
+                acc = matd_plan_emit(plan, MATD_PLAN_ADD, acc, rhs, p);
+                break;
+            }
+
+            case '-': {
+                if (oneterm && acc >= 0)
+                    return acc;
+
+                int p = (*pos)++;
+                int rhs = matd_plan_recurse(plan, expr, pos, -1, argpos, 1);
+                rhs = matd_plan_gobble_right(plan, expr, pos, rhs);
+                if (acc < 0)
+                    acc = matd_plan_emit(plan, MATD_PLAN_NEG, rhs, -1, p);
+                else
+                    acc = matd_plan_emit(plan, MATD_PLAN_SUB, acc, rhs, p);
+                break;
+            }
+
+            case ' ': {
+                (*pos)++;
+                break;
+            }
+
+            default: {
+                fprintf(stderr, "matd_op_compile(): Unknown character: '%c'\n", expr[*pos]);
+                assert(expr[*pos] != expr[*pos]);
+            }
+        }
+    }
+    return acc;
+}
+
+matd_plan_t *matd_op_compile(const char *expr)
+{
+    assert(expr != NULL);
+
+    int nargs = 0;
+    int exprlen = 0;
+    for (const char *p = expr; *p != 0; p++) {
+        if (*p == 'M' || *p == 'F')
+            nargs++;
+        exprlen++;
+    }
+
+    assert(exprlen > 0);
+
+    matd_plan_t *plan = calloc(1, sizeof(matd_plan_t));
+    plan->expr = strdup(expr);
+    plan->nargs = nargs;
+    plan->isfree = calloc(nargs + 1, sizeof(uint8_t));
+
+    // as in matd_op(), at most two results per character, plus the
+    // final copy of a bare argument.
+    int maxinsts = 2*exprlen + 1;
+    plan->insts = calloc(maxinsts, sizeof(struct matd_plan_inst));
+    plan->nslots = nargs;
+
+    int pos = 0, argpos = 0;
+    int res = matd_plan_recurse(plan, plan->expr, &pos, -1, &argpos, 0);
+    assert(res >= 0);
+    assert(argpos == nargs);
+
+    // keep the result in the plan's storage, even for "M".
+    if (res < nargs)
+        res = matd_plan_emit(plan, MATD_PLAN_COPY, res, -1, 0);
+    plan->result = res;
+
+    assert(plan->ninsts <= maxinsts);
+
+    plan->rows = calloc(plan->nslots, sizeof(int));
+    plan->cols = calloc(plan->nslots, sizeof(int));
+    plan->mats = calloc(plan->nslots, sizeof(matd_t*));
+    plan->arena = arena_create(0);
+
+    return plan;
+}
+
+void matd_plan_destroy(matd_plan_t *plan)
+{
+    if (!plan)
+        return;
+
+    arena_destroy(plan->arena);
+    free(plan->mats);
+    free(plan->cols);
+    free(plan->rows);
+    free(plan->insts);
+    free(plan->isfree);
+    free(plan->expr);
+    free(plan);
+}
+
+int matd_plan_nargs(const matd_plan_t *plan)
+{
+    return plan->nargs;
+}
+
+static int matd_plan_shape_error(const matd_plan_t *plan, const struct matd_plan_inst *inst, const char *what)
+{
+    fprintf(stderr, "matd_plan_check(): \"%s\" at position %d: %s (%dx%d", plan->expr, inst->pos,
+            what, plan->rows[inst->a], plan->cols[inst->a]);
+    if (inst->b >= 0)
+        fprintf(stderr, ", %dx%d", plan->rows[inst->b], plan->cols[inst->b]);
+    fprintf(stderr, ")\n");
+    return -1;
+}
+
+// propagate the argument shapes in plan->rows/cols through every
+// instruction, then (re)allocate the temporaries.
+static int matd_plan_size(matd_plan_t *plan)
+{
+    int *rows = plan->rows, *cols = plan->cols;
+
+    plan->checked = 0;
+
+    for (int i = 0; i < plan->ninsts; i++) {
+        const struct matd_plan_inst *inst = &plan->insts[i];
+        int a = inst->a, b = inst->b, d = inst->dst;
+
+        switch (inst->op) {
+            case MATD_PLAN_CONST:
+                rows[d] = cols[d] = 0;
+                break;
+
+            case MATD_PLAN_COPY:
+            case MATD_PLAN_NEG:
+                rows[d] = rows[a];
+                cols[d] = cols[a];
+                break;
+
+            case MATD_PLAN_MUL:
+                if (rows[a] == 0) {
+                    rows[d] = rows[b];
+                    cols[d] = cols[b];
+                } else if (rows[b] == 0) {
+                    rows[d] = rows[a];
+                    cols[d] = cols[a];
+                } else {
+                    if (cols[a] != rows[b])
+                        return matd_plan_shape_error(plan, inst, "inner dimensions differ");
+                    rows[d] = rows[a];
+                    cols[d] = cols[b];
+                }
+                break;
+
+            case MATD_PLAN_ADD:
+            case MATD_PLAN_SUB:
+                if (rows[a] != rows[b] || cols[a] != cols[b])
+                    return matd_plan_shape_error(plan, inst, "shapes differ");
+                rows[d] = rows[a];
+                cols[d] = cols[a];
+                break;
+
+            case MATD_PLAN_TRANSPOSE:
+                rows[d] = cols[a];
+                cols[d] = rows[a];
+                break;
+
+            case MATD_PLAN_INVERSE:
+                if (rows[a] != cols[a])
+                    return matd_plan_shape_error(plan, inst, "inverse of a non-square matrix");
+                rows[d] = rows[a];
+                cols[d] = cols[a];
+                break;
+        }
+    }
+
+    arena_reset(plan->arena);
+    for (int i = 0; i < plan->ninsts; i++) {
+        int d = plan->insts[i].dst;
+        int n = rows[d] * cols[d];
+        matd_t *m = arena_calloc(plan->arena, 1, sizeof(matd_t) + (n ? n : 1)*sizeof(double));
+        m->nrows = rows[d];
+        m->ncols = cols[d];
+        plan->mats[d] = m;
+    }
+
+    plan->checked = 1;
+    return 0;
+}
+
+int matd_plan_check(matd_plan_t *plan, const int *dims, int *rows, int *cols)
+{
+    assert(plan != NULL);
+
+    for (int i = 0; i < plan->nargs; i++) {
+        int r = dims[2*i+0], c = dims[2*i+1];
+        assert(r >= 0 && c >= 0);
+        if (r == 0 || c == 0)
+            r = c = 0;
+        plan->rows[i] = r;
+        plan->cols[i] = c;
+    }
+
+    if (matd_plan_size(plan))
+        return -1;
+
+    if (rows)
+        *rows = plan->rows[plan->result];
+    if (cols)
+        *cols = plan->cols[plan->result];
+    return 0;
+}
+
+static inline int matd_numel(const matd_t *m)
+{
+    return matd_is_scalar(m) ? 1 : m->nrows*m->ncols;
+}
+
+// returns 0 on success, -1 if an inverse was singular.
+static int matd_plan_run(matd_plan_t *plan)
+{
+    matd_t **mats = plan->mats;
+
+    for (int i = 0; i < plan->ninsts; i++) {
+        const struct matd_plan_inst *inst = &plan->insts[i];
+        const matd_t *a = inst->a >= 0 ? mats[inst->a] : NULL;
+        const matd_t *b = inst->b >= 0 ? mats[inst->b] : NULL;
+        matd_t *d = mats[inst->dst];
+        int n = matd_numel(d);
+
+        switch (inst->op) {
+            case MATD_PLAN_CONST:
+                d->data[0] = inst->s;
+                break;
+
+            case MATD_PLAN_COPY:
+                memcpy(d->data, a->data, n*sizeof(double));
+                break;
+
+            case MATD_PLAN_NEG:
+                for (int j = 0; j < n; j++)
+                    d->data[j] = -a->data[j];
+                break;
+
+            case MATD_PLAN_ADD:
+                for (int j = 0; j < n; j++)
+                    d->data[j] = a->data[j] + b->data[j];
+                break;
+
+            case MATD_PLAN_SUB:
+                for (int j = 0; j < n; j++)
+                    d->data[j] = a->data[j] - b->data[j];
+                break;
+
+            case MATD_PLAN_MUL:
+                if (matd_is_scalar(a)) {
+                    for (int j = 0; j < n; j++)
+                        d->data[j] = a->data[0] * b->data[j];
+                } else if (matd_is_scalar(b)) {
+                    for (int j = 0; j < n; j++)
+                        d->data[j] = b->data[0] * a->data[j];
+                } else {
+                    matd_multiply_into(d, a, b);
+                }
+                break;
+
+            case MATD_PLAN_TRANSPOSE:
+                if (matd_is_scalar(a)) {
+                    d->data[0] = a->data[0];
+                } else {
+                    for (int r = 0; r < a->nrows; r++)
+                        for (int c = 0; c < a->ncols; c++)
+                            MATD_EL(d, c, r) = MATD_EL(a, r, c);
+                }
+                break;
+
+            case MATD_PLAN_INVERSE: {
+                // matd_inverse() temporaries go to the thread arena.
+                arena_t *tmp = arena_thread();
+                arena_checkpoint_t cp = arena_checkpoint(tmp);
+                arena_t *old = matd_use_arena(tmp);
+                matd_t *inv = matd_inverse(a);
+                matd_use_arena(old);
+                if (inv)
+                    memcpy(d->data, inv->data, n*sizeof(double));
+                if (old != tmp)
+                    arena_restore(tmp, cp);
+                if (!inv)
+                    return -1;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+matd_t *matd_plan_eval(matd_plan_t *plan, matd_t *out, ...)
+{
+    assert(plan != NULL);
+
+    int changed = !plan->checked;
+    int aliased = 0;
+
+    va_list ap;
+    va_start(ap, out);
+    for (int i = 0; i < plan->nargs; i++) {
+        matd_t *m = va_arg(ap, matd_t*);
+        assert(m != NULL);
+        plan->mats[i] = m;
+
+        int r = m->nrows, c = m->ncols;
+        if (r == 0 || c == 0)
+            r = c = 0;
+        if (r != plan->rows[i] || c != plan->cols[i]) {
+            plan->rows[i] = r;
+            plan->cols[i] = c;
+            changed = 1;
+        }
+        if (m == out)
+            aliased = 1;
+    }
+    va_end(ap);
+
+    matd_t *res = NULL;
+
+    if (changed && matd_plan_size(plan))
+        goto cleanup;
+
+    matd_t *tmp = plan->mats[plan->result];
+
+    if (out) {
+        assert(matd_numel(out) == matd_numel(tmp));
+        assert(matd_is_scalar(out) ? matd_is_scalar(tmp) :
+               (out->nrows == tmp->nrows && out->ncols == tmp->ncols));
+    }
+
+    // write the last operation straight into 'out', unless 'out' is
+    // also one of its inputs.
+    int direct = out && !aliased;
+    if (direct)
+        plan->mats[plan->result] = out;
+
+    int err = matd_plan_run(plan);
+
+    plan->mats[plan->result] = tmp;
+
+    if (err)
+        goto cleanup;
+
+    if (out && !direct)
+        memcpy(out->data, tmp->data, matd_numel(tmp)*sizeof(double));
+
+    res = out ? out : tmp;
+
+  cleanup:
+    for (int i = 0; i < plan->nargs; i++) {
+        if (plan->isfree[i])
+            matd_destroy(plan->mats[i]);
+    }
+
+    return res;
+}
+
 double matd_vec_mag(const matd_t *a)
 {
     assert(a != NULL);
@@ -1837,6 +2610,8 @@ int main(int argc, char *argv[])
 
 // NOTE: The below implementation of Cholesky is different from the one
 // used in NGV.
+#define MATD_CHOL_NB 64
+
 matd_chol_t *matd_chol(matd_t *A)
 {
     assert(A->nrows == A->ncols);
@@ -1855,29 +2630,103 @@ MATD_EL(U, i, j) = 0;
 */
     int is_spd = 1; // (A->nrows == A->ncols);
 
-    for (int i = 0; i < N; i++) {
-        double d = MATD_EL(U, i, i);
-        is_spd &= (d > 0);
+    if (N <= MATD_CHOL_NB) {
+        for (int i = 0; i < N; i++) {
+            double d = MATD_EL(U, i, i);
+            is_spd &= (d > 0);
 
-        if (d < MATD_EPS)
-            d = MATD_EPS;
-        d = 1.0 / sqrt(d);
+            if (d < MATD_EPS)
+                d = MATD_EPS;
+            d = 1.0 / sqrt(d);
 
-        for (int j = i; j < N; j++)
-            MATD_EL(U, i, j) *= d;
+            for (int j = i; j < N; j++)
+                MATD_EL(U, i, j) *= d;
 
-        for (int j = i+1; j < N; j++) {
-            double s = MATD_EL(U, i, j);
+            for (int j = i+1; j < N; j++) {
+                double s = MATD_EL(U, i, j);
 
-            if (s == 0)
-                continue;
+                if (s == 0)
+                    continue;
+
+                for (int k = j; k < N; k++) {
+                    MATD_EL(U, j, k) -= MATD_EL(U, i, k)*s;
+                }
+            }
+        }
+
+        matd_chol_t *chol = calloc(1, sizeof(matd_chol_t));
+        chol->is_spd = is_spd;
+        chol->u = U;
+        return chol;
+    }
+
+    // Larger matrices are blocked by rows: each block of MATD_CHOL_NB
+    // rows is factored with the row-by-row algorithm above (which
+    // also produces the panel to its right), then the trailing rows
+    // get the whole block's update at once, U[k1:,k1:] -= P'*P,
+    // through matd_gemm().
+    double *Pt = malloc((N - MATD_CHOL_NB) * MATD_CHOL_NB * sizeof(double));
+
+    for (int k0 = 0; k0 < N; k0 += MATD_CHOL_NB) {
+        int k1 = imin(N, k0 + MATD_CHOL_NB);
+
+        for (int i = k0; i < k1; i++) {
+            double d = MATD_EL(U, i, i);
+            is_spd &= (d > 0);
 
-            for (int k = j; k < N; k++) {
-                MATD_EL(U, j, k) -= MATD_EL(U, i, k)*s;
+            if (d < MATD_EPS)
+                d = MATD_EPS;
+            d = 1.0 / sqrt(d);
+
+            for (int j = i; j < N; j++)
+                MATD_EL(U, i, j) *= d;
+
+            for (int j = i+1; j < k1; j++) {
+                double s = MATD_EL(U, i, j);
+
+                if (s == 0)
+                    continue;
+
+                for (int k = j; k < N; k++) {
+                    MATD_EL(U, j, k) -= MATD_EL(U, i, k)*s;
+                }
             }
         }
+
+        if (k1 == N)
+            break;
+
+        // Pt = -P', with P = U[k0:k1, k1:N]
+        int nb = k1 - k0, m = N - k1;
+        for (int i = 0; i < nb; i++)
+            for (int j = 0; j < m; j++)
+                Pt[j*nb + i] = -MATD_EL(U, k0 + i, k1 + j);
+
+        // A stripe of MATD_MR rows at a time, each starting at the
+        // diagonal. The stripe's MATD_MR x MATD_MR diagonal tile is
+        // written whole, so its part below the diagonal is saved and
+        // restored: like the unblocked loop, the factorization leaves
+        // the lower triangle as it was in A.
+        for (int r = 0; r < m; r += MATD_MR) {
+            int mr = imin(MATD_MR, m - r);
+            double *T = &MATD_EL(U, k1 + r, k1 + r);
+
+            double lower[MATD_MR * MATD_MR];
+            for (int a = 1; a < mr; a++)
+                for (int b = 0; b < a; b++)
+                    lower[a*MATD_MR + b] = T[a*N + b];
+
+            matd_gemm(mr, m - r, nb, &Pt[r*nb], nb,
+                      &MATD_EL(U, k0, k1 + r), N, T, N);
+
+            for (int a = 1; a < mr; a++)
+                for (int b = 0; b < a; b++)
+                    T[a*N + b] = lower[a*MATD_MR + b];
+        }
     }
 
+    free(Pt);
+
     matd_chol_t *chol = calloc(1, sizeof(matd_chol_t));
     chol->is_spd = is_spd;
     chol->u = U;
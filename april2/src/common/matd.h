@@ -37,6 +37,7 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stddef.h>
 #include <string.h>
 #include "math_util.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -355,12 +356,80 @@ double matd_err_inf(const matd_t *a, const matd_t *b);
  */
 matd_t *matd_op(const char *expr, ...);
 
+/**
+ * A matd_op() expression parsed once into a list of primitive
+ * operations, with storage for every intermediate result. Plans are
+ * meant for hot loops; they are not thread safe (each thread needs its
+ * own plan).
+ */
+typedef struct matd_plan matd_plan_t;
+
+/**
+ * Parses 'expr' (same syntax as matd_op()) into a reusable plan. Syntax
+ * errors are fatal, as with matd_op(). Destroy with matd_plan_destroy().
+ */
+matd_plan_t *matd_op_compile(const char *expr);
+
+void matd_plan_destroy(matd_plan_t *plan);
+
+/**
+ * Number of matrix arguments ('M' and 'F' placeholders) the plan takes.
+ */
+int matd_plan_nargs(const matd_plan_t *plan);
+
+/**
+ * Checks that arguments of the given shapes ('dims' holds nargs
+ * rows,cols pairs; 0,0 for a scalar) are consistent with every
+ * operation in the plan, without touching any data, and sizes the
+ * plan's temporaries for them. On success returns 0 and the shape of
+ * the result in 'rows', 'cols' (either may be NULL); otherwise prints
+ * the offending operation and returns -1.
+ *
+ *    matd_plan_t *JtWJ = matd_op_compile("M'*M*M");
+ *    int dims[] = { 3,3, 3,3, 3,3 };
+ *    assert(!matd_plan_check(JtWJ, dims, NULL, NULL));
+ */
+int matd_plan_check(matd_plan_t *plan, const int *dims, int *rows, int *cols);
+
+/**
+ * Evaluates the plan on the supplied arguments (one per placeholder,
+ * as with matd_op(); 'F' arguments are destroyed afterwards). The
+ * shapes are re-checked only when they differ from the previous call.
+ *
+ * If 'out' is non-NULL, it must already have the result's shape; the
+ * result is written there and 'out' is returned. If 'out' is NULL, the
+ * result stays in the plan's own storage, valid until the next call on
+ * this plan or matd_plan_destroy(); do not destroy it.
+ *
+ * Returns NULL if the shapes are inconsistent or an inverse was
+ * singular. Nothing is allocated once the shapes are stable (except
+ * within the thread arena, for inverses larger than 2x2).
+ */
+matd_t *matd_plan_eval(matd_plan_t *plan, matd_t *out, ...);
+
 /**
  * Frees the memory associated with matrix 'm', being the result of an earlier
  * call to a matd_*() function, after which 'm' will no longer be usable.
  */
 void matd_destroy(matd_t *m);
 
+/**
+ * Makes every matrix created by the calling thread come from 'arena'
+ * (or from the heap again if NULL), and returns the previous setting.
+ * matd_destroy() ignores matrices from the current arena; they are
+ * released when the arena is reset or restored, so they must not
+ * outlive that, nor be destroyed after switching back to the heap.
+ *
+ *    arena_checkpoint_t cp = arena_checkpoint(arena);
+ *    arena_t *old = matd_use_arena(arena);
+ *    ... temporaries ...
+ *    matd_use_arena(old);
+ *    arena_restore(arena, cp);
+ *
+ * matd_op() already keeps its temporaries in arena_thread().
+ */
+arena_t *matd_use_arena(arena_t *arena);
+
 typedef struct
 {
     matd_t *U;
@@ -0,0 +1,181 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/arena.h"
+#include "common/zarray.h"
+#include "common/matd.h"
+#include "common/time_util.h"
+
+// Checks arena allocation, checkpoints and resets, and that a
+// repeated processing step stops allocating blocks once the arena
+// has grown to its high-water mark.
+
+static void test_alloc()
+{
+    arena_t *arena = arena_create(256);
+
+    // alignment, and allocations larger than a block
+    for (int i = 1; i < 1000; i += 7) {
+        char *p = arena_alloc(arena, i);
+        assert(((uintptr_t) p & (ARENA_ALIGN - 1)) == 0);
+        memset(p, i, i);
+        assert(arena_owns(arena, p));
+    }
+
+    arena_checkpoint_t cp = arena_checkpoint(arena);
+    size_t used = arena_used(arena);
+
+    char *s = arena_strdup(arena, "hello");
+    int *z = arena_calloc(arena, 100, sizeof(int));
+    for (int i = 0; i < 100; i++)
+        assert(z[i] == 0);
+    assert(!strcmp(s, "hello"));
+
+    arena_restore(arena, cp);
+    assert(arena_used(arena) == used);
+    assert(!arena_owns(arena, z));
+
+    arena_reset(arena);
+    assert(arena_used(arena) == 0);
+    assert(arena->block->prev == NULL && arena->spare == NULL);
+
+    // extending the latest allocation in place
+    char *a = arena_alloc(arena, 16);
+    assert(arena_realloc(arena, a, 16, 32) == a);
+
+    arena_destroy(arena);
+}
+
+// one "message": a few growing arrays and matrices, all released at
+// the end of the step.
+static double step(arena_t *arena, int n)
+{
+    zarray_t *za = zarray_create_arena(arena, sizeof(double));
+    zarray_t *zb = zarray_create_arena(arena, sizeof(int32_t[3]));
+
+    for (int i = 0; i < n; i++) {
+        double v = i * 0.5;
+        zarray_add(za, &v);
+        if (i % 3 == 0) {
+            int32_t p[3] = { i, -i, 1 };
+            zarray_add(zb, p);
+        }
+    }
+
+    arena_t *old = matd_use_arena(arena);
+    matd_t *A = matd_create(6, 6);
+    for (int i = 0; i < 36; i++)
+        A->data[i] = (i % 7) + (i / 6 == i % 6 ? 10 : 0);
+    matd_t *AtA = matd_op("M'*M", A, A);
+    matd_destroy(A);
+    matd_use_arena(old);
+
+    double acc = 0;
+    for (int i = 0; i < zarray_size(za); i++) {
+        double v;
+        zarray_get(za, i, &v);
+        acc += v;
+    }
+    acc += zarray_size(zb) + MATD_EL(AtA, 2, 3);
+
+    zarray_destroy(za);
+    zarray_destroy(zb);
+    return acc;
+}
+
+static void test_steady_state()
+{
+    arena_t *arena = arena_create(1024);
+
+    double first = step(arena, 5000);
+    arena_reset(arena);
+
+    int nmallocs = arena->nmallocs;
+    for (int iter = 0; iter < 100; iter++) {
+        assert(step(arena, 5000) == first);
+        arena_reset(arena);
+    }
+    assert(arena->nmallocs == nmallocs);
+
+    printf("steady state: %d blocks allocated, high water %zu bytes\n",
+           arena->nmallocs, arena->high_water);
+    arena_destroy(arena);
+}
+
+static void test_matd_op()
+{
+    matd_t *A = matd_create_data(2, 2, (double[]) { 1, 2, 3, 4 });
+
+    arena_t *tmp = arena_thread();
+    size_t used = arena_used(tmp);
+
+    // temporaries come from the thread arena and are released
+    matd_t *B = matd_op("(M*M')^-1*M + 2*M", A, A, A, A);
+    assert(arena_used(tmp) == used);
+    assert(!arena_owns(tmp, B));
+
+    matd_t *At = matd_transpose(A);
+    matd_t *ref = matd_multiply(A, At);
+    matd_t *inv = matd_inverse(ref);
+    matd_t *C = matd_multiply(inv, A);
+    for (int i = 0; i < 4; i++)
+        assert(fabs(B->data[i] - (C->data[i] + 2 * A->data[i])) < 1e-12);
+
+    int64_t t0 = utime_now();
+    for (int iter = 0; iter < 100000; iter++)
+        matd_destroy(matd_op("M'*M", A, A));
+    printf("matd_op(\"M'*M\") 2x2: %.3f us\n", (utime_now() - t0) / 100000.0);
+
+    matd_destroy(A);
+    matd_destroy(B);
+    matd_destroy(C);
+    matd_destroy(inv);
+    matd_destroy(ref);
+    matd_destroy(At);
+}
+
+int main(int argc, char *argv[])
+{
+    test_alloc();
+    test_steady_state();
+    test_matd_op();
+
+    printf("ok\n");
+    return 0;
+}
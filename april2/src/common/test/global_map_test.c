@@ -0,0 +1,178 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "../global_map.h"
+#include "../gridmap.h"
+
+// Checks the chunked global map against a dense reference vote
+// grid while gridmaps are added, moved and removed.
+
+#define NMAPS 6
+#define MPP 0.1
+
+// reference covers global pixels [-REF_HALF, REF_HALF)
+#define REF_HALF 1024
+#define REF_SIZE (2*REF_HALF)
+
+static uint8_t ref[REF_SIZE*REF_SIZE*3];
+
+static void ref_update(const grid_map_t *gm, const double *xyt, int delta)
+{
+    double c = cos(xyt[2]), s = sin(xyt[2]);
+
+    for (int iy = 0; iy < gm->height; iy++) {
+        for (int ix = 0; ix < gm->width; ix++) {
+            uint8_t v = gm->data[iy*gm->width + ix];
+            if (v > GRID_VAL_SLAMMABLE)
+                continue;
+
+            double x = gm->x0 + ix*gm->meters_per_pixel;
+            double y = gm->y0 + iy*gm->meters_per_pixel;
+            int gx = (int) floor((x*c - y*s + xyt[0]) / MPP) + REF_HALF;
+            int gy = (int) floor((x*s + y*c + xyt[1]) / MPP) + REF_HALF;
+            assert(gx >= 0 && gx < REF_SIZE && gy >= 0 && gy < REF_SIZE);
+
+            uint8_t *count = &ref[3*(gy*REF_SIZE + gx) + v];
+            if (delta > 0 && *count < 255)
+                *count += 1;
+            else if (delta < 0 && *count > 0)
+                *count -= 1;
+        }
+    }
+}
+
+static uint8_t ref_value(int gx, int gy)
+{
+    gx += REF_HALF;
+    gy += REF_HALF;
+    if (gx < 0 || gx >= REF_SIZE || gy < 0 || gy >= REF_SIZE)
+        return GRID_VAL_UNKNOWN;
+
+    const uint8_t *count = &ref[3*(gy*REF_SIZE + gx)];
+    if (count[1] + count[2] > count[0])
+        return count[1] > count[2] ? GRID_VAL_OBSTACLE : GRID_VAL_SLAMMABLE;
+    if (count[0] > 0)
+        return GRID_VAL_TRAVERSABLE;
+    return GRID_VAL_UNKNOWN;
+}
+
+static void check(global_map_t *glm)
+{
+    const grid_map_t *out = global_map_get_map(glm);
+
+    int gx0 = (int) lround(out->x0 / MPP);
+    int gy0 = (int) lround(out->y0 / MPP);
+
+    int nknown = 0;
+    for (int y = 0; y < out->height; y++) {
+        for (int x = 0; x < out->width; x++) {
+            uint8_t v = out->data[y*out->width + x];
+            if (v != ref_value(gx0 + x, gy0 + y)) {
+                printf("mismatch at %d %d: %d vs %d\n", gx0 + x, gy0 + y, v, ref_value(gx0 + x, gy0 + y));
+                exit(1);
+            }
+            if (v != GRID_VAL_UNKNOWN)
+                nknown++;
+        }
+    }
+
+    // and nothing known outside of the exported map
+    for (int gy = -REF_HALF; gy < REF_HALF; gy++) {
+        for (int gx = -REF_HALF; gx < REF_HALF; gx++) {
+            if (gx >= gx0 && gx < gx0 + out->width && gy >= gy0 && gy < gy0 + out->height)
+                continue;
+            assert(ref_value(gx, gy) == GRID_VAL_UNKNOWN);
+        }
+    }
+
+    printf("map %4d x %4d, %7d known pixels\n", out->width, out->height, nknown);
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(0);
+
+    global_map_t *glm = global_map_create(MPP);
+
+    grid_map_t *gms[NMAPS];
+    double xyts[NMAPS][3];
+
+    for (int i = 0; i < NMAPS; i++) {
+        grid_map_t *gm = calloc(1, sizeof(grid_map_t));
+        gm->width = 100 + random() % 200;
+        gm->height = 100 + random() % 200;
+        gm->meters_per_pixel = MPP;
+        gm->x0 = -gm->width * MPP / 2;
+        gm->y0 = -gm->height * MPP / 2;
+        gm->datalen = gm->width * gm->height;
+        gm->data = malloc(gm->datalen);
+        for (int j = 0; j < gm->datalen; j++)
+            gm->data[j] = random() % 5;
+        gms[i] = gm;
+
+        xyts[i][0] = (random() % 1000) / 10.0 - 50;
+        xyts[i][1] = (random() % 1000) / 10.0 - 50;
+        xyts[i][2] = (random() % 628) / 100.0;
+
+        global_map_add_gridmap(glm, gm, xyts[i]);
+        ref_update(gm, xyts[i], 1);
+        check(glm);
+    }
+
+    for (int iter = 0; iter < 10; iter++) {
+        int i = random() % NMAPS;
+        ref_update(gms[i], xyts[i], -1);
+
+        xyts[i][0] += (random() % 100) / 10.0 - 5;
+        xyts[i][1] += (random() % 100) / 10.0 - 5;
+        xyts[i][2] += (random() % 100) / 100.0 - 0.5;
+
+        global_map_move_gridmap(glm, gms[i], xyts[i]);
+        ref_update(gms[i], xyts[i], 1);
+        check(glm);
+    }
+
+    for (int i = 0; i < NMAPS; i++) {
+        global_map_remove_gridmap(glm, gms[i]);
+        ref_update(gms[i], xyts[i], -1);
+        if (i == NMAPS / 2)
+            global_map_crop(glm);
+        check(glm);
+    }
+
+    global_map_crop(glm);
+    check(glm);
+
+    global_map_destroy(glm);
+    for (int i = 0; i < NMAPS; i++) {
+        free(gms[i]->data);
+        free(gms[i]);
+    }
+
+    printf("ok\n");
+    return 0;
+}
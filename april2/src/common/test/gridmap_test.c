@@ -0,0 +1,238 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "../gridmap.h"
+#include "../workerpool.h"
+
+// Checks the morphological gridmap operations against
+// straightforward per-pixel implementations, with and without a
+// workerpool.
+
+static int imax_(int a, int b) { return a > b ? a : b; }
+static int imin_(int a, int b) { return a < b ? a : b; }
+
+static void ref_dilate(grid_map_t *gm, uint8_t v, int iterations)
+{
+    grid_map_t *aft = gridmap_copy(gm);
+
+    for (int iter = 0; iter < iterations; iter++) {
+        for (int y = 0; y < gm->height; y++) {
+            for (int x = 0; x < gm->width; x++) {
+                if (aft->data[y*gm->width+x] == v)
+                    continue;
+                if (gridmap_has_neighbor(gm, x, y, v))
+                    aft->data[y*gm->width+x] = v;
+            }
+        }
+        memcpy(gm->data, aft->data, gm->datalen);
+    }
+
+    gridmap_destroy(aft);
+}
+
+static void ref_disc_max(grid_map_t *gm, int radius)
+{
+    grid_map_t *aft = gridmap_copy(gm);
+
+    for (int y = 0; y < gm->height; y++) {
+        for (int x = 0; x < gm->width; x++) {
+            int v = 0;
+            for (int k = -radius; k <= radius; k++) {
+                for (int l = -radius; l <= radius; l++) {
+                    if (k*k + l*l > radius*radius)
+                        continue;
+                    if (y+k < 0 || y+k >= gm->height || x+l < 0 || x+l >= gm->width)
+                        continue;
+                    v = imax_(v, gm->data[(y+k)*gm->width + x+l]);
+                }
+            }
+            aft->data[y*gm->width + x] = imax_(v, gm->data[y*gm->width + x]);
+        }
+    }
+
+    memcpy(gm->data, aft->data, gm->datalen);
+    gridmap_destroy(aft);
+}
+
+static grid_map_t *ref_max_convolution(const grid_map_t *gm_in, int k)
+{
+    grid_map_t *gm = gridmap_copy(gm_in);
+
+    for (int y = 0; y < gm->height; y++) {
+        for (int x = 0; x < gm->width; x++) {
+            int v = 0;
+            for (int dy = 0; dy < k && y+dy < gm->height; dy++)
+                for (int dx = 0; dx < k && x+dx < gm->width; dx++)
+                    v = imax_(v, gm_in->data[(y+dy)*gm->width + x+dx]);
+            gm->data[y*gm->width + x] = v;
+        }
+    }
+
+    return gm;
+}
+
+static grid_map_t *ref_decimate_max(const grid_map_t *gm, int factor)
+{
+    grid_map_t *out = gridmap_make_pixels(gm->x0, gm->y0, (gm->width + factor - 1) / factor,
+                                          (gm->height + factor - 1) / factor + 1,
+                                          gm->meters_per_pixel * factor, 0, true);
+
+    for (int iy = 0; iy < gm->height; iy++) {
+        for (int ix = 0; ix < gm->width; ix++) {
+            uint8_t *o = &out->data[(iy/factor)*out->width + ix/factor];
+            *o = imax_(*o, gm->data[iy*gm->width + ix]);
+        }
+    }
+
+    return out;
+}
+
+static void ref_downsample(const grid_map_t *gm, grid_map_t **gmean, grid_map_t **gmin, grid_map_t **gmax)
+{
+    *gmean = gridmap_make_pixels(gm->x0, gm->y0, gm->width/2, gm->height/2, gm->meters_per_pixel*2, 0, 0);
+    *gmin = gridmap_copy(*gmean);
+    *gmax = gridmap_copy(*gmean);
+
+    for (int j = 0; j < (*gmean)->height; j++) {
+        for (int i = 0; i < (*gmean)->width; i++) {
+            int a = gm->data[(2*j + 0)*gm->width + (2*i + 0)];
+            int b = gm->data[(2*j + 0)*gm->width + (2*i + 1)];
+            int c = gm->data[(2*j + 1)*gm->width + (2*i + 0)];
+            int d = gm->data[(2*j + 1)*gm->width + (2*i + 1)];
+
+            int idx = j*(*gmean)->width + i;
+            (*gmean)->data[idx] = round((a + b + c + d) / 4.0);
+            (*gmin)->data[idx] = imin_(imin_(a, b), imin_(c, d));
+            (*gmax)->data[idx] = imax_(imax_(a, b), imax_(c, d));
+        }
+    }
+}
+
+static grid_map_t *random_map(int width, int height)
+{
+    grid_map_t *gm = gridmap_make_pixels(0, 0, width, height, 0.1, 0, true);
+
+    // sparse, clustered values so the filters have structure to find
+    int mode = random() % 3;
+    for (int i = 0; i < gm->datalen; i++) {
+        if (mode == 0)
+            gm->data[i] = random() & 0xff;
+        else if (mode == 1)
+            gm->data[i] = (random() % 50 == 0) ? (random() & 0xff) : 0;
+        else
+            gm->data[i] = random() % 5;
+    }
+
+    return gm;
+}
+
+static void check_equal(const grid_map_t *a, const grid_map_t *b, const char *what)
+{
+    if (a->width != b->width || a->height != b->height ||
+        memcmp(a->data, b->data, a->datalen)) {
+        printf("%s mismatch (%d x %d)\n", what, a->width, a->height);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(0);
+    workerpool_t *wp = workerpool_create(4);
+
+    for (int trial = 0; trial < 200; trial++) {
+        int width = 1 + random() % 150;
+        int height = 1 + random() % 150;
+        grid_map_t *gm = random_map(width, height);
+
+        for (int pass = 0; pass < 2; pass++) {
+            workerpool_t *pool = pass ? wp : NULL;
+
+            int iterations = random() % 6;
+            uint8_t v = random() % 5;
+            grid_map_t *a = gridmap_copy(gm), *b = gridmap_copy(gm);
+            ref_dilate(a, v, iterations);
+            gridmap_dilate_wp(pool, b, v, iterations);
+            check_equal(a, b, "dilate");
+            gridmap_destroy(a);
+            gridmap_destroy(b);
+
+            int radius = random() % 12;
+            a = gridmap_copy(gm);
+            b = gridmap_copy(gm);
+            ref_disc_max(a, radius);
+            gridmap_convolve_centered_disc_max_wp(pool, b, radius);
+            check_equal(a, b, "disc_max");
+            gridmap_destroy(a);
+            gridmap_destroy(b);
+
+            int k = 1 + random() % 10;
+            a = ref_max_convolution(gm, k);
+            b = gridmap_max_convolution_wp(pool, gm, k);
+            check_equal(a, b, "max_convolution");
+            gridmap_destroy(a);
+            gridmap_destroy(b);
+        }
+
+        int factor = 1 + random() % 5;
+        grid_map_t *a = ref_decimate_max(gm, factor);
+        grid_map_t *b = gridmap_decimate_max(gm, factor);
+        check_equal(a, b, "decimate_max");
+        gridmap_destroy(a);
+        gridmap_destroy(b);
+
+        grid_map_t *rmean, *rmin, *rmax, *gmin, *gmax;
+        ref_downsample(gm, &rmean, &rmin, &rmax);
+
+        b = gridmap_downsample_mean(gm);
+        check_equal(rmean, b, "downsample_mean");
+        gridmap_destroy(b);
+
+        b = gridmap_downsample_min(gm);
+        check_equal(rmin, b, "downsample_min");
+        gridmap_destroy(b);
+
+        b = gridmap_downsample_max(gm);
+        check_equal(rmax, b, "downsample_max");
+        gridmap_destroy(b);
+
+        gridmap_downsample_min_and_max(gm, &gmin, &gmax);
+        check_equal(rmin, gmin, "downsample_min_and_max (min)");
+        check_equal(rmax, gmax, "downsample_min_and_max (max)");
+
+        gridmap_destroy(gmin);
+        gridmap_destroy(gmax);
+        gridmap_destroy(rmean);
+        gridmap_destroy(rmin);
+        gridmap_destroy(rmax);
+        gridmap_destroy(gm);
+    }
+
+    workerpool_destroy(wp);
+    printf("ok\n");
+    return 0;
+}
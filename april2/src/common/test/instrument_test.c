@@ -0,0 +1,169 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../instrument.h"
+#include "../zarray.h"
+
+// Records known latencies from several threads and checks the
+// reported counts and percentiles, then measures the cost of a span.
+
+#define NTHREADS 4
+#define NRECORDS 100000
+
+// cost of one stage of a chain of spans (see INSTRUMENT_SPAN_NEXT).
+// A lone span pays for a second timestamp, which may take it over
+// this on hosts with a slow TSC; it is only reported.
+#define SPAN_BUDGET_NS 50
+
+static void *record_thread(void *user)
+{
+    int id = instrument_span_id("test.latency");
+
+    // 1% of records at 1 ms, the rest at 10 us
+    for (int i = 0; i < NRECORDS; i++)
+        instrument_span_record(id, (i % 100) == 0 ? 1000000 : 10000);
+
+    for (int i = 0; i < NRECORDS; i++)
+        INSTRUMENT_COUNT("test.count", 1);
+
+    return NULL;
+}
+
+static const instrument_span_stats_t *find_span(zarray_t *spans, const char *name)
+{
+    for (int i = 0; i < zarray_size(spans); i++) {
+        instrument_span_stats_t *s;
+        zarray_get_volatile(spans, i, &s);
+        if (!strcmp(s->name, name))
+            return s;
+    }
+    return NULL;
+}
+
+// reported values are bucket upper edges: within 12.5% above
+static void check_near(int64_t reported, int64_t actual)
+{
+    if (reported < actual || reported > actual * 1.125 + 1) {
+        printf("reported %ld, actual %ld\n", (long) reported, (long) actual);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    instrument_window_t *w = instrument_window_create();
+    zarray_t *spans = zarray_create(sizeof(instrument_span_stats_t));
+    zarray_t *counters = zarray_create(sizeof(instrument_counter_stats_t));
+
+    // bucket edges for every magnitude
+    int id = instrument_span_id("test.edges");
+    assert(id == instrument_span_id("test.edges"));
+    for (uint64_t v = 1; v < (1ull << 40); v = v * 3 / 2 + 1) {
+        instrument_span_record(id, v);
+        instrument_window_read(w, spans, counters);
+        const instrument_span_stats_t *s = find_span(spans, "test.edges");
+        assert(s && s->count == 1);
+        check_near(s->p50_ns, v);
+        check_near(s->max_ns, v);
+    }
+
+    pthread_t threads[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, record_thread, NULL);
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    instrument_window_read(w, spans, counters);
+    const instrument_span_stats_t *s = find_span(spans, "test.latency");
+    assert(s && s->count == NTHREADS * NRECORDS);
+    check_near(s->p50_ns, 10000);
+    check_near(s->p99_ns, 10000);
+    check_near(s->max_ns, 1000000);
+    assert(fabs(s->mean_ns - (0.99 * 10000 + 0.01 * 1000000)) < 1);
+
+    assert(zarray_size(counters) == 1);
+    instrument_counter_stats_t *c;
+    zarray_get_volatile(counters, 0, &c);
+    assert(c->delta == NTHREADS * NRECORDS && c->total == NTHREADS * NRECORDS);
+
+    // nothing new since the last read
+    instrument_window_read(w, spans, counters);
+    assert(find_span(spans, "test.latency") == NULL);
+    zarray_get_volatile(counters, 0, &c);
+    assert(c->delta == 0 && c->total == NTHREADS * NRECORDS);
+
+    // cost of one span, including both timestamps, of one stage of a
+    // chain of spans (one timestamp), and of the two timestamps alone;
+    // the best of a few runs, so that preemption does not fail the
+    // test
+    double span_ns = HUGE_VAL, lap_ns = HUGE_VAL, ticks_ns = HUGE_VAL;
+    for (int run = 0; run < 10; run++) {
+        uint64_t t0 = instrument_now_ns();
+        for (int i = 0; i < NRECORDS; i++) {
+            INSTRUMENT_SPAN_BEGIN(t);
+            INSTRUMENT_SPAN_END("test.cost", t);
+        }
+        uint64_t t1 = instrument_now_ns();
+        INSTRUMENT_SPAN_BEGIN(t);
+        for (int i = 0; i < NRECORDS; i++)
+            INSTRUMENT_SPAN_NEXT("test.lap", t);
+        uint64_t t2 = instrument_now_ns();
+        volatile uint64_t sink = 0;
+        for (int i = 0; i < NRECORDS; i++) {
+            uint64_t t = instrument_ticks();
+            sink += instrument_ticks() - t;
+        }
+        uint64_t t3 = instrument_now_ns();
+        span_ns = fmin(span_ns, (double) (t1 - t0) / NRECORDS);
+        lap_ns = fmin(lap_ns, (double) (t2 - t1) / NRECORDS);
+        ticks_ns = fmin(ticks_ns, (double) (t3 - t2) / NRECORDS);
+    }
+    printf("%.1f ns per span, %.1f ns per chained span, %.1f ns reading the %s twice\n",
+           span_ns, lap_ns, ticks_ns, instrument_use_tsc ? "tsc" : "clock");
+
+    assert(lap_ns < SPAN_BUDGET_NS);
+
+    // spans measured in ticks still report nanoseconds
+    uint64_t ns0 = instrument_now_ns();
+    INSTRUMENT_SPAN_BEGIN(t_sleep);
+    usleep(20000);
+    INSTRUMENT_SPAN_END("test.sleep", t_sleep);
+    uint64_t slept = instrument_now_ns() - ns0;
+    instrument_window_read(w, spans, counters);
+    s = find_span(spans, "test.sleep");
+    assert(s && s->count == 1);
+    assert(s->max_ns >= slept * 0.95 && s->max_ns <= slept * 1.2);
+
+    zarray_destroy(spans);
+    zarray_destroy(counters);
+    instrument_window_destroy(w);
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,259 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/matd.h"
+#include "common/time_util.h"
+
+// Times the dense matd kernels (multiply, Cholesky, inverse, SVD)
+// across sizes, against the textbook loops they replaced, and checks
+// that both agree.
+//
+// usage: matd_bench [seconds per measurement]
+
+static double budget = 0.2;
+
+static matd_t *randm(int rows, int cols)
+{
+    matd_t *m = matd_create(rows, cols);
+    for (int i = 0; i < rows*cols; i++)
+        m->data[i] = (random() % 2001) / 1000.0 - 1;
+    return m;
+}
+
+// A'A + n*I: symmetric positive definite and well conditioned.
+static matd_t *rand_spd(int n)
+{
+    matd_t *A = randm(n, n);
+    matd_t *S = matd_op("M'*M", A, A);
+    for (int i = 0; i < n; i++)
+        MATD_EL(S, i, i) += n;
+    matd_destroy(A);
+    return S;
+}
+
+static matd_t *ref_multiply(const matd_t *a, const matd_t *b)
+{
+    matd_t *m = matd_create(a->nrows, b->ncols);
+    for (int i = 0; i < m->nrows; i++) {
+        for (int j = 0; j < m->ncols; j++) {
+            double acc = 0;
+            for (int k = 0; k < a->ncols; k++)
+                acc += MATD_EL(a, i, k) * MATD_EL(b, k, j);
+            MATD_EL(m, i, j) = acc;
+        }
+    }
+    return m;
+}
+
+static matd_chol_t *ref_chol(matd_t *A)
+{
+    int N = A->nrows;
+    matd_t *U = matd_copy(A);
+    for (int i = 0; i < N; i++) {
+        double d = 1.0 / sqrt(fmax(MATD_EL(U, i, i), MATD_EPS));
+        for (int j = i; j < N; j++)
+            MATD_EL(U, i, j) *= d;
+        for (int j = i+1; j < N; j++) {
+            double s = MATD_EL(U, i, j);
+            for (int k = j; k < N; k++)
+                MATD_EL(U, j, k) -= MATD_EL(U, i, k)*s;
+        }
+    }
+
+    matd_chol_t *chol = calloc(1, sizeof(matd_chol_t));
+    chol->is_spd = 1;
+    chol->u = U;
+    return chol;
+}
+
+static matd_t *ref_inverse(const matd_t *A)
+{
+    matd_plu_t *plu = matd_plu(A);
+    matd_t *ident = matd_identity(A->nrows);
+    matd_t *inv = matd_plu_solve(plu, ident);
+    matd_destroy(ident);
+    matd_plu_destroy(plu);
+    return inv;
+}
+
+// max abs difference over the upper triangle (or everything).
+static double maxdiff(const matd_t *a, const matd_t *b, int upper)
+{
+    assert(a->nrows == b->nrows && a->ncols == b->ncols);
+    double err = 0;
+    for (int i = 0; i < a->nrows; i++)
+        for (int j = upper ? i : 0; j < a->ncols; j++)
+            err = fmax(err, fabs(MATD_EL(a, i, j) - MATD_EL(b, i, j)));
+    return err;
+}
+
+// time one call of 'f', in microseconds, repeating for 'budget' seconds.
+#define TIME_US(result, stmt)                                           \
+    do {                                                                \
+        int64_t t0 = utime_now(), t1;                                   \
+        int reps = 0;                                                   \
+        do {                                                            \
+            stmt;                                                       \
+            reps++;                                                     \
+            t1 = utime_now();                                           \
+        } while (t1 - t0 < budget * 1e6);                               \
+        result = (t1 - t0) / (double) reps;                             \
+    } while (0)
+
+static void bench_multiply()
+{
+    int sizes[] = { 3, 6, 16, 64, 256, 512 };
+
+    printf("%-10s %6s %12s %12s %8s %10s\n", "op", "n", "ref us", "matd us", "speedup", "maxerr");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        matd_t *A = randm(n, n+1), *B = randm(n+1, n);
+
+        matd_t *R = ref_multiply(A, B), *M = matd_multiply(A, B);
+        double err = maxdiff(R, M, 0);
+        assert(err < 1e-10 * n);
+
+        double tref, tnew;
+        TIME_US(tref, matd_destroy(ref_multiply(A, B)));
+        TIME_US(tnew, matd_destroy(matd_multiply(A, B)));
+        printf("%-10s %6d %12.3f %12.3f %8.2f %10.2e\n", "multiply", n, tref, tnew, tref / tnew, err);
+
+        matd_destroy(R);
+        matd_destroy(M);
+        matd_destroy(A);
+        matd_destroy(B);
+    }
+}
+
+static void bench_chol()
+{
+    int sizes[] = { 3, 6, 64, 130, 256, 512 };
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        matd_t *A = rand_spd(n);
+
+        matd_chol_t *R = ref_chol(A);
+        matd_chol_t *chol = matd_chol(A);
+        assert(chol->is_spd);
+        double err = maxdiff(R->u, chol->u, 0);
+        assert(err < 1e-9);
+        matd_chol_destroy(chol);
+
+        double tref, tnew;
+        TIME_US(tref, matd_chol_destroy(ref_chol(A)));
+        TIME_US(tnew, matd_chol_destroy(matd_chol(A)));
+        printf("%-10s %6d %12.3f %12.3f %8.2f %10.2e\n", "chol", n, tref, tnew, tref / tnew, err);
+
+        matd_chol_destroy(R);
+        matd_destroy(A);
+    }
+}
+
+static void bench_inverse()
+{
+    int sizes[] = { 3, 4, 6, 16, 64 };
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        matd_t *A = rand_spd(n);
+
+        matd_t *R = ref_inverse(A), *I = matd_inverse(A);
+        double err = maxdiff(R, I, 0);
+        assert(err < 1e-9);
+
+        double tref, tnew;
+        TIME_US(tref, matd_destroy(ref_inverse(A)));
+        TIME_US(tnew, matd_destroy(matd_inverse(A)));
+        printf("%-10s %6d %12.3f %12.3f %8.2f %10.2e\n", "inverse", n, tref, tnew, tref / tnew, err);
+
+        matd_destroy(R);
+        matd_destroy(I);
+        matd_destroy(A);
+    }
+
+    // exactly singular matrices are still rejected.
+    matd_t *Z = matd_create(5, 5);
+    assert(matd_inverse(Z) == NULL);
+    matd_destroy(Z);
+}
+
+static void bench_svd()
+{
+    int sizes[] = { 3, 6, 32, 128 };
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        matd_t *A = randm(n, n);
+
+        matd_svd_t svd = matd_svd(A);
+        matd_t *USV = matd_op("M*M*M'", svd.U, svd.S, svd.V);
+        double err = maxdiff(A, USV, 0);
+        assert(err < 1e-9);
+
+        double tnew;
+        TIME_US(tnew, {
+                matd_svd_t t = matd_svd(A);
+                matd_destroy(t.U);
+                matd_destroy(t.S);
+                matd_destroy(t.V);
+            });
+        printf("%-10s %6d %12s %12.3f %8s %10.2e\n", "svd", n, "-", tnew, "-", err);
+
+        matd_destroy(USV);
+        matd_destroy(svd.U);
+        matd_destroy(svd.S);
+        matd_destroy(svd.V);
+        matd_destroy(A);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        budget = atof(argv[1]);
+
+    srandom(0);
+
+    bench_multiply();
+    bench_chol();
+    bench_inverse();
+    bench_svd();
+
+    return 0;
+}
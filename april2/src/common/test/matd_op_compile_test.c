@@ -0,0 +1,217 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/matd.h"
+#include "common/time_util.h"
+
+// Checks compiled expressions against matd_op(): same results, same
+// shape rules, output buffers and 'F' arguments, and times the two on
+// the april_graph_cholesky products.
+
+static matd_t *randm(int rows, int cols)
+{
+    matd_t *m = matd_create(rows, cols);
+    for (int i = 0; i < rows*cols; i++)
+        m->data[i] = (random() % 2001) / 1000.0 - 1;
+    return m;
+}
+
+static void check_equal(const matd_t *a, const matd_t *b)
+{
+    assert(a->nrows == b->nrows && a->ncols == b->ncols);
+    int n = matd_is_scalar(a) ? 1 : a->nrows*a->ncols;
+    for (int i = 0; i < n; i++)
+        assert(fabs(a->data[i] - b->data[i]) <= 1e-9 * (1 + fabs(a->data[i])));
+}
+
+static void test_expressions()
+{
+    for (int iter = 0; iter < 200; iter++) {
+        int n = 1 + random() % 6, m = 1 + random() % 6;
+        matd_t *A = randm(n, m), *B = randm(n, m), *S = randm(n, n), *v = randm(m, 1);
+        for (int i = 0; i < n; i++)
+            MATD_EL(S, i, i) += 2*n;
+
+        struct {
+            const char *expr;
+            matd_t *args[4];
+            int rows, cols;
+        } cases[] = {
+            { "M'*M",             { A, S },       m, n },
+            { "M*M",              { A, v },       n, 1 },
+            { "M'*M*M",           { A, S, A },    m, m },
+            { "M+M-M",            { A, B, A },    n, m },
+            { "-M' + 2*M'",       { A, B },       m, n },
+            { "M^-1*M",           { S, A },       n, m },
+            { "(M*M')^-1*M + M",  { S, S, A, B }, n, m },
+            { "M(M'M)",           { A, B, A },    n, m },
+            { "M*0.5",            { v },          m, 1 },
+            { "M",                { A },          n, m },
+        };
+
+        for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+            matd_t **a = cases[c].args;
+            matd_plan_t *plan = matd_op_compile(cases[c].expr);
+            int nargs = matd_plan_nargs(plan);
+
+            int dims[8], rows, cols;
+            for (int i = 0; i < nargs; i++) {
+                dims[2*i+0] = a[i]->nrows;
+                dims[2*i+1] = a[i]->ncols;
+            }
+            assert(!matd_plan_check(plan, dims, &rows, &cols));
+            assert(rows == cases[c].rows && cols == cases[c].cols);
+
+            matd_t *ref = matd_op(cases[c].expr, a[0], a[1], a[2], a[3]);
+
+            // twice, to exercise the reused temporaries
+            for (int rep = 0; rep < 2; rep++) {
+                matd_t *res = matd_plan_eval(plan, NULL, a[0], a[1], a[2], a[3]);
+                check_equal(ref, res);
+            }
+
+            matd_t *out = matd_create(rows, cols);
+            assert(matd_plan_eval(plan, out, a[0], a[1], a[2], a[3]) == out);
+            check_equal(ref, out);
+
+            matd_destroy(out);
+            matd_destroy(ref);
+            matd_plan_destroy(plan);
+        }
+
+        matd_destroy(A);
+        matd_destroy(B);
+        matd_destroy(S);
+        matd_destroy(v);
+    }
+}
+
+static void test_shapes()
+{
+    matd_plan_t *plan = matd_op_compile("M*M + M");
+
+    int good[] = { 3,2, 2,4, 3,4 };
+    int bad_inner[] = { 3,2, 3,4, 3,4 };
+    int bad_add[] = { 3,2, 2,4, 4,3 };
+    int scalar[] = { 0,0, 2,4, 2,4 };
+    int rows, cols;
+
+    assert(!matd_plan_check(plan, good, &rows, &cols) && rows == 3 && cols == 4);
+    assert(matd_plan_check(plan, bad_inner, NULL, NULL) == -1);
+    assert(matd_plan_check(plan, bad_add, NULL, NULL) == -1);
+    assert(!matd_plan_check(plan, scalar, &rows, &cols) && rows == 2 && cols == 4);
+
+    // eval rejects inconsistent arguments, then recovers
+    matd_t *A = randm(3, 2), *B = randm(3, 4), *C = randm(2, 4);
+    assert(matd_plan_eval(plan, NULL, A, B, B) == NULL);
+    assert(matd_plan_eval(plan, NULL, A, C, B) != NULL);
+    matd_plan_destroy(plan);
+
+    int square[] = { 3,2 };
+    plan = matd_op_compile("M^-1");
+    assert(matd_plan_check(plan, square, NULL, NULL) == -1);
+    matd_plan_destroy(plan);
+
+    // singular inverse
+    plan = matd_op_compile("M^-1");
+    matd_t *Z = matd_create(3, 3);
+    assert(matd_plan_eval(plan, NULL, Z) == NULL);
+    matd_plan_destroy(plan);
+
+    // output aliasing an argument, and 'F' arguments
+    plan = matd_op_compile("M*F");
+    matd_t *S = randm(4, 4), *T = randm(4, 4);
+    matd_t *ref = matd_op("M*M", S, T);
+    assert(matd_plan_eval(plan, S, S, T) == S);
+    check_equal(ref, S);
+
+    matd_destroy(ref);
+    matd_destroy(Z);
+    matd_destroy(S);
+    matd_destroy(A);
+    matd_destroy(B);
+    matd_destroy(C);
+    matd_plan_destroy(plan);
+}
+
+static void test_timing()
+{
+    matd_t *J = randm(3, 3), *W = randm(3, 3);
+    int iters = 200000;
+    double sum = 0;
+
+    int64_t t0 = utime_now();
+    for (int i = 0; i < iters; i++) {
+        matd_t *JtW = matd_op("M'*M", J, W);
+        matd_t *JtWJ = matd_op("M*M", JtW, J);
+        sum += JtWJ->data[0];
+        matd_destroy(JtW);
+        matd_destroy(JtWJ);
+    }
+
+    int64_t t1 = utime_now();
+    matd_plan_t *JtW_plan = matd_op_compile("M'*M");
+    matd_plan_t *JtWJ_plan = matd_op_compile("M*M");
+    for (int i = 0; i < iters; i++) {
+        matd_t *JtW = matd_plan_eval(JtW_plan, NULL, J, W);
+        matd_t *JtWJ = matd_plan_eval(JtWJ_plan, NULL, JtW, J);
+        sum -= JtWJ->data[0];
+    }
+    int64_t t2 = utime_now();
+
+    assert(fabs(sum) < 1e-6 * iters);
+    printf("J'*W*J 3x3: matd_op %.3f us, compiled %.3f us\n",
+           (t1 - t0) / (double) iters, (t2 - t1) / (double) iters);
+
+    matd_plan_destroy(JtW_plan);
+    matd_plan_destroy(JtWJ_plan);
+    matd_destroy(J);
+    matd_destroy(W);
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(0);
+
+    test_expressions();
+    test_shapes();
+    test_timing();
+
+    printf("ok\n");
+    return 0;
+}
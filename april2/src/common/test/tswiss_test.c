@@ -0,0 +1,238 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/zhash.h"
+#include "common/hash_util.h"
+#include "common/time_util.h"
+
+// Checks tswiss_impl.h against zhash under random puts, removes,
+// iterator removes and copies, then compares the speed of zhash,
+// thash_impl.h and tswiss_impl.h on the point decimation workload of
+// sm_points_data_get (integer x,y keys with many duplicates).
+
+typedef struct int32x2 int32x2_t;
+struct int32x2 {
+    int32_t x, y;
+};
+
+#define TNAME int32x2_swiss
+#define TKEYTYPE int32x2_t
+#define TVALTYPE uint32_t
+#define TKEYHASH(pk) hash_u32x2((pk)->x, (pk)->y)
+#define TKEYEQUAL(pka, pkb) ((pka)->x == (pkb)->x && (pka)->y == (pkb)->y)
+#include "../tswiss_impl.h"
+#undef TNAME
+#undef TKEYHASH
+
+// scanmatch's original hash
+#define TNAME int32x2_thash
+#define TKEYHASH(pk) ((uint32_t) ((pk)->x^(pk)->y))
+#include "../thash_impl.h"
+#undef TNAME
+#undef TKEYHASH
+
+// what sm_points_data_get uses
+#define TNAME int32x2_thash_mixed
+#define TKEYHASH(pk) ((uint32_t) hash_u32x2((pk)->x, (pk)->y))
+#include "../thash_impl.h"
+#undef TNAME
+#undef TKEYHASH
+#undef TKEYEQUAL
+#undef TKEYTYPE
+#undef TVALTYPE
+
+static int int32x2_equals(const void *_a, const void *_b)
+{
+    const int32x2_t *a = _a, *b = _b;
+    return a->x == b->x && a->y == b->y;
+}
+
+static uint32_t int32x2_hash(const void *_a)
+{
+    const int32x2_t *a = _a;
+    return hash_u32x2(a->x, a->y);
+}
+
+static void check_same(int32x2_swiss_t *sw, zhash_t *zh)
+{
+    assert(int32x2_swiss_size(sw) == zhash_size(zh));
+
+    zhash_iterator_t zit;
+    zhash_iterator_init(zh, &zit);
+    int32x2_t key;
+    uint32_t value, swvalue;
+    while (zhash_iterator_next(&zit, &key, &value)) {
+        assert(int32x2_swiss_get(sw, &key, &swvalue));
+        assert(swvalue == value);
+    }
+
+    int n = 0;
+    int32x2_swiss_iterator_t sit;
+    int32x2_swiss_iterator_init(sw, &sit);
+    while (int32x2_swiss_iterator_next(&sit, &key, &value)) {
+        assert(zhash_get(zh, &key, &swvalue) && swvalue == value);
+        n++;
+    }
+    assert(n == zhash_size(zh));
+}
+
+static void test_random()
+{
+    int32x2_swiss_t *sw = int32x2_swiss_create();
+    zhash_t *zh = zhash_create(sizeof(int32x2_t), sizeof(uint32_t), int32x2_hash, int32x2_equals);
+
+    srandom(0);
+    for (int iter = 0; iter < 200000; iter++) {
+        // a small key range makes for many replacements and removals
+        int32x2_t key = { .x = random() % 100, .y = random() % 100 };
+        uint32_t value = random(), oldvalue, zoldvalue;
+        int32x2_t oldkey;
+
+        int op = random() % 100;
+        if (op < 55) {
+            int had = zhash_put(zh, &key, &value, NULL, &zoldvalue);
+            assert(int32x2_swiss_put(sw, &key, &value, &oldkey, &oldvalue) == had);
+            assert(!had || (oldvalue == zoldvalue && int32x2_equals(&oldkey, &key)));
+        } else if (op < 95) {
+            int had = zhash_remove(zh, &key, NULL, &zoldvalue);
+            assert(int32x2_swiss_remove(sw, &key, NULL, &oldvalue) == had);
+            assert(!had || oldvalue == zoldvalue);
+        } else if (op < 99) {
+            // remove some entries while iterating
+            int32x2_swiss_iterator_t sit;
+            int32x2_swiss_iterator_init(sw, &sit);
+            while (int32x2_swiss_iterator_next(&sit, &key, &value)) {
+                if (random() % 4 == 0) {
+                    int32x2_swiss_iterator_remove(&sit);
+                    assert(zhash_remove(zh, &key, NULL, NULL));
+                }
+            }
+        } else {
+            int32x2_swiss_t *copy = int32x2_swiss_copy(sw);
+            int32x2_swiss_destroy(sw);
+            sw = copy;
+        }
+
+        if (iter % 1000 == 0)
+            check_same(sw, zh);
+    }
+
+    check_same(sw, zh);
+    int32x2_swiss_performance(sw);
+
+    int32x2_swiss_clear(sw);
+    assert(int32x2_swiss_size(sw) == 0);
+    zhash_clear(zh);
+    check_same(sw, zh);
+
+    int32x2_swiss_destroy(sw);
+    zhash_destroy(zh);
+}
+
+// Points of a scan at ~0.05 m per pixel: a ring of walls, so most
+// keys repeat and nearby keys differ in a few low bits.
+static int32x2_t *make_points(int npoints)
+{
+    int32x2_t *pts = malloc(npoints * sizeof(int32x2_t));
+    for (int i = 0; i < npoints; i++) {
+        double theta = 2 * M_PI * i / npoints;
+        double r = 300 + 100 * sin(5 * theta) + (random() % 8);
+        pts[i].x = floor(r * cos(theta));
+        pts[i].y = floor(r * sin(theta));
+    }
+    return pts;
+}
+
+#define BENCH(name, body)                                               \
+    do {                                                                \
+        int64_t t0 = utime_now();                                       \
+        int nout = 0;                                                   \
+        for (int rep = 0; rep < nreps; rep++) {                         \
+            body;                                                       \
+        }                                                               \
+        printf("%-24s %8.3f ms per decimation (%d points)\n", name,     \
+               (utime_now() - t0) / 1000.0 / nreps, nout / nreps);       \
+    } while (0)
+
+int main(int argc, char *argv[])
+{
+    test_random();
+
+    int npoints = 100000, nreps = 5;
+    int32x2_t *pts = make_points(npoints);
+
+    BENCH("zhash", {
+            zhash_t *h = zhash_create(sizeof(int32x2_t), sizeof(uint32_t), int32x2_hash, int32x2_equals);
+            for (int i = 0; i < npoints; i++) {
+                uint32_t *count;
+                if (zhash_get_volatile(h, &pts[i], &count)) {
+                    (*count)++;
+                } else {
+                    uint32_t one = 1;
+                    zhash_put(h, &pts[i], &one, NULL, NULL);
+                }
+            }
+            nout += zhash_size(h);
+            zhash_destroy(h);
+        });
+
+#define BENCH_T(name, T)                                                \
+    BENCH(name, {                                                       \
+            T##_t *h = T##_create_capacity(npoints);                    \
+            for (int i = 0; i < npoints; i++) {                         \
+                uint32_t *count;                                        \
+                if (T##_get_volatile(h, &pts[i], &count)) {             \
+                    (*count)++;                                         \
+                } else {                                                \
+                    uint32_t one = 1;                                   \
+                    T##_put(h, &pts[i], &one, NULL, NULL);              \
+                }                                                       \
+            }                                                           \
+            nout += T##_size(h);                                        \
+            T##_destroy(h);                                             \
+        })
+
+    BENCH_T("thash (x^y)", int32x2_thash);
+    BENCH_T("thash (hash_u32x2)", int32x2_thash_mixed);
+    BENCH_T("tswiss", int32x2_swiss);
+
+    free(pts);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,449 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+/*
+// An open-addressing hash table in the style of Swiss tables, with
+// the same interface as thash_impl.h. Instantiate it the same way:
+
+#define TNAME int32x2_hash
+#define TKEYTYPE int32x2_t
+#define TVALTYPE uint32_t
+
+// takes a pointer to the key, returns a uint64_t. Use the functions
+// in hash_util.h: the low 7 bits and the remaining bits are used
+// separately, so the hash must mix well everywhere.
+#define TKEYHASH(pk) hash_u32x2((pk)->x, (pk)->y)
+
+#define TKEYEQUAL(pka, pkb) ((pka)->x == (pkb)->x && (pka)->y == (pkb)->y)
+#include "common/tswiss_impl.h"
+
+// Slots are arranged in groups of 16. A separate control byte per
+// slot holds either EMPTY, DELETED, or 7 bits of the key's hash, so a
+// lookup compares a whole group's control bytes at once (with SSE2)
+// and only touches the keys whose 7 bits match. Groups are probed
+// quadratically; a lookup ends at the first group with an EMPTY slot.
+//
+// Unlike thash_impl.h, removal leaves the other entries in place, so
+// iterator_remove() never revisits or skips entries.
+*/
+
+#ifndef _TSWISS_GROUP
+#define _TSWISS_GROUP
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define TSWISS_GROUP_SIZE 16
+
+#define TSWISS_EMPTY   ((uint8_t) 0x80)
+#define TSWISS_DELETED ((uint8_t) 0xfe)
+
+// the maximum load, counting deleted slots, is 7/8.
+#define TSWISS_MAX_LOAD(nslots) ((nslots) - (nslots) / 8)
+
+// bit i is set if ctrl[i] == v.
+static inline uint32_t tswiss_group_match(const uint8_t *ctrl, uint8_t v)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char) v)));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < TSWISS_GROUP_SIZE; i++)
+        m |= (uint32_t) (ctrl[i] == v) << i;
+    return m;
+#endif
+}
+
+// bit i is set if ctrl[i] is EMPTY or DELETED (i.e., its high bit is set).
+static inline uint32_t tswiss_group_match_free(const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) ctrl));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < TSWISS_GROUP_SIZE; i++)
+        m |= (uint32_t) (ctrl[i] >> 7) << i;
+    return m;
+#endif
+}
+
+#endif
+
+#define TRRFN(root, suffix) root ## _ ## suffix
+#define TRFN(root, suffix) TRRFN(root, suffix)
+#define TFN(suffix) TRFN(TNAME, suffix)
+
+#define TTYPENAME TFN(t)
+
+struct TFN(_entry)
+{
+    TKEYTYPE key;
+    TVALTYPE value;
+};
+
+typedef struct TTYPENAME TTYPENAME;
+struct TTYPENAME
+{
+    uint8_t            *ctrl;    // nslots control bytes
+    struct TFN(_entry) *entries; // nslots entries
+    int                 nslots;  // a power of two, at least TSWISS_GROUP_SIZE
+    int                 size;
+
+    // number of EMPTY slots that may still be filled before rehashing
+    int                 growth_left;
+};
+
+// will allocate enough room so that size can grow to 'capacity'
+// without rehashing.
+static inline TTYPENAME *TFN(create_capacity)(int capacity)
+{
+    int nslots = TSWISS_GROUP_SIZE;
+    while (TSWISS_MAX_LOAD(nslots) < capacity)
+        nslots *= 2;
+
+    TTYPENAME *hash = calloc(1, sizeof(TTYPENAME));
+    hash->nslots = nslots;
+    hash->ctrl = malloc(nslots);
+    memset(hash->ctrl, TSWISS_EMPTY, nslots);
+    hash->entries = malloc(nslots * sizeof(struct TFN(_entry)));
+    hash->growth_left = TSWISS_MAX_LOAD(nslots);
+    return hash;
+}
+
+static inline TTYPENAME *TFN(create)()
+{
+    return TFN(create_capacity)(8);
+}
+
+static inline void TFN(destroy)(TTYPENAME *hash)
+{
+    if (!hash)
+        return;
+
+    free(hash->ctrl);
+    free(hash->entries);
+    free(hash);
+}
+
+static inline int TFN(size)(TTYPENAME *hash)
+{
+    return hash->size;
+}
+
+static inline void TFN(clear)(TTYPENAME *hash)
+{
+    memset(hash->ctrl, TSWISS_EMPTY, hash->nslots);
+    hash->size = 0;
+    hash->growth_left = TSWISS_MAX_LOAD(hash->nslots);
+}
+
+// Returns the slot holding key, or -1. 'code' is TKEYHASH(key).
+static inline int TFN(_find)(TTYPENAME *hash, TKEYTYPE *key, uint64_t code)
+{
+    uint32_t group_mask = hash->nslots / TSWISS_GROUP_SIZE - 1;
+    uint32_t group = (code >> 7) & group_mask;
+    uint8_t h2 = code & 0x7f;
+
+    for (uint32_t probe = 1; ; probe++) {
+        uint32_t base = group * TSWISS_GROUP_SIZE;
+
+        // overlap the likely miss on the entries with the one on ctrl
+        __builtin_prefetch(&hash->entries[base]);
+        uint32_t m = tswiss_group_match(&hash->ctrl[base], h2);
+
+        while (m) {
+            int idx = base + __builtin_ctz(m);
+            if (TKEYEQUAL(key, &hash->entries[idx].key))
+                return idx;
+            m &= m - 1;
+        }
+
+        if (tswiss_group_match(&hash->ctrl[base], TSWISS_EMPTY))
+            return -1;
+
+        // triangular steps visit every group when their number is a
+        // power of two.
+        group = (group + probe) & group_mask;
+    }
+}
+
+// Returns the first EMPTY or DELETED slot on code's probe sequence.
+static inline int TFN(_find_free)(TTYPENAME *hash, uint64_t code)
+{
+    uint32_t group_mask = hash->nslots / TSWISS_GROUP_SIZE - 1;
+    uint32_t group = (code >> 7) & group_mask;
+
+    for (uint32_t probe = 1; ; probe++) {
+        uint32_t base = group * TSWISS_GROUP_SIZE;
+        uint32_t m = tswiss_group_match_free(&hash->ctrl[base]);
+        if (m)
+            return base + __builtin_ctz(m);
+
+        group = (group + probe) & group_mask;
+    }
+}
+
+// examine the performance of the hashing function by looking at the
+// number of groups visited to find each entry.
+static inline void TFN(performance)(TTYPENAME *hash)
+{
+    int ndeleted = 0, max_probe = 0;
+    int64_t probe1 = 0, probe2 = 0;
+
+    for (int idx = 0; idx < hash->nslots; idx++) {
+        if (hash->ctrl[idx] == TSWISS_DELETED)
+            ndeleted++;
+        if (hash->ctrl[idx] & 0x80)
+            continue;
+
+        uint64_t code = TKEYHASH(&hash->entries[idx].key);
+        uint32_t group_mask = hash->nslots / TSWISS_GROUP_SIZE - 1;
+        uint32_t group = (code >> 7) & group_mask;
+
+        int nprobes = 1;
+        while (group != idx / TSWISS_GROUP_SIZE) {
+            group = (group + nprobes) & group_mask;
+            nprobes++;
+        }
+
+        probe1 += nprobes;
+        probe2 += nprobes * nprobes;
+        if (nprobes > max_probe)
+            max_probe = nprobes;
+    }
+
+    double Ex1 = hash->size ? 1.0 * probe1 / hash->size : 0;
+    double Ex2 = hash->size ? 1.0 * probe2 / hash->size : 0;
+
+#define strr(s) #s
+#define str(s) strr(s)
+    printf("%s: size %8d, nslots: %8d, deleted %8d, groups probed: max %3d, mean %6.3f, stddev %6.3f\n",
+           str(TNAME), hash->size, hash->nslots, ndeleted, max_probe, Ex1, sqrt(Ex2 - Ex1*Ex1));
+}
+
+static inline int TFN(get_volatile)(TTYPENAME *hash, TKEYTYPE *key, TVALTYPE **value)
+{
+    int idx = TFN(_find)(hash, key, TKEYHASH(key));
+    if (idx < 0)
+        return 0;
+
+    *value = &hash->entries[idx].value;
+    return 1;
+}
+
+static inline int TFN(get)(TTYPENAME *hash, TKEYTYPE *key, TVALTYPE *value)
+{
+    int idx = TFN(_find)(hash, key, TKEYHASH(key));
+    if (idx < 0)
+        return 0;
+
+    *value = hash->entries[idx].value;
+    return 1;
+}
+
+static inline int TFN(contains)(TTYPENAME *hash, TKEYTYPE *key)
+{
+    return TFN(_find)(hash, key, TKEYHASH(key)) >= 0;
+}
+
+static inline int TFN(put)(TTYPENAME *hash, TKEYTYPE *key, TVALTYPE *value, TKEYTYPE *oldkey, TVALTYPE *oldvalue);
+
+// rebuilds the table, dropping DELETED slots, with room for at least
+// twice the current size.
+static inline void TFN(_rehash)(TTYPENAME *hash)
+{
+    TTYPENAME *newhash = TFN(create_capacity)(2 * hash->size + 1);
+
+    for (int idx = 0; idx < hash->nslots; idx++) {
+        if (hash->ctrl[idx] & 0x80)
+            continue;
+
+        struct TFN(_entry) *e = &hash->entries[idx];
+        uint64_t code = TKEYHASH(&e->key);
+        int newidx = TFN(_find_free)(newhash, code);
+        newhash->ctrl[newidx] = code & 0x7f;
+        newhash->entries[newidx] = *e;
+        newhash->size++;
+        newhash->growth_left--;
+    }
+
+    // play switch-a-roo. We become 'newhash' and free the old one.
+    TTYPENAME tmp;
+    memcpy(&tmp, hash, sizeof(TTYPENAME));
+    memcpy(hash, newhash, sizeof(TTYPENAME));
+    memcpy(newhash, &tmp, sizeof(TTYPENAME));
+    TFN(destroy)(newhash);
+}
+
+static inline int TFN(put)(TTYPENAME *hash, TKEYTYPE *key, TVALTYPE *value, TKEYTYPE *oldkey, TVALTYPE *oldvalue)
+{
+    uint64_t code = TKEYHASH(key);
+    int idx = TFN(_find)(hash, key, code);
+
+    if (idx >= 0) {
+        if (oldkey)
+            *oldkey = hash->entries[idx].key;
+        if (oldvalue)
+            *oldvalue = hash->entries[idx].value;
+        hash->entries[idx].key = *key;
+        hash->entries[idx].value = *value;
+        return 1;
+    }
+
+    idx = TFN(_find_free)(hash, code);
+
+    if (hash->ctrl[idx] == TSWISS_EMPTY) {
+        if (hash->growth_left == 0) {
+            TFN(_rehash)(hash);
+            idx = TFN(_find_free)(hash, code);
+        }
+        hash->growth_left--;
+    }
+
+    hash->ctrl[idx] = code & 0x7f;
+    hash->entries[idx].key = *key;
+    hash->entries[idx].value = *value;
+    hash->size++;
+    return 0;
+}
+
+static inline void TFN(_erase)(TTYPENAME *hash, int idx)
+{
+    int base = idx & ~(TSWISS_GROUP_SIZE - 1);
+
+    // a lookup that reaches this group stops here if the group has
+    // an EMPTY slot, so the slot can be made EMPTY again without
+    // hiding any entry probed past it.
+    if (tswiss_group_match(&hash->ctrl[base], TSWISS_EMPTY)) {
+        hash->ctrl[idx] = TSWISS_EMPTY;
+        hash->growth_left++;
+    } else {
+        hash->ctrl[idx] = TSWISS_DELETED;
+    }
+
+    hash->size--;
+}
+
+static inline int TFN(remove)(TTYPENAME *hash, TKEYTYPE *key, TKEYTYPE *oldkey, TVALTYPE *oldvalue)
+{
+    int idx = TFN(_find)(hash, key, TKEYHASH(key));
+    if (idx < 0)
+        return 0;
+
+    if (oldkey)
+        *oldkey = hash->entries[idx].key;
+    if (oldvalue)
+        *oldvalue = hash->entries[idx].value;
+
+    TFN(_erase)(hash, idx);
+    return 1;
+}
+
+static inline TTYPENAME *TFN(copy)(TTYPENAME *hash)
+{
+    TTYPENAME *newhash = calloc(1, sizeof(TTYPENAME));
+    memcpy(newhash, hash, sizeof(TTYPENAME));
+
+    newhash->ctrl = malloc(hash->nslots);
+    memcpy(newhash->ctrl, hash->ctrl, hash->nslots);
+    newhash->entries = malloc(hash->nslots * sizeof(struct TFN(_entry)));
+    memcpy(newhash->entries, hash->entries, hash->nslots * sizeof(struct TFN(_entry)));
+
+    return newhash;
+}
+
+typedef struct TFN(iterator) TFN(iterator_t);
+struct TFN(iterator)
+{
+    TTYPENAME *hash;
+    int last_entry; // points to last entry returned by _next
+};
+
+static inline void TFN(iterator_init)(TTYPENAME *hash, TFN(iterator_t) *iter)
+{
+    iter->hash = hash;
+    iter->last_entry = -1;
+}
+
+static inline int TFN(iterator_next_volatile)(TFN(iterator_t) *iter, TKEYTYPE **outkey, TVALTYPE **outval)
+{
+    TTYPENAME *hash = iter->hash;
+
+    while (iter->last_entry + 1 < hash->nslots) {
+        iter->last_entry++;
+
+        if (!(hash->ctrl[iter->last_entry] & 0x80)) {
+            if (outkey)
+                *outkey = &hash->entries[iter->last_entry].key;
+            if (outval)
+                *outval = &hash->entries[iter->last_entry].value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline int TFN(iterator_next)(TFN(iterator_t) *iter, TKEYTYPE *outkey, TVALTYPE *outval)
+{
+    TKEYTYPE *k;
+    TVALTYPE *v;
+    if (!TFN(iterator_next_volatile)(iter, &k, &v))
+        return 0;
+
+    if (outkey)
+        *outkey = *k;
+    if (outval)
+        *outval = *v;
+    return 1;
+}
+
+static inline void TFN(iterator_remove)(TFN(iterator_t) *iter)
+{
+    TFN(_erase)(iter->hash, iter->last_entry);
+}
+
+#undef TRRFN
+#undef TRFN
+#undef TFN
+#undef TTYPENAME
+#undef strr
+#undef str
@@ -38,6 +38,8 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -53,6 +55,8 @@ struct zarray
     int size; // how many elements?
     int alloc; // we've allocated storage for how many elements?
     char *data;
+
+    arena_t *arena; // if non-NULL, the array and its data live in this arena
 };
 
 /**
@@ -69,13 +73,29 @@ static inline zarray_t *zarray_create(size_t el_sz)
     return za;
 }
 
+/**
+ * Creates a variable array whose structure and storage are allocated
+ * from 'arena'. It is released along with the arena's other
+ * allocations (zarray_destroy() does nothing), so it must not be used
+ * after the arena is reset or restored to an earlier checkpoint.
+ */
+static inline zarray_t *zarray_create_arena(arena_t *arena, size_t el_sz)
+{
+    assert(el_sz > 0);
+
+    zarray_t *za = (zarray_t*) arena_calloc(arena, 1, sizeof(zarray_t));
+    za->el_sz = el_sz;
+    za->arena = arena;
+    return za;
+}
+
 /**
  * Frees all resources associated with the variable array structure which was
  * created by zarray_create(). After calling, 'za' will no longer be valid for storage.
  */
 static inline void zarray_destroy(zarray_t *za)
 {
-    if (za == NULL)
+    if (za == NULL || za->arena != NULL)
         return;
 
     if (za->data != NULL)
@@ -168,13 +188,17 @@ static inline void zarray_ensure_capacity(zarray_t *za, int capacity)
     if (capacity <= za->alloc)
         return;
 
+    int oldalloc = za->alloc;
     while (za->alloc < capacity) {
         za->alloc *= 2;
         if (za->alloc < 8)
             za->alloc = 8;
     }
 
-    za->data = (char*) realloc(za->data, za->alloc * za->el_sz);
+    if (za->arena)
+        za->data = (char*) arena_realloc(za->arena, za->data, oldalloc * za->el_sz, za->alloc * za->el_sz);
+    else
+        za->data = (char*) realloc(za->data, za->alloc * za->el_sz);
 }
 
 /**
@@ -25,6 +25,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include <stdbool.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <stdint.h>
 
 #include "common/doubles.h"
 #include "common/floats.h"
@@ -39,11 +40,25 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 const int MAX_DEPTH = 5;
 const double EPS = 0.00001;
 
+// Images are rendered in TILE_SIZE x TILE_SIZE tiles. Each thread
+// starts on its own contiguous run of tiles, taking them from the
+// front; a thread that runs out steals from the back of another's.
+#define TILE_SIZE 16
+
+// next (low 32 bits) and end (high 32 bits) of the remaining tiles,
+// updated together so the owner and thieves never take the same one.
+// Padded to keep each queue on its own cache line.
+typedef struct {
+    uint64_t range;
+    char pad[56];
+} tile_queue_t;
+
 typedef struct {
     raytracer_t *r;
     image_u8x3_t *im;
-    int y0;    // render lines y0 to (y1-1)
-    int y1;
+    tile_queue_t *queues;
+    int nqueues;
+    int self;
 } thread_data_t;
 
 
@@ -52,6 +67,7 @@ raytracer_t *raytracer_create(camera_t *camera, scene_t *scene)
     raytracer_t *r = calloc(1, sizeof(raytracer_t));
     r->camera = camera;
     r->scene = scene;
+    r->packets = 1;
     return r;
 }
 
@@ -64,41 +80,19 @@ static double test_ray(const double ray0[3], const double raydir[3],
                        scene_t *scene)
 {
     intersection_t isect = { .dist = DBL_MAX };
-    for (int i = 0; i < zarray_size(scene->objects); i += 1) {
-        drawable_t *obj;
-        zarray_get(scene->objects, i, &obj);
-
-        // Transform rays into object coordinate frame
-        double tray0[3];
-        double traydir[3];
-        doubles_mat44_transform_xyz(obj->Tinv, ray0, tray0);
-        doubles_mat44_rotate_vector(obj->Tinv, raydir, traydir);
-
-        // Only updates isect if it's closer than the existing object
-        obj->intersect(obj, tray0, traydir, &isect);
-    }
-
+    scene_intersect(scene, ray0, raydir, &isect);
     return isect.dist;
 }
 
 static void trace_ray(const double ray0[3], const double raydir[3],
-                      scene_t *scene, int depth, float color[3])
+                      scene_t *scene, int depth, float color[3]);
+
+// Color of the ray, given its first intersection
+static void shade_ray(const double ray0[3], const double raydir[3],
+                      scene_t *scene, int depth, const intersection_t *_isect,
+                      float color[3])
 {
-    // Find first object along the ray
-    intersection_t isect = { .dist = DBL_MAX };
-    for (int i = 0; i < zarray_size(scene->objects); i += 1) {
-        drawable_t *obj;
-        zarray_get(scene->objects, i, &obj);
-
-        // Transform rays into object coordinate frame
-        double tray0[3];
-        double traydir[3];
-        doubles_mat44_transform_xyz(obj->Tinv, ray0, tray0);
-        doubles_mat44_rotate_vector(obj->Tinv, raydir, traydir);
-
-        // Only updates isect if it's closer than the existing object
-        obj->intersect(obj, tray0, traydir, &isect);
-    }
+    const intersection_t isect = *_isect;
 
     // If no intersection, return background color
     if (isect.obj == NULL) {
@@ -168,31 +162,125 @@ static void trace_ray(const double ray0[3], const double raydir[3],
                            (1-fogblend) * scene->fog_color[i]);
 }
 
+static void trace_ray(const double ray0[3], const double raydir[3],
+                      scene_t *scene, int depth, float color[3])
+{
+    // Find first object along the ray
+    intersection_t isect = { .dist = DBL_MAX };
+    scene_intersect(scene, ray0, raydir, &isect);
+
+    shade_ray(ray0, raydir, scene, depth, &isect, color);
+}
+
+static void primary_ray(raytracer_t *r, int width, int height, int x, int y,
+                        double raydir[3])
+{
+    double nx = (x - width/2.0) / (width/2.0);
+    double ny = (y - height/2.0) / (height/2.0);
+    camera_get_ray_direction(r->camera, nx, ny, raydir);
+}
+
+static void put_pixel(image_u8x3_t *im, int x, int y, const float color[3])
+{
+    int offset = (im->height-1-y)*im->stride + 3*x;
+    im->buf[offset] = imin(255, color[0]*255);
+    im->buf[offset+1] = imin(255, color[1]*255);
+    im->buf[offset+2] = imin(255, color[2]*255);
+}
+
+static void render_tile(raytracer_t *r, image_u8x3_t *im, int tile)
+{
+    int width = im->width;
+    int height = im->height;
+    int tiles_wide = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int x0 = (tile % tiles_wide) * TILE_SIZE, x1 = imin(x0 + TILE_SIZE, width);
+    int y0 = (tile / tiles_wide) * TILE_SIZE, y1 = imin(y0 + TILE_SIZE, height);
+
+    if (!r->packets) {
+        for (int y = y0; y < y1; y += 1) {
+            for (int x = x0; x < x1; x += 1) {
+                double raydir[3];
+                primary_ray(r, width, height, x, y, raydir);
+                float color[3];
+                trace_ray(r->camera->pos, raydir, r->scene, 0, color);
+                put_pixel(im, x, y, color);
+            }
+        }
+        return;
+    }
+
+    // 2x2 pixel packets; at the tile's edges, pixels outside the image
+    // repeat the block's first ray and are not written.
+    for (int y = y0; y < y1; y += 2) {
+        for (int x = x0; x < x1; x += 2) {
+            double raydirs[4][3];
+            for (int i = 0; i < 4; i += 1) {
+                int px = x + (i & 1), py = y + (i >> 1);
+                if (px < x1 && py < y1)
+                    primary_ray(r, width, height, px, py, raydirs[i]);
+                else
+                    doubles_copy(raydirs[0], raydirs[i], 3);
+            }
+
+            intersection_t isects[4];
+            for (int i = 0; i < 4; i += 1)
+                isects[i] = (intersection_t) { .dist = DBL_MAX };
+            scene_intersect4(r->scene, r->camera->pos, raydirs, isects);
+
+            for (int i = 0; i < 4; i += 1) {
+                int px = x + (i & 1), py = y + (i >> 1);
+                if (px >= x1 || py >= y1)
+                    continue;
+
+                float color[3];
+                shade_ray(r->camera->pos, raydirs[i], r->scene, 0, &isects[i], color);
+                put_pixel(im, px, py, color);
+            }
+        }
+    }
+}
+
+// Takes a tile from the front of the queue (or, when stealing, the
+// back). Returns -1 if the queue is empty.
+static int take_tile(tile_queue_t *q, int steal)
+{
+    uint64_t range = __atomic_load_n(&q->range, __ATOMIC_RELAXED);
+    while (1) {
+        uint32_t next = range & 0xffffffff, end = range >> 32;
+        if (next >= end)
+            return -1;
+
+        uint64_t newrange = steal ? (((uint64_t) (end - 1)) << 32) | next
+                                  : (((uint64_t) end) << 32) | (next + 1);
+        if (__atomic_compare_exchange_n(&q->range, &range, newrange, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return steal ? (int) (end - 1) : (int) next;
+    }
+}
+
 static void *worker_thread(void *user)
 {
     thread_data_t *data = user;
-    int y0 = data->y0;
-    int y1 = data->y1;
-    int width = data->im->width;
-    int height = data->im->height;
 
-    for (int y = y0; y < y1; y += 1) {
-        double ny = (y - height/2.0) / (height/2.0);
-        for (int x = 0; x < width; x += 1) {
-            double nx = (x - width/2.0) / (width/2.0);
-
-            double raydir[3];
-            camera_get_ray_direction(data->r->camera, nx, ny, raydir);
-            float color[3];
-            trace_ray(data->r->camera->pos, raydir, data->r->scene, 0, color);
-            int offset = (height-1-y)*data->im->stride + 3*x;
-            data->im->buf[offset] = imin(255, color[0]*255);
-            data->im->buf[offset+1] = imin(255, color[1]*255);
-            data->im->buf[offset+2] = imin(255, color[2]*255);
+    int tile;
+    while ((tile = take_tile(&data->queues[data->self], 0)) >= 0)
+        render_tile(data->r, data->im, tile);
+
+    // Steal until every queue is empty. Queues only shrink, so one
+    // pass that finds nothing means we're done.
+    while (1) {
+        int stole = 0;
+        for (int i = 1; i < data->nqueues; i += 1) {
+            tile_queue_t *victim = &data->queues[(data->self + i) % data->nqueues];
+            while ((tile = take_tile(victim, 1)) >= 0) {
+                render_tile(data->r, data->im, tile);
+                stole = 1;
+            }
         }
+        if (!stole)
+            break;
     }
 
-    free(data);
     return NULL;
 }
 
@@ -200,25 +288,34 @@ image_u8x3_t *raytracer_render(raytracer_t *r, int width, int height,
                                int antialias, int nthreads)
 {
     assert(antialias > 0);
+    assert(nthreads > 0);
+
+    scene_build(r->scene);
 
     image_u8x3_t *im = image_u8x3_create(width*antialias, height*antialias);
 
-    // Create render threads
-    int y = 0;
-    int yincr = im->height / nthreads;
-    if (im->height % nthreads) yincr += 1;
-    pthread_t threads[nthreads];
+    int ntiles = ((im->width + TILE_SIZE - 1) / TILE_SIZE) *
+        ((im->height + TILE_SIZE - 1) / TILE_SIZE);
+
+    tile_queue_t queues[nthreads];
+    thread_data_t data[nthreads];
     for (int i = 0; i < nthreads; i += 1) {
-        thread_data_t *data = calloc(1, sizeof(thread_data_t));
-        data->r = r;
-        data->im = im;
-        data->y0 = y;
-        y += yincr;
-        data->y1 = imin(y, im->height);
-        pthread_create(&threads[i], NULL, worker_thread, data);
+        uint32_t next = (int64_t) ntiles * i / nthreads;
+        uint32_t end = (int64_t) ntiles * (i + 1) / nthreads;
+        queues[i].range = (((uint64_t) end) << 32) | next;
+
+        data[i] = (thread_data_t) { .r = r, .im = im, .queues = queues,
+                                    .nqueues = nthreads, .self = i };
     }
 
-    for (int i = 0; i < nthreads; i += 1) {
+    // Create render threads; this thread renders too
+    pthread_t threads[nthreads];
+    for (int i = 1; i < nthreads; i += 1)
+        pthread_create(&threads[i], NULL, worker_thread, &data[i]);
+
+    worker_thread(&data[0]);
+
+    for (int i = 1; i < nthreads; i += 1) {
         pthread_join(threads[i], NULL);
     }
 
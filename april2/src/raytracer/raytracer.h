@@ -31,12 +31,18 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 typedef struct {
     camera_t *camera;
     scene_t *scene;
+
+    // trace primary rays in 2x2 packets (SIMD box tests with SSE2).
+    // Images are identical either way. Default: on.
+    int packets;
 } raytracer_t;
 
 
 raytracer_t *raytracer_create(camera_t *camera, scene_t *scene);
 
 //Antialias: a value of n means n^2 rays are cast per pixel. must be at least 1
+//Builds the scene's BVH if needed (see scene_build), so objects must not
+//be added to the scene concurrently.
 image_u8x3_t *raytracer_render(raytracer_t *r, int width, int height,
                                int antialias, int nthreads);
 
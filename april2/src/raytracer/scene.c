@@ -20,9 +20,16 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common/floats.h"
 
@@ -35,6 +42,13 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #define TYPE_MATRIX       3
 #define TYPE_CHAIN        4
 
+#define BVH_LEAF_SIZE     2
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_STACK_SIZE    128
+
+// object bounds beyond this are treated as unbounded
+#define BOUNDS_LIMIT      1e18
+
 
 scene_t *scene_create(const float bgcolor[3], const float ambient_light[3])
 {
@@ -44,6 +58,7 @@ scene_t *scene_create(const float bgcolor[3], const float ambient_light[3])
     floats_copy(ambient_light, s->ambient_light, 3);
     s->objects = zarray_create(sizeof(void*));
     s->lights = zarray_create(sizeof(void*));
+    s->unbounded = zarray_create(sizeof(void*));
 
     return s;
 }
@@ -95,6 +110,7 @@ void scene_add(scene_t *scene, scene_object_t so)
     double T[16];
     doubles_mat44_identity(T);
     scene_add_transform(scene, so, T);
+    scene->bvh_valid = 0;
 }
 
 void scene_destroy(scene_t *s)
@@ -113,10 +129,372 @@ void scene_destroy(scene_t *s)
     }
     zarray_destroy(s->objects);
     zarray_destroy(s->lights);
+    zarray_destroy(s->unbounded);
+    free(s->nodes);
+    free(s->bvh_objects);
 
     free(s);
 }
 
+struct build_item {
+    drawable_t *obj;
+    double min[3], max[3];
+    double c[3];
+};
+
+static double box_area(const double min[3], const double max[3])
+{
+    double d[3];
+    for (int i = 0; i < 3; i += 1)
+        d[i] = max[i] - min[i];
+    return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+static void box_union(double min[3], double max[3],
+                      const double bmin[3], const double bmax[3])
+{
+    for (int i = 0; i < 3; i += 1) {
+        min[i] = fmin(min[i], bmin[i]);
+        max[i] = fmax(max[i], bmax[i]);
+    }
+}
+
+#define DEFINE_COMPARE(axis)                                            \
+    static int compare_c##axis(const void *_a, const void *_b)          \
+    {                                                                   \
+        const struct build_item *a = _a, *b = _b;                       \
+        return (a->c[axis] > b->c[axis]) - (a->c[axis] < b->c[axis]);   \
+    }
+DEFINE_COMPARE(0)
+DEFINE_COMPARE(1)
+DEFINE_COMPARE(2)
+
+static int (*const compare_c[3])(const void*, const void*) = {
+    compare_c0, compare_c1, compare_c2
+};
+
+static float float_down(double v)
+{
+    float f = (float) v;
+    return f > v ? nextafterf(f, -INFINITY) : f;
+}
+
+static float float_up(double v)
+{
+    float f = (float) v;
+    return f < v ? nextafterf(f, INFINITY) : f;
+}
+
+// Builds the subtree over items[start, start+count) with a full
+// surface area heuristic sweep (scenes hold few objects). Returns the
+// node's index.
+static int bvh_build(zarray_t *nodes, struct build_item *items,
+                     int start, int count)
+{
+    double min[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+    double max[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+    for (int i = start; i < start + count; i += 1)
+        box_union(min, max, items[i].min, items[i].max);
+
+    scene_bvh_node_t node = { .start = start, .count = count };
+    for (int i = 0; i < 3; i += 1) {
+        node.min[i] = float_down(min[i]);
+        node.max[i] = float_up(max[i]);
+    }
+    int nodeidx = zarray_size(nodes);
+    zarray_add(nodes, &node);
+
+    if (count <= BVH_LEAF_SIZE)
+        return nodeidx;
+
+    // cost of a split relative to testing each object once
+    double best_cost = count * box_area(min, max);
+    int best_axis = -1, best_split = count / 2;
+    double right_area[count];
+
+    for (int axis = 0; axis < 3; axis += 1) {
+        qsort(&items[start], count, sizeof(struct build_item), compare_c[axis]);
+
+        double bmin[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+        double bmax[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+        for (int i = count - 1; i > 0; i -= 1) {
+            box_union(bmin, bmax, items[start+i].min, items[start+i].max);
+            right_area[i] = box_area(bmin, bmax);
+        }
+
+        doubles_copy((double[]){ DBL_MAX, DBL_MAX, DBL_MAX }, bmin, 3);
+        doubles_copy((double[]){ -DBL_MAX, -DBL_MAX, -DBL_MAX }, bmax, 3);
+        for (int i = 1; i < count; i += 1) {
+            box_union(bmin, bmax, items[start+i-1].min, items[start+i-1].max);
+            double cost = box_area(min, max) +
+                i * box_area(bmin, bmax) + (count - i) * right_area[i];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    if (best_axis < 0) {
+        if (count <= BVH_MAX_LEAF_SIZE)
+            return nodeidx;
+        best_axis = 0;
+    }
+    qsort(&items[start], count, sizeof(struct build_item), compare_c[best_axis]);
+
+    bvh_build(nodes, items, start, best_split);
+    int right = bvh_build(nodes, items, start + best_split, count - best_split);
+
+    scene_bvh_node_t *n;
+    zarray_get_volatile(nodes, nodeidx, &n);
+    n->start = right;
+    n->count = 0;
+
+    return nodeidx;
+}
+
+void scene_build(scene_t *scene)
+{
+    if (scene->bvh_valid)
+        return;
+
+    zarray_clear(scene->unbounded);
+    free(scene->nodes);
+    free(scene->bvh_objects);
+
+    int nobjects = zarray_size(scene->objects);
+    struct build_item *items = malloc(sizeof(struct build_item) * (nobjects + 1));
+    int nitems = 0;
+
+    for (int i = 0; i < nobjects; i += 1) {
+        drawable_t *d;
+        zarray_get(scene->objects, i, &d);
+
+        double omin[3], omax[3];
+        int bounded = d->get_bounds != NULL;
+        if (bounded) {
+            d->get_bounds(d, omin, omax);
+            for (int j = 0; j < 3; j += 1)
+                if (!(fabs(omin[j]) < BOUNDS_LIMIT && fabs(omax[j]) < BOUNDS_LIMIT))
+                    bounded = 0;
+        }
+
+        if (!bounded) {
+            zarray_add(scene->unbounded, &d);
+            continue;
+        }
+
+        // world box around the transformed corners
+        struct build_item *item = &items[nitems++];
+        item->obj = d;
+        doubles_copy((double[]){ DBL_MAX, DBL_MAX, DBL_MAX }, item->min, 3);
+        doubles_copy((double[]){ -DBL_MAX, -DBL_MAX, -DBL_MAX }, item->max, 3);
+        for (int corner = 0; corner < 8; corner += 1) {
+            double p[3] = { (corner & 1) ? omax[0] : omin[0],
+                            (corner & 2) ? omax[1] : omin[1],
+                            (corner & 4) ? omax[2] : omin[2] };
+            double w[3];
+            doubles_mat44_transform_xyz(d->T, p, w);
+            box_union(item->min, item->max, w, w);
+        }
+        for (int j = 0; j < 3; j += 1)
+            item->c[j] = (item->min[j] + item->max[j]) / 2;
+    }
+
+    zarray_t *nodes = zarray_create(sizeof(scene_bvh_node_t));
+    if (nitems > 0)
+        bvh_build(nodes, items, 0, nitems);
+
+    scene->nnodes = zarray_size(nodes);
+    scene->nodes = malloc(sizeof(scene_bvh_node_t) * (scene->nnodes + 1));
+    memcpy(scene->nodes, nodes->data, sizeof(scene_bvh_node_t) * scene->nnodes);
+
+    scene->bvh_objects = malloc(sizeof(drawable_t*) * (nitems + 1));
+    for (int i = 0; i < nitems; i += 1)
+        scene->bvh_objects[i] = items[i].obj;
+
+    zarray_destroy(nodes);
+    free(items);
+    scene->bvh_valid = 1;
+}
+
+static inline void intersect_object(drawable_t *obj, const double ray0[3],
+                                    const double raydir[3], intersection_t *isect)
+{
+    // Transform rays into object coordinate frame
+    double tray0[3];
+    double traydir[3];
+    doubles_mat44_transform_xyz(obj->Tinv, ray0, tray0);
+    doubles_mat44_rotate_vector(obj->Tinv, raydir, traydir);
+
+    // Only updates isect if it's closer than the existing object
+    obj->intersect(obj, tray0, traydir, isect);
+}
+
+// true if the ray enters the box within [0, maxdist]
+static inline int box_hit(const scene_bvh_node_t *node, const double ray0[3],
+                          const double invdir[3], double maxdist)
+{
+    double t0 = 0, t1 = maxdist;
+    for (int i = 0; i < 3; i += 1) {
+        double a = (node->min[i] - ray0[i]) * invdir[i];
+        double b = (node->max[i] - ray0[i]) * invdir[i];
+        t0 = fmax(t0, fmin(a, b));
+        t1 = fmin(t1, fmax(a, b));
+    }
+    return t0 <= t1;
+}
+
+// Of an interior node's children, returns the one a ray traveling
+// along 'dir' is likely to reach first (the other is the sibling).
+static inline int32_t near_child(const scene_t *scene, int32_t idx, const double dir[3])
+{
+    const scene_bvh_node_t *a = &scene->nodes[idx + 1];
+    const scene_bvh_node_t *b = &scene->nodes[scene->nodes[idx].start];
+
+    // axis along which the children are farthest apart
+    double best = -1, delta = 0;
+    for (int i = 0; i < 3; i += 1) {
+        double d = (b->min[i] + b->max[i]) - (a->min[i] + a->max[i]);
+        if (fabs(d) > best) {
+            best = fabs(d);
+            delta = d * dir[i];
+        }
+    }
+
+    return delta >= 0 ? idx + 1 : scene->nodes[idx].start;
+}
+
+static inline int32_t sibling(const scene_t *scene, int32_t idx, int32_t child)
+{
+    return child == idx + 1 ? scene->nodes[idx].start : idx + 1;
+}
+
+void scene_intersect(const scene_t *scene, const double ray0[3],
+                     const double raydir[3], intersection_t *isect)
+{
+    assert(scene->bvh_valid);
+
+    // unbounded objects are typically large (ground planes), so they
+    // often shorten the ray before the traversal starts.
+    for (int i = 0; i < zarray_size(scene->unbounded); i += 1) {
+        drawable_t *obj;
+        zarray_get(scene->unbounded, i, &obj);
+        intersect_object(obj, ray0, raydir, isect);
+    }
+
+    if (scene->nnodes == 0)
+        return;
+
+    double invdir[3];
+    for (int i = 0; i < 3; i += 1)
+        invdir[i] = 1.0 / raydir[i];
+
+    int32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0) {
+        int32_t idx = stack[--sp];
+        const scene_bvh_node_t *node = &scene->nodes[idx];
+
+        if (!box_hit(node, ray0, invdir, isect->dist))
+            continue;
+
+        if (node->count) {
+            for (int i = node->start; i < node->start + node->count; i += 1)
+                intersect_object(scene->bvh_objects[i], ray0, raydir, isect);
+            continue;
+        }
+
+        assert(sp + 2 <= BVH_STACK_SIZE);
+        int32_t near = near_child(scene, idx, raydir);
+        stack[sp++] = sibling(scene, idx, near);
+        stack[sp++] = near;
+    }
+}
+
+#ifdef __SSE2__
+// bit i set if ray i enters the box within [0, maxdist[i]]
+static inline int box_hit4(const scene_bvh_node_t *node, const __m128 ray0[3],
+                           const __m128 invdir[3], __m128 maxdist)
+{
+    __m128 t0 = _mm_setzero_ps(), t1 = maxdist;
+    for (int i = 0; i < 3; i += 1) {
+        __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min[i]), ray0[i]), invdir[i]);
+        __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max[i]), ray0[i]), invdir[i]);
+        // argument order makes a NaN (0 * inf) leave t0/t1 unchanged
+        t0 = _mm_max_ps(_mm_min_ps(a, b), t0);
+        t1 = _mm_min_ps(_mm_max_ps(a, b), t1);
+    }
+
+    // allow for float rounding; a false hit only costs a test
+    t1 = _mm_add_ps(t1, _mm_mul_ps(_mm_set1_ps(1e-4f),
+                                   _mm_add_ps(t1, _mm_set1_ps(1))));
+
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+void scene_intersect4(const scene_t *scene, const double ray0[3],
+                      const double raydirs[4][3], intersection_t isects[4])
+{
+#ifdef __SSE2__
+    assert(scene->bvh_valid);
+
+    for (int i = 0; i < zarray_size(scene->unbounded); i += 1) {
+        drawable_t *obj;
+        zarray_get(scene->unbounded, i, &obj);
+        for (int j = 0; j < 4; j += 1)
+            intersect_object(obj, ray0, raydirs[j], &isects[j]);
+    }
+
+    if (scene->nnodes == 0)
+        return;
+
+    __m128 ray04[3], invdir4[3];
+    double meandir[3];
+    for (int i = 0; i < 3; i += 1) {
+        ray04[i] = _mm_set1_ps((float) ray0[i]);
+        invdir4[i] = _mm_setr_ps(1.0f / (float) raydirs[0][i], 1.0f / (float) raydirs[1][i],
+                                 1.0f / (float) raydirs[2][i], 1.0f / (float) raydirs[3][i]);
+        meandir[i] = raydirs[0][i] + raydirs[1][i] + raydirs[2][i] + raydirs[3][i];
+    }
+
+    int32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while (sp > 0) {
+        int32_t idx = stack[--sp];
+        const scene_bvh_node_t *node = &scene->nodes[idx];
+
+        __m128 maxdist = _mm_setr_ps((float) isects[0].dist, (float) isects[1].dist,
+                                     (float) isects[2].dist, (float) isects[3].dist);
+        int mask = box_hit4(node, ray04, invdir4, maxdist);
+        if (!mask)
+            continue;
+
+        if (node->count) {
+            for (int i = node->start; i < node->start + node->count; i += 1)
+                for (int j = 0; j < 4; j += 1)
+                    if (mask & (1 << j))
+                        intersect_object(scene->bvh_objects[i], ray0, raydirs[j], &isects[j]);
+            continue;
+        }
+
+        assert(sp + 2 <= BVH_STACK_SIZE);
+        int32_t near = near_child(scene, idx, meandir);
+        stack[sp++] = sibling(scene, idx, near);
+        stack[sp++] = near;
+    }
+#else
+    for (int i = 0; i < 4; i += 1)
+        scene_intersect(scene, ray0, raydirs[i], &isects[i]);
+#endif
+}
+
 scene_object_t so_chain_impl(scene_object_t first, ...)
 {
     zarray_t *objs = zarray_create(sizeof(scene_object_t));
@@ -220,6 +598,13 @@ static void plane_intersect(drawable_t *obj, const double ray0[3],
     }
 }
 
+static void plane_get_bounds(drawable_t *obj, double min[3], double max[3])
+{
+    struct plane *plane = obj->impl;
+    doubles_copy((double[]){plane->xy0[0], plane->xy0[1], 0}, min, 3);
+    doubles_copy((double[]){plane->xy1[0], plane->xy1[1], 0}, max, 3);
+}
+
 static void plane_destroy(drawable_t *obj)
 {
     //printf("plane free: %p\n", obj);
@@ -243,6 +628,7 @@ scene_object_t so_plane(surface_t *surface_top, surface_t *surface_bottom,
     d->impl = plane;
     d->intersect = plane_intersect;
     d->destroy = plane_destroy;
+    d->get_bounds = plane_get_bounds;
 
     scene_object_t so = {
         .type = TYPE_DRAWABLE,
@@ -295,6 +681,14 @@ static void sphere_intersect(drawable_t *obj, const double ray0[3],
     }
 }
 
+static void sphere_get_bounds(drawable_t *obj, double min[3], double max[3])
+{
+    struct sphere *sphere = obj->impl;
+    double r = sphere->radius;
+    doubles_copy((double[]){-r, -r, -r}, min, 3);
+    doubles_copy((double[]){r, r, r}, max, 3);
+}
+
 static void sphere_destroy(drawable_t *obj)
 {
     //printf("sphere free: %p\n", obj);
@@ -314,6 +708,7 @@ scene_object_t so_sphere(surface_t *surface, double radius)
     d->impl = sphere;
     d->intersect = sphere_intersect;
     d->destroy = sphere_destroy;
+    d->get_bounds = sphere_get_bounds;
 
     scene_object_t so = {
         .type = TYPE_DRAWABLE,
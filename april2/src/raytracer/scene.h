@@ -22,6 +22,8 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <stdint.h>
+
 #include "common/doubles.h"
 #include "common/zarray.h"
 
@@ -32,6 +34,7 @@ typedef struct scene_object scene_object_t;
 typedef struct intersection intersection_t;
 typedef struct drawable drawable_t;
 typedef struct light light_t;
+typedef struct scene_bvh_node scene_bvh_node_t;
 
 struct scene {
     float bgcolor[3];
@@ -42,6 +45,22 @@ struct scene {
 
     zarray_t *objects;   // array of drawable_t*
     zarray_t *lights;    // array of light_t*
+
+    // Bounding volume hierarchy over the objects with finite bounds,
+    // built by scene_build() and invalidated by scene_add().
+    int bvh_valid;
+    int nnodes;
+    scene_bvh_node_t *nodes;
+    drawable_t **bvh_objects;  // in leaf order
+    zarray_t *unbounded;       // drawable_t* tested by every ray
+};
+
+// World-frame box, rounded outwards to float. Interior nodes have
+// count == 0 and children at this + 1 and 'start'; leaves hold
+// bvh_objects[start, start + count).
+struct scene_bvh_node {
+    float min[3], max[3];
+    int32_t start, count;
 };
 
 // Essentially a void pointer tagged with a type. small enough to pass by value
@@ -67,6 +86,11 @@ struct drawable {
                       const double raydir[3], intersection_t *isect);
     void (*destroy)(drawable_t *obj);
 
+    // Box containing the object, in the object coordinate frame. May
+    // be NULL (or report non-finite bounds), in which case the object
+    // is tested against every ray.
+    void (*get_bounds)(drawable_t *obj, double min[3], double max[3]);
+
     double T[16];     // object to world
     double Tinv[16];  // world to object
     void *impl;
@@ -84,6 +108,21 @@ void scene_add(scene_t *scene, scene_object_t so);
 
 void scene_destroy(scene_t *s);
 
+// (Re)builds the BVH if objects were added since the last build.
+void scene_build(scene_t *scene);
+
+// Finds the closest intersection along the ray (world frame, unit
+// raydir), updating isect if it is closer than isect->dist. Requires
+// scene_build().
+void scene_intersect(const scene_t *scene, const double ray0[3],
+                     const double raydir[3], intersection_t *isect);
+
+// As scene_intersect for four rays sharing an origin, such as the
+// primary rays of a 2x2 pixel block. With SSE2, the rays traverse the
+// BVH together, testing each box against all four at once.
+void scene_intersect4(const scene_t *scene, const double ray0[3],
+                      const double raydirs[4][3], intersection_t isects[4]);
+
 // Below, different types of scene objects are defined
 
 // NOTE: scene_object_t's should not be reused
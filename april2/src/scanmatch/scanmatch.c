@@ -28,6 +28,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/zhash.h"
 #include "common/zarray.h"
 #include "common/math_util.h"
+#include "common/instrument.h"
 
 #include <stdint.h>
 #include <math.h>
@@ -46,7 +47,7 @@ struct int32x2 {
 #define TNAME int32x2_hash
 #define TKEYTYPE int32x2_t
 #define TVALTYPE uint32_t
-#define TKEYHASH(pk) ((uint32_t) ((pk)->x^(pk)->y))
+#define TKEYHASH(pk) ((uint32_t) hash_u32x2((pk)->x, (pk)->y))
 #define TKEYEQUAL(pka, pkb) ((pka)->x == (pkb)->x && (pka)->y == (pkb)->y)
 #include "common/thash_impl.h"
 #undef TKEYEQUAL
@@ -477,6 +478,244 @@ sm_model_data_t *sm_model_data_create(image_u8_t *im,
     return model_data;
 }
 
+//////////////////////////////////////////////////////////////////
+// model cache
+//
+// The pyramid is computed over a global map, in square tiles of
+// SM_TILE_SIZE cells at every level. Cell u at level L (D = 2^L)
+// holds the max of global pixels [D*u, D*u + 2D - 2], which is the
+// max of cells 2u .. 2u+2 at level L-1; thus the same cells that
+// sm_model_data_create would produce for a model containing them.
+
+#define SM_TILE_BITS 6
+#define SM_TILE_SIZE (1 << SM_TILE_BITS)
+
+static inline uint64_t sm_tile_key(int32_t tx, int32_t ty)
+{
+    return (((uint64_t) (uint32_t) tx) << 32) | ((uint32_t) ty);
+}
+
+static inline int32_t floorDiv2(int32_t v)
+{
+    return v >> 1;
+}
+
+sm_model_cache_t *sm_model_cache_create(float meters_per_pixel, int nresolutions)
+{
+    sm_model_cache_t *cache = calloc(1, sizeof(sm_model_cache_t));
+    cache->meters_per_pixel = meters_per_pixel;
+    cache->nresolutions = nresolutions;
+    cache->tiles = calloc(nresolutions, sizeof(zhash_t*));
+
+    for (int level = 0; level < nresolutions; level++)
+        cache->tiles[level] = zhash_create(sizeof(uint64_t), sizeof(uint8_t*),
+                                           zhash_uint64_hash, zhash_uint64_equals);
+
+    return cache;
+}
+
+void sm_model_cache_destroy(sm_model_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    for (int level = 0; level < cache->nresolutions; level++) {
+        zhash_vmap_values(cache->tiles[level], free);
+        zhash_destroy(cache->tiles[level]);
+    }
+
+    free(cache->tiles);
+    free(cache);
+}
+
+// returns the cells of tile (tx, ty) at 'level', or NULL if they are
+// all zero. Tiles above level 0 are computed on first use.
+static const uint8_t *sm_model_cache_tile(sm_model_cache_t *cache, int level, int32_t tx, int32_t ty)
+{
+    uint64_t key = sm_tile_key(tx, ty);
+    uint8_t *data = NULL;
+
+    if (zhash_get(cache->tiles[level], &key, &data) || level == 0)
+        return data;
+
+    // cells [T*tx, T*tx + T) need the children [2T*tx, 2T*tx + 2T],
+    // which span up to 3x3 tiles at the level below.
+    const int T = SM_TILE_SIZE, S = 2*SM_TILE_SIZE + 1;
+    const uint8_t *child[3][3];
+    int any = 0;
+
+    for (int j = 0; j < 3; j++) {
+        for (int i = 0; i < 3; i++) {
+            child[j][i] = sm_model_cache_tile(cache, level - 1, 2*tx + i, 2*ty + j);
+            any |= (child[j][i] != NULL);
+        }
+    }
+
+    if (any) {
+        uint8_t src[S*S];
+
+        for (int y = 0; y < S; y++) {
+            for (int x = 0; x < S; x++) {
+                const uint8_t *c = child[y >> SM_TILE_BITS][x >> SM_TILE_BITS];
+                src[y*S + x] = c ? c[(y & (T-1))*T + (x & (T-1))] : 0;
+            }
+        }
+
+        // separable 3x3 max with stride 2
+        uint8_t rows[S*T];
+        for (int y = 0; y < S; y++) {
+            for (int x = 0; x < T; x++) {
+                const uint8_t *p = &src[y*S + 2*x];
+                uint8_t v = max(p[0], p[1]);
+                rows[y*T + x] = max(v, p[2]);
+            }
+        }
+
+        data = malloc(T*T);
+        int nonzero = 0;
+
+        for (int y = 0; y < T; y++) {
+            for (int x = 0; x < T; x++) {
+                uint8_t a = rows[(2*y + 0)*T + x], b = rows[(2*y + 1)*T + x], c = rows[(2*y + 2)*T + x];
+                uint8_t v = max(a, b);
+                v = max(v, c);
+                data[y*T + x] = v;
+                nonzero |= v;
+            }
+        }
+
+        if (!nonzero) {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    zhash_put(cache->tiles[level], &key, &data, NULL, NULL);
+    return data;
+}
+
+// drop every tile above level 0 that was computed from level 0 tile
+// (tx, ty).
+static void sm_model_cache_invalidate(sm_model_cache_t *cache, int32_t tx, int32_t ty)
+{
+    int32_t tx0 = tx, tx1 = tx, ty0 = ty, ty1 = ty;
+
+    for (int level = 1; level < cache->nresolutions; level++) {
+        // parent t depends on children 2t .. 2t+2
+        tx0 = floorDiv2(tx0 - 2);
+        ty0 = floorDiv2(ty0 - 2);
+        tx1 = floorDiv2(tx1);
+        ty1 = floorDiv2(ty1);
+
+        for (int32_t y = ty0; y <= ty1; y++) {
+            for (int32_t x = tx0; x <= tx1; x++) {
+                uint64_t key = sm_tile_key(x, y);
+                uint8_t *data;
+                if (zhash_remove(cache->tiles[level], &key, NULL, &data))
+                    free(data);
+            }
+        }
+    }
+}
+
+void sm_model_cache_update(sm_model_cache_t *cache, const image_u8_t *im, int32_t x0, int32_t y0)
+{
+    const int T = SM_TILE_SIZE;
+
+    for (int32_t ty = y0 >> SM_TILE_BITS; ty <= (y0 + im->height - 1) >> SM_TILE_BITS; ty++) {
+        for (int32_t tx = x0 >> SM_TILE_BITS; tx <= (x0 + im->width - 1) >> SM_TILE_BITS; tx++) {
+
+            // the part of the image covered by this tile
+            int32_t gx0 = max(x0, tx*T), gx1 = min(x0 + im->width, tx*T + T);
+            int32_t gy0 = max(y0, ty*T), gy1 = min(y0 + im->height, ty*T + T);
+
+            uint64_t key = sm_tile_key(tx, ty);
+            uint8_t *data = NULL;
+            zhash_get(cache->tiles[0], &key, &data);
+
+            int changed = 0;
+            for (int32_t gy = gy0; gy < gy1 && !changed; gy++) {
+                const uint8_t *in = &im->buf[(gy - y0)*im->stride];
+                for (int32_t gx = gx0; gx < gx1; gx++) {
+                    uint8_t old = data ? data[(gy - ty*T)*T + gx - tx*T] : 0;
+                    if (in[gx - x0] != old) {
+                        changed = 1;
+                        break;
+                    }
+                }
+            }
+
+            if (!changed)
+                continue;
+
+            if (!data) {
+                data = calloc(1, T*T);
+                zhash_put(cache->tiles[0], &key, &data, NULL, NULL);
+            }
+
+            for (int32_t gy = gy0; gy < gy1; gy++)
+                memcpy(&data[(gy - ty*T)*T + gx0 - tx*T], &im->buf[(gy - y0)*im->stride + gx0 - x0], gx1 - gx0);
+
+            sm_model_cache_invalidate(cache, tx, ty);
+        }
+    }
+}
+
+// fill 'out' with the cells starting at (u0, v0) of 'level'.
+static void sm_model_cache_copy(sm_model_cache_t *cache, int level, int32_t u0, int32_t v0, image_u8_t *out)
+{
+    const int T = SM_TILE_SIZE;
+
+    for (int32_t ty = v0 >> SM_TILE_BITS; ty <= (v0 + out->height - 1) >> SM_TILE_BITS; ty++) {
+        for (int32_t tx = u0 >> SM_TILE_BITS; tx <= (u0 + out->width - 1) >> SM_TILE_BITS; tx++) {
+            const uint8_t *data = sm_model_cache_tile(cache, level, tx, ty);
+
+            int32_t gx0 = max(u0, tx*T), gx1 = min(u0 + out->width, tx*T + T);
+            int32_t gy0 = max(v0, ty*T), gy1 = min(v0 + out->height, ty*T + T);
+
+            for (int32_t gy = gy0; gy < gy1; gy++) {
+                uint8_t *dst = &out->buf[(gy - v0)*out->stride + gx0 - u0];
+                if (data)
+                    memcpy(dst, &data[(gy - ty*T)*T + gx0 - tx*T], gx1 - gx0);
+                else
+                    memset(dst, 0, gx1 - gx0);
+            }
+        }
+    }
+}
+
+sm_model_data_t *sm_model_cache_get(sm_model_cache_t *cache,
+                                    int32_t x0, int32_t y0, int32_t width, int32_t height,
+                                    int nresolutions)
+{
+    assert(nresolutions <= cache->nresolutions);
+
+    sm_model_data_t *model_data = calloc(1, sizeof(sm_model_data_t));
+    model_data->meters_per_pixel = cache->meters_per_pixel;
+    model_data->models = zarray_create(sizeof(sm_model_t*));
+
+    for (int level = 0; level < nresolutions; level++) {
+        int D = 1<<level;
+
+        // same geometry as sm_model_data_create
+        sm_model_t *model = calloc(1, sizeof(sm_model_t));
+        if (level == 0) {
+            model->x0 = x0;
+            model->y0 = y0;
+            model->im = image_u8_create(width, height);
+        } else {
+            model->x0 = D*floorDiv(x0, D) - 2*D;
+            model->y0 = D*floorDiv(y0, D) - 2*D;
+            model->im = image_u8_create(width / D + 4, height / D + 4);
+        }
+
+        sm_model_cache_copy(cache, level, model->x0 / D, model->y0 / D, model->im);
+        zarray_add(model_data->models, &model);
+    }
+
+    return model_data;
+}
+
 // it is an error to destroy a points_data object if there are still
 // entries referring to it in the heap.
 void sm_points_data_destroy(sm_points_data_t *points_data)
@@ -913,7 +1152,7 @@ void sm_search_record_destroy(sm_search_record_t *r)
 // we correct for the bias introduced by point cloud decimation, but assume
 // that the model is unbiased. If your model is biased, you should correct
 // the resulting transform.
-sm_result_t *sm_search_run(sm_search_t *search)
+static sm_result_t *search_run(sm_search_t *search)
 {
     int debug = 0;
     int trace = 0;
@@ -1281,10 +1520,19 @@ static double eval(sm_points_data_t *points_data, sm_model_data_t *model_data, d
     return score;
 }
 
+sm_result_t *sm_search_run(sm_search_t *search)
+{
+    INSTRUMENT_SPAN_BEGIN(ns);
+    sm_result_t *result = search_run(search);
+    INSTRUMENT_SPAN_END("scanmatch.search", ns);
+    return result;
+}
+
 sm_hillclimb_result_t *sm_hillclimb(sm_points_data_t *points_data, sm_model_data_t *model_data, double _xyt0[3],
                                     sm_hillclimb_params_t *params,
                                     float scale, float *mean, float *inf)
 {
+    INSTRUMENT_SPAN_BEGIN(ns);
     sm_hillclimb_result_t *result = calloc(1, sizeof(sm_hillclimb_result_t));
 
     double xyt0[3];
@@ -1357,6 +1605,8 @@ sm_hillclimb_result_t *sm_hillclimb(sm_points_data_t *points_data, sm_model_data
     result->score = best_score;
     result->penalty = best_penalty;
 
+    INSTRUMENT_SPAN_END("scanmatch.hillclimb", ns);
+
 //    printf("****** %f\n", result->score);
 //    assert(result->score >= 0);
     return result;
@@ -27,6 +27,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/zmaxheap.h"
 #include "common/zarray.h"
 #include "common/zhash.h"
+#include "common/hash_util.h"
 #include "common/image_u8.h"
 
 
@@ -61,17 +62,19 @@ struct sm_points_record
     int32_t level;
 };
 
-static uint32_t __attribute__ ((noinline)) sm_points_hasher(struct sm_points_record *rec)
+// hashes the bits of the floats, so the result does not depend on
+// how the compiler evaluates them.
+static inline uint64_t sm_points_hasher(const struct sm_points_record *rec)
 {
-    return rec->level*3274915.6717346 + rec->rad*237523.219871 + rec->meters_per_pixel*597111.68971;
+    uint64_t h = hash_u64(rec->level);
+    h = hash_combine(h, hash_float(rec->rad));
+    return hash_combine(h, hash_float(rec->meters_per_pixel));
 }
 
 #define TNAME sm_points_record_hash
 #define TKEYTYPE struct sm_points_record
 #define TVALTYPE zarray_t*
-#define TKEYHASH(pk) sm_points_hasher(pk)
-//#define TKEYHASH(pk) ((uint32_t) ((pk)->level*32749 + ((pk)->rad * 237) + ((pk)->meters_per_pixel*511)))
-//#define TKEYEQUAL(pka, pkb) (!memcmp(pka, pkb, sizeof(struct sm_points_record)))
+#define TKEYHASH(pk) ((uint32_t) sm_points_hasher(pk))
 #define TKEYEQUAL(pka, pkb) ((pka)->level==(pkb)->level && (pka)->rad == (pkb)->rad && (pka)->meters_per_pixel == (pkb)->meters_per_pixel)
 #include "common/thash_impl.h"
 #undef TKEYEQUAL
@@ -243,6 +246,38 @@ sm_model_data_t *sm_model_data_create_reference(image_u8_t *im,
 // it is an error to free a model that still belongs to search queries.
 void sm_model_data_destroy(sm_model_data_t *model_data);
 
+// A cache of model pyramids over a global map, stored in tiles at
+// every resolution. Models for successive windows onto the same map
+// are assembled from the cached tiles; only tiles whose map pixels
+// change are recomputed.
+typedef struct sm_model_cache sm_model_cache_t;
+struct sm_model_cache
+{
+    float meters_per_pixel;
+    int nresolutions;
+
+    // one per level: uint64_t tile key => uint8_t* (NULL if all
+    // zero). Level 0 holds the map itself.
+    zhash_t **tiles;
+};
+
+sm_model_cache_t *sm_model_cache_create(float meters_per_pixel, int nresolutions);
+void sm_model_cache_destroy(sm_model_cache_t *cache);
+
+// write the map pixels covered by 'im', whose pixel 0 is at (x0, y0).
+// Pixels never written are zero. Tiles whose contents are unchanged
+// keep their cached pyramids.
+void sm_model_cache_update(sm_model_cache_t *cache, const image_u8_t *im, int32_t x0, int32_t y0);
+
+// returns a new model for the width x height window of the map at
+// (x0, y0), equivalent to sm_model_data_create on that window except
+// that the lower-resolution levels also include map pixels just
+// outside the window. (This only loosens their bounds.) Free with
+// sm_model_data_destroy.
+sm_model_data_t *sm_model_cache_get(sm_model_cache_t *cache,
+                                    int32_t x0, int32_t y0, int32_t width, int32_t height,
+                                    int nresolutions);
+
 
 sm_search_t *sm_search_create();
 
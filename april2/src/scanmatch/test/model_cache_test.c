@@ -0,0 +1,123 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common/image_u8.h"
+
+#include "../scanmatch.h"
+
+// Checks models assembled by sm_model_cache against the pyramid that
+// sm_model_data_create builds for the whole map, including after
+// parts of the map change.
+
+#define NRES 6
+
+static int model_value(sm_model_data_t *md, int level, int32_t u, int32_t v)
+{
+    sm_model_t *model;
+    zarray_get(md->models, level, &model);
+
+    int D = 1 << level;
+    int x = u - model->x0 / D, y = v - model->y0 / D;
+    if (x < 0 || y < 0 || x >= model->im->width || y >= model->im->height)
+        return 0;
+    return model->im->buf[y*model->im->stride + x];
+}
+
+static void check(sm_model_cache_t *cache, image_u8_t *map, int32_t mx0, int32_t my0)
+{
+    sm_model_data_t *full = sm_model_data_create(image_u8_copy(map), mx0, my0, 0.1, NRES);
+
+    for (int trial = 0; trial < 20; trial++) {
+        int32_t x0 = mx0 - 40 + random() % (map->width + 40);
+        int32_t y0 = my0 - 40 + random() % (map->height + 40);
+        int32_t width = 1 + random() % 300, height = 1 + random() % 300;
+
+        sm_model_data_t *md = sm_model_cache_get(cache, x0, y0, width, height, NRES);
+        assert(zarray_size(md->models) == NRES);
+
+        for (int level = 0; level < NRES; level++) {
+            sm_model_t *model;
+            zarray_get(md->models, level, &model);
+
+            int D = 1 << level;
+            for (int y = 0; y < model->im->height; y++) {
+                for (int x = 0; x < model->im->width; x++) {
+                    int32_t u = model->x0 / D + x, v = model->y0 / D + y;
+                    if (model->im->buf[y*model->im->stride + x] != model_value(full, level, u, v)) {
+                        printf("level %d cell (%d, %d) mismatch\n", level, u, v);
+                        exit(1);
+                    }
+                }
+            }
+        }
+
+        sm_model_data_destroy(md);
+    }
+
+    sm_model_data_destroy(full);
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(0);
+
+    int32_t mx0 = -317, my0 = 95;
+    image_u8_t *map = image_u8_create(500, 400);
+    for (int y = 0; y < map->height; y++)
+        for (int x = 0; x < map->width; x++)
+            map->buf[y*map->stride + x] = (random() % 40 == 0) ? (random() & 0xff) : 0;
+
+    sm_model_cache_t *cache = sm_model_cache_create(0.1, NRES);
+    sm_model_cache_update(cache, map, mx0, my0);
+    check(cache, map, mx0, my0);
+
+    for (int iter = 0; iter < 10; iter++) {
+        // rewrite a patch of the map, partly with the same contents
+        int w = 1 + random() % 100, h = 1 + random() % 100;
+        int px = random() % (map->width - w), py = random() % (map->height - h);
+        image_u8_t *patch = image_u8_create(w, h);
+
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                uint8_t v = map->buf[(py + y)*map->stride + px + x];
+                if (random() % 20 == 0)
+                    v = random() & 0xff;
+                patch->buf[y*patch->stride + x] = v;
+                map->buf[(py + y)*map->stride + px + x] = v;
+            }
+        }
+
+        sm_model_cache_update(cache, patch, mx0 + px, my0 + py);
+        image_u8_destroy(patch);
+
+        check(cache, map, mx0, my0);
+    }
+
+    sm_model_cache_destroy(cache);
+    image_u8_destroy(map);
+    printf("ok\n");
+    return 0;
+}
@@ -5,10 +5,10 @@ CFLAGS := $(CFLAGS_STD) $(CFLAGS_VX) $(CFLAGS_LCM) $(CFLAGS_GRAPH) $(CFLAGS_APRI
 LDFLAGS := $(LDFLAGS_STD) $(LDFLAGS_VX) $(LDFLAGS_LCM) $(LDFLAGS_GRAPH) $(LDFLAGS_APRIL_LCMTYPES)
 DEPS := $(DEPS_STD) $(DEPS_VX) $(DEPS_LCM) $(DEPS_GRAPH) $(DEPS_APRIL_LCMTYPES)
 
-all: $(BIN_PATH)/sim-anim $(BIN_PATH)/sim-viewer $(BIN_PATH)/sim-editor $(LIB_PATH)/libsim.a
+all: $(BIN_PATH)/sim-anim $(BIN_PATH)/sim-viewer $(BIN_PATH)/sim-editor $(BIN_PATH)/sim-velodyne $(LIB_PATH)/libsim.a
 	@true
 
-$(LIB_PATH)/libsim.a: sim.o sim_triray.o
+$(LIB_PATH)/libsim.a: sim.o sim_triray.o sim_bvh.o sim_velodyne.o
 	@$(AR) rc $@ $^
 
 $(BIN_PATH)/sim-anim: anim.o $(DEPS)
@@ -20,5 +20,8 @@ $(BIN_PATH)/sim-viewer: viewer.o $(DEPS)
 $(BIN_PATH)/sim-editor: sim_editor.o sim.o sim_triray.o  $(DEPS)
 	@$(CC) -o $@ $^ $(LDFLAGS)
 
+$(BIN_PATH)/sim-velodyne: velodyne.o sim.o sim_triray.o sim_bvh.o sim_velodyne.o $(DEPS) $(DEPS_APRIL_VELODYNE)
+	@$(CC) -o $@ $^ $(LDFLAGS)
+
 clean:
 	@rm -rf *.o
@@ -1,10 +1,10 @@
 export CFLAGS_SIM = $(CFLAGS_COMMON)
-export LDFLAGS_SIM = $(LIB_PATH)/libsim.a
+export LDFLAGS_SIM = $(LIB_PATH)/libsim.a $(LDFLAGS_APRIL_VELODYNE)
 export DEPS_SIM = $(LIB_PATH)/libsim.a
 
 .phony: sim sim_clean
 
-sim: common vx april_lcmtypes graph
+sim: common vx april_lcmtypes graph velodyne
 
 sim:
 	@echo $@
@@ -18,3 +18,5 @@ all: sim
 
 
 clean: sim_clean
+
+include $(APRIL_PATH)/src/sim/test/Rules.mk
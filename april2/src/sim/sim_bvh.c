@@ -0,0 +1,535 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "sim_bvh.h"
+#include "common/doubles.h"
+#include "common/zarray.h"
+#include "common/math_util.h"
+
+#define LEAF_SIZE 4      // always make a leaf at or below this many triangles
+#define MAX_LEAF_SIZE 16 // never make a leaf above this many
+#define NBINS 16         // SAH candidate splits per axis
+#define STACK_SIZE 128
+
+// Traversal keeps at most one pending sibling per level plus the two
+// children being pushed, so a tree no deeper than this can never
+// overflow the traversal stack. The build makes a leaf (of any size)
+// rather than go deeper.
+#define MAX_DEPTH (STACK_SIZE - 1)
+
+#define BATCH_TASK_RAYS 1024
+
+struct build_tri
+{
+    float min[3], max[3], c[3];
+};
+
+static void box_empty(float min[3], float max[3])
+{
+    for (int i = 0; i < 3; i++) {
+        min[i] = FLT_MAX;
+        max[i] = -FLT_MAX;
+    }
+}
+
+static void box_add(float min[3], float max[3], const float bmin[3], const float bmax[3])
+{
+    for (int i = 0; i < 3; i++) {
+        min[i] = fminf(min[i], bmin[i]);
+        max[i] = fmaxf(max[i], bmax[i]);
+    }
+}
+
+static float box_area(const float min[3], const float max[3])
+{
+    float d[3];
+    for (int i = 0; i < 3; i++)
+        d[i] = fmaxf(0, max[i] - min[i]);
+    return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+static void tri_box(const float *v, float min[3], float max[3])
+{
+    box_empty(min, max);
+    for (int j = 0; j < 3; j++)
+        box_add(min, max, &v[3*j], &v[3*j]);
+}
+
+// recursively build nodes for triangles idx[start, start+count) at
+// the given depth. Returns the index of the new node.
+static int build(zarray_t *nodes, const struct build_tri *bt, int32_t *idx, int start, int count,
+                 int depth)
+{
+    struct sim_bvh_node node;
+    float cmin[3], cmax[3];
+    box_empty(node.min, node.max);
+    box_empty(cmin, cmax);
+
+    for (int i = start; i < start + count; i++) {
+        box_add(node.min, node.max, bt[idx[i]].min, bt[idx[i]].max);
+        box_add(cmin, cmax, bt[idx[i]].c, bt[idx[i]].c);
+    }
+
+    int nodeidx = zarray_size(nodes);
+    node.start = start;
+    node.count = count;
+    zarray_add(nodes, &node);
+
+    if (count <= LEAF_SIZE || depth >= MAX_DEPTH)
+        return nodeidx;
+
+    // binned SAH over the centroids, on all three axes
+    int best_axis = -1, best_split = 0;
+    float best_cost = count * box_area(node.min, node.max);
+
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0)
+            continue;
+
+        int bin_count[NBINS] = { 0 };
+        float bin_min[NBINS][3], bin_max[NBINS][3];
+        for (int b = 0; b < NBINS; b++)
+            box_empty(bin_min[b], bin_max[b]);
+
+        for (int i = start; i < start + count; i++) {
+            const struct build_tri *t = &bt[idx[i]];
+            int b = imin(NBINS - 1, (int) (NBINS * (t->c[axis] - cmin[axis]) / extent));
+            bin_count[b]++;
+            box_add(bin_min[b], bin_max[b], t->min, t->max);
+        }
+
+        // area and count to the right of each split
+        float right_area[NBINS];
+        int right_count[NBINS];
+        float rmin[3], rmax[3];
+        box_empty(rmin, rmax);
+        int n = 0;
+        for (int b = NBINS - 1; b > 0; b--) {
+            box_add(rmin, rmax, bin_min[b], bin_max[b]);
+            n += bin_count[b];
+            right_area[b] = box_area(rmin, rmax);
+            right_count[b] = n;
+        }
+
+        float lmin[3], lmax[3];
+        box_empty(lmin, lmax);
+        n = 0;
+        for (int b = 1; b < NBINS; b++) {
+            box_add(lmin, lmax, bin_min[b-1], bin_max[b-1]);
+            n += bin_count[b-1];
+            if (n == 0 || right_count[b] == 0)
+                continue;
+
+            // one traversal step costs about as much as a triangle test
+            float cost = box_area(node.min, node.max) +
+                n * box_area(lmin, lmax) + right_count[b] * right_area[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis >= 0) {
+        float extent = cmax[best_axis] - cmin[best_axis];
+        int lo = start, hi = start + count - 1;
+        while (lo <= hi) {
+            const struct build_tri *t = &bt[idx[lo]];
+            int b = imin(NBINS - 1, (int) (NBINS * (t->c[best_axis] - cmin[best_axis]) / extent));
+            if (b < best_split) {
+                lo++;
+            } else {
+                int32_t tmp = idx[lo];
+                idx[lo] = idx[hi];
+                idx[hi] = tmp;
+                hi--;
+            }
+        }
+        mid = lo;
+    } else if (count > MAX_LEAF_SIZE) {
+        // no useful split (e.g., coincident centroids); split in half
+        mid = start + count / 2;
+    } else {
+        return nodeidx;
+    }
+
+    build(nodes, bt, idx, start, mid - start, depth + 1);
+    int right = build(nodes, bt, idx, mid, start + count - mid, depth + 1);
+
+    struct sim_bvh_node *n;
+    zarray_get_volatile(nodes, nodeidx, &n);
+    n->start = right;
+    n->count = 0;
+
+    return nodeidx;
+}
+
+static void update_world(sim_bvh_t *bvh, const uint8_t *moved)
+{
+    for (int i = 0; i < bvh->ntris; i++) {
+        int obj = bvh->tri_object[i];
+        if (moved && !moved[obj])
+            continue;
+
+        const double *T = &bvh->object_T[16*obj];
+        for (int j = 0; j < 3; j++) {
+            double local[3] = { bvh->local[9*i + 3*j + 0],
+                                bvh->local[9*i + 3*j + 1],
+                                bvh->local[9*i + 3*j + 2] };
+            double world[3];
+            doubles_mat44_transform_xyz(T, local, world);
+            for (int k = 0; k < 3; k++)
+                bvh->world[9*i + 3*j + k] = world[k];
+        }
+    }
+}
+
+// recompute every node's box; children always follow their parent.
+static void refit_nodes(sim_bvh_t *bvh)
+{
+    for (int i = bvh->nnodes - 1; i >= 0; i--) {
+        struct sim_bvh_node *node = &bvh->nodes[i];
+        box_empty(node->min, node->max);
+
+        if (node->count) {
+            for (int t = node->start; t < node->start + node->count; t++) {
+                float min[3], max[3];
+                tri_box(&bvh->world[9*t], min, max);
+                box_add(node->min, node->max, min, max);
+            }
+        } else {
+            box_add(node->min, node->max, bvh->nodes[i+1].min, bvh->nodes[i+1].max);
+            box_add(node->min, node->max, bvh->nodes[node->start].min, bvh->nodes[node->start].max);
+        }
+    }
+}
+
+sim_bvh_t *sim_bvh_create(sim_world_t *sw, int nthreads)
+{
+    sim_bvh_t *bvh = calloc(1, sizeof(sim_bvh_t));
+    bvh->sw = sw;
+    bvh->others = zarray_create(sizeof(sim_object_t*));
+    if (nthreads > 1)
+        bvh->wp = workerpool_create(nthreads);
+
+    zarray_t *objects = zarray_create(sizeof(sim_object_t*));
+    zarray_t *tris = zarray_create(sizeof(float[9]));
+    zarray_t *tri_object = zarray_create(sizeof(int32_t));
+
+    for (int i = 0; i < zarray_size(sw->objects); i++) {
+        sim_object_t *so;
+        zarray_get(sw->objects, i, &so);
+
+        if (!so->triray) {
+            zarray_add(bvh->others, &so);
+            continue;
+        }
+
+        int32_t objidx = zarray_size(objects);
+        zarray_add(objects, &so);
+
+        int n0 = zarray_size(tris);
+        sim_triray_get_triangles(so->triray, tris);
+        for (int j = n0; j < zarray_size(tris); j++)
+            zarray_add(tri_object, &objidx);
+    }
+
+    bvh->nobjects = zarray_size(objects);
+    bvh->objects = malloc(sizeof(sim_object_t*) * (bvh->nobjects + 1));
+    bvh->object_T = malloc(sizeof(double) * 16 * (bvh->nobjects + 1));
+    for (int i = 0; i < bvh->nobjects; i++) {
+        zarray_get(objects, i, &bvh->objects[i]);
+        memcpy(&bvh->object_T[16*i], bvh->objects[i]->T, 16 * sizeof(double));
+    }
+
+    // build over world-space triangles in their original order, then
+    // store them in tree order.
+    int ntris = zarray_size(tris);
+    bvh->ntris = ntris;
+    bvh->local = malloc(sizeof(float) * 9 * (ntris + 1));
+    bvh->world = malloc(sizeof(float) * 9 * (ntris + 1));
+    bvh->tri_object = malloc(sizeof(int32_t) * (ntris + 1));
+    memcpy(bvh->local, tris->data, sizeof(float) * 9 * ntris);
+    memcpy(bvh->tri_object, tri_object->data, sizeof(int32_t) * ntris);
+    update_world(bvh, NULL);
+
+    struct build_tri *bt = malloc(sizeof(struct build_tri) * (ntris + 1));
+    int32_t *idx = malloc(sizeof(int32_t) * (ntris + 1));
+    for (int i = 0; i < ntris; i++) {
+        tri_box(&bvh->world[9*i], bt[i].min, bt[i].max);
+        for (int j = 0; j < 3; j++)
+            bt[i].c[j] = (bt[i].min[j] + bt[i].max[j]) / 2;
+        idx[i] = i;
+    }
+
+    zarray_t *nodes = zarray_create(sizeof(struct sim_bvh_node));
+    if (ntris > 0)
+        build(nodes, bt, idx, 0, ntris, 0);
+
+    bvh->nnodes = zarray_size(nodes);
+    bvh->nodes = malloc(sizeof(struct sim_bvh_node) * (bvh->nnodes + 1));
+    memcpy(bvh->nodes, nodes->data, sizeof(struct sim_bvh_node) * bvh->nnodes);
+
+    for (int i = 0; i < ntris; i++) {
+        memcpy(&bvh->local[9*i], tris->data + sizeof(float[9]) * idx[i], sizeof(float[9]));
+        zarray_get(tri_object, idx[i], &bvh->tri_object[i]);
+    }
+    update_world(bvh, NULL);
+
+    free(bt);
+    free(idx);
+    zarray_destroy(nodes);
+    zarray_destroy(objects);
+    zarray_destroy(tris);
+    zarray_destroy(tri_object);
+
+    return bvh;
+}
+
+void sim_bvh_destroy(sim_bvh_t *bvh)
+{
+    if (!bvh)
+        return;
+
+    if (bvh->wp)
+        workerpool_destroy(bvh->wp);
+    zarray_destroy(bvh->others);
+    free(bvh->objects);
+    free(bvh->object_T);
+    free(bvh->local);
+    free(bvh->world);
+    free(bvh->tri_object);
+    free(bvh->nodes);
+    free(bvh);
+}
+
+int sim_bvh_refit(sim_bvh_t *bvh)
+{
+    uint8_t moved[bvh->nobjects + 1];
+    int nmoved = 0;
+
+    for (int i = 0; i < bvh->nobjects; i++) {
+        moved[i] = memcmp(&bvh->object_T[16*i], bvh->objects[i]->T, 16 * sizeof(double)) != 0;
+        if (moved[i]) {
+            memcpy(&bvh->object_T[16*i], bvh->objects[i]->T, 16 * sizeof(double));
+            nmoved++;
+        }
+    }
+
+    if (nmoved) {
+        update_world(bvh, moved);
+        refit_nodes(bvh);
+    }
+
+    return nmoved;
+}
+
+// Moller-Trumbore; returns the distance along (unit) d, or max.
+static inline double tri_ray_distance(const float *v, const double p[3], const double d[3], double max)
+{
+    double e1[3], e2[3], t[3];
+    for (int i = 0; i < 3; i++) {
+        e1[i] = v[3 + i] - v[i];
+        e2[i] = v[6 + i] - v[i];
+        t[i] = p[i] - v[i];
+    }
+
+    double pv[3];
+    doubles_cross_product(d, e2, pv);
+    double det = doubles_dot(e1, pv, 3);
+    if (fabs(det) < 1E-15)
+        return max;
+
+    double inv = 1.0 / det;
+    double u = doubles_dot(t, pv, 3) * inv;
+    if (u < 0 || u > 1)
+        return max;
+
+    double qv[3];
+    doubles_cross_product(t, e1, qv);
+    double w = doubles_dot(d, qv, 3) * inv;
+    if (w < 0 || u + w > 1)
+        return max;
+
+    double lambda = doubles_dot(e2, qv, 3) * inv;
+    if (lambda < 0 || lambda > max)
+        return max;
+
+    return lambda;
+}
+
+// distance at which the ray enters the node's box, or HUGE_VAL if it
+// misses it within [0, max].
+static inline double box_entry(const struct sim_bvh_node *node, const double p[3], const double inv[3], double max)
+{
+    double t0 = 0, t1 = max;
+    for (int i = 0; i < 3; i++) {
+        double a = (node->min[i] - p[i]) * inv[i];
+        double b = (node->max[i] - p[i]) * inv[i];
+        t0 = fmax(t0, fmin(a, b));
+        t1 = fmin(t1, fmax(a, b));
+    }
+    return t0 <= t1 ? t0 : HUGE_VAL;
+}
+
+static double bvh_cast(const sim_bvh_t *bvh, const double p[3], const double dir[3], double max,
+                       sim_object_t **ignores, int nignores, sim_object_t **out_object)
+{
+    double inv[3];
+    for (int i = 0; i < 3; i++)
+        inv[i] = 1.0 / dir[i];
+
+    int32_t stack[STACK_SIZE];
+    int sp = 0;
+
+    if (bvh->nnodes > 0 && box_entry(&bvh->nodes[0], p, inv, max) != HUGE_VAL)
+        stack[sp++] = 0;
+
+    while (sp > 0) {
+        const struct sim_bvh_node *node = &bvh->nodes[stack[--sp]];
+
+        if (node->count) {
+            for (int i = node->start; i < node->start + node->count; i++) {
+                sim_object_t *so = bvh->objects[bvh->tri_object[i]];
+
+                int ignore = 0;
+                for (int j = 0; j < nignores; j++)
+                    if (so == ignores[j])
+                        ignore = 1;
+                if (ignore)
+                    continue;
+
+                double d = tri_ray_distance(&bvh->world[9*i], p, dir, max);
+                if (d < max) {
+                    max = d;
+                    if (out_object)
+                        *out_object = so;
+                }
+            }
+            continue;
+        }
+
+        int32_t a = node - bvh->nodes + 1, b = node->start;
+        double ta = box_entry(&bvh->nodes[a], p, inv, max);
+        double tb = box_entry(&bvh->nodes[b], p, inv, max);
+
+        // push the farther child first so the nearer is visited first
+        if (ta > tb) {
+            int32_t tmp = a; a = b; b = tmp;
+            double dtmp = ta; ta = tb; tb = dtmp;
+        }
+
+        if (tb != HUGE_VAL)
+            stack[sp++] = b;
+        if (ta != HUGE_VAL)
+            stack[sp++] = a;
+    }
+
+    // objects that provide only a ray_cast method
+    for (int idx = 0; idx < zarray_size(bvh->others); idx++) {
+        sim_object_t *so;
+        zarray_get(bvh->others, idx, &so);
+
+        int ignore = 0;
+        for (int i = 0; i < nignores; i++)
+            if (so == ignores[i])
+                ignore = 1;
+
+        if (ignore || !so->ray_cast)
+            continue;
+
+        double Tp[3], Tdir[3];
+        doubles_mat44_inv_transform_xyz(so->T, p, Tp);
+        doubles_mat44_inv_rotate_vector(so->T, dir, Tdir);
+
+        double oldmax = max;
+        max = so->ray_cast(so, Tp, Tdir, max);
+        if (max < oldmax && out_object)
+            *out_object = so;
+    }
+
+    return max;
+}
+
+double sim_bvh_ray_cast(const sim_bvh_t *bvh, const double p[3], const double dir[3], double max,
+                        sim_object_t **ignores, int nignores, sim_object_t **out_object)
+{
+    return bvh_cast(bvh, p, dir, max, ignores, nignores, out_object);
+}
+
+struct batch_task
+{
+    const sim_bvh_t *bvh;
+    const double *p, *dir;
+    double max;
+    sim_object_t **ignores;
+    int nignores;
+    double *out;
+    int start, end;
+};
+
+static void batch_task(void *_task)
+{
+    struct batch_task *task = _task;
+
+    for (int i = task->start; i < task->end; i++)
+        task->out[i] = bvh_cast(task->bvh, &task->p[3*i], &task->dir[3*i], task->max,
+                                task->ignores, task->nignores, NULL);
+}
+
+void sim_bvh_ray_cast_batch(const sim_bvh_t *bvh, int nrays, const double *p, const double *dir,
+                            double max, sim_object_t **ignores, int nignores, double *out)
+{
+    int ntasks = (nrays + BATCH_TASK_RAYS - 1) / BATCH_TASK_RAYS;
+    if (!bvh->wp)
+        ntasks = imin(ntasks, 1);
+    else
+        ntasks = imax(ntasks, imin(nrays, workerpool_get_nthreads(bvh->wp)));
+
+    if (ntasks == 0)
+        return;
+
+    struct batch_task tasks[ntasks];
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i] = (struct batch_task) { .bvh = bvh, .p = p, .dir = dir, .max = max,
+                                         .ignores = ignores, .nignores = nignores, .out = out,
+                                         .start = (int64_t) nrays * i / ntasks,
+                                         .end = (int64_t) nrays * (i + 1) / ntasks };
+    }
+
+    if (!bvh->wp || ntasks == 1) {
+        for (int i = 0; i < ntasks; i++)
+            batch_task(&tasks[i]);
+        return;
+    }
+
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(bvh->wp, batch_task, &tasks[i]);
+    workerpool_run(bvh->wp);
+}
@@ -0,0 +1,91 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SIM_BVH_H
+#define _SIM_BVH_H
+
+#include <stdint.h>
+
+#include "common/workerpool.h"
+#include "sim.h"
+
+// A bounding volume hierarchy over the triangles of every object in a
+// sim_world, in world coordinates, so that a ray cast visits only the
+// triangles near the ray instead of every object in turn.
+//
+// The tree is built once with the surface area heuristic and stored
+// as a flat array of nodes in depth-first order. When objects move,
+// sim_bvh_refit() re-transforms their triangles and refits the boxes
+// without changing the tree, which stays efficient as long as the
+// scene's layout does not change drastically. Adding or removing
+// objects requires a new sim_bvh.
+//
+// Objects without triangle geometry (no triray) are ray cast with
+// their own ray_cast method, as in sim_world_ray_cast.
+
+struct sim_bvh_node
+{
+    float min[3], max[3];
+
+    // leaf (count > 0): triangles [start, start + count).
+    // interior (count == 0): children are this + 1 and 'start'.
+    int32_t start, count;
+};
+
+typedef struct sim_bvh sim_bvh_t;
+struct sim_bvh
+{
+    sim_world_t *sw;
+    workerpool_t *wp;
+
+    int nobjects;
+    sim_object_t **objects;  // with triangles
+    double *object_T;        // 16 per object, as of the last refit
+
+    zarray_t *others;        // sim_object_t* without triangles
+
+    int ntris;
+    float *local;            // 9 per triangle: object coordinates
+    float *world;            // 9 per triangle: world coordinates
+    int32_t *tri_object;     // index into objects
+
+    int nnodes;
+    struct sim_bvh_node *nodes;
+};
+
+// nthreads: size of the worker pool used for batch casts (<= 1: none)
+sim_bvh_t *sim_bvh_create(sim_world_t *sw, int nthreads);
+void sim_bvh_destroy(sim_bvh_t *bvh);
+
+// update for objects whose T changed since the last build/refit.
+// Returns the number of objects that moved.
+int sim_bvh_refit(sim_bvh_t *bvh);
+
+// as sim_world_ray_cast. dir must be a unit vector.
+double sim_bvh_ray_cast(const sim_bvh_t *bvh, const double p[3], const double dir[3], double max,
+                        sim_object_t **ignores, int nignores, sim_object_t **out_object);
+
+// cast nrays rays, p[3*i] in direction dir[3*i], writing the
+// distances to out[i]. Rays are split across the worker pool.
+void sim_bvh_ray_cast_batch(const sim_bvh_t *bvh, int nrays, const double *p, const double *dir,
+                            double max, sim_object_t **ignores, int nignores, double *out);
+
+#endif
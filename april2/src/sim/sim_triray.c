@@ -300,6 +300,29 @@ void sim_tri_compute_sphere(sim_triray_t *str)
     str->sphere_valid = 1;
 }
 
+void sim_triray_get_triangles(sim_triray_t *str, zarray_t *out)
+{
+    switch (str->type) {
+        case 0: {
+            for (int i = 0; i < zarray_size(str->u.tris.tris); i++) {
+                struct triangle *tri;
+                zarray_get_volatile(str->u.tris.tris, i, &tri);
+                zarray_add(out, tri->p);
+            }
+            break;
+        }
+
+        case 1: {
+            for (int i = 0; i < zarray_size(str->u.strs.strs); i++) {
+                sim_triray_t *thisstr;
+                zarray_get(str->u.strs.strs, i, &thisstr);
+                sim_triray_get_triangles(thisstr, out);
+            }
+            break;
+        }
+    }
+}
+
 // dir must be UNIT vector
 double sim_triray_cast(sim_triray_t *str, const double p[3], const double dir[3], double max)
 {
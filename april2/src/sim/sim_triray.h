@@ -56,6 +56,9 @@ void sim_triray_add_mesh(sim_triray_t *str, mesh_model_t *model);
 
 void sim_triray_split(sim_triray_t *str, const double max_sz, const int min_tris);
 
+// append the vertices of every triangle to out (float[9]: p0, p1, p2)
+void sim_triray_get_triangles(sim_triray_t *str, zarray_t *out);
+
 // dir must be UNIT vector
 double sim_triray_cast(sim_triray_t *str, const double p[3], const double dir[3], double max);
 
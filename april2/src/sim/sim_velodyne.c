@@ -0,0 +1,178 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "sim_velodyne.h"
+#include "common/doubles.h"
+#include "common/math_util.h"
+#include "velodyne/april_velodyne.h"
+
+#define HDL_32E_FIRING_USECS 46.08
+#define VLP_16_FIRING_USECS  55.296
+
+// range resolution of the packet format
+#define RANGE_UNIT 0.002
+
+#define RAYS_PER_PACKET (12 * 32)
+
+sim_velodyne_t *sim_velodyne_create(int mode, double hz, int64_t utime)
+{
+    const float *elevations = april_velodyne_vertical_angles(mode);
+    if (elevations == NULL)
+        return NULL;
+
+    sim_velodyne_t *sv = calloc(1, sizeof(sim_velodyne_t));
+    sv->mode = mode;
+    sv->hz = hz;
+    sv->range_max = 100;
+    sv->utime0 = utime;
+
+    for (int i = 0; i < mode; i++) {
+        double rad = to_radians(elevations[i]);
+        sv->elevation_sincos[i][0] = sin(rad);
+        sv->elevation_sincos[i][1] = cos(rad);
+    }
+
+    return sv;
+}
+
+void sim_velodyne_destroy(sim_velodyne_t *sv)
+{
+    free(sv);
+}
+
+// time between the starts of consecutive data blocks
+static double block_usecs(const sim_velodyne_t *sv)
+{
+    return sv->mode == 16 ? 2*VLP_16_FIRING_USECS : HDL_32E_FIRING_USECS;
+}
+
+double sim_velodyne_packet_usecs(const sim_velodyne_t *sv)
+{
+    return 12 * block_usecs(sv);
+}
+
+int64_t sim_velodyne_next_utime(const sim_velodyne_t *sv)
+{
+    return sv->utime0 + (int64_t) (sv->npackets * sim_velodyne_packet_usecs(sv) + 0.5);
+}
+
+// aim every laser once at 'azimuth' (degrees), writing 'mode' rays
+// to dirs.
+static void aim(const sim_velodyne_t *sv, const double T[16], double azimuth, double *dirs)
+{
+    // the decoder maps azimuth a to the angle -a
+    double theta = -to_radians(azimuth);
+    double c = cos(theta), s = sin(theta);
+
+    for (int i = 0; i < sv->mode; i++) {
+        double local[3] = { sv->elevation_sincos[i][1] * c,
+                            sv->elevation_sincos[i][1] * s,
+                            sv->elevation_sincos[i][0] };
+        doubles_mat44_rotate_vector(T, local, &dirs[3*i]);
+    }
+}
+
+// encode n ranges as 3-byte returns
+static void encode(const sim_velodyne_t *sv, const double *ranges, int n, uint8_t *out)
+{
+    for (int i = 0; i < n; i++) {
+        uint32_t v = 0;
+        uint8_t intensity = 0;
+        if (ranges[i] < sv->range_max) {
+            v = iclamp((int) (ranges[i] / RANGE_UNIT + 0.5), 1, 0xffff);
+            intensity = 100;
+        }
+
+        out[3*i + 0] = v & 0xff;
+        out[3*i + 1] = (v >> 8) & 0xff;
+        out[3*i + 2] = intensity;
+    }
+}
+
+int64_t sim_velodyne_packet(sim_velodyne_t *sv, sim_world_t *sw, const double T[16],
+                            sim_object_t **ignores, int nignores,
+                            uint8_t buf[SIM_VELODYNE_PACKET_SIZE])
+{
+    memset(buf, 0, SIM_VELODYNE_PACKET_SIZE);
+
+    double degrees_per_usec = 360.0 * sv->hz / 1.0E6;
+    double t0 = sv->npackets * sim_velodyne_packet_usecs(sv);
+
+    // both modes fire 32 rays per block
+    double p[3*RAYS_PER_PACKET], dirs[3*RAYS_PER_PACKET], ranges[RAYS_PER_PACKET];
+
+    for (int block = 0; block < 12; block++) {
+        uint8_t *data = &buf[100 * block];
+        double t = t0 + block * block_usecs(sv);
+
+        // fire at the azimuth as transmitted (0.01 degree units)
+        uint16_t a = ((int64_t) (fmod(t * degrees_per_usec, 360) * 100 + 0.5)) % 36000;
+        double azimuth = a / 100.0;
+
+        data[0] = 0xff;
+        data[1] = 0xee;
+        data[2] = a & 0xff;
+        data[3] = a >> 8;
+
+        double *block_dirs = &dirs[3*32*block];
+        if (sv->mode == 32) {
+            aim(sv, T, azimuth, block_dirs);
+        } else {
+            aim(sv, T, azimuth, block_dirs);
+            aim(sv, T, fmod(azimuth + VLP_16_FIRING_USECS * degrees_per_usec, 360), &block_dirs[3*16]);
+        }
+    }
+
+    for (int i = 0; i < RAYS_PER_PACKET; i++) {
+        p[3*i + 0] = T[3];
+        p[3*i + 1] = T[7];
+        p[3*i + 2] = T[11];
+    }
+
+    if (sv->bvh) {
+        sim_bvh_ray_cast_batch(sv->bvh, RAYS_PER_PACKET, p, dirs, sv->range_max, ignores, nignores, ranges);
+    } else {
+        for (int i = 0; i < RAYS_PER_PACKET; i++)
+            ranges[i] = sim_world_ray_cast(sw, &p[3*i], &dirs[3*i], sv->range_max, ignores, nignores, NULL);
+    }
+
+    for (int block = 0; block < 12; block++)
+        encode(sv, &ranges[32*block], 32, &buf[100*block + 4]);
+
+    // microseconds past the hour of the first firing
+    int64_t utime = sim_velodyne_next_utime(sv);
+    uint32_t toh = (uint32_t) (utime % ((int64_t) 3600 * 1000000));
+    buf[1200] = toh & 0xff;
+    buf[1201] = (toh >> 8) & 0xff;
+    buf[1202] = (toh >> 16) & 0xff;
+    buf[1203] = (toh >> 24) & 0xff;
+
+    buf[1204] = VELO_FACTORY_STRONGEST_RETURN;
+    buf[1205] = sv->mode == 16 ? VELO_FACTORY_VLP_16 : VELO_FACTORY_HDL_32E;
+
+    sv->npackets++;
+    return utime;
+}
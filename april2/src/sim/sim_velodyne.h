@@ -0,0 +1,77 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SIM_VELODYNE_H
+#define _SIM_VELODYNE_H
+
+#include <stdint.h>
+
+#include "sim.h"
+#include "sim_bvh.h"
+
+// A simulated HDL-32E/VLP-16 which ray casts a sim_world at the
+// sensor's firing pattern and produces the same 1206 byte data
+// packets as the real device (see april_velodyne_on_packet).
+//
+// An HDL-32E packet holds 12 firings of all 32 lasers, 46.08 us
+// apart. A VLP-16 packet holds 12 blocks of two 16 laser firings,
+// 55.296 us apart; the second firing's azimuth is not transmitted.
+// The sensor spins clockwise (seen from above) at 'hz' revolutions
+// per second.
+
+#define SIM_VELODYNE_PACKET_SIZE 1206
+
+typedef struct sim_velodyne sim_velodyne_t;
+struct sim_velodyne
+{
+    int     mode;       // number of lasers: 16 or 32
+    double  hz;         // revolutions per second
+    double  range_max;  // meters; farther returns are dropped
+
+    int64_t utime0;     // of the first firing, at azimuth 0
+    int64_t npackets;   // produced so far
+
+    float   elevation_sincos[32][2];
+
+    // optional. When set, each packet's rays are cast as one batch
+    // against the BVH (which the caller keeps refit) instead of the
+    // world.
+    sim_bvh_t *bvh;
+};
+
+sim_velodyne_t *sim_velodyne_create(int mode, double hz, int64_t utime);
+void sim_velodyne_destroy(sim_velodyne_t *sv);
+
+// duration of one packet's worth of firings, in microseconds
+double sim_velodyne_packet_usecs(const sim_velodyne_t *sv);
+
+// utime of the next packet's first firing
+int64_t sim_velodyne_next_utime(const sim_velodyne_t *sv);
+
+// Ray casts the next packet's firings with the sensor at T (sensor to
+// world) and advances the sensor clock. Returns the utime of the
+// packet's first firing. Objects in 'ignores' (e.g., the vehicle
+// itself) are not hit.
+int64_t sim_velodyne_packet(sim_velodyne_t *sv, sim_world_t *sw, const double T[16],
+                            sim_object_t **ignores, int nignores,
+                            uint8_t buf[SIM_VELODYNE_PACKET_SIZE]);
+
+#endif
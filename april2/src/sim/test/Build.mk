@@ -0,0 +1,14 @@
+CFLAGS := $(CFLAGS_STD) $(CFLAGS_COMMON) $(CFLAGS_SIM)
+LDFLAGS := $(LDFLAGS_SIM) $(LDFLAGS_STD) $(LDFLAGS_COMMON) $(LDFLAGS_LCM)
+DEPS := $(DEPS_SIM) $(DEPS_STD) $(DEPS_COMMON)
+
+include $(BUILD_COMMON)
+
+all: sim_bvh_test
+	@true
+
+sim_bvh_test: sim_bvh_test.o $(DEPS)
+	@$(LD) -o $@ $^ $(LDFLAGS)
+
+clean:
+	@rm -rf *.o sim_bvh_test
@@ -0,0 +1,15 @@
+.PHONY: sim_test sim_test_clean
+
+sim_test: sim
+
+sim_test:
+	@echo $@
+	@$(MAKE) -C $(APRIL_PATH)/src/sim/test -f Build.mk
+
+sim_test_clean:
+	@echo $@
+	@$(MAKE) -C $(APRIL_PATH)/src/sim/test -f Build.mk clean
+
+all: sim_test
+
+clean: sim_test_clean
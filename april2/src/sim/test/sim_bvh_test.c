@@ -0,0 +1,214 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "sim/sim.h"
+#include "sim/sim_bvh.h"
+#include "common/zarray.h"
+
+#define NRAYS 2000
+#define MAX_RANGE 100
+#define SCENE_SIZE 30
+#define TOLERANCE 1E-3
+
+// an object with only a ray_cast method, which sim_bvh must cast
+// against directly.
+struct sphere
+{
+    sim_object_t so;
+    double r;
+};
+
+static const stype_t sphere_stype = { .name = "sphere" };
+
+static double uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * (random() / (double) RAND_MAX);
+}
+
+// rotation about z and a translation
+static void random_T(double T[16])
+{
+    double t = uniform(-M_PI, M_PI);
+    double R[16] = { cos(t), -sin(t), 0, uniform(-SCENE_SIZE, SCENE_SIZE),
+                     sin(t),  cos(t), 0, uniform(-SCENE_SIZE, SCENE_SIZE),
+                     0,       0,      1, uniform(-2, 2),
+                     0,       0,      0, 1 };
+    memcpy(T, R, sizeof(R));
+}
+
+static double sphere_ray_cast(sim_object_t *so, const double p[3], const double dir[3], double max)
+{
+    struct sphere *s = (struct sphere*) so;
+
+    // |p + t*dir|^2 = r^2, dir a unit vector
+    double b = p[0]*dir[0] + p[1]*dir[1] + p[2]*dir[2];
+    double c = p[0]*p[0] + p[1]*p[1] + p[2]*p[2] - s->r * s->r;
+    double disc = b*b - c;
+    if (disc < 0)
+        return max;
+
+    double t = -b - sqrt(disc);
+    if (t < 0)
+        t = -b + sqrt(disc);
+    if (t < 0 || t > max)
+        return max;
+    return t;
+}
+
+static sim_world_t *random_world(int nboxes, int nspheres)
+{
+    sim_world_t *sw = sim_world_create();
+    const float rgba[4] = { 1, 1, 1, 1 };
+
+    for (int i = 0; i < nboxes; i++) {
+        double T[16];
+        random_T(T);
+        float M[16] = { uniform(0.1, 5), 0, 0, 0,
+                        0, uniform(0.1, 5), 0, 0,
+                        0, 0, uniform(0.1, 5), 0,
+                        0, 0, 0, 1 };
+        sim_object_t *so = sim_object_box_create(T, M, rgba, 0);
+        zarray_add(sw->objects, &so);
+    }
+
+    for (int i = 0; i < nspheres; i++) {
+        struct sphere *s = calloc(1, sizeof(struct sphere));
+        s->so.stype = &sphere_stype;
+        s->so.ray_cast = sphere_ray_cast;
+        random_T(s->so.T);
+        s->r = uniform(0.5, 3);
+        sim_object_t *so = &s->so;
+        zarray_add(sw->objects, &so);
+    }
+
+    return sw;
+}
+
+static void random_rays(int nrays, double *p, double *dir)
+{
+    for (int i = 0; i < nrays; i++) {
+        double d[3] = { uniform(-1, 1), uniform(-1, 1), uniform(-0.3, 0.3) };
+        double mag = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        for (int j = 0; j < 3; j++) {
+            p[3*i + j] = j < 2 ? uniform(-SCENE_SIZE, SCENE_SIZE) : uniform(-2, 2);
+            dir[3*i + j] = d[j] / mag;
+        }
+    }
+}
+
+// every ray, cast singly and in a batch, must agree with
+// sim_world_ray_cast, as must the object hit. Returns the number of
+// rays that hit something.
+static int compare_casts(sim_world_t *sw, sim_bvh_t *bvh, sim_object_t **ignores, int nignores)
+{
+    double *p = malloc(sizeof(double) * 3 * NRAYS);
+    double *dir = malloc(sizeof(double) * 3 * NRAYS);
+    double *batch = malloc(sizeof(double) * NRAYS);
+    random_rays(NRAYS, p, dir);
+
+    sim_bvh_ray_cast_batch(bvh, NRAYS, p, dir, MAX_RANGE, ignores, nignores, batch);
+
+    int nhits = 0;
+    for (int i = 0; i < NRAYS; i++) {
+        sim_object_t *world_obj = NULL, *bvh_obj = NULL;
+        double world = sim_world_ray_cast(sw, &p[3*i], &dir[3*i], MAX_RANGE,
+                                          ignores, nignores, &world_obj);
+        double single = sim_bvh_ray_cast(bvh, &p[3*i], &dir[3*i], MAX_RANGE,
+                                         ignores, nignores, &bvh_obj);
+
+        // the BVH keeps its triangles in world coordinates as floats
+        assert(fabs(world - single) < TOLERANCE);
+        assert(batch[i] == single);
+        if (world < MAX_RANGE) {
+            assert(world_obj == bvh_obj);
+            nhits++;
+        }
+    }
+
+    free(p);
+    free(dir);
+    free(batch);
+    return nhits;
+}
+
+static void world_destroy(sim_world_t *sw)
+{
+    for (int i = 0; i < zarray_size(sw->objects); i++) {
+        sim_object_t *so;
+        zarray_get(sw->objects, i, &so);
+        // boxes' meshes and trirays are left to the OS
+        free(so);
+    }
+    zarray_destroy(sw->objects);
+    zarray_destroy(sw->agents);
+    free(sw);
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(0);
+
+    // empty world
+    sim_world_t *sw = sim_world_create();
+    sim_bvh_t *bvh = sim_bvh_create(sw, 1);
+    assert(compare_casts(sw, bvh, NULL, 0) == 0);
+    sim_bvh_destroy(bvh);
+    world_destroy(sw);
+
+    for (int iter = 0; iter < 20; iter++) {
+        sw = random_world(1 + random() % 200, random() % 4);
+        bvh = sim_bvh_create(sw, 1 + iter % 4);
+
+        int nhits = compare_casts(sw, bvh, NULL, 0);
+        assert(nhits > 0);
+
+        sim_object_t *ignore;
+        zarray_get(sw->objects, 0, &ignore);
+        compare_casts(sw, bvh, &ignore, 1);
+
+        // move some objects and refit without rebuilding
+        int nmoved = 0;
+        for (int i = 0; i < zarray_size(sw->objects); i++) {
+            sim_object_t *so;
+            zarray_get(sw->objects, i, &so);
+            if (!so->triray || random() % 3)
+                continue;
+            random_T(so->T);
+            nmoved++;
+        }
+        assert(sim_bvh_refit(bvh) == nmoved);
+        assert(sim_bvh_refit(bvh) == 0);
+        compare_casts(sw, bvh, NULL, 0);
+
+        sim_bvh_destroy(bvh);
+        world_destroy(sw);
+    }
+
+    printf("sim_bvh_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,254 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "common/getopt.h"
+#include "common/doubles.h"
+#include "common/math_util.h"
+#include "common/time_util.h"
+#include "common/stype.h"
+
+#include "lcm/lcm.h"
+#include "lcmtypes/raw_t.h"
+#include "lcmtypes/pose_t.h"
+
+#include "sim.h"
+#include "sim_velodyne.h"
+
+// Drives a simulated velodyne around a circle in a sim world,
+// producing the data packets and POSE messages that the real vehicle
+// would: either published live, or written straight to an LCM log.
+// The poses are ground truth.
+//
+//   sim-velodyne -w example.config --radius 8 --duration 30 -l /tmp/sim.lcmlog
+
+typedef struct state state_t;
+struct state
+{
+    lcm_t *lcm;
+    lcm_eventlog_t *log;
+    int64_t nevents;
+
+    sim_world_t *sw;
+    sim_velodyne_t *sv;
+    sim_bvh_t *bvh;
+
+    double radius, speed, height;
+};
+
+static void emit(state_t *state, const char *channel, int64_t utime, void *data, int datalen)
+{
+    if (state->log) {
+        lcm_eventlog_event_t ev = { .timestamp = utime,
+                                    .channellen = strlen(channel),
+                                    .datalen = datalen,
+                                    .eventnum = state->nevents++,
+                                    .channel = (char*) channel,
+                                    .data = data };
+        lcm_eventlog_write_event(state->log, &ev);
+    } else {
+        lcm_publish(state->lcm, channel, data, datalen);
+    }
+}
+
+static void emit_raw(state_t *state, const char *channel, const raw_t *msg)
+{
+    int len = raw_t_encoded_size(msg);
+    uint8_t *buf = malloc(len);
+    raw_t_encode(buf, 0, len, msg);
+    emit(state, channel, msg->utime, buf, len);
+    free(buf);
+}
+
+static void emit_pose(state_t *state, const char *channel, const pose_t *msg)
+{
+    int len = pose_t_encoded_size(msg);
+    uint8_t *buf = malloc(len);
+    pose_t_encode(buf, 0, len, msg);
+    emit(state, channel, msg->utime, buf, len);
+    free(buf);
+}
+
+// vehicle pose t seconds in: counter-clockwise around a circle
+// centered at the origin, facing along the direction of travel.
+static void vehicle_pose(state_t *state, double t, pose_t *pose)
+{
+    double omega = state->speed / state->radius;
+    double a = omega * t;
+
+    double rpy[3] = { 0, 0, mod2pi(a + M_PI/2) };
+
+    pose->pos[0] = state->radius * cos(a);
+    pose->pos[1] = state->radius * sin(a);
+    pose->pos[2] = 0;
+    pose->vel[0] = -state->speed * sin(a);
+    pose->vel[1] = state->speed * cos(a);
+    pose->vel[2] = 0;
+    doubles_rpy_to_quat(rpy, pose->orientation);
+    pose->rotation_rate[0] = 0;
+    pose->rotation_rate[1] = 0;
+    pose->rotation_rate[2] = omega;
+    pose->accel[0] = -state->speed * omega * cos(a);
+    pose->accel[1] = -state->speed * omega * sin(a);
+    pose->accel[2] = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    setlinebuf(stderr);
+    setlinebuf(stdout);
+
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(gopt, 'w', "world", "", "sim world (.world or .config)");
+    getopt_add_int(gopt, 'm', "model", "32", "lasers: 32 (HDL-32E) or 16 (VLP-16)");
+    getopt_add_double(gopt, '\0', "hz", "10", "sensor revolutions per second");
+    getopt_add_double(gopt, '\0', "range-max", "100", "maximum range (m)");
+    getopt_add_double(gopt, '\0', "height", "1.0", "sensor height above the vehicle origin (m)");
+    getopt_add_double(gopt, '\0', "radius", "5", "radius of the vehicle's circular path (m)");
+    getopt_add_double(gopt, '\0', "speed", "1", "vehicle speed (m/s)");
+    getopt_add_double(gopt, '\0', "pose-hz", "100", "POSE rate");
+    getopt_add_double(gopt, 'd', "duration", "10", "seconds to simulate (0 = forever)");
+    getopt_add_int(gopt, 't', "threads", "4", "ray casting threads");
+    getopt_add_bool(gopt, '\0', "no-bvh", 0, "ray cast each object in turn instead of using a BVH");
+    getopt_add_bool(gopt, '\0', "fast", 0, "run as fast as possible instead of in real time");
+    getopt_add_string(gopt, 'l', "log", "", "write an LCM log here instead of publishing");
+    getopt_add_string(gopt, '\0', "data-channel", "VELODYNE_DATA", "channel for data packets");
+    getopt_add_string(gopt, '\0', "pose-channel", "POSE", "channel for vehicle poses");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help") ||
+        !strlen(getopt_get_string(gopt, "world"))) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(gopt);
+        exit(-1);
+    }
+
+    state_t *state = calloc(1, sizeof(state_t));
+    state->radius = fmax(getopt_get_double(gopt, "radius"), 1E-3);
+    state->speed = getopt_get_double(gopt, "speed");
+    state->height = getopt_get_double(gopt, "height");
+
+    sim_stype_init();
+    state->sw = sim_world_create_from_file(getopt_get_string(gopt, "world"));
+    if (!state->sw) {
+        printf("unable to load world %s\n", getopt_get_string(gopt, "world"));
+        exit(-2);
+    }
+
+    int64_t utime0 = utime_now();
+    state->sv = sim_velodyne_create(getopt_get_int(gopt, "model"), getopt_get_double(gopt, "hz"), utime0);
+    if (!state->sv) {
+        printf("unsupported model %d\n", getopt_get_int(gopt, "model"));
+        exit(-3);
+    }
+    state->sv->range_max = getopt_get_double(gopt, "range-max");
+
+    if (!getopt_get_bool(gopt, "no-bvh")) {
+        state->bvh = sim_bvh_create(state->sw, getopt_get_int(gopt, "threads"));
+        state->sv->bvh = state->bvh;
+        printf("BVH: %d triangles, %d nodes\n", state->bvh->ntris, state->bvh->nnodes);
+    }
+
+    if (strlen(getopt_get_string(gopt, "log"))) {
+        state->log = lcm_eventlog_create(getopt_get_string(gopt, "log"), "w");
+        if (!state->log) {
+            printf("unable to create log %s\n", getopt_get_string(gopt, "log"));
+            exit(-4);
+        }
+    } else {
+        state->lcm = lcm_create(NULL);
+    }
+
+    const char *data_channel = getopt_get_string(gopt, "data-channel");
+    const char *pose_channel = getopt_get_string(gopt, "pose-channel");
+    int64_t duration_us = getopt_get_double(gopt, "duration") * 1E6;
+    int64_t pose_period_us = 1E6 / fmax(getopt_get_double(gopt, "pose-hz"), 1E-3);
+    int fast = getopt_get_bool(gopt, "fast") || state->log;
+
+    int64_t next_pose_utime = utime0;
+    int64_t npackets = 0, last_report_utime = utime_now(), last_report_npackets = 0;
+
+    while (1) {
+        int64_t utime = sim_velodyne_next_utime(state->sv);
+        if (duration_us > 0 && utime - utime0 > duration_us)
+            break;
+
+        // poses are emitted ahead of the packets they bracket, so a
+        // consumer's interpolator can always de-skew.
+        while (next_pose_utime <= utime + pose_period_us) {
+            pose_t pose = { .utime = next_pose_utime };
+            vehicle_pose(state, (next_pose_utime - utime0) / 1.0E6, &pose);
+            emit_pose(state, pose_channel, &pose);
+            next_pose_utime += pose_period_us;
+        }
+
+        if (!fast) {
+            int64_t now = utime_now();
+            if (utime > now)
+                usleep(utime - now);
+        }
+
+        // sensor pose at the middle of the packet
+        pose_t pose;
+        vehicle_pose(state, (utime - utime0 + sim_velodyne_packet_usecs(state->sv) / 2) / 1.0E6, &pose);
+
+        double T[16];
+        pose.pos[2] += state->height;
+        doubles_quat_xyz_to_mat44(pose.orientation, pose.pos, T);
+
+        // nothing here moves objects, but someone sharing the world may
+        if (state->bvh)
+            sim_bvh_refit(state->bvh);
+
+        uint8_t buf[SIM_VELODYNE_PACKET_SIZE];
+        sim_velodyne_packet(state->sv, state->sw, T, NULL, 0, buf);
+
+        raw_t msg = { .utime = utime, .len = SIM_VELODYNE_PACKET_SIZE, .buf = buf };
+        emit_raw(state, data_channel, &msg);
+        npackets++;
+
+        int64_t now = utime_now();
+        if (now - last_report_utime > 1E6) {
+            printf("%.1f s simulated, %.0f packets/s\n", (utime - utime0) / 1.0E6,
+                   (npackets - last_report_npackets) * 1.0E6 / (now - last_report_utime));
+            last_report_utime = now;
+            last_report_npackets = npackets;
+        }
+    }
+
+    printf("%" PRId64 " packets\n", npackets);
+
+    if (state->log)
+        lcm_eventlog_destroy(state->log);
+    if (state->lcm)
+        lcm_destroy(state->lcm);
+    sim_velodyne_destroy(state->sv);
+    sim_bvh_destroy(state->bvh);
+    getopt_destroy(gopt);
+    free(state);
+    return 0;
+}
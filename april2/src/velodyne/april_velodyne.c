@@ -102,7 +102,6 @@ april_velodyne_t *april_velodyne_create()
 void april_velodyne_destroy(april_velodyne_t *velo)
 {
     free(velo->vertical_angle_sincos);
-    free(velo);
 
     if (velo->pts) {
         zarray_destroy(velo->pts);
@@ -110,9 +109,22 @@ void april_velodyne_destroy(april_velodyne_t *velo)
         zarray_destroy(velo->intensities);
     }
 
+    free(velo);
+
     return;
 }
 
+const float *april_velodyne_vertical_angles(int mode)
+{
+    switch (mode) {
+        case 16:
+            return vertical_angle_degrees_16;
+        case 32:
+            return vertical_angle_degrees_32;
+    }
+    return NULL;
+}
+
 /** Initialize a velodyne based on the data buffer from a message
  *  from the device in question. Returns 0 on success, or 1 if message
  *  disagrees with already initialized velodyne object
@@ -37,6 +37,10 @@ typedef struct april_velodyne april_velodyne_t;
 april_velodyne_t *april_velodyne_create();
 void april_velodyne_destroy(april_velodyne_t *velo);
 
+// Elevation (degrees) of each laser, in the order the lasers appear
+// in a data block, for a 16 or 32 laser sensor. NULL for other modes.
+const float *april_velodyne_vertical_angles(int mode);
+
 void april_velodyne_on_packet(april_velodyne_t *velo,
                               const uint8_t *buf,
                               int32_t buflen,
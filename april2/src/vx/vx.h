@@ -291,6 +291,7 @@ enum { VX_MESSAGE_BUFFER_REDRAW = 1,
        VX_MESSAGE_DEFINE_NAMED_MATRIX = 20,
        VX_MESSAGE_UNDEFINE_NAMED_MATRIX = 21,
        VX_MESSAGE_LAYER_SET_CAMERA_MODE = 22,
+       VX_MESSAGE_DEFINE_RESOURCE_REF = 25, // alias a resource to identical, already-defined content
 };
 
 struct vx_message
@@ -77,6 +77,101 @@ void websocket_client_send_wrapper(const char *layerbuffer, const char *type, we
     websocket_client_send(client, buf, bufpos);
 }
 
+// Content hash (64 bit FNV-1a) of the resources that we can
+// deduplicate. Two resources with different ids but identical
+// contents are transmitted only once; later copies are sent as
+// references to the earlier one.
+static int resource_content_hash(vx_resource_t *resc, uint64_t *hash)
+{
+    const uint8_t *data;
+    size_t len;
+    uint32_t dim = 0;
+
+    switch (resc->type) {
+        case VX_RESOURCE_ATTR_F32:
+            data = (const uint8_t*) resc->u.attr_f32.data;
+            len = resc->u.attr_f32.nelements * sizeof(float);
+            dim = resc->u.attr_f32.dim;
+            break;
+        case VX_RESOURCE_IDX_U16:
+            data = (const uint8_t*) resc->u.idx_u16.data;
+            len = resc->u.idx_u16.nelements * sizeof(uint16_t);
+            break;
+        default:
+            return 0;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t hdr[3] = { resc->type, dim, len };
+    for (size_t i = 0; i < sizeof(hdr); i++)
+        h = (h ^ ((const uint8_t*) hdr)[i]) * 0x100000001b3ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+
+    *hash = h;
+    return 1;
+}
+
+static void encode_content_hash(uint8_t *buf, uint32_t *bufpos, uint64_t hash)
+{
+    // two u32s, since the javascript client can't represent a u64.
+    encode_u32(buf, bufpos, hash >> 32);
+    encode_u32(buf, bufpos, hash & 0xffffffff);
+}
+
+// Encodes the float payload of an ATTR_F32 define, prefixed by its
+// compression format. Large arrays are byte-shuffled (the i'th byte
+// of every big-endian float stored contiguously, so that the
+// slowly-varying exponent bytes form long runs) and then compressed
+// with c5. If that doesn't help, the data is sent raw.
+static void encode_attr_f32_payload(uint8_t *buf, uint32_t *bufpos, const float *data, int nelements,
+                                    int compress_min_bytes)
+{
+    int inlength = nelements * 4;
+
+    if (compress_min_bytes > 0 && inlength >= compress_min_bytes) {
+        uint8_t *shuffled = malloc(inlength);
+        for (int i = 0; i < nelements; i++) {
+            uint8_t tmp[4];
+            uint32_t tmppos = 0;
+            encode_f32(tmp, &tmppos, data[i]);
+            for (int k = 0; k < 4; k++)
+                shuffled[k*nelements + i] = tmp[k];
+        }
+
+        uint8_t *c = malloc(inlength * 2 + C5_PAD);
+        int32_t clen = 0;
+        c5(shuffled, inlength, c, &clen);
+        free(shuffled);
+
+        if (clen + 4 < inlength) {
+            encode_u8(buf, bufpos, 2); // compression format: shuffle + c5
+            encode_u32(buf, bufpos, clen);
+            encodeN(buf, bufpos, c, clen);
+            free(c);
+            return;
+        }
+
+        free(c);
+    }
+
+    encode_u8(buf, bufpos, 0); // compression format: none
+    for (int i = 0; i < nelements; i++)
+        encode_f32(buf, bufpos, data[i]);
+}
+
+// Redraws of a buffer are paced according to how long the client
+// took to accept the previous one. A redraw that arrives early is
+// deferred; when it comes due, the buffer's current front is sent,
+// so any intermediate frames are dropped rather than queued.
+struct webvx_buffer_pacing
+{
+    char *layer_name;
+    char *buffer_name;
+    int64_t next_utime;
+    int pending;
+};
+
 // This thread only writes to the socket. It ignores write errors due
 // to socket close states, exiting only when wsclientinfo->closed is
 // set. (This will be set by on_disconnect, which is called by the
@@ -84,7 +179,7 @@ void websocket_client_send_wrapper(const char *layerbuffer, const char *type, we
 static void *webvx_canvas_thread(void *_impl)
 {
     struct webvx_canvas_client_info *clientinfo = _impl;
-//    webvx_t *webvx = clientinfo->webvx;
+    webvx_t *webvx = clientinfo->webvx;
     websocket_client_t *client = clientinfo->wsclient;
     struct webvx_canvas_definition *canvasdef = clientinfo->canvasdef;
 
@@ -99,6 +194,17 @@ static void *webvx_canvas_thread(void *_impl)
     zhash_t *last_snapshots = zhash_create(sizeof(char*), sizeof(vx_serializer_t*),
                                            zhash_str_hash, zhash_str_equals);
 
+    // content hash => number of live remote resources with that
+    // content, and remote resource id => content hash.
+    zhash_t *remote_content_refcnt = zhash_create(sizeof(uint64_t), sizeof(uint32_t),
+                                                  zhash_uint64_hash, zhash_uint64_equals);
+    zhash_t *remote_resource_content = zhash_create(sizeof(uint64_t), sizeof(uint64_t),
+                                                    zhash_uint64_hash, zhash_uint64_equals);
+
+    // "layer$buffer" => struct webvx_buffer_pacing
+    zhash_t *pacings = zhash_create(sizeof(char*), sizeof(struct webvx_buffer_pacing),
+                                    zhash_str_hash, zhash_str_equals);
+
     vx_canvas_t *vc = vx_canvas_create();
     clientinfo->vc = vc;
 
@@ -120,15 +226,63 @@ static void *webvx_canvas_thread(void *_impl)
 
 //        printf("layer messages %d\n", zarray_size(vc->canvas_messages));
 
+        // wake up no later than the earliest deferred redraw.
+        int64_t wake_utime = utime_now() + 1E6;
+        int npending = 0;
+
+        if (1) {
+            zhash_iterator_t zit;
+            zhash_iterator_init(pacings, &zit);
+            struct webvx_buffer_pacing *pacing;
+            while (zhash_iterator_next_volatile(&zit, NULL, &pacing)) {
+                if (pacing->pending) {
+                    npending++;
+                    if (pacing->next_utime < wake_utime)
+                        wake_utime = pacing->next_utime;
+                }
+            }
+        }
+
         if (zarray_size(vc->canvas_messages) == 0) {
             struct timespec ts;
-            utime_to_timespec(utime_now() + 1E6, &ts);
+            utime_to_timespec(wake_utime, &ts);
             pthread_cond_timedwait(&vc->cond, &vc->mutex, &ts);
         }
 
-        if (zarray_size(vc->canvas_messages) == 0) {
-            pthread_mutex_unlock(&vc->mutex);
+        struct vx_message msg;
+        int have_msg = 0;
+
+        if (zarray_size(vc->canvas_messages) > 0) {
+            zarray_get(vc->canvas_messages, 0, &msg);
+            zarray_remove_index(vc->canvas_messages, 0, 0);
+            have_msg = 1;
+        }
+
+        pthread_mutex_unlock(&vc->mutex);
 
+        if (!have_msg && npending > 0) {
+            // is a deferred redraw due?
+            int64_t now = utime_now();
+
+            zhash_iterator_t zit;
+            zhash_iterator_init(pacings, &zit);
+            struct webvx_buffer_pacing *pacing;
+            while (zhash_iterator_next_volatile(&zit, NULL, &pacing)) {
+                if (pacing->pending && pacing->next_utime <= now) {
+                    memset(&msg, 0, sizeof(msg));
+                    msg.type = VX_MESSAGE_BUFFER_REDRAW;
+                    msg.u.buffer_redraw.layer_name = strdup(pacing->layer_name);
+                    msg.u.buffer_redraw.buffer_name = strdup(pacing->buffer_name);
+                    have_msg = 1;
+                    break;
+                }
+            }
+
+            if (!have_msg)
+                continue;
+        }
+
+        if (!have_msg) {
             // generate a NOP. This serves as a keep-alive/heartbeat.
 
             uint8_t buf[1024];
@@ -141,12 +295,6 @@ static void *webvx_canvas_thread(void *_impl)
             continue;
         }
 
-        struct vx_message msg;
-        zarray_get(vc->canvas_messages, 0, &msg);
-        zarray_remove_index(vc->canvas_messages, 0, 0);
-
-        pthread_mutex_unlock(&vc->mutex);
-
         switch (msg.type)
         {
             case VX_MESSAGE_CANVAS_ECHO:
@@ -346,6 +494,30 @@ static void *webvx_canvas_thread(void *_impl)
 
             case VX_MESSAGE_BUFFER_REDRAW:
             {
+                char *layerbuffer = malloc(strlen(msg.u.buffer_redraw.layer_name) + strlen(msg.u.buffer_redraw.buffer_name) + 2);
+                sprintf(layerbuffer, "%s$%s", msg.u.buffer_redraw.layer_name, msg.u.buffer_redraw.buffer_name);
+
+                struct webvx_buffer_pacing *pacing = NULL;
+                if (!zhash_get_volatile(pacings, &layerbuffer, &pacing)) {
+                    struct webvx_buffer_pacing newpacing = {
+                        .layer_name = strdup(msg.u.buffer_redraw.layer_name),
+                        .buffer_name = strdup(msg.u.buffer_redraw.buffer_name) };
+                    char *key = strdup(layerbuffer);
+                    zhash_put(pacings, &key, &newpacing, NULL, NULL);
+                    zhash_get_volatile(pacings, &layerbuffer, &pacing);
+                }
+
+                if (utime_now() < pacing->next_utime) {
+                    // too soon; we'll send whatever is current when it's due.
+                    pacing->pending = 1;
+                    free(layerbuffer);
+                    free(msg.u.buffer_redraw.layer_name);
+                    free(msg.u.buffer_redraw.buffer_name);
+                    break;
+                }
+
+                int64_t send_utime0 = utime_now();
+
                 vx_lock();
 
                 vx_serializer_t *snapshot = NULL;
@@ -365,8 +537,6 @@ static void *webvx_canvas_thread(void *_impl)
                 //////////////////////////////////////////////////////
                 // now we can take our sweet time transmitting the snapshot.
                 vx_serializer_t *last_snapshot = NULL;
-                char *layerbuffer = malloc(strlen(msg.u.buffer_redraw.layer_name) + strlen(msg.u.buffer_redraw.buffer_name) + 2);
-                sprintf(layerbuffer, "%s$%s", msg.u.buffer_redraw.layer_name, msg.u.buffer_redraw.buffer_name);
 
                 zhash_get(last_snapshots, &layerbuffer, &last_snapshot);
 
@@ -383,7 +553,33 @@ static void *webvx_canvas_thread(void *_impl)
 
                         if (refcnt == 1) {
                             // This was the first reference: we need to
-                            // transmit this resource
+                            // transmit this resource. If the client
+                            // already holds identical content under
+                            // another id, just tell it to alias that.
+                            uint64_t hash = 0;
+                            if (resource_content_hash(resc, &hash)) {
+                                uint32_t contentcnt = 0;
+                                zhash_get(remote_content_refcnt, &hash, &contentcnt);
+                                contentcnt++;
+                                zhash_put(remote_content_refcnt, &hash, &contentcnt, NULL, NULL);
+                                zhash_put(remote_resource_content, &resc->id, &hash, NULL, NULL);
+
+                                if (contentcnt > 1) {
+                                    uint8_t buf[64];
+                                    uint32_t bufpos = 0;
+
+                                    encode_u32(buf, &bufpos, 0x124578ab); // magic
+                                    encode_u8(buf, &bufpos, VX_MESSAGE_DEFINE_RESOURCE_REF);
+                                    encode_u64(buf, &bufpos, resc->id);
+                                    encode_u8(buf, &bufpos, resc->type == VX_RESOURCE_ATTR_F32 ?
+                                              VX_MESSAGE_DEFINE_VERTEX_ATTRIBUTE : VX_MESSAGE_DEFINE_INDEX_ARRAY);
+                                    encode_content_hash(buf, &bufpos, hash);
+
+                                    websocket_client_send_wrapper(layerbuffer, "ref", client, buf, bufpos);
+                                    continue;
+                                }
+                            }
+
                             switch(resc->type) {
                                 case VX_RESOURCE_PROGRAM: {
                                     uint32_t buflen = strlen(resc->u.program.vertex_shader_src) +
@@ -422,10 +618,10 @@ static void *webvx_canvas_thread(void *_impl)
                                     encode_u8(buf, &bufpos,  resc->type);
                                     encode_u32(buf, &bufpos, resc->u.attr_f32.nelements);
                                     encode_u8(buf, &bufpos,  resc->u.attr_f32.dim);
-                                    encode_u8(buf, &bufpos, 0); // padding
-
-                                    for (int i = 0; i < resc->u.attr_f32.nelements; i++)
-                                        encode_f32(buf, &bufpos, resc->u.attr_f32.data[i]);
+                                    encode_content_hash(buf, &bufpos, hash);
+                                    encode_attr_f32_payload(buf, &bufpos, resc->u.attr_f32.data,
+                                                            resc->u.attr_f32.nelements,
+                                                            webvx->compress_min_bytes);
 
                                     websocket_client_send_wrapper(layerbuffer, "attr_f32", client, buf, bufpos);
                                     free(buf);
@@ -446,6 +642,7 @@ static void *webvx_canvas_thread(void *_impl)
                                     encode_u8(buf, &bufpos, resc->type);
 
                                     encode_u32(buf, &bufpos, resc->u.idx_u16.nelements);
+                                    encode_content_hash(buf, &bufpos, hash);
 
                                     for (int i = 0; i < resc->u.idx_u16.nelements; i++)
                                         encode_u16(buf, &bufpos, resc->u.idx_u16.data[i]);
@@ -601,6 +798,18 @@ static void *webvx_canvas_thread(void *_impl)
                         } else {
                             zhash_remove(remote_resources_refcnt, &resc->id, NULL, NULL);
 
+                            uint64_t hash;
+                            if (zhash_remove(remote_resource_content, &resc->id, NULL, &hash)) {
+                                uint32_t contentcnt = 0;
+                                zhash_get(remote_content_refcnt, &hash, &contentcnt);
+                                assert(contentcnt >= 1);
+                                contentcnt--;
+                                if (contentcnt > 0)
+                                    zhash_put(remote_content_refcnt, &hash, &contentcnt, NULL, NULL);
+                                else
+                                    zhash_remove(remote_content_refcnt, &hash, NULL, NULL);
+                            }
+
                             uint8_t buf[64];
                             uint32_t bufpos = 0;
 
@@ -641,6 +850,12 @@ static void *webvx_canvas_thread(void *_impl)
                     }
                 }
 
+                if (1) {
+                    int64_t send_utime1 = utime_now();
+                    pacing->next_utime = send_utime1 + webvx->pacing_factor * (send_utime1 - send_utime0);
+                    pacing->pending = 0;
+                }
+
                 free(msg.u.buffer_redraw.layer_name);
                 free(msg.u.buffer_redraw.buffer_name);
                 break;
@@ -659,6 +874,23 @@ static void *webvx_canvas_thread(void *_impl)
     websocket_client_destroy(client);
 
     zhash_destroy(remote_resources_refcnt);
+    zhash_destroy(remote_content_refcnt);
+    zhash_destroy(remote_resource_content);
+
+    if (1) {
+        zhash_iterator_t zit;
+        zhash_iterator_init(pacings, &zit);
+
+        char *name;
+        struct webvx_buffer_pacing pacing;
+        while (zhash_iterator_next(&zit, &name, &pacing)) {
+            free(name);
+            free(pacing.layer_name);
+            free(pacing.buffer_name);
+        }
+
+        zhash_destroy(pacings);
+    }
 
     if (1) {
         zhash_iterator_t zit;
@@ -934,6 +1166,8 @@ webvx_t *webvx_create_server(int port, const char *rootdir, const char *default_
     webvx_t *webvx = calloc(1, sizeof(webvx_t));
 
     webvx->port = port;
+    webvx->compress_min_bytes = 4096;
+    webvx->pacing_factor = 1.0;
     webvx->httpd = httpd_create();
     if (httpd_listen(webvx->httpd, port, 10, 0)) {
         fprintf(stderr, "Cannot create httpd on port %d, goodbye\n", port);
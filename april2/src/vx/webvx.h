@@ -34,6 +34,15 @@ struct webvx
     httpd_t  *httpd;
 
     zarray_t *canvas_definitions; // struct webvx_canvas_definition*
+
+    // vertex attributes of at least this many bytes are sent
+    // compressed. (<= 0 disables compression.)
+    int       compress_min_bytes;
+
+    // a buffer is not redrawn again until pacing_factor times the
+    // duration of its previous transmission has elapsed; redraws in
+    // between are dropped. (0 disables pacing.)
+    double    pacing_factor;
 };
 
 // creates a new webserver listening on port 'port' whose root directory is mapped to
@@ -6,6 +6,8 @@ function VxCanvas(canvasid)
     this.programs = new Object();
     this.attributes = new Object();
     this.indices = new Object(); // index buffers
+    this.attributes_by_hash = new Object(); // content hash => buffer
+    this.indices_by_hash = new Object();
     this.textures = new Object();
 
     //////////////////////////////////////////////////
@@ -405,7 +407,8 @@ var VX_MESSAGE_BUFFER_REDRAW = 1,
     VX_MESSAGE_DEFINE_NAMED_MATRIX = 20,
     VX_MESSAGE_UNDEFINE_NAMED_MATRIX = 21,
     VX_MESSAGE_LAYER_SET_CAMERA_MODE = 22,
-    VX_MESSAGE_CANVAS_ECHO = 23;
+    VX_MESSAGE_CANVAS_ECHO = 23,
+    VX_MESSAGE_DEFINE_RESOURCE_REF = 25;
 
 var VX_SERIALIZER_MODEL_PUSH = 1,
     VX_SERIALIZER_MODEL_POP = 2,
@@ -932,6 +935,26 @@ JSVXEventHandler.prototype.onmouseclick = function(e) {
 };
 */
 
+// buffers may be shared by several ids (see
+// VX_MESSAGE_DEFINE_RESOURCE_REF); delete the GL buffer once the last
+// one is undefined.
+VxCanvas.prototype.release_buffer = function(map, by_hash, name)
+{
+    var attr = map[name];
+    if (attr == null)
+        return;
+
+    delete map[name];
+
+    attr.refs--;
+    if (attr.refs > 0)
+        return;
+
+    if (by_hash[attr.hash] === attr)
+        delete by_hash[attr.hash];
+    this.gl.deleteBuffer(attr);
+};
+
 VxCanvas.prototype.onMessage = function(e)
 {
     var gl = this.gl;
@@ -1000,17 +1023,36 @@ VxCanvas.prototype.onMessage = function(e)
                 var type = din.read_u8(); // float=2, int32=3
                 var nelements = din.read_u32();
                 var ndim = din.read_u8();
+                var hash = din.read_u32() + ":" + din.read_u32();
 
                 var attr = gl.createBuffer();
                 attr.ndim = ndim;
+                attr.hash = hash;
+                attr.refs = 1;
 
                 var buffer = null;
 
                 if (type == 2) {
-                    // XXX optimize?
-                    var padding = din.read_u8();
-
-                    buffer = din.read_f32_array(nelements);
+                    // 0: raw, 2: byte-shuffled and c5-compressed
+                    var compression = din.read_u8();
+
+                    if (compression == 0) {
+                        buffer = din.read_f32_array(nelements);
+                    } else if (compression == 2) {
+                        var nbytes = din.read_u32();
+                        var bytes = new UC5(din.read_N(nbytes)).uncompress();
+
+                        buffer = new Float32Array(nelements);
+                        var tmp = new Uint8Array(4);
+                        var tmpview = new DataView(tmp.buffer);
+                        for (var i = 0; i < nelements; i++) {
+                            for (var k = 0; k < 4; k++)
+                                tmp[k] = bytes[k*nelements + i];
+                            buffer[i] = tmpview.getFloat32(0, false);
+                        }
+                    } else {
+                        alert("unknown attribute compression");
+                    }
                     attr.type = gl.FLOAT;
 
                 } else if (type == 3) {
@@ -1028,8 +1070,31 @@ VxCanvas.prototype.onMessage = function(e)
                     gl.bindBuffer(gl.ARRAY_BUFFER, attr);
                     gl.bufferData(gl.ARRAY_BUFFER, buffer, gl.STATIC_DRAW);
                     this.attributes[name] = attr;
+                    this.attributes_by_hash[hash] = attr;
+                }
+
+                break;
+            }
+
+            // another id for content we already have.
+            case VX_MESSAGE_DEFINE_RESOURCE_REF: {
+                var name = din.read_id();
+                var kind = din.read_u8();
+                var hash = din.read_u32() + ":" + din.read_u32();
+
+                var map = (kind == VX_MESSAGE_DEFINE_VERTEX_ATTRIBUTE) ? this.attributes : this.indices;
+                var by_hash = (kind == VX_MESSAGE_DEFINE_VERTEX_ATTRIBUTE) ? this.attributes_by_hash : this.indices_by_hash;
+
+                var attr = by_hash[hash];
+                if (attr == null) {
+                    console.log("reference to unknown resource content "+hash);
+                    break;
                 }
 
+                if (map[name] == null) {
+                    attr.refs++;
+                    map[name] = attr;
+                }
                 break;
             }
 
@@ -1037,8 +1102,7 @@ VxCanvas.prototype.onMessage = function(e)
             case VX_MESSAGE_UNDEFINE_VERTEX_ATTRIBUTE: {
                 var name = din.read_id();
 
-                gl.deleteBuffer(this.attributes[name]);
-                delete this.attributes[name];
+                this.release_buffer(this.attributes, this.attributes_by_hash, name);
                 break;
             }
 
@@ -1046,9 +1110,12 @@ VxCanvas.prototype.onMessage = function(e)
                 var name = din.read_id();
                 var type = din.read_u8(); // float=2, int32=3
                 var nelements = din.read_u32();
+                var hash = din.read_u32() + ":" + din.read_u32();
 
                 var attr = gl.createBuffer();
                 attr.ndim = ndim;
+                attr.hash = hash;
+                attr.refs = 1;
 
                 if (type == 6) { // idx_u16
                     var buffer = new Uint16Array(nelements);
@@ -1063,6 +1130,7 @@ VxCanvas.prototype.onMessage = function(e)
                     gl.bindBuffer(gl.ELEMENT_ARRAY_BUFFER, attr);
                     gl.bufferData(gl.ELEMENT_ARRAY_BUFFER, buffer, gl.STATIC_DRAW);
                     vc.indices[name] = attr;
+                    vc.indices_by_hash[hash] = attr;
                 }
 
                 break;
@@ -1071,8 +1139,7 @@ VxCanvas.prototype.onMessage = function(e)
             case VX_MESSAGE_UNDEFINE_INDEX_ARRAY: {
                 var name = din.read_id();
 
-                gl.deleteBuffer(this.indices[name]);
-                delete this.indices[name];
+                this.release_buffer(this.indices, this.indices_by_hash, name);
                 break;
             }
 
@@ -1,3 +1,4 @@
 include $(ROOT_PATH)/src/lidar-FLAG/map_generator/Rules.mk
 include $(ROOT_PATH)/src/lidar-FLAG/particle-filter-localization/Rules.mk
 include $(ROOT_PATH)/src/lidar-FLAG/april-graph-localization/Rules.mk
+include $(ROOT_PATH)/src/lidar-FLAG/trace-stats/Rules.mk
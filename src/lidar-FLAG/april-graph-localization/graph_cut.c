@@ -0,0 +1,381 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/doubles.h"
+#include "april_graph/pcm.h"
+
+#include "graph_cut.h"
+
+static inline uint32_t cell_hash(uint64_t key)
+{
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (uint32_t) key;
+}
+
+// (landmark, cell) -> most recently inserted hypothesis in that cell.
+// The rest of the cell is chained through hypothesis_t.next.
+#define TNAME hypothesis_hash
+#define TVALTYPE int32_t
+#define TKEYTYPE uint64_t
+#define TKEYHASH(pk) cell_hash(*(pk))
+#define TKEYEQUAL(pka, pkb) (*(pka) == *(pkb))
+#include "common/thash_impl.h"
+#undef TKEYEQUAL
+#undef TKEYHASH
+#undef TKEYTYPE
+#undef TVALTYPE
+#undef TNAME
+
+typedef struct hypothesis {
+    april_graph_factor_t *factor; // NULL if the slot is free
+    double xy[2];                 // implied global landmark position
+    int landmark;
+    int64_t cx, cy;               // spatial hash cell
+    uint64_t key;
+    uint64_t seq;
+    int votes;
+    int32_t next;
+} hypothesis_t;
+
+typedef struct aging_entry {
+    int32_t idx;
+    int node;
+    uint64_t seq;
+} aging_entry_t;
+
+typedef struct graph_cut_impl {
+    hypothesis_hash_t *hash;
+    zarray_t *hypotheses; // hypothesis_t, slots are recycled
+    zarray_t *free_slots; // int32_t
+    zarray_t *aging;      // aging_entry_t, in insertion order
+    int aging_head;
+    zarray_t *ready;      // int32_t, hypotheses with enough votes
+    zarray_t *neighbors;  // int32_t, scratch
+    pcm_t *pcm;
+    uint64_t seq;
+    int size;
+} graph_cut_impl_t;
+
+graph_cut_t *graph_cut_create(april_graph_t *g, int vote_thres, double dist_err_tolerance, int max_age)
+{
+    graph_cut_t *cut = calloc(1, sizeof(graph_cut_t));
+    cut->graph = g;
+    cut->vote_thres = vote_thres;
+    cut->dist_err_tolerance = dist_err_tolerance;
+    cut->max_age = max_age;
+    cut->graduate_factors = zarray_create(sizeof(april_graph_factor_t*));
+
+    graph_cut_impl_t *impl = calloc(1, sizeof(graph_cut_impl_t));
+    impl->hash = hypothesis_hash_create();
+    impl->hypotheses = zarray_create(sizeof(hypothesis_t));
+    impl->free_slots = zarray_create(sizeof(int32_t));
+    impl->aging = zarray_create(sizeof(aging_entry_t));
+    impl->ready = zarray_create(sizeof(int32_t));
+    impl->neighbors = zarray_create(sizeof(int32_t));
+    // a landmark's hypotheses are few; run PCM on the calling thread
+    // rather than keeping a thread per processor alive for it
+    impl->pcm = pcm_create(1);
+    cut->impl = impl;
+
+    return cut;
+}
+
+// Cells are dist_err_tolerance wide, so every hypothesis that can
+// agree with a position lies in its cell or one of the 8 neighbours.
+// Landmarks are graph node indices, which grow with the trajectory,
+// so they get 24 bits; cell coordinates wrap after 2^20 cells, far
+// beyond anything a single landmark is observed from.
+static inline uint64_t cell_key(int landmark, int64_t cx, int64_t cy)
+{
+    return ((uint64_t) landmark << 40) |
+        (((uint64_t) cx & 0xfffff) << 20) |
+        ((uint64_t) cy & 0xfffff);
+}
+
+static inline hypothesis_t *get_hypothesis(graph_cut_impl_t *impl, int32_t idx)
+{
+    hypothesis_t *h;
+    zarray_get_volatile(impl->hypotheses, idx, &h);
+    return h;
+}
+
+static void unlink_hypothesis(graph_cut_impl_t *impl, int32_t idx)
+{
+    hypothesis_t *h = get_hypothesis(impl, idx);
+
+    int32_t head;
+    int found = hypothesis_hash_get(impl->hash, &h->key, &head);
+    assert(found);
+    (void) found;
+
+    if (head == idx) {
+        if (h->next < 0)
+            hypothesis_hash_remove(impl->hash, &h->key, NULL, NULL);
+        else
+            hypothesis_hash_put(impl->hash, &h->key, &h->next, NULL, NULL);
+    } else {
+        hypothesis_t *prev = get_hypothesis(impl, head);
+        while (prev->next != idx) {
+            assert(prev->next >= 0);
+            prev = get_hypothesis(impl, prev->next);
+        }
+        prev->next = h->next;
+    }
+
+    h->factor = NULL;
+    zarray_add(impl->free_slots, &idx);
+    impl->size--;
+}
+
+// Appends the hypotheses of landmark in the 3x3 cells around (cx, cy)
+static void gather_neighbors(graph_cut_impl_t *impl, int landmark,
+                             int64_t cx, int64_t cy, zarray_t *out)
+{
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            uint64_t key = cell_key(landmark, cx + dx, cy + dy);
+            int32_t idx;
+            if (!hypothesis_hash_get(impl->hash, &key, &idx))
+                continue;
+
+            for (; idx >= 0; idx = get_hypothesis(impl, idx)->next)
+                zarray_add(out, &idx);
+        }
+    }
+}
+
+// Takes the votes of idx back from its neighbours, then frees it.
+static void remove_hypothesis(graph_cut_t *cut, int32_t idx)
+{
+    graph_cut_impl_t *impl = cut->impl;
+    hypothesis_t *h = get_hypothesis(impl, idx);
+
+    zarray_clear(impl->neighbors);
+    gather_neighbors(impl, h->landmark, h->cx, h->cy, impl->neighbors);
+    for (int i = 0; i < zarray_size(impl->neighbors); i++) {
+        int32_t nidx;
+        zarray_get(impl->neighbors, i, &nidx);
+        hypothesis_t *e = get_hypothesis(impl, nidx);
+        if (nidx != idx && doubles_distance(e->xy, h->xy, 2) < cut->dist_err_tolerance)
+            e->votes--;
+    }
+
+    unlink_hypothesis(impl, idx);
+}
+
+struct clique_problem
+{
+    graph_cut_impl_t *impl;
+    zarray_t *candidates;
+    double tolerance;
+};
+
+static int hypotheses_consistent(int a, int b, void *user)
+{
+    struct clique_problem *cp = user;
+    int32_t ia, ib;
+    zarray_get(cp->candidates, a, &ia);
+    zarray_get(cp->candidates, b, &ib);
+    return doubles_distance(get_hypothesis(cp->impl, ia)->xy,
+                            get_hypothesis(cp->impl, ib)->xy, 2) < cp->tolerance;
+}
+
+// Votes only show that a hypothesis agrees with each voter, not that
+// the voters agree with each other. Graduate the largest mutually
+// consistent set around idx, if it is big enough.
+static void try_graduate(graph_cut_t *cut, int32_t idx)
+{
+    graph_cut_impl_t *impl = cut->impl;
+    hypothesis_t *h = get_hypothesis(impl, idx);
+
+    zarray_t *candidates = zarray_create(sizeof(int32_t));
+    gather_neighbors(impl, h->landmark, h->cx, h->cy, candidates);
+
+    struct clique_problem cp = { .impl = impl,
+                                 .candidates = candidates,
+                                 .tolerance = cut->dist_err_tolerance };
+    zarray_t *clique = pcm_max_clique(impl->pcm, zarray_size(candidates),
+                                      hypotheses_consistent, &cp);
+
+    if (zarray_size(clique) > cut->vote_thres) {
+        for (int i = 0; i < zarray_size(clique); i++) {
+            int c;
+            zarray_get(clique, i, &c);
+            int32_t gidx;
+            zarray_get(candidates, c, &gidx);
+            april_graph_factor_t *f = get_hypothesis(impl, gidx)->factor;
+            zarray_add(cut->graduate_factors, &f);
+            remove_hypothesis(cut, gidx);
+        }
+    }
+
+    zarray_destroy(clique);
+    zarray_destroy(candidates);
+}
+
+static void expire_hypotheses(graph_cut_t *cut, int newest_node)
+{
+    graph_cut_impl_t *impl = cut->impl;
+
+    while (impl->aging_head < zarray_size(impl->aging)) {
+        aging_entry_t *e;
+        zarray_get_volatile(impl->aging, impl->aging_head, &e);
+        if (newest_node - e->node <= cut->max_age)
+            break;
+
+        hypothesis_t *h = get_hypothesis(impl, e->idx);
+        // the slot may have graduated, and possibly been reused, since
+        if (h->factor != NULL && h->seq == e->seq) {
+            april_graph_factor_t *factor = h->factor;
+            remove_hypothesis(cut, e->idx);
+            factor->destroy(factor);
+        }
+        impl->aging_head++;
+    }
+
+    // compact once the consumed prefix dominates
+    if (impl->aging_head > 64 && impl->aging_head > zarray_size(impl->aging) / 2) {
+        int n = zarray_size(impl->aging) - impl->aging_head;
+        memmove(impl->aging->data,
+                impl->aging->data + impl->aging_head * impl->aging->el_sz,
+                n * impl->aging->el_sz);
+        zarray_truncate(impl->aging, n);
+        impl->aging_head = 0;
+    }
+}
+
+void graph_cut_add(graph_cut_t *cut, april_graph_factor_t* factor)
+{
+    assert(factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE);
+    //first node should always be landmark node
+    april_graph_node_t *landmark_node;
+    zarray_get(cut->graph->nodes, factor->nodes[0], &landmark_node);
+    assert(landmark_node->type == APRIL_GRAPH_NODE_XY_TYPE);
+
+    graph_cut_impl_t *impl = cut->impl;
+    int landmark = factor->nodes[0];
+    int node_idx = factor->nodes[1];
+
+    expire_hypotheses(cut, node_idx);
+
+    april_graph_node_t *node;
+    zarray_get(cut->graph->nodes, node_idx, &node);
+
+    hypothesis_t h = { .factor = factor, .seq = impl->seq++, .votes = 0, .next = -1 };
+    doubles_xyt_transform_xy(node->state, factor->u.common.z, h.xy);
+
+    double tol = cut->dist_err_tolerance;
+    int64_t cx = (int64_t) floor(h.xy[0] / tol);
+    int64_t cy = (int64_t) floor(h.xy[1] / tol);
+    h.landmark = landmark;
+    h.cx = cx;
+    h.cy = cy;
+    h.key = cell_key(landmark, cx, cy);
+
+    // vote against the existing hypotheses only
+    zarray_clear(impl->ready);
+    zarray_clear(impl->neighbors);
+    gather_neighbors(impl, landmark, cx, cy, impl->neighbors);
+    for (int i = 0; i < zarray_size(impl->neighbors); i++) {
+        int32_t idx;
+        zarray_get(impl->neighbors, i, &idx);
+        hypothesis_t *e = get_hypothesis(impl, idx);
+        if (doubles_distance(e->xy, h.xy, 2) >= tol)
+            continue;
+        h.votes++;
+        if (++e->votes >= cut->vote_thres)
+            zarray_add(impl->ready, &idx);
+    }
+
+    // insert at the head of its cell
+    int32_t slot;
+    if (zarray_size(impl->free_slots)) {
+        zarray_get(impl->free_slots, zarray_size(impl->free_slots) - 1, &slot);
+        zarray_truncate(impl->free_slots, zarray_size(impl->free_slots) - 1);
+    } else {
+        slot = zarray_size(impl->hypotheses);
+        zarray_add(impl->hypotheses, &h);
+    }
+    hypothesis_hash_get(impl->hash, &h.key, &h.next);
+    zarray_set(impl->hypotheses, slot, &h, NULL);
+    hypothesis_hash_put(impl->hash, &h.key, &slot, NULL, NULL);
+    impl->size++;
+
+    aging_entry_t age = { .idx = slot, .node = node_idx, .seq = h.seq };
+    zarray_add(impl->aging, &age);
+
+    if (h.votes >= cut->vote_thres)
+        zarray_add(impl->ready, &slot);
+
+    // the new hypothesis first: every clique it completes contains it
+    for (int i = zarray_size(impl->ready) - 1; i >= 0; i--) {
+        int32_t idx;
+        zarray_get(impl->ready, i, &idx);
+        // may have graduated with an earlier clique
+        if (get_hypothesis(impl, idx)->factor != NULL &&
+            get_hypothesis(impl, idx)->votes >= cut->vote_thres)
+            try_graduate(cut, idx);
+    }
+}
+
+int graph_cut_size(graph_cut_t *cut)
+{
+    graph_cut_impl_t *impl = cut->impl;
+    return impl->size;
+}
+
+void graph_cut_destroy(graph_cut_t* cut)
+{
+    if(cut == NULL)
+        return;
+
+    graph_cut_impl_t *impl = cut->impl;
+    for (int i = 0; i < zarray_size(impl->hypotheses); i++) {
+        hypothesis_t *h = get_hypothesis(impl, i);
+        if (h->factor)
+            h->factor->destroy(h->factor);
+    }
+    hypothesis_hash_destroy(impl->hash);
+    zarray_destroy(impl->hypotheses);
+    zarray_destroy(impl->free_slots);
+    zarray_destroy(impl->aging);
+    zarray_destroy(impl->ready);
+    zarray_destroy(impl->neighbors);
+    pcm_destroy(impl->pcm);
+    free(impl);
+
+    zarray_destroy(cut->graduate_factors);
+    free(cut);
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include "april_graph/april_graph.h"
+#include "common/zarray.h"
+
+// Landmark observations are held as hypotheses until enough of them
+// agree. Two hypotheses of the same landmark agree if the global
+// positions they imply (observation transformed by the observing
+// node, at the time the hypothesis was added) are within
+// dist_err_tolerance.
+//
+// Votes are maintained incrementally: a new hypothesis is only tested
+// against the hypotheses in the neighbouring cells of a spatial hash,
+// so the cost of an add does not grow with the number of times a
+// landmark has been observed. Once a hypothesis has vote_thres votes,
+// the largest mutually consistent set around it (april_graph/pcm.h)
+// graduates if it has more than vote_thres members. Hypotheses whose
+// observing node is more than max_age nodes older than the newest one
+// are dropped.
+typedef struct graph_cut graph_cut_t;
+struct graph_cut {
+    april_graph_t *graph;
+
+    int vote_thres;
+    double dist_err_tolerance;
+    int max_age;
+
+    // april_graph_factor_t*, filled by graph_cut_add(). Ownership of
+    // the factors passes to the caller, who should clear the array.
+    zarray_t *graduate_factors;
+
+    void *impl;
+};
+
+graph_cut_t *graph_cut_create(april_graph_t *g, int vote_thres, double dist_err_tolerance, int max_age);
+
+// factor must be an xyt factor from a landmark node (nodes[0]) to a
+// pose node (nodes[1]). The cut takes ownership of the factor.
+void graph_cut_add(graph_cut_t *cut, april_graph_factor_t *factor);
+
+// number of hypotheses currently waiting for votes
+int graph_cut_size(graph_cut_t *cut);
+
+void graph_cut_destroy(graph_cut_t *cut);
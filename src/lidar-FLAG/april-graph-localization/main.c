@@ -46,6 +46,8 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/gridmap.h"
 #include "common/gridmap_util.h"
 #include "common/http_advertiser.h"
+#include "common/instrument.h"
+#include "common/instrument_lcm.h"
 
 #include "vx/vx.h"
 #include "vx/webvx.h"
@@ -57,8 +59,17 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "lcmtypes/global_world_state_t.h"
 #include "lcmtypes/global_robot_state_t.h"
 #include "lcmtypes/line_features_t.h"
+#include "lcmtypes/corner_features_t.h"
 #include "lcmtypes/lcmdoubles_t.h"
 
+#include "lidar-FLAG/corner_features.h"
+#include "lidar-FLAG/landmark_map.h"
+#include "lidar-FLAG/pipeline_trace.h"
+#include "lidar-FLAG/world_tiles.h"
+#include "lidar-FLAG/trajectory_layer.h"
+
+#include "graph_cut.h"
+
 
 /**
  * Running program:
@@ -66,17 +77,21 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #define NUM_MIN 3
 #define DIST_ERR_THRES 0.1
+// landmark hypotheses not confirmed within this many nodes are dropped
+#define HYPOTHESIS_MAX_AGE 50
 #define D_THRESHOLD 0.5
+// corners below this detector quality are not associated
+#define MIN_CORNER_QUALITY 0.1
+// legacy line_features_t corners carry no covariance; this
+// reproduces the fixed range noise used before corner_features_t.
+#define LEGACY_CORNER_SIGMA 0.05
+// optimized nodes that moved less than this (m) since they were last
+// drawn are not redrawn
+#define GRAPH_RENDER_TOLERANCE 0.02
+// landmarks get graph nodes once the robot is within about this
+// distance (m) of their landmark_map tile
+#define LANDMARK_NODE_RADIUS 100
 double motion_noise[3] = { 0.1, 0.05, to_radians(0.1) };
-typedef struct {
-    april_graph_t *graph;
-    int nlandmark;
-    zarray_t *factor_hypotheses;
-
-    int vote_thres;
-    double dist_err_tolerance;
-    zarray_t *graduate_factors;
-} graph_cut_t;
 
 typedef struct state state_t;
 struct state{
@@ -86,14 +101,14 @@ struct state{
 
     const char *input_file_path;
 
-    zarray_t *landmarks;
+    landmark_map_t *landmarks;
 
     gps_lin_t *gps_lin;
     geo_image_t *geo_img;
 
     config_t *mission_config;
-    vx_object_t *world_img;
-    grid_map_t *gm;
+    world_tiles_t *world;
+    world_tiles_layer_t *world_layer;
 
     pthread_mutex_t mutex;
     pthread_mutex_t pose_lock;
@@ -108,113 +123,32 @@ struct state{
     double initial_position[3];
     bool is_start;
 
+    // protects the pose histories and the graph snapshot, which the
+    // render thread reads
+    pthread_mutex_t poses_lock;
+    int poses_epoch; // bumped when the histories restart
     zarray_t *odom_poses;
     zarray_t *lidar_poses;
+    zarray_t *graph_landmarks; // double[2], optimized landmark nodes
+    zarray_t *graph_poses;     // double[3], optimized pose nodes, as drawn
+    int graph_landmarks_version; // bumped when graph_landmarks changed
+    int graph_poses_epoch;     // bumped when drawn graph_poses moved
     april_graph_t *graph;
-    zarray_t *line_features_queue;
 
-    graph_cut_t *cut;
-};
+    // Landmark nodes are added to the graph as the robot nears them
+    // (see page_landmark_nodes), so graph nodes are a mix of poses and
+    // landmarks.
+    int *landmark_nodes;         // graph node of each map landmark, or -1
+    zarray_t *landmark_node_ids; // int, graph nodes of the landmarks
+    zarray_t *pose_node_ids;     // int, graph nodes of the poses, in order
+    double paged_xy[2];          // where landmark nodes were last paged in
+    zarray_t *corner_features_queue;
 
-graph_cut_t *graph_cut_create(april_graph_t *g, int nlandmarks,
-                              int vote_thres, double dist_err_tollerance)
-{
-    graph_cut_t *cut = calloc(1, sizeof(graph_cut_t));
-    cut->graph = g;
-    cut->nlandmark = nlandmarks;
-    cut->factor_hypotheses = zarray_create(sizeof(zarray_t*));
-    cut->vote_thres = vote_thres;
-    cut->dist_err_tolerance = dist_err_tollerance;
-    cut->graduate_factors = zarray_create(sizeof(april_graph_factor_t*));
-    for(int i=0; i<nlandmarks; i++) {
-        zarray_t *landmark_factors = zarray_create(sizeof(april_graph_factor_t*));
-        zarray_add(cut->factor_hypotheses, &landmark_factors);
-    }
-    return cut;
-}
-
-bool check_consistency(april_graph_t *graph, april_graph_factor_t *fa, april_graph_factor_t *fb, double thres)
-{
-    april_graph_node_t *na;
-    april_graph_node_t *nb;
-    zarray_get(graph->nodes, fa->nodes[1], &na);
-    zarray_get(graph->nodes, fb->nodes[1], &nb);
-    double pa[2];
-    double pb[2];
-    doubles_xyt_transform_xy(na->state, fa->u.common.z, pa);
-    doubles_xyt_transform_xy(nb->state, fb->u.common.z, pb);
-    if(doubles_distance(pa, pb, 2) < thres) {
-        return true;
-    }
-    return false;
-}
-
-void graph_cut_add(graph_cut_t *cut, april_graph_factor_t* factor)
-{
-    assert(factor->type == APRIL_GRAPH_FACTOR_XYT_TYPE);
-    zarray_t *landmark_factors;
-    //first node should always be landmark node
-    assert(factor->nodes[0] < cut->nlandmark);
-    zarray_get(cut->factor_hypotheses, factor->nodes[0], &landmark_factors);
-    if(!zarray_size(landmark_factors)) {
-        zarray_add(landmark_factors, &factor);
-        return;
-    }
-    zarray_add(landmark_factors, &factor);
-    int *votes = calloc(zarray_size(landmark_factors), sizeof(int));
-    //XXX: Instead of check most recent one, we recheck consistency of all before
-    /* april_graph_factor old_factor; */
-    /* for(int i=0 ; i<zarray_size(landmark_factors); i++) { */
-    /*     zarray_get(landmark_factors, i, &old_factor); */
-    /*     //check consistency between old factor and factor */
-    /* } */
-    april_graph_factor_t *fa;
-    april_graph_factor_t *fb;
-    for(int i=0 ; i<zarray_size(landmark_factors); i++) {
-        for(int j=i+1 ; j<zarray_size(landmark_factors); j++) {
-            zarray_get(landmark_factors, i, &fa);
-            zarray_get(landmark_factors, j, &fb);
-            //check consistency between old factor and factor
-            if(check_consistency(cut->graph, fa, fb, cut->dist_err_tolerance)) {
-                //printf("Vote++\n");
-                votes[i]++;
-                votes[j]++;
-            }
-        }
-    }
-    int idx = 0;
-    int loop_idx = 0;
-    while(loop_idx < zarray_size(landmark_factors)) {
-        zarray_get(landmark_factors, loop_idx, &fa);
-        if(votes[idx] >= cut->vote_thres) {
-            //printf("Graduate!\n");
-            zarray_add(cut->graduate_factors, &fa);
-            zarray_remove_index(landmark_factors, loop_idx, 0);
-        } else {
-            loop_idx++;
-        }
-        idx++;
-    }
-    free(votes);
-}
+    // latency traces of the queued features, by utime
+    pipeline_traces_t *traces;
 
-void graph_cut_destroy(graph_cut_t* cut)
-{
-    if(cut == NULL)
-        return;
-    zarray_t *landmark_factors;
-    april_graph_factor_t *factor;
-    for(int i = 0; i < cut->nlandmark; i++) {
-        zarray_get(cut->factor_hypotheses, i, &landmark_factors);
-        for(int j=0; j<zarray_size(landmark_factors); j++) {
-            zarray_get(landmark_factors, j, &factor);
-            //XXX: Destroy is not clean
-            factor->destroy(factor);
-        }
-        zarray_destroy(landmark_factors);
-    }
-    zarray_destroy(cut->factor_hypotheses);
-}
+    graph_cut_t *cut;
+};
 
 static void signal_handler(int signum)
 {
@@ -255,33 +189,31 @@ static void redraw_satellite(state_t *state)
     vx_buffer_swap(vb);
 }
 
+// pages in the world map tiles around the latest pose.
 static void redraw_global_world(state_t *state)
 {
-    if (state->world_img == NULL) {
+    if (state->world_layer == NULL) {
         return;
     }
-    vx_buffer_t *vb = vx_world_get_buffer(state->vw, "map");
-    vx_buffer_add_back(vb,
-                       vxo_depth_test(0,
-                                      vxo_matrix_xyt(state->lidar_to_img),
-                                      vxo_chain(vxo_matrix_translate(state->gm->x0, state->gm->y0, 0),
-                                                vxo_matrix_scale(state->gm->meters_per_pixel),
-                                                state->world_img,
-                                                NULL),
-                                      NULL),
-                       NULL);
 
-    vx_buffer_swap(vb);
+    double xyt[3];
+    int have_pose = 0;
+    pthread_mutex_lock(&state->poses_lock);
+    if (zarray_size(state->lidar_poses) > 0) {
+        zarray_get(state->lidar_poses, zarray_size(state->lidar_poses) - 1, xyt);
+        have_pose = 1;
+    }
+    pthread_mutex_unlock(&state->poses_lock);
 
+    world_tiles_layer_update(state->world_layer, state->lidar_to_img, have_pose ? xyt : NULL);
 }
 
 static void render_landmarks(state_t *state)
 {
     vx_buffer_t* vb = vx_world_get_buffer(state->vw, "landmarks");
     float xy[2];
-    for (int i = 0; i < zarray_size(state->landmarks); i++) {
-        double _xy[2];
-        zarray_get(state->landmarks, i, _xy);
+    for (int i = 0; i < landmark_map_size(state->landmarks); i++) {
+        const double *_xy = landmark_map_xy(state->landmarks, i);
         xy[0] = _xy[0];
         xy[1] = _xy[1];
         float *color = vx_white;
@@ -296,88 +228,187 @@ static void render_landmarks(state_t *state)
     vx_buffer_swap(vb);
 }
 
-static void render_graph(state_t *state, vx_buffer_t *vb, float color[4])
+// Returns 1 if the entries of 'drawn' and the states of the graph
+// nodes 'ids' (int) differ by more than GRAPH_RENDER_TOLERANCE in x or
+// y.
+static int graph_nodes_moved(const state_t *state, const zarray_t *drawn, const zarray_t *ids)
 {
-    for(int i=0; i<state->graph->nodes->size; i++ ) {
+    for (int i = 0; i < zarray_size(drawn); i++) {
+        const double *xy;
+        int id;
         april_graph_node_t *node;
-        zarray_get(state->graph->nodes, i, &node);
-        if(i < state->landmarks->size) {
-            //landmark node
-            vx_buffer_add_back(vb,
-                               vxo_depth_test(0,
-                                              vxo_matrix_translate(node->state[0], node->state[1], 0),
-                                              vxo_matrix_scale(0.5),
-                                              vxo_square_solid(vx_green),
-                                              NULL),
-                               NULL);
+        zarray_get_volatile(drawn, i, &xy);
+        zarray_get(ids, i, &id);
+        zarray_get(state->graph->nodes, id, &node);
+        if (fabs(node->state[0] - xy[0]) > GRAPH_RENDER_TOLERANCE ||
+            fabs(node->state[1] - xy[1]) > GRAPH_RENDER_TOLERANCE)
+            return 1;
+    }
+    return 0;
+}
 
+// Updates the node states the render thread draws. New pose nodes are
+// appended, so that the trajectory can be extended incrementally; the
+// drawn states are only refreshed in full (bumping graph_poses_epoch
+// or graph_landmarks_version) once an optimization moved one of them
+// noticeably. Call with poses_lock held.
+static void snapshot_graph(state_t *state)
+{
+    int nlandmarks = zarray_size(state->landmark_node_ids);
+    int nposes = zarray_size(state->pose_node_ids);
+
+    if (zarray_size(state->graph_landmarks) != nlandmarks ||
+        graph_nodes_moved(state, state->graph_landmarks, state->landmark_node_ids)) {
+        zarray_clear(state->graph_landmarks);
+        for (int i = 0; i < nlandmarks; i++) {
+            int id;
+            april_graph_node_t *node;
+            zarray_get(state->landmark_node_ids, i, &id);
+            zarray_get(state->graph->nodes, id, &node);
+            zarray_add(state->graph_landmarks, node->state);
         }
-        else {
-            vx_buffer_add_back(vb,
-                               vxo_depth_test(0,
-                                              vxo_matrix_xyt(node->state),
-                                              vxo_robot_solid(color),
-                                              NULL),
-                               NULL);
-        }
+        state->graph_landmarks_version++;
+    }
+
+    if (zarray_size(state->graph_poses) > nposes ||
+        graph_nodes_moved(state, state->graph_poses, state->pose_node_ids)) {
+        zarray_clear(state->graph_poses);
+        state->graph_poses_epoch++;
+    }
+    for (int i = zarray_size(state->graph_poses); i < nposes; i++) {
+        int id;
+        april_graph_node_t *node;
+        zarray_get(state->pose_node_ids, i, &id);
+        zarray_get(state->graph->nodes, id, &node);
+        zarray_add(state->graph_poses, node->state);
     }
 }
 
-static void render_poses(zarray_t *poses, vx_buffer_t *vb, float color[4])
+// Landmark nodes are redrawn only when snapshot_graph() refreshed them.
+static void render_graph_landmarks(state_t *state, vx_buffer_t *vb, int *version)
 {
-    double pose[3];
-    for(int i=0; i < zarray_size(poses); i++) {
-        zarray_get(poses, i, pose);
+    pthread_mutex_lock(&state->poses_lock);
+    if (*version == state->graph_landmarks_version) {
+        pthread_mutex_unlock(&state->poses_lock);
+        return;
+    }
+    *version = state->graph_landmarks_version;
+    zarray_t *landmarks = zarray_copy(state->graph_landmarks);
+    pthread_mutex_unlock(&state->poses_lock);
+
+    for(int i=0; i<zarray_size(landmarks); i++ ) {
+        double *xy;
+        zarray_get_volatile(landmarks, i, &xy);
         vx_buffer_add_back(vb,
                            vxo_depth_test(0,
-                                          vxo_matrix_xyt(pose),
-                                          vxo_robot_solid(color),
+                                          vxo_matrix_translate(xy[0], xy[1], 0),
+                                          vxo_matrix_scale(0.5),
+                                          vxo_square_solid(vx_green),
                                           NULL),
                            NULL);
     }
+    vx_buffer_swap(vb);
+
+    zarray_destroy(landmarks);
 }
 
 static void* render_loop(void *user)
 {
     state_t *state = (state_t*)user;
     timeutil_rest_t *rt = timeutil_rest_create();
-    vx_buffer_t *vb_lidar = vx_world_get_buffer(state->vw, "Lidar-positions");
-    vx_buffer_t *vb_odom = vx_world_get_buffer(state->vw, "Odom-positions");
-    vx_buffer_t *vb_flag = vx_world_get_buffer(state->vw, "Flag-positions");
+    trajectory_layer_t *tl_lidar = trajectory_layer_create(state->vw, "Lidar-positions", vx_yellow);
+    trajectory_layer_t *tl_odom = trajectory_layer_create(state->vw, "Odom-positions", vx_blue);
+    trajectory_layer_t *tl_graph = trajectory_layer_create(state->vw, "Flag-positions", vx_red);
+    vx_buffer_t *vb_landmarks = vx_world_get_buffer(state->vw, "Graph-landmarks");
+    int epoch = 0;
+    int graph_epoch = 0;
+    int landmarks_version = 0;
     while(1) {
         timeutil_sleep_hz(rt, 10);
         /*
           double xyt_global[3];
           doubles_xyt_mul(state->l2g, state->xyt_local, xyt_global);
         */
-        render_graph(state, vb_flag, vx_red);
-        render_poses(state->lidar_poses, vb_lidar, vx_yellow);
-        render_poses(state->odom_poses, vb_odom, vx_blue);
+        pthread_mutex_lock(&state->poses_lock);
+        if (epoch != state->poses_epoch) {
+            epoch = state->poses_epoch;
+            trajectory_layer_reset(tl_lidar);
+            trajectory_layer_reset(tl_odom);
+        }
+        // the optimization moved poses already drawn
+        if (graph_epoch != state->graph_poses_epoch) {
+            graph_epoch = state->graph_poses_epoch;
+            trajectory_layer_reset(tl_graph);
+        }
+        pthread_mutex_unlock(&state->poses_lock);
 
-        vx_buffer_swap(vb_lidar);
-        vx_buffer_swap(vb_odom);
-        vx_buffer_swap(vb_flag);
+        render_graph_landmarks(state, vb_landmarks, &landmarks_version);
+        trajectory_layer_update(tl_graph, state->graph_poses, &state->poses_lock);
+        redraw_global_world(state);
+        trajectory_layer_update(tl_lidar, state->lidar_poses, &state->poses_lock);
+        trajectory_layer_update(tl_odom, state->odom_poses, &state->poses_lock);
     }
     return NULL;
 }
 
-static void load_landmark_nodes(state_t *state)
+// Returns the graph node of map landmark idx, adding it (and its
+// prior) if it has none yet.
+static int add_landmark_node(state_t *state, int idx)
 {
-    for(int i = 0; i < zarray_size(state->landmarks); i++) {
-        double xy[2];
-        zarray_get(state->landmarks, i, xy);
-        //add xy node
-        april_graph_node_t *node = april_graph_node_xy_create(xy, xy, xy);
-        zarray_add(state->graph->nodes, &node);
-        //add xypos factor
-        matd_t *W = matd_create(2, 2);
-        MATD_EL(W, 0, 0) = 1.0 / pow(0.1, 2);
-        MATD_EL(W, 1, 1) = 1.0 / pow(0.1, 2);
-        april_graph_factor_t *factor = april_graph_factor_xypos_create(i, xy, NULL, W);
-        april_graph_factor_attr_put(factor, NULL, "type", strdup("landmark"));
-        zarray_add(state->graph->factors, &factor);
-        matd_destroy(W);
-    }
+    if (state->landmark_nodes[idx] >= 0)
+        return state->landmark_nodes[idx];
+
+    double xy[2] = { landmark_map_xy(state->landmarks, idx)[0],
+                     landmark_map_xy(state->landmarks, idx)[1] };
+    //add xy node
+    april_graph_node_t *node = april_graph_node_xy_create(xy, xy, xy);
+    int id = zarray_size(state->graph->nodes);
+    zarray_add(state->graph->nodes, &node);
+    state->landmark_nodes[idx] = id;
+    zarray_add(state->landmark_node_ids, &id);
+
+    //add xypos factor, trusting surveyed landmarks more if the map says so
+    const struct landmark_map_meta *meta = landmark_map_get_meta(state->landmarks, idx);
+    double sigma = (meta && meta->sigma > 0) ? meta->sigma : 0.1;
+    matd_t *W = matd_create(2, 2);
+    MATD_EL(W, 0, 0) = 1.0 / pow(sigma, 2);
+    MATD_EL(W, 1, 1) = 1.0 / pow(sigma, 2);
+    april_graph_factor_t *factor = april_graph_factor_xypos_create(id, xy, NULL, W);
+    april_graph_factor_attr_put(factor, NULL, "type", strdup("landmark"));
+    zarray_add(state->graph->factors, &factor);
+    matd_destroy(W);
+    return id;
+}
+
+static void page_landmark(int idx, const double xy[2], void *user)
+{
+    add_landmark_node(user, idx);
+}
+
+// Adds nodes for the landmarks in the landmark_map tiles within
+// LANDMARK_NODE_RADIUS of xy. Only rescans once the robot has moved a
+// quarter of that since the last scan, unless 'force'.
+static void page_landmark_nodes(state_t *state, const double xy[2], int force)
+{
+    if (!force && doubles_distance(xy, state->paged_xy, 2) < LANDMARK_NODE_RADIUS / 4.0)
+        return;
+
+    memcpy(state->paged_xy, xy, sizeof(double)*2);
+    landmark_map_foreach_in_box(state->landmarks,
+                                xy[0] - LANDMARK_NODE_RADIUS, xy[1] - LANDMARK_NODE_RADIUS,
+                                xy[0] + LANDMARK_NODE_RADIUS, xy[1] + LANDMARK_NODE_RADIUS,
+                                page_landmark, state);
+}
+
+// Forgets every node, e.g. for a new graph.
+static void reset_graph_nodes(state_t *state)
+{
+    free(state->landmark_nodes);
+    state->landmark_nodes = malloc(sizeof(int) * (landmark_map_size(state->landmarks) + 1));
+    for (int i = 0; i < landmark_map_size(state->landmarks); i++)
+        state->landmark_nodes[i] = -1;
+    zarray_clear(state->landmark_node_ids);
+    zarray_clear(state->pose_node_ids);
 }
 
 void start_flag(state_t *state)
@@ -398,34 +429,41 @@ void start_flag(state_t *state)
                        NULL);
     vx_buffer_swap(vb);
 
-    zarray_clear(state->odom_poses);
-    zarray_clear(state->lidar_poses);
     //XXX: Memory leak here;
     april_graph_destroy(state->graph);
     state->graph = april_graph_create();
     graph_cut_destroy(state->cut);
-    state->cut = graph_cut_create(state->graph, zarray_size(state->landmarks), NUM_MIN, DIST_ERR_THRES);
-    load_landmark_nodes(state);
+    state->cut = graph_cut_create(state->graph, NUM_MIN, DIST_ERR_THRES, HYPOTHESIS_MAX_AGE);
+    reset_graph_nodes(state);
 
+    pthread_mutex_lock(&state->poses_lock);
+    zarray_clear(state->odom_poses);
+    zarray_clear(state->lidar_poses);
     zarray_add(state->odom_poses, state->initial_position);
     zarray_add(state->lidar_poses, state->initial_position);
+    state->poses_epoch++;
+    snapshot_graph(state);
+    pthread_mutex_unlock(&state->poses_lock);
 
     //add a new node into aprilgraph;
     april_graph_node_t *node = april_graph_node_xyt_create(state->initial_position,
                                                            state->initial_position,
                                                            state->initial_position);
+    int id = zarray_size(state->graph->nodes);
     zarray_add(state->graph->nodes, &node);
+    zarray_add(state->pose_node_ids, &id);
     //add a xytpos factor
     matd_t *W = matd_create(3, 3);
     MATD_EL(W, 0, 0) = 1.0 / pow(0.01, 2);
     MATD_EL(W, 1, 1) = 1.0 / pow(0.01, 2);
     MATD_EL(W, 2, 2) = 1.0 / pow(0.001, 2);
-    april_graph_factor_t *factor = april_graph_factor_xytpos_create(zarray_size(state->graph->nodes)-1,
-                                                                    state->initial_position, NULL, W);
+    april_graph_factor_t *factor = april_graph_factor_xytpos_create(id, state->initial_position, NULL, W);
     april_graph_factor_attr_put(factor, NULL, "type", strdup("Initial"));
     zarray_add(state->graph->factors, &factor);
     matd_destroy(W);
 
+    page_landmark_nodes(state, state->initial_position, 1);
+
     pthread_mutex_unlock(&state->mutex);
 
 }
@@ -554,13 +592,6 @@ static void on_l2g(const lcm_recv_buf_t *rbuf,
     pthread_mutex_unlock(&state->mutex);
 }
 
-static void floats_to_doubles(float *f, double *d, int len)
-{
-    for(int i = 0; i<len; i++) {
-        d[i] = f[i];
-    }
-}
-
 static void optimize_cholesky(state_t *state)
 {
     //int64_t utime0 = utime_now();
@@ -572,48 +603,88 @@ static void optimize_cholesky(state_t *state)
     //printf("optimized using cholesky (%.3f s)\n", (utime1 - utime0) / 1.0E6);
 }
 
-static int find_landmark(state_t *state, double _xy[3], double threshold)
+static int find_landmark(state_t *state, double _xy[2], double threshold)
 {
-    double dist_thresh = threshold;
-    int32_t closest_id = -1;
-    double closest_dist = dist_thresh;
+    return landmark_map_find_nearest(state->landmarks, _xy, threshold);
+}
 
-    double xy[2];
-    for (int i = 0; i < zarray_size(state->landmarks); i++) {
-        zarray_get(state->landmarks, i, xy);
-        double dist = doubles_distance(_xy, xy, 2);
-        if (dist < closest_dist) {
-            closest_dist = dist;
-            closest_id = i;
-        }
+static void on_corner_features(const lcm_recv_buf_t *rbuf, const char *channel,
+                               const corner_features_t *msg, void *user)
+{
+    state_t *state = user;
+    if (!corner_features_valid(msg)) {
+        printf("WRN: dropping corner_features_t (version %d, %d corners)\n",
+               msg->version, msg->ncorners);
+        return;
     }
+    pipeline_traces_stamp(state->traces, msg->utime, "features_received", rbuf->recv_utime);
 
-    return closest_id;
+    pthread_mutex_lock(&state->mutex);
+    corner_features_t *corner_f = corner_features_t_copy(msg);
+    zarray_add(state->corner_features_queue, &corner_f);
+    pthread_mutex_unlock(&state->mutex);
 }
 
 static void on_line_features(const lcm_recv_buf_t *rbuf, const char *channel,
                              const line_features_t *msg, void *user)
 {
     state_t *state = user;
+    pipeline_traces_stamp(state->traces, msg->utime, "features_received", rbuf->recv_utime);
+
     pthread_mutex_lock(&state->mutex);
-    line_features_t *line_f = line_features_t_copy(msg);
-    zarray_add(state->line_features_queue, &line_f);
+    corner_features_t *corner_f = corner_features_from_line_features(msg, LEGACY_CORNER_SIGMA);
+    zarray_add(state->corner_features_queue, &corner_f);
     pthread_mutex_unlock(&state->mutex);
 }
 
-void line_feature_process(state_t *state, line_features_t *line_f)
+static void on_features_trace(const lcm_recv_buf_t *rbuf, const char *channel,
+                              const pipeline_trace_t *msg, void *user)
+{
+    state_t *state = user;
+    pipeline_traces_add_upstream(state->traces, msg);
+}
+
+// Information matrix of an xyt corner observation, whose covariance
+// has been through flag_corner_regularize_cov(). theta is the bearing
+// and is not used by the consistency check, so it keeps unit weight.
+static matd_t *corner_information(const flag_corner_t *c)
+{
+    double det = c->cov[0]*c->cov[2] - c->cov[1]*c->cov[1];
+    matd_t *W = matd_identity(3);
+    MATD_EL(W, 0, 0) = c->cov[2] / det;
+    MATD_EL(W, 0, 1) = -c->cov[1] / det;
+    MATD_EL(W, 1, 0) = -c->cov[1] / det;
+    MATD_EL(W, 1, 1) = c->cov[0] / det;
+    return W;
+}
+
+// Range variance of a corner observation, recovered from the
+// information matrix built by corner_information().
+static double corner_range_variance(april_graph_factor_t *factor)
+{
+    const double *z = factor->u.common.z;
+    const matd_t *W = factor->u.common.W;
+    double det = MATD_EL(W, 0, 0)*MATD_EL(W, 1, 1) - MATD_EL(W, 0, 1)*MATD_EL(W, 1, 0);
+    flag_corner_t c = { .xy = { z[0], z[1] },
+                        .cov = { MATD_EL(W, 1, 1) / det, -MATD_EL(W, 0, 1) / det, MATD_EL(W, 0, 0) / det } };
+    double var[2];
+    flag_corner_range_bearing_variance(&c, var);
+    return var[0];
+}
+
+void corner_feature_process(state_t *state, corner_features_t *corner_f)
 {
     pose_t pose_local;
     int ret;
     lcmdoubles_t pose;
     pthread_mutex_lock(&state->pose_lock);
     if ((ret = interpolator_get(state->pose_interp,
-                                line_f->utime,
+                                corner_f->utime,
                                 &pose_local)))
     {
         if(ret == -1) {
             printf("No POSE (single side)\n");
-            printf("time diff: %f ms \n", (line_f->utime - pose_local.utime) * 1E-3);
+            printf("time diff: %f ms \n", (corner_f->utime - pose_local.utime) * 1E-3);
         }
         if(ret == -2) {
             printf("No POSE(double side)\n");
@@ -647,12 +718,16 @@ void line_feature_process(state_t *state, line_features_t *line_f)
         return;
     }
     april_graph_node_t *last_node;
-    int last_node_idx = zarray_size(state->graph->nodes)-1;
+    int last_node_idx;
+    zarray_get(state->pose_node_ids, zarray_size(state->pose_node_ids)-1, &last_node_idx);
     zarray_get(state->graph->nodes, last_node_idx, &last_node);
     double nstate[3];
     doubles_xyt_mul(last_node->state, z, nstate);
     april_graph_node_t *new_node = april_graph_node_xyt_create(nstate, nstate, nstate);
+    int new_node_idx = zarray_size(state->graph->nodes);
     zarray_add(state->graph->nodes, &new_node);
+    zarray_add(state->pose_node_ids, &new_node_idx);
+    page_landmark_nodes(state, nstate, 0);
 
     //add odometry factor
     matd_t *W = matd_create(3, 3);
@@ -660,26 +735,32 @@ void line_feature_process(state_t *state, line_features_t *line_f)
     MATD_EL(W, 1, 1) = 1.0 / pow(motion_noise[1], 2);
     MATD_EL(W, 2, 2) = 1.0 / pow(motion_noise[2], 2);
 
-    april_graph_factor_t *factor = april_graph_factor_xyt_create(last_node_idx, zarray_size(state->graph->nodes)-1,
+    april_graph_factor_t *factor = april_graph_factor_xyt_create(last_node_idx, new_node_idx,
                                                                  z, NULL, W);
     april_graph_factor_attr_put(factor, NULL, "type", strdup("odom"));
     zarray_add(state->graph->factors, &factor);
 
     //double flag_pose[3];
-    if(!line_f->lines_data_length) {
+    if(!corner_f->ncorners) {
         goto line_feature_cleanup;
     }
 
     //Data association here
-    for (int i = 0; i < line_f->lines_data_length / 3; i++) {
+    for (int i = 0; i < corner_f->ncorners; i++) {
+        flag_corner_t corner;
+        corner_features_get(corner_f, i, &corner);
+        if (corner.quality < MIN_CORNER_QUALITY || !flag_corner_regularize_cov(&corner))
+            continue;
+
         //transform local points to global
-        double local_corner[3];
+        double local_corner[3] = { corner.xy[0], corner.xy[1], corner.theta };
         double global_corner_position[2];
-        floats_to_doubles(&line_f->lines[3*i], local_corner, 3);
         doubles_xyt_transform_xy(new_node->state, local_corner, global_corner_position);
         const double d_threshold = D_THRESHOLD;
-        int idx = find_landmark(state, global_corner_position, d_threshold);
-        if(idx != -1) {
+        int landmark_idx = find_landmark(state, global_corner_position, d_threshold);
+        if(landmark_idx != -1) {
+            // usually paged in already
+            int idx = add_landmark_node(state, landmark_idx);
             //TODO: Instead of directly adding a factor, we add a potential factor, if enough observations are consistent,
             //we will add a factor. Instead of use graph-cut to check consistency, maybe it is easiser use a simpler version of loopval.
             //graph_cut_create(graph, num_of_landmark_nodes);
@@ -692,8 +773,8 @@ void line_feature_process(state_t *state, line_features_t *line_f)
                 MATD_EL(W1, 0, 0) = 1.0 / pow(0.05, 2);
                 matd_t *W2 = matd_op("0.01*M", W1);
                 double z = doubles_magnitude(local_corner, 2);
-                april_graph_factor_t *factor1 = april_graph_factor_r_create(idx, zarray_size(state->graph->nodes)-1, &z, &z, W1);
-                april_graph_factor_t *factor2 = april_graph_factor_r_create(idx, zarray_size(state->graph->nodes)-1, &z, &z, W2);
+                april_graph_factor_t *factor1 = april_graph_factor_r_create(idx, new_node_idx, &z, &z, W1);
+                april_graph_factor_t *factor2 = april_graph_factor_r_create(idx, new_node_idx, &z, &z, W2);
 
                 april_graph_factor_t *maxfactor = april_graph_factor_max_create(
                     (april_graph_factor_t*[]) { factor1, factor2 },
@@ -704,8 +785,8 @@ void line_feature_process(state_t *state, line_features_t *line_f)
                 matd_destroy(W2);
             }
             else if(choose == 1) {
-                matd_t *W = matd_identity(3);
-                april_graph_factor_t *factor = april_graph_factor_xyt_create(idx, zarray_size(state->graph->nodes)-1,
+                matd_t *W = corner_information(&corner);
+                april_graph_factor_t *factor = april_graph_factor_xyt_create(idx, new_node_idx,
                                                                              local_corner,
                                                                              NULL,
                                                                              W);
@@ -715,7 +796,7 @@ void line_feature_process(state_t *state, line_features_t *line_f)
                     zarray_get(state->cut->graduate_factors, i, &factor);
                     double z =  doubles_magnitude(factor->u.common.z, 2);
                     matd_t *W1 = matd_identity(1);
-                    MATD_EL(W1, 0, 0) = 1.0 / pow(0.05, 2);
+                    MATD_EL(W1, 0, 0) = 1.0 / corner_range_variance(factor);
                     matd_t *W2 = matd_op("0.01*M", W1);
                     april_graph_factor_t *factor1 = april_graph_factor_r_create(factor->nodes[0], factor->nodes[1], &z, &z, W1);
                     april_graph_factor_t *factor2 = april_graph_factor_r_create(factor->nodes[0], factor->nodes[1], &z, &z, W2);
@@ -737,22 +818,32 @@ void line_feature_process(state_t *state, line_features_t *line_f)
     }
 
   line_feature_cleanup:
-    optimize_cholesky(state);
+    {
+        INSTRUMENT_SPAN_BEGIN(ns_solve);
+        optimize_cholesky(state);
+        INSTRUMENT_SPAN_END("graph.solve", ns_solve);
+    }
+    pipeline_traces_stamp(state->traces, corner_f->utime, "solve_done", utime_now());
     //check movement
     //publish states
 
-    pose.utime = line_f->utime;
+    pose.utime = corner_f->utime;
     pose.ndata = 3;
-    pose.data = lidar_pose;
+    pthread_mutex_lock(&state->poses_lock);
     zarray_add(state->lidar_poses, lidar_pose);
+    zarray_add(state->odom_poses, odom_pose);
+    snapshot_graph(state);
+    pthread_mutex_unlock(&state->poses_lock);
+
+    pose.data = lidar_pose;
     lcmdoubles_t_publish(state->lcm, "FLAG.LIDAR-POSE", &pose);
 
     pose.data = odom_pose;
-    zarray_add(state->odom_poses, odom_pose);
     lcmdoubles_t_publish(state->lcm, "FLAG.ODOM-POSE", &pose);
 
     pose.data = new_node->state;
     lcmdoubles_t_publish(state->lcm, "FLAG.FLAG-POSE", &pose);
+    pipeline_traces_stamp(state->traces, corner_f->utime, "pose_published", utime_now());
 }
 
 void *line_f_thread(void *user)
@@ -766,103 +857,52 @@ void *line_f_thread(void *user)
         timeutil_usleep(100000);
         pthread_mutex_lock(&state->mutex);
         // Don't get too far behind
-        while (zarray_size(state->line_features_queue) > high_water) {
-            line_features_t *l_f = NULL;
-            zarray_get(state->line_features_queue, 0, &l_f);
-            zarray_remove_index(state->line_features_queue, 0, 0);
-            line_features_t_destroy(l_f);
+        while (zarray_size(state->corner_features_queue) > high_water) {
+            corner_features_t *c_f = NULL;
+            zarray_get(state->corner_features_queue, 0, &c_f);
+            zarray_remove_index(state->corner_features_queue, 0, 0);
+            pipeline_traces_stamp(state->traces, c_f->utime, PIPELINE_TRACE_DROPPED, utime_now());
+            pipeline_traces_finish(state->traces, c_f->utime);
+            corner_features_t_destroy(c_f);
+            INSTRUMENT_COUNT("graph.features_dropped", 1);
         }
 
         // Wait if no data
-        if (zarray_size(state->line_features_queue) < low_water) {
+        if (zarray_size(state->corner_features_queue) < low_water) {
             pthread_mutex_unlock(&state->mutex);
             continue;
         }
 
-        line_features_t *l_f = NULL;
-        zarray_get(state->line_features_queue, 0, &l_f);
-        zarray_remove_index(state->line_features_queue, 0, 0);
+        corner_features_t *c_f = NULL;
+        zarray_get(state->corner_features_queue, 0, &c_f);
+        zarray_remove_index(state->corner_features_queue, 0, 0);
         pthread_mutex_unlock(&state->mutex);
-        if(state->is_start)
-            line_feature_process(state, l_f);
-        line_features_t_destroy(l_f);
-    }
-
-    return NULL;
-}
-
-vx_object_t* make_gws_from_file(state_t *state, const char *path)
-{
-    global_world_state_t *gws = NULL;
-    vx_object_t *vxo = NULL;
-
-    FILE *fp = fopen(path, "r");
-    fseek(fp, 0L, SEEK_END);
-    long len = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-
-    uint8_t *buf = malloc(len);
-    size_t sz = fread(buf, 1, len, fp);
-
-    if (sz != len)
-        goto cleanup;
-
-    uint32_t pos = 0;
-    gws = stype_decode_object(buf, &pos, len, NULL);
-    printf("NFO: Loaded global_world_state_t from %s - %ld bytes\n", path, len);
 
-
-    grid_map_t *gm = NULL;
-    switch (gws->global_map.encoding) {
-        case GRID_MAP_T_ENCODING_NONE:
-            gm = gridmap_copy(&gws->global_map);
-            break;
-        case GRID_MAP_T_ENCODING_GZIP:
-            gm = grid_map_t_decode_gzip(&gws->global_map);
-            break;
-        default:
-            printf("ERR: encoding type %d not supported\n", gws->global_map.encoding);
-            exit(1);
+        pipeline_traces_stamp(state->traces, c_f->utime, "features_dequeued", utime_now());
+        if(state->is_start) {
+            INSTRUMENT_SPAN_BEGIN(ns_update);
+            corner_feature_process(state, c_f);
+            INSTRUMENT_SPAN_END("graph.update", ns_update);
+        }
+        // complete if a pose was published, otherwise up to the dequeue
+        pipeline_traces_finish(state->traces, c_f->utime);
+        corner_features_t_destroy(c_f);
     }
 
-
-    image_u8_t *im = image_u8_create(gm->width, gm->height);
-    for (int y = 0; y < gm->height; y++)
-        memcpy(&im->buf[y*im->stride], &gm->data[y*gm->width], gm->width);
-
-    vx_resource_t *tex = vx_resource_make_texture_u8_copy(im, 0);
-    image_u8_destroy(im);
-
-    vxo = vxo_image_tile(tex,
-                         vx_nada,
-                         vx_gray,
-                         vx_maroon,
-                         vx_orange);
-    state->gm = gm;
-    global_world_state_t_destroy(gws);
-
-  cleanup:
-    free(buf);
-    fclose(fp);
-    return vxo;
+    return NULL;
 }
 
 void read_landmarks(state_t *state)
 {
-    FILE *f = fopen(state->input_file_path, "r");
-
-    float x;
-    float y;
-    if(f) {
-        while (fscanf(f, "%f,%f", &x, &y) != EOF) {
-            double *xy = (double*) calloc(2, sizeof(float));
-            xy[0] = x;
-            xy[1] = y;
-            zarray_add(state->landmarks, xy);
-        }
-        printf("Read in %d landmarks \n", zarray_size(state->landmarks));
-        fclose(f);
+    landmark_map_t *map = landmark_map_open(state->input_file_path);
+    if (map == NULL) {
+        printf("ERR: unable to read landmarks from %s\n", state->input_file_path);
+        return;
     }
+
+    landmark_map_destroy(state->landmarks);
+    state->landmarks = map;
+    printf("Read in %d landmarks \n", landmark_map_size(state->landmarks));
 }
 
 void setup_geo(state_t *state, getopt_t *gopt)
@@ -916,10 +956,12 @@ int main(int argc, char *argv[])
 
     getopt_t *gopt = getopt_create();
     getopt_add_int(gopt, 'p', "port", "8891", "jsvx server port");
-    getopt_add_string(gopt, 'i', "in-file", "", "input feature file");
+    getopt_add_string(gopt, 'i', "in-file", "", "input landmark map (binary or csv)");
     getopt_add_string(gopt, 'f', "image", "", "satellite image file path");
-    getopt_add_string(gopt, '\0', "world", "", "global world image file path");
+    getopt_add_string(gopt, '\0', "world", "", "global world image file path (tiled or legacy)");
+    getopt_add_double(gopt, '\0', "world-radius", "150", "display world map tiles within this distance (m)");
     getopt_add_string(gopt, 'm', "mission-config", "", "Config file for mission");
+    getopt_add_double(gopt, '\0', "instrument-hz", "1", "INSTRUMENT report rate (0 = none)");
 
     if (!getopt_parse(gopt, argc, argv, 1)) {
         getopt_do_usage(gopt);
@@ -947,8 +989,8 @@ int main(int argc, char *argv[])
                                        NULL,
                                        "index.html");
 
-    //each element contains (x,y) position of the landmark in global frame.
-    state->landmarks = zarray_create(2*sizeof(double));
+    // (x,y) positions of the landmarks in global frame.
+    state->landmarks = landmark_map_create(NULL, NULL, 0, LANDMARK_MAP_DEFAULT_TILE_SIZE);
     webvx_define_canvas(state->webvx,
                         "flag-map-generator-Canvas",
                         on_create_canvas,
@@ -964,18 +1006,28 @@ int main(int argc, char *argv[])
 
     if (strlen(getopt_get_string(gopt, "world"))) {
         printf("Load world file from: %s\n", getopt_get_string(gopt, "world"));
-        state->world_img = make_gws_from_file(state, getopt_get_string(gopt, "world"));
-        redraw_global_world(state);
+        state->world = world_tiles_open(getopt_get_string(gopt, "world"));
+        if (state->world == NULL)
+            printf("ERR: unable to read world map %s\n", getopt_get_string(gopt, "world"));
+        else
+            state->world_layer = world_tiles_layer_create(state->vw, "map", state->world,
+                                                          getopt_get_double(gopt, "world-radius"), 0);
     }
 
     //Initilize variables
     state->graph = april_graph_create();
-    load_landmark_nodes(state);
+    state->landmark_node_ids = zarray_create(sizeof(int));
+    state->pose_node_ids = zarray_create(sizeof(int));
+    reset_graph_nodes(state);
     state->odom_poses = zarray_create(sizeof(double[3]));
     state->lidar_poses = zarray_create(sizeof(double[3]));
-    state->line_features_queue = zarray_create(sizeof(line_features_t*));
+    state->graph_landmarks = zarray_create(sizeof(double[2]));
+    state->graph_poses = zarray_create(sizeof(double[3]));
+    pthread_mutex_init(&state->poses_lock, NULL);
+    state->corner_features_queue = zarray_create(sizeof(corner_features_t*));
+    state->traces = pipeline_traces_create("FLAG-graph", state->lcm, PIPELINE_TRACE_CHANNEL);
 
-    state->cut = graph_cut_create(state->graph, zarray_size(state->landmarks), NUM_MIN, DIST_ERR_THRES);
+    state->cut = graph_cut_create(state->graph, NUM_MIN, DIST_ERR_THRES, HYPOTHESIS_MAX_AGE);
 
     pthread_mutex_init(&state->mutex, NULL);
     pthread_mutex_init(&state->pose_lock, NULL);
@@ -987,13 +1039,19 @@ int main(int argc, char *argv[])
                            4, offsetof(pose_t, orientation));
 
 
+    corner_features_t_subscribe(state->lcm, "LOCAL_CORNER_FEATURES", on_corner_features, state);
     line_features_t_subscribe(state->lcm,"LOCAL_LINE_FEATURES", on_line_features, state);
     pose_t_subscribe(state->lcm, "POSE", on_pose, state);
     lcmdoubles_t_subscribe(state->lcm, "L2G_SCANMATCH", on_l2g, state);
+    pipeline_trace_t_subscribe(state->lcm, PIPELINE_TRACE_FEATURES_CHANNEL, on_features_trace, state);
 
     http_advertiser_create(state->lcm, getopt_get_int(gopt, "port"),
                            "FLAG localization", "FLAG localization");
 
+    if (getopt_get_double(gopt, "instrument-hz") > 0)
+        instrument_publisher_create(state->lcm, INSTRUMENT_CHANNEL, "FLAG-graph",
+                                    getopt_get_double(gopt, "instrument-hz"));
+
 
 
     pthread_t render_thread;
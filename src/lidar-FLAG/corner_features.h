@@ -0,0 +1,235 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "common/float16.h"
+#include "common/math_util.h"
+
+#include "lcmtypes/corner_features_t.h"
+#include "lcmtypes/line_features_t.h"
+
+// Helpers shared by velodyne-to-corner (packing) and the FLAG
+// localizers (unpacking) for corner_features_t.
+
+// 2mm resolution, +/- 65m range. Messages with corners further out
+// use a coarser scale (see corner_features_create_from).
+#define CORNER_FEATURES_XY_SCALE 0.002f
+
+// receivers drop messages claiming more corners than this
+#define CORNER_FEATURES_MAX_CORNERS 4096
+
+// smallest position variance (m^2) a received corner is trusted with
+#define CORNER_FEATURES_MIN_VAR 1E-6
+
+typedef struct flag_corner flag_corner_t;
+struct flag_corner {
+    // position and bearing in the sensor frame
+    double xy[2];
+    double theta;
+
+    // position covariance [xx, xy, yy]
+    double cov[3];
+
+    // [0, 1]
+    double quality;
+    int npoints;
+
+    // capture time (absolute)
+    int64_t utime;
+};
+
+// Saturates at the int16_t range; *clamped (if not NULL) is set if
+// it had to.
+static inline int16_t corner_features_quantize(double v, double scale, int *clamped)
+{
+    double q = round(v / scale);
+    if (q > INT16_MAX || q < INT16_MIN || isnan(q)) {
+        if (clamped)
+            *clamped = 1;
+        return q > 0 ? INT16_MAX : INT16_MIN;
+    }
+    return (int16_t) q;
+}
+
+static inline corner_features_t *corner_features_create(int64_t utime, int ncorners)
+{
+    corner_features_t *cf = calloc(1, sizeof(corner_features_t));
+    cf->utime = utime;
+    cf->version = CORNER_FEATURES_T_VERSION;
+    cf->xy_scale = CORNER_FEATURES_XY_SCALE;
+    cf->ncorners = ncorners;
+
+    cf->x = calloc(ncorners, sizeof(int16_t));
+    cf->y = calloc(ncorners, sizeof(int16_t));
+    cf->theta = calloc(ncorners, sizeof(int16_t));
+    cf->cov_xx = calloc(ncorners, sizeof(int16_t));
+    cf->cov_xy = calloc(ncorners, sizeof(int16_t));
+    cf->cov_yy = calloc(ncorners, sizeof(int16_t));
+    cf->quality = calloc(ncorners, sizeof(uint8_t));
+    cf->npoints = calloc(ncorners, sizeof(int16_t));
+    cf->dt = calloc(ncorners, sizeof(int16_t));
+    return cf;
+}
+
+// Returns non-zero if the corner's position is out of range for
+// cf->xy_scale; it is then stored clamped, i.e. wrong.
+static inline int corner_features_set(corner_features_t *cf, int idx,
+                                      const flag_corner_t *c)
+{
+    int clamped = 0;
+    cf->x[idx] = corner_features_quantize(c->xy[0], cf->xy_scale, &clamped);
+    cf->y[idx] = corner_features_quantize(c->xy[1], cf->xy_scale, &clamped);
+    cf->theta[idx] = corner_features_quantize(mod2pi(c->theta),
+                                              M_PI / CORNER_FEATURES_T_THETA_SCALE, NULL);
+
+    cf->cov_xx[idx] = float16_encode(c->cov[0]);
+    cf->cov_xy[idx] = float16_encode(c->cov[1]);
+    cf->cov_yy[idx] = float16_encode(c->cov[2]);
+
+    double q = c->quality < 0 ? 0 : (c->quality > 1 ? 1 : c->quality);
+    cf->quality[idx] = (uint8_t) round(255 * q);
+    cf->npoints[idx] = c->npoints > INT16_MAX ? INT16_MAX : c->npoints;
+    cf->dt[idx] = corner_features_quantize(c->utime - cf->utime, CORNER_FEATURES_T_DT_USEC, NULL);
+    return clamped;
+}
+
+// Packs the corners, at CORNER_FEATURES_XY_SCALE unless one of them
+// is too far out for it; the scale is then coarsened just enough to
+// hold the furthest. Corners at non-finite positions are dropped.
+static inline corner_features_t *corner_features_create_from(int64_t utime, const flag_corner_t *corners,
+                                                             int ncorners)
+{
+    double max_abs = 0;
+    int n = 0;
+    for (int i = 0; i < ncorners; i++) {
+        if (!isfinite(corners[i].xy[0]) || !isfinite(corners[i].xy[1]))
+            continue;
+        max_abs = fmax(max_abs, fmax(fabs(corners[i].xy[0]), fabs(corners[i].xy[1])));
+        n++;
+    }
+
+    corner_features_t *cf = corner_features_create(utime, n);
+    // one count of headroom against rounding
+    if (max_abs / cf->xy_scale > INT16_MAX - 1)
+        cf->xy_scale = nextafterf(max_abs / (INT16_MAX - 1), INFINITY);
+
+    n = 0;
+    for (int i = 0; i < ncorners; i++) {
+        if (!isfinite(corners[i].xy[0]) || !isfinite(corners[i].xy[1]))
+            continue;
+        int clamped = corner_features_set(cf, n++, &corners[i]);
+        assert(!clamped);
+        (void) clamped;
+    }
+    return cf;
+}
+
+// Returns non-zero if a received message can be decoded safely.
+static inline int corner_features_valid(const corner_features_t *cf)
+{
+    return cf->version <= CORNER_FEATURES_T_VERSION &&
+        cf->ncorners >= 0 && cf->ncorners <= CORNER_FEATURES_MAX_CORNERS &&
+        isfinite(cf->xy_scale) && cf->xy_scale > 0;
+}
+
+static inline void corner_features_get(const corner_features_t *cf, int idx,
+                                       flag_corner_t *c)
+{
+    c->xy[0] = cf->x[idx] * cf->xy_scale;
+    c->xy[1] = cf->y[idx] * cf->xy_scale;
+    c->theta = cf->theta[idx] * (M_PI / CORNER_FEATURES_T_THETA_SCALE);
+
+    c->cov[0] = float16_decode(cf->cov_xx[idx]);
+    c->cov[1] = float16_decode(cf->cov_xy[idx]);
+    c->cov[2] = float16_decode(cf->cov_yy[idx]);
+
+    c->quality = cf->quality[idx] / 255.0;
+    c->npoints = cf->npoints[idx];
+    c->utime = cf->utime + (int64_t) cf->dt[idx] * CORNER_FEATURES_T_DT_USEC;
+}
+
+// Makes a received corner's covariance safe to invert: variances are
+// raised to at least CORNER_FEATURES_MIN_VAR and, if the matrix is
+// (nearly) singular, |cov_xy| is added to both, which keeps the
+// determinant at least CORNER_FEATURES_MIN_VAR^2. Returns 0 if the
+// covariance is not finite; the corner should then be dropped.
+static inline int flag_corner_regularize_cov(flag_corner_t *c)
+{
+    if (!isfinite(c->cov[0]) || !isfinite(c->cov[1]) || !isfinite(c->cov[2]))
+        return 0;
+
+    c->cov[0] = fmax(c->cov[0], CORNER_FEATURES_MIN_VAR);
+    c->cov[2] = fmax(c->cov[2], CORNER_FEATURES_MIN_VAR);
+    if (c->cov[0]*c->cov[2] - c->cov[1]*c->cov[1] < CORNER_FEATURES_MIN_VAR*CORNER_FEATURES_MIN_VAR) {
+        c->cov[0] += fabs(c->cov[1]);
+        c->cov[2] += fabs(c->cov[1]);
+    }
+    return 1;
+}
+
+// Variance of the range and bearing of a corner as seen from the
+// sensor, from its position covariance.
+static inline void flag_corner_range_bearing_variance(const flag_corner_t *c, double var[2])
+{
+    double r = sqrt(c->xy[0]*c->xy[0] + c->xy[1]*c->xy[1]);
+    if (r < 1E-6) {
+        var[0] = c->cov[0] + c->cov[2];
+        var[1] = M_PI*M_PI;
+        return;
+    }
+
+    double u[2] = { c->xy[0] / r, c->xy[1] / r };
+    double v[2] = { -u[1], u[0] };
+
+    var[0] = u[0]*u[0]*c->cov[0] + 2*u[0]*u[1]*c->cov[1] + u[1]*u[1]*c->cov[2];
+    var[1] = (v[0]*v[0]*c->cov[0] + 2*v[0]*v[1]*c->cov[1] + v[1]*v[1]*c->cov[2]) / (r*r);
+}
+
+// Wrap legacy [x, y, theta] triples. There is no per-corner
+// information, so every corner gets an isotropic covariance of
+// sigma^2 and full quality.
+static inline corner_features_t *corner_features_from_line_features(const line_features_t *lf,
+                                                                    double sigma)
+{
+    int ncorners = imin(lf->lines_data_length / 3, CORNER_FEATURES_MAX_CORNERS);
+    flag_corner_t *corners = calloc(ncorners + 1, sizeof(flag_corner_t));
+
+    for (int i = 0; i < ncorners; i++) {
+        corners[i] = (flag_corner_t) { .xy = { lf->lines[3*i + 0], lf->lines[3*i + 1] },
+                                       .theta = lf->lines[3*i + 2],
+                                       .cov = { sigma*sigma, 0, sigma*sigma },
+                                       .quality = 1,
+                                       .npoints = 0,
+                                       .utime = lf->utime };
+    }
+
+    corner_features_t *cf = corner_features_create_from(lf->utime, corners, ncorners);
+    free(corners);
+    return cf;
+}
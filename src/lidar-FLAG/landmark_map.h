@@ -0,0 +1,426 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Binary landmark map, shared by the map generator (writing) and the
+// FLAG localizers (reading).
+//
+// The file is an image of the in-memory representation, so it is
+// loaded with a single mmap and no parsing; pages are only faulted in
+// for the tiles that are actually queried. Layout (native byte order,
+// all sections 8-byte aligned):
+//
+//   struct landmark_map_header
+//   uint32_t  tile_starts[ntiles_x * ntiles_y + 1]
+//   struct landmark_map_landmark landmarks[nlandmarks]   (sorted by tile)
+//   struct landmark_map_meta     meta[nlandmarks]        (if LANDMARK_MAP_HAS_META)
+//
+// Landmarks in tile (tx, ty) are landmarks[tile_starts[ty*ntiles_x + tx]]
+// up to (excluding) tile_starts[ty*ntiles_x + tx + 1]. A landmark's
+// index in the file is its id (e.g., its graph node).
+//
+// For compatibility, landmark_map_open() also accepts the legacy
+// "x,y" CSV files, building the same structure in memory.
+
+#define LANDMARK_MAP_MAGIC 0x464c4d50 // "FLMP"
+#define LANDMARK_MAP_VERSION 1
+
+#define LANDMARK_MAP_HAS_META 1
+
+#define LANDMARK_MAP_DEFAULT_TILE_SIZE 50.0 // meters
+
+// The tile index is dense over the landmarks' bounding box; maps
+// needing more tiles than this (64 MB of index, e.g. 200 km square
+// at the default tile size) are refused rather than allocated.
+#define LANDMARK_MAP_MAX_TILES (1 << 24)
+
+struct landmark_map_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nlandmarks;
+
+    double   tile_size;
+    double   origin[2];  // global position of tile (0,0)'s min corner
+    uint32_t ntiles_x, ntiles_y;
+
+    uint64_t tile_starts_offset;
+    uint64_t landmarks_offset;
+    uint64_t meta_offset;   // 0 if no metadata
+    uint64_t file_length;
+};
+
+struct landmark_map_landmark
+{
+    double xy[2];
+};
+
+struct landmark_map_meta
+{
+    float    sigma;          // position standard deviation (m)
+    float    quality;        // [0, 1]
+    uint32_t nobservations;
+    uint32_t reserved;
+};
+
+typedef struct landmark_map landmark_map_t;
+struct landmark_map
+{
+    const struct landmark_map_header *hdr;
+    const uint32_t *tile_starts;
+    const struct landmark_map_landmark *landmarks;
+    const struct landmark_map_meta *meta; // NULL if none
+
+    void  *data;
+    size_t datalen;
+    int    mapped; // munmap (rather than free) data
+};
+
+static inline uint64_t landmark_map_align8(uint64_t v)
+{
+    return (v + 7) & ~((uint64_t) 7);
+}
+
+static inline int landmark_map_size(const landmark_map_t *map)
+{
+    return map->hdr->nlandmarks;
+}
+
+static inline const double *landmark_map_xy(const landmark_map_t *map, int idx)
+{
+    return map->landmarks[idx].xy;
+}
+
+// returns NULL if the map has no metadata.
+static inline const struct landmark_map_meta *landmark_map_get_meta(const landmark_map_t *map, int idx)
+{
+    return map->meta ? &map->meta[idx] : NULL;
+}
+
+// points the section pointers into map->data, checking that
+// everything lies within it. Returns non-zero on error.
+static inline int landmark_map_bind(landmark_map_t *map)
+{
+    const struct landmark_map_header *hdr = map->data;
+
+    if (map->datalen < sizeof(*hdr) ||
+        hdr->magic != LANDMARK_MAP_MAGIC ||
+        hdr->version != LANDMARK_MAP_VERSION ||
+        hdr->file_length != map->datalen)
+        return -1;
+
+    uint64_t ntiles = (uint64_t) hdr->ntiles_x * hdr->ntiles_y;
+    uint64_t nlandmarks = hdr->nlandmarks;
+
+    if (hdr->tile_starts_offset + (ntiles + 1) * sizeof(uint32_t) > map->datalen ||
+        hdr->landmarks_offset + nlandmarks * sizeof(struct landmark_map_landmark) > map->datalen)
+        return -1;
+
+    if ((hdr->flags & LANDMARK_MAP_HAS_META) &&
+        hdr->meta_offset + nlandmarks * sizeof(struct landmark_map_meta) > map->datalen)
+        return -1;
+
+    if (ntiles > LANDMARK_MAP_MAX_TILES ||
+        (nlandmarks > 0 && !(hdr->tile_size > 0 && isfinite(hdr->tile_size))))
+        return -1;
+
+    const uint32_t *tile_starts = (const uint32_t*) ((const uint8_t*) map->data + hdr->tile_starts_offset);
+    if (tile_starts[0] != 0 || tile_starts[ntiles] != nlandmarks)
+        return -1;
+    for (uint64_t i = 0; i < ntiles; i++) {
+        if (tile_starts[i] > tile_starts[i+1])
+            return -1;
+    }
+
+    map->hdr = hdr;
+    map->tile_starts = tile_starts;
+    map->landmarks = (const struct landmark_map_landmark*) ((const uint8_t*) map->data + hdr->landmarks_offset);
+    map->meta = (hdr->flags & LANDMARK_MAP_HAS_META) ?
+        (const struct landmark_map_meta*) ((const uint8_t*) map->data + hdr->meta_offset) : NULL;
+
+    return 0;
+}
+
+// Builds a map from 'n' landmarks (xy interleaved). 'meta' may be
+// NULL. Landmarks are reordered by tile, so ids are those of the
+// returned map, not the input order. Returns NULL if a landmark is
+// not finite, or if they span more than LANDMARK_MAP_MAX_TILES tiles.
+static inline landmark_map_t *landmark_map_create(const double *xy, const struct landmark_map_meta *meta,
+                                                  int n, double tile_size)
+{
+    if (!(tile_size > 0 && isfinite(tile_size)))
+        return NULL;
+
+    double xmin = 0, ymin = 0, xmax = 0, ymax = 0;
+    for (int i = 0; i < n; i++) {
+        if (!isfinite(xy[2*i+0]) || !isfinite(xy[2*i+1]))
+            return NULL;
+        if (i == 0 || xy[2*i+0] < xmin) xmin = xy[2*i+0];
+        if (i == 0 || xy[2*i+1] < ymin) ymin = xy[2*i+1];
+        if (i == 0 || xy[2*i+0] > xmax) xmax = xy[2*i+0];
+        if (i == 0 || xy[2*i+1] > ymax) ymax = xy[2*i+1];
+    }
+
+    double origin[2] = { floor(xmin / tile_size) * tile_size,
+                         floor(ymin / tile_size) * tile_size };
+    // (in doubles until bounded: an outlier can overflow any integer)
+    double dtiles_x = n > 0 ? floor((xmax - origin[0]) / tile_size) + 1 : 0;
+    double dtiles_y = n > 0 ? floor((ymax - origin[1]) / tile_size) + 1 : 0;
+    if (dtiles_x * dtiles_y > LANDMARK_MAP_MAX_TILES)
+        return NULL;
+
+    uint32_t ntiles_x = dtiles_x, ntiles_y = dtiles_y;
+    uint64_t ntiles = (uint64_t) ntiles_x * ntiles_y;
+
+    uint64_t tile_starts_offset = landmark_map_align8(sizeof(struct landmark_map_header));
+    uint64_t landmarks_offset = landmark_map_align8(tile_starts_offset + (ntiles + 1) * sizeof(uint32_t));
+    uint64_t meta_offset = landmark_map_align8(landmarks_offset + n * sizeof(struct landmark_map_landmark));
+    uint64_t file_length = meta ? meta_offset + n * sizeof(struct landmark_map_meta) : meta_offset;
+
+    landmark_map_t *map = calloc(1, sizeof(landmark_map_t));
+    map->datalen = file_length;
+    map->data = calloc(1, file_length);
+
+    struct landmark_map_header *hdr = map->data;
+    hdr->magic = LANDMARK_MAP_MAGIC;
+    hdr->version = LANDMARK_MAP_VERSION;
+    hdr->flags = meta ? LANDMARK_MAP_HAS_META : 0;
+    hdr->nlandmarks = n;
+    hdr->tile_size = tile_size;
+    hdr->origin[0] = origin[0];
+    hdr->origin[1] = origin[1];
+    hdr->ntiles_x = ntiles_x;
+    hdr->ntiles_y = ntiles_y;
+    hdr->tile_starts_offset = tile_starts_offset;
+    hdr->landmarks_offset = landmarks_offset;
+    hdr->meta_offset = meta ? meta_offset : 0;
+    hdr->file_length = file_length;
+
+    uint32_t *tile_starts = (uint32_t*) ((uint8_t*) map->data + tile_starts_offset);
+    struct landmark_map_landmark *landmarks = (struct landmark_map_landmark*) ((uint8_t*) map->data + landmarks_offset);
+    struct landmark_map_meta *outmeta = (struct landmark_map_meta*) ((uint8_t*) map->data + meta_offset);
+
+    // counting sort by tile.
+    uint32_t *tile = malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+    for (int i = 0; i < n; i++) {
+        uint32_t tx = (uint32_t) floor((xy[2*i+0] - origin[0]) / tile_size);
+        uint32_t ty = (uint32_t) floor((xy[2*i+1] - origin[1]) / tile_size);
+        if (tx >= ntiles_x) tx = ntiles_x - 1;
+        if (ty >= ntiles_y) ty = ntiles_y - 1;
+        tile[i] = ty * ntiles_x + tx;
+        tile_starts[tile[i] + 1]++;
+    }
+
+    for (uint64_t t = 0; t < ntiles; t++)
+        tile_starts[t+1] += tile_starts[t];
+
+    uint32_t *fill = malloc(sizeof(uint32_t) * (ntiles + 1));
+    memcpy(fill, tile_starts, sizeof(uint32_t) * (ntiles + 1));
+
+    for (int i = 0; i < n; i++) {
+        uint32_t j = fill[tile[i]]++;
+        landmarks[j].xy[0] = xy[2*i+0];
+        landmarks[j].xy[1] = xy[2*i+1];
+        if (meta)
+            outmeta[j] = meta[i];
+    }
+
+    free(fill);
+    free(tile);
+
+    int res = landmark_map_bind(map);
+    (void) res;
+    return map;
+}
+
+// legacy CSV format: one "x,y" per line.
+static inline landmark_map_t *landmark_map_create_from_csv(const char *path, double tile_size)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    int n = 0, alloc = 1024;
+    double *xy = malloc(sizeof(double) * 2 * alloc);
+
+    double x, y;
+    while (fscanf(f, "%lf,%lf", &x, &y) == 2) {
+        if (n == alloc) {
+            alloc *= 2;
+            xy = realloc(xy, sizeof(double) * 2 * alloc);
+        }
+        xy[2*n+0] = x;
+        xy[2*n+1] = y;
+        n++;
+    }
+    fclose(f);
+
+    landmark_map_t *map = landmark_map_create(xy, NULL, n, tile_size);
+    free(xy);
+    return map;
+}
+
+// Opens a binary landmark map (mmap'd read-only) or, failing that, a
+// legacy CSV file. Returns NULL on error.
+static inline landmark_map_t *landmark_map_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    uint32_t magic = 0;
+    struct stat st;
+    if (fstat(fd, &st) || read(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+        magic != LANDMARK_MAP_MAGIC) {
+        close(fd);
+        return landmark_map_create_from_csv(path, LANDMARK_MAP_DEFAULT_TILE_SIZE);
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    landmark_map_t *map = calloc(1, sizeof(landmark_map_t));
+    map->data = data;
+    map->datalen = st.st_size;
+    map->mapped = 1;
+
+    if (landmark_map_bind(map)) {
+        fprintf(stderr, "landmark_map: %s is corrupt or of an unsupported version\n", path);
+        munmap(data, st.st_size);
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+// Returns non-zero on error.
+static inline int landmark_map_write(const landmark_map_t *map, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+
+    size_t res = fwrite(map->data, 1, map->datalen, f);
+    if (fclose(f) || res != map->datalen)
+        return -1;
+    return 0;
+}
+
+static inline void landmark_map_destroy(landmark_map_t *map)
+{
+    if (map == NULL)
+        return;
+
+    if (map->mapped)
+        munmap(map->data, map->datalen);
+    else
+        free(map->data);
+    free(map);
+}
+
+// Computes the (inclusive) range of tiles overlapping the box
+// [x0,x1]x[y0,y1]. Returns 0 if there are none.
+static inline int landmark_map_tile_range(const landmark_map_t *map, double x0, double y0, double x1, double y1,
+                                          int *tx0, int *ty0, int *tx1, int *ty1)
+{
+    const struct landmark_map_header *hdr = map->hdr;
+    if (hdr->nlandmarks == 0)
+        return 0;
+
+    double fx0 = floor((x0 - hdr->origin[0]) / hdr->tile_size);
+    double fy0 = floor((y0 - hdr->origin[1]) / hdr->tile_size);
+    double fx1 = floor((x1 - hdr->origin[0]) / hdr->tile_size);
+    double fy1 = floor((y1 - hdr->origin[1]) / hdr->tile_size);
+
+    if (fx1 < 0 || fy1 < 0 || fx0 >= hdr->ntiles_x || fy0 >= hdr->ntiles_y)
+        return 0;
+
+    *tx0 = fx0 < 0 ? 0 : (int) fx0;
+    *ty0 = fy0 < 0 ? 0 : (int) fy0;
+    *tx1 = fx1 >= hdr->ntiles_x ? (int) hdr->ntiles_x - 1 : (int) fx1;
+    *ty1 = fy1 >= hdr->ntiles_y ? (int) hdr->ntiles_y - 1 : (int) fy1;
+    return 1;
+}
+
+// Calls f(idx, xy, user) for every landmark in the tiles overlapping
+// the box [x0,x1]x[y0,y1]. (The landmarks themselves may lie
+// slightly outside the box.)
+static inline void landmark_map_foreach_in_box(const landmark_map_t *map, double x0, double y0, double x1, double y1,
+                                               void (*f)(int idx, const double xy[2], void *user), void *user)
+{
+    int tx0, ty0, tx1, ty1;
+    if (!landmark_map_tile_range(map, x0, y0, x1, y1, &tx0, &ty0, &tx1, &ty1))
+        return;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        const uint32_t *starts = &map->tile_starts[ty * map->hdr->ntiles_x];
+        for (uint32_t i = starts[tx0]; i < starts[tx1 + 1]; i++)
+            f(i, map->landmarks[i].xy, user);
+    }
+}
+
+// Returns the index of the landmark closest to xy, provided it is
+// nearer than 'threshold'; otherwise -1. Only the tiles within
+// 'threshold' of xy are examined.
+static inline int landmark_map_find_nearest(const landmark_map_t *map, const double xy[2], double threshold)
+{
+    int tx0, ty0, tx1, ty1;
+    if (!landmark_map_tile_range(map, xy[0] - threshold, xy[1] - threshold,
+                                 xy[0] + threshold, xy[1] + threshold,
+                                 &tx0, &ty0, &tx1, &ty1))
+        return -1;
+
+    int closest_id = -1;
+    double closest_dist2 = threshold * threshold;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        // tiles tx0..tx1 of a row are contiguous.
+        const uint32_t *starts = &map->tile_starts[ty * map->hdr->ntiles_x];
+        for (uint32_t i = starts[tx0]; i < starts[tx1 + 1]; i++) {
+            double dx = map->landmarks[i].xy[0] - xy[0];
+            double dy = map->landmarks[i].xy[1] - xy[1];
+            double dist2 = dx*dx + dy*dy;
+            if (dist2 < closest_dist2) {
+                closest_dist2 = dist2;
+                closest_id = i;
+            }
+        }
+    }
+
+    return closest_id;
+}
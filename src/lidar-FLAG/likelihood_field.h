@@ -0,0 +1,236 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "lidar-FLAG/landmark_map.h"
+
+// Likelihood field over a landmark map: a grid holding, for every
+// cell, the distance from its center to the nearest landmark. A
+// measurement model can then score a corner with a single lookup
+// instead of a nearest-landmark search, and corners far from any
+// landmark saturate at max_dist rather than needing a special case.
+//
+// The grid only covers a square window of +/- radius around a point
+// (typically the particles' mean), so its size does not depend on the
+// size of the map. likelihood_field_update() moves the window when the
+// point strays from its center, rebuilding it from the landmarks in
+// the nearby landmark_map tiles.
+//
+// Distances are quantized to 8 bits over [0, max_dist], so the grid
+// costs one byte per cell. Landmarks and queries are both snapped to
+// cells, so distances are accurate to about one cell diagonal.
+
+// refuse windows larger than this; a rebuild needs 5 bytes per cell
+// (plus the margin) of scratch.
+#define LIKELIHOOD_FIELD_MAX_CELLS (1 << 24)
+
+typedef struct likelihood_field likelihood_field_t;
+struct likelihood_field
+{
+    double meters_per_pixel;
+    double max_dist;          // meters; also returned outside the window
+    double radius;            // meters; half the window's width
+
+    int width, height;        // of the window, in cells
+    uint8_t *dist;            // 255 == max_dist
+
+    int valid;                // has the window been built?
+    double x0, y0;            // global position of cell (0,0)'s min corner
+    double center[2];         // the point the window was built around
+};
+
+// cells with no landmark start out "infinitely" far away; finite so
+// that the transform below needs no special cases.
+#define LIKELIHOOD_FIELD_FAR 1e20f
+
+// 1D squared Euclidean distance transform of f (Felzenszwalb &
+// Huttenlocher), in place. v, z and d are scratch of n, n+1 and n
+// entries.
+static inline void likelihood_field_dt1(float *f, int n, size_t stride, int *v, double *z, double *d)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -HUGE_VAL;
+    z[1] = HUGE_VAL;
+
+    for (int q = 1; q < n; q++) {
+        double s;
+        while (1) {
+            int p = v[k];
+            s = (((double) f[q*stride] + (double) q*q) - ((double) f[p*stride] + (double) p*p)) / (2.0*q - 2.0*p);
+            if (s > z[k])
+                break;
+            k--;
+        }
+
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = HUGE_VAL;
+    }
+
+    k = 0;
+    for (int q = 0; q < n; q++) {
+        while (z[k+1] < q)
+            k++;
+        d[q] = (double) (q - v[k])*(q - v[k]) + f[v[k]*stride];
+    }
+
+    for (int q = 0; q < n; q++)
+        f[q*stride] = d[q];
+}
+
+// Returns NULL if the parameters are invalid or the window would
+// exceed LIKELIHOOD_FIELD_MAX_CELLS. The field is empty (every query
+// returns max_dist) until the first likelihood_field_update().
+static inline likelihood_field_t *likelihood_field_create(double meters_per_pixel, double max_dist,
+                                                          double radius)
+{
+    if (!(meters_per_pixel > 0) || !(max_dist > 0) || !(radius > 0))
+        return NULL;
+
+    // margin cells, included in the transform but not kept, so that
+    // landmarks just outside the window still count.
+    double side = ceil(2 * radius / meters_per_pixel) + 1;
+    double margin = ceil(max_dist / meters_per_pixel) + 1;
+    if ((side + 2*margin) * (side + 2*margin) > LIKELIHOOD_FIELD_MAX_CELLS)
+        return NULL;
+
+    likelihood_field_t *lf = calloc(1, sizeof(likelihood_field_t));
+    lf->meters_per_pixel = meters_per_pixel;
+    lf->max_dist = max_dist;
+    lf->radius = radius;
+    lf->width = lf->height = (int) side;
+    lf->dist = malloc((size_t) lf->width * lf->height);
+    return lf;
+}
+
+static inline void likelihood_field_destroy(likelihood_field_t *lf)
+{
+    if (!lf)
+        return;
+
+    free(lf->dist);
+    free(lf);
+}
+
+// forces the next likelihood_field_update() to rebuild, e.g. after the
+// landmark map changed.
+static inline void likelihood_field_invalidate(likelihood_field_t *lf)
+{
+    lf->valid = 0;
+}
+
+struct likelihood_field_mark
+{
+    float *f;
+    size_t width, height;
+    double x0, y0, meters_per_pixel;
+};
+
+static inline void likelihood_field_mark_landmark(int idx, const double xy[2], void *user)
+{
+    struct likelihood_field_mark *m = user;
+    double fx = floor((xy[0] - m->x0) / m->meters_per_pixel);
+    double fy = floor((xy[1] - m->y0) / m->meters_per_pixel);
+    if (fx >= 0 && fx < m->width && fy >= 0 && fy < m->height)
+        m->f[(size_t) fy * m->width + (size_t) fx] = 0;
+}
+
+// Recenters the window on xy if xy is more than radius/2 from its
+// current center (or it has not been built yet). Returns 1 if the
+// window was rebuilt.
+static inline int likelihood_field_update(likelihood_field_t *lf, const landmark_map_t *map, const double xy[2])
+{
+    if (lf->valid &&
+        fabs(xy[0] - lf->center[0]) <= lf->radius / 2 &&
+        fabs(xy[1] - lf->center[1]) <= lf->radius / 2)
+        return 0;
+
+    double mpp = lf->meters_per_pixel;
+    size_t margin = (size_t) ceil(lf->max_dist / mpp) + 1;
+    size_t width = lf->width + 2*margin, height = lf->height + 2*margin;
+
+    // snap to the cell grid so that a cell covers the same ground
+    // whichever window it is in.
+    lf->x0 = floor((xy[0] - lf->radius) / mpp) * mpp;
+    lf->y0 = floor((xy[1] - lf->radius) / mpp) * mpp;
+    lf->center[0] = xy[0];
+    lf->center[1] = xy[1];
+    lf->valid = 1;
+
+    float *f = malloc(sizeof(float) * width * height);
+    for (size_t i = 0; i < width * height; i++)
+        f[i] = LIKELIHOOD_FIELD_FAR;
+
+    struct likelihood_field_mark m = { .f = f, .width = width, .height = height,
+                                       .x0 = lf->x0 - margin * mpp, .y0 = lf->y0 - margin * mpp,
+                                       .meters_per_pixel = mpp };
+    landmark_map_foreach_in_box(map, m.x0, m.y0, m.x0 + width * mpp, m.y0 + height * mpp,
+                                likelihood_field_mark_landmark, &m);
+
+    size_t maxn = width > height ? width : height;
+    int *v = malloc(sizeof(int) * maxn);
+    double *z = malloc(sizeof(double) * (maxn + 1));
+    double *d = malloc(sizeof(double) * maxn);
+
+    for (size_t iy = 0; iy < height; iy++)
+        likelihood_field_dt1(&f[iy*width], width, 1, v, z, d);
+    for (size_t ix = 0; ix < width; ix++)
+        likelihood_field_dt1(&f[ix], height, width, v, z, d);
+
+    free(v);
+    free(z);
+    free(d);
+
+    for (int iy = 0; iy < lf->height; iy++) {
+        const float *row = &f[(iy + margin)*width + margin];
+        uint8_t *out = &lf->dist[(size_t) iy * lf->width];
+        for (int ix = 0; ix < lf->width; ix++) {
+            double dist = sqrt(row[ix]) * mpp;
+            out[ix] = dist >= lf->max_dist ? 255 : (uint8_t) (dist / lf->max_dist * 255 + 0.5);
+        }
+    }
+
+    free(f);
+    return 1;
+}
+
+// distance (meters) from xy to the nearest landmark, saturating at
+// max_dist. Points outside the window are max_dist away.
+static inline double likelihood_field_distance(const likelihood_field_t *lf, const double xy[2])
+{
+    if (!lf->valid)
+        return lf->max_dist;
+
+    double fx = floor((xy[0] - lf->x0) / lf->meters_per_pixel);
+    double fy = floor((xy[1] - lf->y0) / lf->meters_per_pixel);
+
+    if (!(fx >= 0 && fx < lf->width && fy >= 0 && fy < lf->height))
+        return lf->max_dist;
+
+    return lf->dist[(size_t) fy * lf->width + (size_t) fx] * (lf->max_dist / 255.0);
+}
@@ -61,6 +61,9 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "lcmtypes/global_world_state_t.h"
 #include "lcmtypes/global_robot_state_t.h"
 
+#include "lidar-FLAG/landmark_map.h"
+#include "lidar-FLAG/world_tiles.h"
+
 
 /**
  * Running program:
@@ -83,6 +86,8 @@ struct state{
 
     const char *input_file_path;
     const char *output_file_path;
+    const char *map_file_path;
+    double tile_size;
 
     zarray_t *features;
     int selected;
@@ -91,8 +96,8 @@ struct state{
     geo_image_t *geo_img;
 
     config_t *mission_config;
-    vx_object_t *world_img;
-    grid_map_t *gm;
+    world_tiles_t *world;
+    world_tiles_layer_t *world_layer;
 
     double lidar_to_img[3];
 };
@@ -124,6 +129,27 @@ void write_features(state_t *state)
     printf("wrote %d features to file %s\n", nfeatures, state->output_file_path);
 
     fclose(f);
+
+    // binary, tiled map for the localizers
+    double *dxy = malloc(sizeof(double) * 2 * (nfeatures > 0 ? nfeatures : 1));
+    for (int i = 0; i < nfeatures; i++) {
+        zarray_get(state->features, i, xy);
+        dxy[2*i+0] = xy[0];
+        dxy[2*i+1] = xy[1];
+    }
+
+    landmark_map_t *map = landmark_map_create(dxy, NULL, nfeatures, state->tile_size);
+    if (map == NULL)
+        printf("ERR: landmarks must be finite and fit in %d tiles of %.1f m\n",
+               LANDMARK_MAP_MAX_TILES, state->tile_size);
+    else if (landmark_map_write(map, state->map_file_path))
+        printf("ERR: unable to write landmark map %s\n", state->map_file_path);
+    else
+        printf("wrote %d landmarks in %d x %d tiles to file %s\n", nfeatures,
+               map->hdr->ntiles_x, map->hdr->ntiles_y, state->map_file_path);
+
+    landmark_map_destroy(map);
+    free(dxy);
 }
 
 static void redraw_satellite(state_t *state)
@@ -156,22 +182,10 @@ static void redraw_satellite(state_t *state)
 
 static void redraw_global_world(state_t *state)
 {
-    if (state->world_img == NULL) {
+    if (state->world_layer == NULL) {
         return;
     }
-    vx_buffer_t *vb = vx_world_get_buffer(state->vw, "map");
-    vx_buffer_add_back(vb,
-                       vxo_depth_test(0,
-                                      vxo_matrix_xyt(state->lidar_to_img),
-                                      vxo_chain(vxo_matrix_translate(state->gm->x0, state->gm->y0, 0),
-                                                vxo_matrix_scale(state->gm->meters_per_pixel),
-                                                state->world_img,
-                                                NULL),
-                                      NULL),
-                       NULL);
-
-    vx_buffer_swap(vb);
-
+    world_tiles_layer_update(state->world_layer, state->lidar_to_img, NULL);
 }
 
 static void render_features(state_t *state)
@@ -322,77 +336,21 @@ void on_destroy_canvas(vx_canvas_t *vc, void *impl)
     fprintf(stderr,"ON DESTROY CANVAS\n");
 }
 
-vx_object_t* make_gws_from_file(state_t *state, const char *path)
-{
-    global_world_state_t *gws = NULL;
-    vx_object_t *vxo = NULL;
-
-    FILE *fp = fopen(path, "r");
-    fseek(fp, 0L, SEEK_END);
-    long len = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-
-    uint8_t *buf = malloc(len);
-    size_t sz = fread(buf, 1, len, fp);
-
-    if (sz != len)
-        goto cleanup;
-
-    uint32_t pos = 0;
-    gws = stype_decode_object(buf, &pos, len, NULL);
-    printf("NFO: Loaded global_world_state_t from %s - %ld bytes\n", path, len);
-
-
-    grid_map_t *gm = NULL;
-    switch (gws->global_map.encoding) {
-        case GRID_MAP_T_ENCODING_NONE:
-            gm = gridmap_copy(&gws->global_map);
-            break;
-        case GRID_MAP_T_ENCODING_GZIP:
-            gm = grid_map_t_decode_gzip(&gws->global_map);
-            break;
-        default:
-            printf("ERR: encoding type %d not supported\n", gws->global_map.encoding);
-            exit(1);
-    }
-
-
-    image_u8_t *im = image_u8_create(gm->width, gm->height);
-    for (int y = 0; y < gm->height; y++)
-        memcpy(&im->buf[y*im->stride], &gm->data[y*gm->width], gm->width);
-
-    vx_resource_t *tex = vx_resource_make_texture_u8_copy(im, 0);
-    image_u8_destroy(im);
-
-    vxo = vxo_image_tile(tex,
-                         vx_nada,
-                         vx_gray,
-                         vx_maroon,
-                         vx_orange);
-    state->gm = gm;
-    global_world_state_t_destroy(gws);
-
-  cleanup:
-    free(buf);
-    fclose(fp);
-    return vxo;
-}
-
 void read_features(state_t *state)
 {
-    FILE *f = fopen(state->input_file_path, "r");
-
-    float x;
-    float y;
+    // binary landmark map or csv
+    landmark_map_t *map = landmark_map_open(state->input_file_path);
+    if (map == NULL) {
+        printf("ERR: unable to read features from %s\n", state->input_file_path);
+        return;
+    }
 
-    while (fscanf(f, "%f,%f", &x, &y) != EOF) {
-        float *xy = (float*) calloc(2, sizeof(float));
-        xy[0] = x;
-        xy[1] = y;
+    for (int i = 0; i < landmark_map_size(map); i++) {
+        float xy[2] = { landmark_map_xy(map, i)[0], landmark_map_xy(map, i)[1] };
         zarray_add(state->features, xy);
     }
 
-    fclose(f);
+    landmark_map_destroy(map);
 }
 
 void setup_geo(state_t *state, getopt_t *gopt)
@@ -448,8 +406,11 @@ int main(int argc, char *argv[])
     getopt_add_int(gopt, 'p', "port", "8890", "jsvx server port");
     getopt_add_string(gopt, 'i', "in-file", "", "input feature file");
     getopt_add_string(gopt, 'o', "out-file", "/var/tmp/flag_landmarks.csv", "output feature file");
+    getopt_add_string(gopt, '\0', "map-out-file", "/var/tmp/flag_landmarks.lmap", "output binary landmark map");
+    getopt_add_double(gopt, '\0', "tile-size", "50", "landmark map tile size (m)");
     getopt_add_string(gopt, 'f', "image", "", "satellite image file path");
-    getopt_add_string(gopt, '\0', "world", "", "global world image file path");
+    getopt_add_string(gopt, '\0', "world", "", "global world image file path (tiled or legacy)");
+    getopt_add_string(gopt, '\0', "world-tiles-out", "", "write the world map as tiles to this file");
     getopt_add_string(gopt, 'm', "mission-config", "", "Config file for mission");
 
     if (!getopt_parse(gopt, argc, argv, 1)) {
@@ -496,13 +457,32 @@ int main(int argc, char *argv[])
 
     if (strlen(getopt_get_string(gopt, "world"))) {
         printf("Load world file from: %s\n", getopt_get_string(gopt, "world"));
-        state->world_img = make_gws_from_file(state, getopt_get_string(gopt, "world"));
-        state->world_img->decref(state->world_img);
-        redraw_global_world(state);
+        state->world = world_tiles_open(getopt_get_string(gopt, "world"));
+        if (state->world == NULL) {
+            printf("ERR: unable to read world map %s\n", getopt_get_string(gopt, "world"));
+        } else {
+            const char *tiles_path = getopt_get_string(gopt, "world-tiles-out");
+            if (strlen(tiles_path)) {
+                if (world_tiles_write(state->world, tiles_path))
+                    printf("ERR: unable to write world tiles %s\n", tiles_path);
+                else
+                    printf("wrote %d x %d world tiles to file %s\n", state->world->hdr->ntiles_x,
+                           state->world->hdr->ntiles_y, tiles_path);
+            }
+
+            // the whole map stays in view while editing.
+            state->world_layer = world_tiles_layer_create(state->vw, "map", state->world, 0, 0);
+            redraw_global_world(state);
+        }
     }
 
 
-    state->output_file_path = sprintf_alloc("%s_%ld", getopt_get_string(gopt, "out-file"), utime_now());
+    int64_t utime = utime_now();
+    state->output_file_path = sprintf_alloc("%s_%ld", getopt_get_string(gopt, "out-file"), utime);
+    state->map_file_path = sprintf_alloc("%s_%ld", getopt_get_string(gopt, "map-out-file"), utime);
+    state->tile_size = getopt_get_double(gopt, "tile-size");
+    if (state->tile_size <= 0)
+        state->tile_size = LANDMARK_MAP_DEFAULT_TILE_SIZE;
     while (1) {
         lcm_handle(state->lcm);
     }
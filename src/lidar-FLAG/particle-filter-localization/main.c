@@ -38,6 +38,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/time_util.h"
 #include "common/string_util.h"
 #include "common/zarray.h"
+#include "common/zhash.h"
 #include "common/geo_image.h"
 #include "common/gps_linearization.h"
 #include "common/interpolator.h"
@@ -46,6 +47,8 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/gridmap.h"
 #include "common/gridmap_util.h"
 #include "common/http_advertiser.h"
+#include "common/instrument.h"
+#include "common/instrument_lcm.h"
 
 #include "vx/vx.h"
 #include "vx/webvx.h"
@@ -57,7 +60,16 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "lcmtypes/global_world_state_t.h"
 #include "lcmtypes/global_robot_state_t.h"
 #include "lcmtypes/line_features_t.h"
+#include "lcmtypes/corner_features_t.h"
 #include "lcmtypes/lcmdoubles_t.h"
+#include "lcmtypes/particle_summary_t.h"
+
+#include "lidar-FLAG/corner_features.h"
+#include "lidar-FLAG/landmark_map.h"
+#include "lidar-FLAG/pipeline_trace.h"
+#include "lidar-FLAG/likelihood_field.h"
+#include "lidar-FLAG/world_tiles.h"
+#include "lidar-FLAG/trajectory_layer.h"
 
 
 /**
@@ -68,6 +80,10 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #define NUM_OF_PARTICLES 500 //Number of particles
 double motion_noise[3] = { 0.1, 0.05, to_radians(0.1) };
 double sensor_noise[2] = { 0.15, to_radians(5) };
+// corners below this detector quality are not associated
+#define MIN_CORNER_QUALITY 0.1
+// particles are clustered on a grid of this size (m) to find modes
+#define SUMMARY_MODE_CELL 0.5
 typedef struct state state_t;
 struct state{
     lcm_t *lcm;
@@ -76,14 +92,18 @@ struct state{
 
     const char *input_file_path;
 
-    zarray_t *landmarks;
+    landmark_map_t *landmarks;
+
+    // if non-NULL, corners are scored against this instead of being
+    // associated with their nearest landmark.
+    likelihood_field_t *field;
 
     gps_lin_t *gps_lin;
     geo_image_t *geo_img;
 
     config_t *mission_config;
-    vx_object_t *world_img;
-    grid_map_t *gm;
+    world_tiles_t *world;
+    world_tiles_layer_t *world_layer;
 
     pthread_mutex_t mutex;
     pthread_mutex_t pose_lock;
@@ -98,15 +118,43 @@ struct state{
     double initial_position[3];
     bool is_start;
 
+    // protects the pose histories, which the render thread reads
+    pthread_mutex_t poses_lock;
+    int poses_epoch; // bumped when the histories restart
     zarray_t *odom_poses;
     zarray_t *lidar_poses;
     zarray_t *flag_poses;
 
-    zarray_t *line_features_queue;
+    zarray_t *corner_features_queue;
+
+    // latency traces of the queued features, by utime
+    pipeline_traces_t *traces;
 
     //particles
     double mu[3]; //or use mode
-    double particles[NUM_OF_PARTICLES][3];
+
+    // 'particles' points at one of particle_bufs; resampling writes
+    // into the other one and swaps.
+    double particle_bufs[2][NUM_OF_PARTICLES][3];
+    double (*particles)[3];
+
+    // normalized weights of 'particles', carried across updates that
+    // do not resample.
+    double weights[NUM_OF_PARTICLES];
+
+    // resample only when the effective sample size drops below this
+    // fraction of NUM_OF_PARTICLES.
+    double resample_ess;
+
+    // FLAG.PARTICLE-SUMMARY is published by summary_thread every
+    // summary_period_us (0: never), with up to summary_modes modes and
+    // summary_cloud subsampled particles. 'mutex' protects particles,
+    // weights and particles_utime, the time of the last features the
+    // filter processed (0: none yet).
+    int64_t summary_period_us;
+    int64_t particles_utime;
+    int summary_modes;
+    int summary_cloud;
 };
 
 static void signal_handler(int signum)
@@ -148,33 +196,31 @@ static void redraw_satellite(state_t *state)
     vx_buffer_swap(vb);
 }
 
+// pages in the world map tiles around the latest pose.
 static void redraw_global_world(state_t *state)
 {
-    if (state->world_img == NULL) {
+    if (state->world_layer == NULL) {
         return;
     }
-    vx_buffer_t *vb = vx_world_get_buffer(state->vw, "map");
-    vx_buffer_add_back(vb,
-                       vxo_depth_test(0,
-                                      vxo_matrix_xyt(state->lidar_to_img),
-                                      vxo_chain(vxo_matrix_translate(state->gm->x0, state->gm->y0, 0),
-                                                vxo_matrix_scale(state->gm->meters_per_pixel),
-                                                state->world_img,
-                                                NULL),
-                                      NULL),
-                       NULL);
 
-    vx_buffer_swap(vb);
+    double xyt[3];
+    int have_pose = 0;
+    pthread_mutex_lock(&state->poses_lock);
+    if (zarray_size(state->lidar_poses) > 0) {
+        zarray_get(state->lidar_poses, zarray_size(state->lidar_poses) - 1, xyt);
+        have_pose = 1;
+    }
+    pthread_mutex_unlock(&state->poses_lock);
 
+    world_tiles_layer_update(state->world_layer, state->lidar_to_img, have_pose ? xyt : NULL);
 }
 
 static void render_landmarks(state_t *state)
 {
     vx_buffer_t* vb = vx_world_get_buffer(state->vw, "landmarks");
     float xy[2];
-    for (int i = 0; i < zarray_size(state->landmarks); i++) {
-        double _xy[2];
-        zarray_get(state->landmarks, i, _xy);
+    for (int i = 0; i < landmark_map_size(state->landmarks); i++) {
+        const double *_xy = landmark_map_xy(state->landmarks, i);
         xy[0] = _xy[0];
         xy[1] = _xy[1];
         float *color = vx_white;
@@ -189,20 +235,6 @@ static void render_landmarks(state_t *state)
     vx_buffer_swap(vb);
 }
 
-static void render_poses(zarray_t *poses, vx_buffer_t *vb, float color[4])
-{
-    double pose[3];
-    for(int i=0; i < zarray_size(poses); i++) {
-        zarray_get(poses, i, pose);
-        vx_buffer_add_back(vb,
-                           vxo_depth_test(0,
-                                          vxo_matrix_xyt(pose),
-                                          vxo_robot_solid(color),
-                                          NULL),
-                           NULL);
-    }
-}
-
 static void render_particles(state_t *state)
 {
     vx_buffer_t *vb = vx_world_get_buffer(state->vw, "particles");
@@ -222,9 +254,10 @@ static void* render_loop(void *user)
 {
     state_t *state = (state_t*)user;
     timeutil_rest_t *rt = timeutil_rest_create();
-    vx_buffer_t *vb_lidar = vx_world_get_buffer(state->vw, "Lidar-positions");
-    vx_buffer_t *vb_odom = vx_world_get_buffer(state->vw, "Odom-positions");
-    vx_buffer_t *vb_flag = vx_world_get_buffer(state->vw, "Flag-positions");
+    trajectory_layer_t *tl_lidar = trajectory_layer_create(state->vw, "Lidar-positions", vx_yellow);
+    trajectory_layer_t *tl_odom = trajectory_layer_create(state->vw, "Odom-positions", vx_blue);
+    trajectory_layer_t *tl_flag = trajectory_layer_create(state->vw, "Flag-positions", vx_red);
+    int epoch = 0;
     while(1) {
         timeutil_sleep_hz(rt, 10);
         /*
@@ -232,13 +265,20 @@ static void* render_loop(void *user)
         doubles_xyt_mul(state->l2g, state->xyt_local, xyt_global);
         */
         render_particles(state);
-        render_poses(state->lidar_poses, vb_lidar, vx_yellow);
-        render_poses(state->odom_poses, vb_odom, vx_blue);
-        render_poses(state->flag_poses, vb_flag, vx_red);
 
-        vx_buffer_swap(vb_lidar);
-        vx_buffer_swap(vb_odom);
-        vx_buffer_swap(vb_flag);
+        pthread_mutex_lock(&state->poses_lock);
+        if (epoch != state->poses_epoch) {
+            epoch = state->poses_epoch;
+            trajectory_layer_reset(tl_lidar);
+            trajectory_layer_reset(tl_odom);
+            trajectory_layer_reset(tl_flag);
+        }
+        pthread_mutex_unlock(&state->poses_lock);
+
+        redraw_global_world(state);
+        trajectory_layer_update(tl_lidar, state->lidar_poses, &state->poses_lock);
+        trajectory_layer_update(tl_odom, state->odom_poses, &state->poses_lock);
+        trajectory_layer_update(tl_flag, state->flag_poses, &state->poses_lock);
     }
     return NULL;
 }
@@ -261,6 +301,7 @@ void start_flag(state_t *state)
                        NULL);
     vx_buffer_swap(vb);
 
+    pthread_mutex_lock(&state->poses_lock);
     zarray_clear(state->odom_poses);
     zarray_clear(state->lidar_poses);
     zarray_clear(state->flag_poses);
@@ -268,10 +309,13 @@ void start_flag(state_t *state)
     zarray_add(state->odom_poses, state->initial_position);
     zarray_add(state->lidar_poses, state->initial_position);
     zarray_add(state->flag_poses, state->initial_position);
+    state->poses_epoch++;
+    pthread_mutex_unlock(&state->poses_lock);
 
     //Initalize samples
     for(int i = 0; i < NUM_OF_PARTICLES; i++) {
         memcpy(state->particles[i], state->initial_position, sizeof(double)*3);
+        state->weights[i] = 1.0 / NUM_OF_PARTICLES;
     }
 
     pthread_mutex_unlock(&state->mutex);
@@ -396,23 +440,43 @@ static void on_l2g(const lcm_recv_buf_t *rbuf,
     pthread_mutex_unlock(&state->mutex);
 }
 
-static void floats_to_doubles(float *f, double *d, int len)
+static void on_corner_features(const lcm_recv_buf_t *rbuf, const char *channel,
+                               const corner_features_t *msg, void *user)
 {
-    for(int i = 0; i<len; i++) {
-        d[i] = f[i];
+    state_t *state = user;
+    if (!corner_features_valid(msg)) {
+        printf("WRN: dropping corner_features_t (version %d, %d corners)\n",
+               msg->version, msg->ncorners);
+        return;
     }
+    pipeline_traces_stamp(state->traces, msg->utime, "features_received", rbuf->recv_utime);
+
+    pthread_mutex_lock(&state->mutex);
+    corner_features_t *corner_f = corner_features_t_copy(msg);
+    zarray_add(state->corner_features_queue, &corner_f);
+    pthread_mutex_unlock(&state->mutex);
 }
 
 static void on_line_features(const lcm_recv_buf_t *rbuf, const char *channel,
                              const line_features_t *msg, void *user)
 {
     state_t *state = user;
+    pipeline_traces_stamp(state->traces, msg->utime, "features_received", rbuf->recv_utime);
+
     pthread_mutex_lock(&state->mutex);
-    line_features_t *line_f = line_features_t_copy(msg);
-    zarray_add(state->line_features_queue, &line_f);
+    // legacy corners carry no covariance, only sensor_noise is used
+    corner_features_t *corner_f = corner_features_from_line_features(msg, 0);
+    zarray_add(state->corner_features_queue, &corner_f);
     pthread_mutex_unlock(&state->mutex);
 }
 
+static void on_features_trace(const lcm_recv_buf_t *rbuf, const char *channel,
+                              const pipeline_trace_t *msg, void *user)
+{
+    state_t *state = user;
+    pipeline_traces_add_upstream(state->traces, msg);
+}
+
 static double gaussian_sample(double mu, double variance)
 {
     return mu + sqrt(variance) * randf_normal();
@@ -423,57 +487,165 @@ static double normpdf_W(double v, double mu, double variance)
     return -sq(v-mu) / 2 / variance;
 }
 
+// low-variance resampling into the spare particle buffer, which then
+// becomes the live one.
 static void resample(state_t *state, double w[])
 {
+    double (*particles)[3] = state->particles;
+    double (*out)[3] = (particles == state->particle_bufs[0]) ?
+        state->particle_bufs[1] : state->particle_bufs[0];
+
     double c = w[0];
     double r = 1.0 / NUM_OF_PARTICLES * randf_uniform(0, 1);
-    double particles[NUM_OF_PARTICLES][3];
-    memcpy(particles, state->particles, sizeof(double)*NUM_OF_PARTICLES*3);
     int k = 0;
     for (int i = 0; i < NUM_OF_PARTICLES; i++) {
         double U = r + (double)i / NUM_OF_PARTICLES;
-        while (U>c) {
+        // (weights may sum to slightly less than one)
+        while (U>c && k < NUM_OF_PARTICLES - 1) {
             k++;
             c +=  w[k];
         }
-        //XXX??? : Will this be a problem, should I have a temperory holder for particles state?
-        //memcpy(state->particles[i], state->particles[k], sizeof(double)*3);
-        memcpy(state->particles[i], particles[k], sizeof(double)*3);
+        memcpy(out[i], particles[k], sizeof(double)*3);
+        state->weights[i] = 1.0 / NUM_OF_PARTICLES;
     }
+
+    state->particles = out;
 }
 
 static int find_landmark(state_t *state, double _xy[2], double threshold)
 {
-    double dist_thresh = threshold;
-    int32_t closest_id = -1;
-    double closest_dist = dist_thresh;
-
-    double xy[2];
-    for (int i = 0; i < zarray_size(state->landmarks); i++) {
-        zarray_get(state->landmarks, i, xy);
-        double dist = doubles_distance(_xy, xy, 2);
-        if (dist < closest_dist) {
-            closest_dist = dist;
-            closest_id = i;
+    return landmark_map_find_nearest(state->landmarks, _xy, threshold);
+}
+
+struct summary_cell
+{
+    double w, x, y, c, s;
+};
+
+static int summary_cell_compare(const void *_a, const void *_b)
+{
+    const struct summary_cell *a = _a, *b = _b;
+    return (a->w < b->w) - (a->w > b->w);
+}
+
+static void publish_particle_summary(state_t *state, int64_t utime,
+                                     double particles[][3], const double *weights)
+{
+
+    particle_summary_t msg = { .utime = utime,
+                               .version = PARTICLE_SUMMARY_T_VERSION,
+                               .nparticles = NUM_OF_PARTICLES };
+
+    // weighted mean (circular in theta), and modes as the heaviest
+    // cells of a coarse grid
+    double sw = 0, sw2 = 0, sx = 0, sy = 0, sc = 0, ss = 0;
+    zhash_t *cells = zhash_create(sizeof(uint64_t), sizeof(struct summary_cell),
+                                  zhash_uint64_hash, zhash_uint64_equals);
+
+    for (int k = 0; k < NUM_OF_PARTICLES; k++) {
+        double w = weights[k];
+        double c = cos(particles[k][2]), s = sin(particles[k][2]);
+        sw += w;
+        sw2 += w*w;
+        sx += w*particles[k][0];
+        sy += w*particles[k][1];
+        sc += w*c;
+        ss += w*s;
+
+        int32_t ix = (int32_t) floor(particles[k][0] / SUMMARY_MODE_CELL);
+        int32_t iy = (int32_t) floor(particles[k][1] / SUMMARY_MODE_CELL);
+        uint64_t key = (((uint64_t) (uint32_t) ix) << 32) | (uint32_t) iy;
+
+        struct summary_cell *cell;
+        if (!zhash_get_volatile(cells, &key, &cell)) {
+            struct summary_cell empty = { 0 };
+            zhash_put(cells, &key, &empty, NULL, NULL);
+            zhash_get_volatile(cells, &key, &cell);
         }
+        cell->w += w;
+        cell->x += w*particles[k][0];
+        cell->y += w*particles[k][1];
+        cell->c += w*c;
+        cell->s += w*s;
+    }
+
+    if (sw <= 0) {
+        zhash_destroy(cells);
+        return;
+    }
+
+    msg.ess = sw*sw / sw2;
+    msg.mean[0] = sx / sw;
+    msg.mean[1] = sy / sw;
+    msg.mean[2] = atan2(ss, sc);
+
+    for (int k = 0; k < NUM_OF_PARTICLES; k++) {
+        double d[3] = { particles[k][0] - msg.mean[0],
+                        particles[k][1] - msg.mean[1],
+                        mod2pi(particles[k][2] - msg.mean[2]) };
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                msg.cov[3*i + j] += weights[k]*d[i]*d[j] / sw;
+    }
+
+    zarray_t *modes = zhash_values(cells);
+    zarray_sort(modes, summary_cell_compare);
+    msg.nmodes = imin(state->summary_modes, zarray_size(modes));
+    double mode_x[msg.nmodes + 1], mode_y[msg.nmodes + 1], mode_theta[msg.nmodes + 1];
+    float mode_weight[msg.nmodes + 1];
+    for (int i = 0; i < msg.nmodes; i++) {
+        struct summary_cell *cell;
+        zarray_get_volatile(modes, i, &cell);
+        mode_x[i] = cell->x / cell->w;
+        mode_y[i] = cell->y / cell->w;
+        mode_theta[i] = atan2(cell->s, cell->c);
+        mode_weight[i] = cell->w / sw;
     }
+    msg.mode_x = mode_x;
+    msg.mode_y = mode_y;
+    msg.mode_theta = mode_theta;
+    msg.mode_weight = mode_weight;
+
+    // subsampled cloud, quantized relative to the mean
+    msg.ncloud = imin(state->summary_cloud, NUM_OF_PARTICLES);
+    double extent = 0;
+    for (int i = 0; i < msg.ncloud; i++) {
+        int k = i * NUM_OF_PARTICLES / msg.ncloud;
+        extent = fmax(extent, fabs(particles[k][0] - msg.mean[0]));
+        extent = fmax(extent, fabs(particles[k][1] - msg.mean[1]));
+    }
+    msg.xy_scale = fmax(extent / INT16_MAX, 1E-4);
+
+    int16_t cloud[3][msg.ncloud + 1];
+    for (int i = 0; i < msg.ncloud; i++) {
+        int k = i * NUM_OF_PARTICLES / msg.ncloud;
+        cloud[0][i] = iclamp(lround((particles[k][0] - msg.mean[0]) / msg.xy_scale), -INT16_MAX, INT16_MAX);
+        cloud[1][i] = iclamp(lround((particles[k][1] - msg.mean[1]) / msg.xy_scale), -INT16_MAX, INT16_MAX);
+        cloud[2][i] = lround(mod2pi(particles[k][2]) / M_PI * PARTICLE_SUMMARY_T_THETA_SCALE);
+    }
+    msg.cloud_x = cloud[0];
+    msg.cloud_y = cloud[1];
+    msg.cloud_theta = cloud[2];
 
-    return closest_id;
+    particle_summary_t_publish(state->lcm, "FLAG.PARTICLE-SUMMARY", &msg);
+
+    zarray_destroy(modes);
+    zhash_destroy(cells);
 }
 
-void line_feature_process(state_t *state, line_features_t *line_f)
+void corner_feature_process(state_t *state, corner_features_t *corner_f)
 {
     pose_t pose_local;
     int ret;
     lcmdoubles_t pose;
     pthread_mutex_lock(&state->pose_lock);
     if ((ret = interpolator_get(state->pose_interp,
-                               line_f->utime,
+                               corner_f->utime,
                                &pose_local)))
     {
         if(ret == -1) {
             printf("No POSE (single side)\n");
-            printf("time diff: %f ms \n", (line_f->utime - pose_local.utime) * 1E-3);
+            printf("time diff: %f ms \n", (corner_f->utime - pose_local.utime) * 1E-3);
         }
         if(ret == -2) {
             printf("No POSE(double side)\n");
@@ -483,6 +655,12 @@ void line_feature_process(state_t *state, line_features_t *line_f)
     }
     pthread_mutex_unlock(&state->pose_lock);
 
+    // the filter's estimate now stands for this time, even if the
+    // robot has not moved enough to update it
+    pthread_mutex_lock(&state->mutex);
+    state->particles_utime = corner_f->utime;
+    pthread_mutex_unlock(&state->mutex);
+
     double xyt_local[3];
     doubles_quat_xyz_to_xyt(pose_local.orientation,
                             pose_local.pos,
@@ -517,6 +695,7 @@ void line_feature_process(state_t *state, line_features_t *line_f)
     //double cos_sum = 0.0f;
     //double sin_sum = 0.0f;
 
+    pthread_mutex_lock(&state->mutex);
     for (int k = 0; k < NUM_OF_PARTICLES; k++) {
         double motion[3] = { z[0] - gaussian_sample(0, pow(motion_std[0], 2)),
                              z[1] - gaussian_sample(0, pow(motion_std[1], 2)),
@@ -529,30 +708,68 @@ void line_feature_process(state_t *state, line_features_t *line_f)
         //cos_sum += cos(state->particles[k][2]);
         //sin_sum += sin(state->particles[k][2]);
     }
+    pthread_mutex_unlock(&state->mutex);
     //state->mu[0] = mu_sum[0] / NUM_OF_PARTICLES;
     //state->mu[1] = mu_sum[1] / NUM_OF_PARTICLES;
     //state->mu[2] = atan2(sin_sum, cos_sum);
 
     //double flag_pose[3];
-    if(!line_f->lines_data_length) {
+    // decode once; every particle associates against the same corners
+    int ncorners = 0;
+    flag_corner_t *corners = calloc(corner_f->ncorners + 1, sizeof(flag_corner_t));
+    double (*corner_var)[2] = calloc(corner_f->ncorners + 1, sizeof(double[2]));
+    for (int i = 0; i < corner_f->ncorners; i++) {
+        corner_features_get(corner_f, i, &corners[ncorners]);
+        if (corners[ncorners].quality < MIN_CORNER_QUALITY ||
+            !flag_corner_regularize_cov(&corners[ncorners]))
+            continue;
+        flag_corner_range_bearing_variance(&corners[ncorners], corner_var[ncorners]);
+        for (int j = 0; j < 2; j++)
+            corner_var[ncorners][j] += sensor_noise[j];
+        ncorners++;
+    }
+
+    if(!ncorners) {
         double mu[3];
         doubles_xyt_mul(state->mu, z, mu);
         memcpy(state->mu, mu, sizeof(double)*3);
         goto line_feature_cleanup;
     }
 
+    if (state->field) {
+        // keep the field's window over the particles
+        double mean[2] = { 0, 0 };
+        for (int k = 0; k < NUM_OF_PARTICLES; k++) {
+            mean[0] += state->particles[k][0] / NUM_OF_PARTICLES;
+            mean[1] += state->particles[k][1] / NUM_OF_PARTICLES;
+        }
+        if (likelihood_field_update(state->field, state->landmarks, mean))
+            INSTRUMENT_COUNT("pf.field_rebuilds", 1);
+    }
+
     for (int k = 0; k < NUM_OF_PARTICLES; k++) {
-        w[k] = 1.0;
-        /* data association here */
-        {
+        w[k] = 1.0 + log(state->weights[k]);
+        if (state->field) {
+            // every corner contributes by its distance to the nearest
+            // landmark; no association needed.
+            for (int i = 0; i < ncorners; i++) {
+                double local_corner[2] = { corners[i].xy[0], corners[i].xy[1] };
+                double global_corner_position[2];
+                doubles_xyt_transform_xy(state->particles[k], local_corner, global_corner_position);
+
+                double dist = likelihood_field_distance(state->field, global_corner_position);
+                w[k] += normpdf_W(dist, 0, corner_var[i][0]);
+            }
+        } else {
+            /* data association here */
             double xy[2] = { 0 };
             double min_dist = DBL_MAX;
             int closest_landmark_id = -1;
-            for (int i = 0; i < line_f->lines_data_length / 3; i++) {
+            int closest_corner_id = -1;
+            for (int i = 0; i < ncorners; i++) {
                 //transform local points to global
-                double local_corner[3];
+                double local_corner[3] = { corners[i].xy[0], corners[i].xy[1], corners[i].theta };
                 double global_corner_position[2];
-                floats_to_doubles(&line_f->lines[3*i], local_corner, 3);
                 doubles_xyt_transform_xy(state->particles[k], local_corner, global_corner_position);
 
                 /* particles data association radius */
@@ -561,12 +778,12 @@ void line_feature_process(state_t *state, line_features_t *line_f)
                 if (landmark_idx == -1) {
                     continue;
                 }
-                double landmark[2];
-                zarray_get(state->landmarks, landmark_idx, landmark);
+                const double *landmark = landmark_map_xy(state->landmarks, landmark_idx);
                 //XXX: For now, we only use the closest landmark as a feature for data asscocaition
                 double dist = doubles_distance(global_corner_position, landmark, 2);
                 if(dist < min_dist){
                     closest_landmark_id = landmark_idx;
+                    closest_corner_id = i;
                     min_dist = dist;
                     xy[0] = global_corner_position[0];
                     xy[1] = global_corner_position[1];
@@ -580,8 +797,7 @@ void line_feature_process(state_t *state, line_features_t *line_f)
                 w[k] += normpdf_W(delta_z[1], 0, sensor_noise[1]);
             } else {
                 /* only x and y distance */
-                double landmark[2];
-                zarray_get(state->landmarks, closest_landmark_id, landmark);
+                const double *landmark = landmark_map_xy(state->landmarks, closest_landmark_id);
                 /* double zhat[2] = { landmark[0] - state->particles[k][0], */
                 /*                    landmark[1] - state->particles[k][1] }; //here are the expectations */
                 /* double z[2] = { xy[0] - global_pose[0], */
@@ -594,8 +810,8 @@ void line_feature_process(state_t *state, line_features_t *line_f)
                                 atan2(xy[1] - state->particles[k][1], xy[0] - state->particles[k][0]) }; //observations
 
                 double delta_z[2] = { z[0] - zhat[0], mod2pi(z[1] - zhat[1])};
-                w[k] += normpdf_W(delta_z[0], 0, sensor_noise[0]);
-                w[k] += normpdf_W(delta_z[1], 0, sensor_noise[1]);
+                w[k] += normpdf_W(delta_z[0], 0, corner_var[closest_corner_id][0]);
+                w[k] += normpdf_W(delta_z[1], 0, corner_var[closest_corner_id][1]);
             }
         }
         if (w[k] > w_max) {
@@ -622,7 +838,20 @@ void line_feature_process(state_t *state, line_features_t *line_f)
         }
     }
     memcpy(state->mu, state->particles[largest_W_idx], sizeof(double)*3);
-    resample(state, W);
+
+    double W_sq_sum = 0;
+    for (int k = 0; k < NUM_OF_PARTICLES; k++)
+        W_sq_sum += W[k]*W[k];
+
+    pthread_mutex_lock(&state->mutex);
+    if (1.0 / W_sq_sum < state->resample_ess * NUM_OF_PARTICLES) {
+        INSTRUMENT_SPAN_BEGIN(ns_resample);
+        resample(state, W);
+        INSTRUMENT_SPAN_END("pf.resample", ns_resample);
+        INSTRUMENT_COUNT("pf.resampled", 1);
+    } else
+        memcpy(state->weights, W, sizeof(W));
+    pthread_mutex_unlock(&state->mutex);
 
     /* double corner[2]; */
     /* vx_buffer_t *vb = vx_world_get_buffer(state->vw, "corners"); */
@@ -643,30 +872,54 @@ void line_feature_process(state_t *state, line_features_t *line_f)
     /* vx_buffer_swap(vb); */
 
   line_feature_cleanup:
+    free(corners);
+    free(corner_var);
+    pipeline_traces_stamp(state->traces, corner_f->utime, "solve_done", utime_now());
     //check movement
     //publish states
 
-    pose.utime = line_f->utime;
+    pose.utime = corner_f->utime;
     pose.ndata = 3;
-    pose.data = lidar_pose;
+    pthread_mutex_lock(&state->poses_lock);
     zarray_add(state->lidar_poses, lidar_pose);
+    zarray_add(state->odom_poses, odom_pose);
+    zarray_add(state->flag_poses, state->mu);
+    pthread_mutex_unlock(&state->poses_lock);
+
+    pose.data = lidar_pose;
     lcmdoubles_t_publish(state->lcm, "FLAG.LIDAR-POSE", &pose);
 
     pose.data = odom_pose;
-    zarray_add(state->odom_poses, odom_pose);
     lcmdoubles_t_publish(state->lcm, "FLAG.ODOM-POSE", &pose);
 
     pose.data = state->mu;
     lcmdoubles_t_publish(state->lcm, "FLAG.FLAG-POSE", &pose);
-    zarray_add(state->flag_poses, state->mu);
+    pipeline_traces_stamp(state->traces, corner_f->utime, "pose_published", utime_now());
+}
+
+// publishes FLAG.PARTICLE-SUMMARY at its own rate, whether or not
+// the filter is updating.
+static void *summary_thread(void *user)
+{
+    state_t *state = user;
+    timeutil_rest_t *rt = timeutil_rest_create();
+
+    double (*particles)[3] = malloc(sizeof(double[3]) * NUM_OF_PARTICLES);
+    double *weights = malloc(sizeof(double) * NUM_OF_PARTICLES);
+
+    while (1) {
+        timeutil_sleep_hz(rt, 1E6 / state->summary_period_us);
+
+        pthread_mutex_lock(&state->mutex);
+        int64_t utime = state->particles_utime;
+        memcpy(particles, state->particles, sizeof(double[3]) * NUM_OF_PARTICLES);
+        memcpy(weights, state->weights, sizeof(double) * NUM_OF_PARTICLES);
+        pthread_mutex_unlock(&state->mutex);
 
-    double particles[NUM_OF_PARTICLES*3];
-    for(int i=0; i<NUM_OF_PARTICLES; i++) {
-        memcpy(&particles[i*3], state->particles[i], sizeof(double)*3);
+        if (utime != 0)
+            publish_particle_summary(state, utime, particles, weights);
     }
-    pose.ndata = NUM_OF_PARTICLES*3;
-    pose.data = particles;
-    lcmdoubles_t_publish(state->lcm, "FLAG.PARTICLES", &pose);
+    return NULL;
 }
 
 void *line_f_thread(void *user)
@@ -680,103 +933,54 @@ void *line_f_thread(void *user)
         timeutil_usleep(100000);
         pthread_mutex_lock(&state->mutex);
         // Don't get too far behind
-        while (zarray_size(state->line_features_queue) > high_water) {
-            line_features_t *l_f = NULL;
-            zarray_get(state->line_features_queue, 0, &l_f);
-            zarray_remove_index(state->line_features_queue, 0, 0);
-            line_features_t_destroy(l_f);
+        while (zarray_size(state->corner_features_queue) > high_water) {
+            corner_features_t *c_f = NULL;
+            zarray_get(state->corner_features_queue, 0, &c_f);
+            zarray_remove_index(state->corner_features_queue, 0, 0);
+            pipeline_traces_stamp(state->traces, c_f->utime, PIPELINE_TRACE_DROPPED, utime_now());
+            pipeline_traces_finish(state->traces, c_f->utime);
+            corner_features_t_destroy(c_f);
+            INSTRUMENT_COUNT("pf.features_dropped", 1);
         }
 
         // Wait if no data
-        if (zarray_size(state->line_features_queue) < low_water) {
+        if (zarray_size(state->corner_features_queue) < low_water) {
             pthread_mutex_unlock(&state->mutex);
             continue;
         }
 
-        line_features_t *l_f = NULL;
-        zarray_get(state->line_features_queue, 0, &l_f);
-        zarray_remove_index(state->line_features_queue, 0, 0);
+        corner_features_t *c_f = NULL;
+        zarray_get(state->corner_features_queue, 0, &c_f);
+        zarray_remove_index(state->corner_features_queue, 0, 0);
         pthread_mutex_unlock(&state->mutex);
-        if(state->is_start)
-            line_feature_process(state, l_f);
-        line_features_t_destroy(l_f);
-    }
-
-    return NULL;
-}
-
-vx_object_t* make_gws_from_file(state_t *state, const char *path)
-{
-    global_world_state_t *gws = NULL;
-    vx_object_t *vxo = NULL;
-
-    FILE *fp = fopen(path, "r");
-    fseek(fp, 0L, SEEK_END);
-    long len = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-
-    uint8_t *buf = malloc(len);
-    size_t sz = fread(buf, 1, len, fp);
-
-    if (sz != len)
-        goto cleanup;
 
-    uint32_t pos = 0;
-    gws = stype_decode_object(buf, &pos, len, NULL);
-    printf("NFO: Loaded global_world_state_t from %s - %ld bytes\n", path, len);
-
-
-    grid_map_t *gm = NULL;
-    switch (gws->global_map.encoding) {
-        case GRID_MAP_T_ENCODING_NONE:
-            gm = gridmap_copy(&gws->global_map);
-            break;
-        case GRID_MAP_T_ENCODING_GZIP:
-            gm = grid_map_t_decode_gzip(&gws->global_map);
-            break;
-        default:
-            printf("ERR: encoding type %d not supported\n", gws->global_map.encoding);
-            exit(1);
+        pipeline_traces_stamp(state->traces, c_f->utime, "features_dequeued", utime_now());
+        if(state->is_start) {
+            INSTRUMENT_SPAN_BEGIN(ns_update);
+            corner_feature_process(state, c_f);
+            INSTRUMENT_SPAN_END("pf.update", ns_update);
+        }
+        // complete if a pose was published, otherwise up to the dequeue
+        pipeline_traces_finish(state->traces, c_f->utime);
+        corner_features_t_destroy(c_f);
     }
 
-
-    image_u8_t *im = image_u8_create(gm->width, gm->height);
-    for (int y = 0; y < gm->height; y++)
-        memcpy(&im->buf[y*im->stride], &gm->data[y*gm->width], gm->width);
-
-    vx_resource_t *tex = vx_resource_make_texture_u8_copy(im, 0);
-    image_u8_destroy(im);
-
-    vxo = vxo_image_tile(tex,
-                         vx_nada,
-                         vx_gray,
-                         vx_maroon,
-                         vx_orange);
-    state->gm = gm;
-    global_world_state_t_destroy(gws);
-
-  cleanup:
-    free(buf);
-    fclose(fp);
-    return vxo;
+    return NULL;
 }
 
 void read_landmarks(state_t *state)
 {
-    FILE *f = fopen(state->input_file_path, "r");
-
-    float x;
-    float y;
-    if(f) {
-        while (fscanf(f, "%f,%f", &x, &y) != EOF) {
-            double *xy = (double*) calloc(2, sizeof(float));
-            xy[0] = x;
-            xy[1] = y;
-            zarray_add(state->landmarks, xy);
-        }
-        printf("Read in %d landmarks \n", zarray_size(state->landmarks));
-        fclose(f);
+    landmark_map_t *map = landmark_map_open(state->input_file_path);
+    if (map == NULL) {
+        printf("ERR: unable to read landmarks from %s\n", state->input_file_path);
+        return;
     }
+
+    landmark_map_destroy(state->landmarks);
+    state->landmarks = map;
+    if (state->field)
+        likelihood_field_invalidate(state->field);
+    printf("Read in %d landmarks \n", landmark_map_size(state->landmarks));
 }
 
 void setup_geo(state_t *state, getopt_t *gopt)
@@ -830,10 +1034,20 @@ int main(int argc, char *argv[])
 
     getopt_t *gopt = getopt_create();
     getopt_add_int(gopt, 'p', "port", "8891", "jsvx server port");
-    getopt_add_string(gopt, 'i', "in-file", "", "input feature file");
+    getopt_add_string(gopt, 'i', "in-file", "", "input landmark map (binary or csv)");
     getopt_add_string(gopt, 'f', "image", "", "satellite image file path");
-    getopt_add_string(gopt, '\0', "world", "", "global world image file path");
+    getopt_add_string(gopt, '\0', "world", "", "global world image file path (tiled or legacy)");
+    getopt_add_double(gopt, '\0', "world-radius", "150", "display world map tiles within this distance (m)");
     getopt_add_string(gopt, 'm', "mission-config", "", "Config file for mission");
+    getopt_add_double(gopt, '\0', "instrument-hz", "1", "INSTRUMENT report rate (0 = none)");
+    getopt_add_double(gopt, '\0', "resample-ess", "1.0", "resample when the effective sample size falls below this fraction of the particles (e.g. 0.5)");
+    getopt_add_double(gopt, '\0', "summary-hz", "2", "FLAG.PARTICLE-SUMMARY rate (0 = none)");
+    getopt_add_int(gopt, '\0', "summary-modes", "3", "modes per particle summary");
+    getopt_add_int(gopt, '\0', "summary-cloud", "100", "particles per summary cloud (0 = none)");
+    getopt_add_bool(gopt, '\0', "likelihood-field", 0, "score corners by distance to the nearest landmark instead of associating them");
+    getopt_add_double(gopt, '\0', "field-resolution", "0.1", "likelihood field cell size (m)");
+    getopt_add_double(gopt, '\0', "field-max-dist", "2.0", "likelihood field saturation distance (m)");
+    getopt_add_double(gopt, '\0', "field-radius", "100", "likelihood field window half-width around the particles (m)");
 
     if (!getopt_parse(gopt, argc, argv, 1)) {
         getopt_do_usage(gopt);
@@ -841,6 +1055,12 @@ int main(int argc, char *argv[])
     }
     signal(SIGINT, signal_handler);
     state_t *state = (state_t*) calloc(1, sizeof(state_t));
+    state->particles = state->particle_bufs[0];
+    state->resample_ess = getopt_get_double(gopt, "resample-ess");
+    if (getopt_get_double(gopt, "summary-hz") > 0)
+        state->summary_period_us = 1E6 / getopt_get_double(gopt, "summary-hz");
+    state->summary_modes = imax(0, getopt_get_int(gopt, "summary-modes"));
+    state->summary_cloud = imax(0, getopt_get_int(gopt, "summary-cloud"));
     //HARD CODE for evaluation against lidar
     state->lidar_to_img[0] =  -6.600000;
     state->lidar_to_img[1] =  -9.000000;
@@ -861,8 +1081,8 @@ int main(int argc, char *argv[])
                                        NULL,
                                        "index.html");
 
-    //each element contains (x,y) position of the landmark in global frame.
-    state->landmarks = zarray_create(2*sizeof(double));
+    // (x,y) positions of the landmarks in global frame.
+    state->landmarks = landmark_map_create(NULL, NULL, 0, LANDMARK_MAP_DEFAULT_TILE_SIZE);
     webvx_define_canvas(state->webvx,
                         "flag-map-generator-Canvas",
                         on_create_canvas,
@@ -876,17 +1096,33 @@ int main(int argc, char *argv[])
         render_landmarks(state);
     }
 
+    if (getopt_get_bool(gopt, "likelihood-field")) {
+        state->field = likelihood_field_create(getopt_get_double(gopt, "field-resolution"),
+                                               getopt_get_double(gopt, "field-max-dist"),
+                                               getopt_get_double(gopt, "field-radius"));
+        if (state->field == NULL)
+            printf("ERR: likelihood field too large or invalid; using landmark association\n");
+        else
+            printf("Likelihood field: %d x %d cell window\n", state->field->width, state->field->height);
+    }
+
     if (strlen(getopt_get_string(gopt, "world"))) {
         printf("Load world file from: %s\n", getopt_get_string(gopt, "world"));
-        state->world_img = make_gws_from_file(state, getopt_get_string(gopt, "world"));
-        redraw_global_world(state);
+        state->world = world_tiles_open(getopt_get_string(gopt, "world"));
+        if (state->world == NULL)
+            printf("ERR: unable to read world map %s\n", getopt_get_string(gopt, "world"));
+        else
+            state->world_layer = world_tiles_layer_create(state->vw, "map", state->world,
+                                                          getopt_get_double(gopt, "world-radius"), 0);
     }
 
     //Initilize variables
     state->odom_poses = zarray_create(sizeof(double[3]));
     state->lidar_poses = zarray_create(sizeof(double[3]));
     state->flag_poses = zarray_create(sizeof(double[3]));
-    state->line_features_queue = zarray_create(sizeof(line_features_t*));
+    pthread_mutex_init(&state->poses_lock, NULL);
+    state->corner_features_queue = zarray_create(sizeof(corner_features_t*));
+    state->traces = pipeline_traces_create("FLAG-pf", state->lcm, PIPELINE_TRACE_CHANNEL);
 
     pthread_mutex_init(&state->mutex, NULL);
     pthread_mutex_init(&state->pose_lock, NULL);
@@ -898,13 +1134,19 @@ int main(int argc, char *argv[])
                            4, offsetof(pose_t, orientation));
 
 
+    corner_features_t_subscribe(state->lcm, "LOCAL_CORNER_FEATURES", on_corner_features, state);
     line_features_t_subscribe(state->lcm,"LOCAL_LINE_FEATURES", on_line_features, state);
     pose_t_subscribe(state->lcm, "POSE", on_pose, state);
     lcmdoubles_t_subscribe(state->lcm, "L2G_SCANMATCH", on_l2g, state);
+    pipeline_trace_t_subscribe(state->lcm, PIPELINE_TRACE_FEATURES_CHANNEL, on_features_trace, state);
 
     http_advertiser_create(state->lcm, getopt_get_int(gopt, "port"),
                            "FLAG localization", "FLAG localization");
 
+    if (getopt_get_double(gopt, "instrument-hz") > 0)
+        instrument_publisher_create(state->lcm, INSTRUMENT_CHANNEL, "FLAG-pf",
+                                    getopt_get_double(gopt, "instrument-hz"));
+
 
 
     pthread_t render_thread;
@@ -913,6 +1155,11 @@ int main(int argc, char *argv[])
     pthread_t thread;
     pthread_create(&thread, NULL, line_f_thread, state);
 
+    if (state->summary_period_us > 0) {
+        pthread_t summary;
+        pthread_create(&summary, NULL, summary_thread, state);
+    }
+
     while (1) {
         lcm_handle(state->lcm);
     }
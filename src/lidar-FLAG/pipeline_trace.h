@@ -0,0 +1,255 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lcm/lcm.h>
+
+#include "common/math_util.h"
+#include "common/zhash.h"
+#include "lcmtypes/pipeline_trace_t.h"
+
+// Latency tracing from the velodyne packets to the published pose.
+//
+// Each process that handles some data (a sweep's corner features,
+// keyed by their utime) stamps the wall-clock time at which the data
+// reached each of its stages, and publishes the stamps as a
+// pipeline_trace_t next to its output. The next process merges that
+// trace with its own stamps, so the last one publishes the whole
+// chain (FLAG.TRACE), which FLAG-trace-stats turns into per-stage
+// latency distributions.
+//
+// Stamps from different processes are only comparable on one host or
+// with synchronized clocks.
+
+// published by velodyne-to-corner just before LOCAL_CORNER_FEATURES
+#define PIPELINE_TRACE_FEATURES_CHANNEL "LOCAL_CORNER_FEATURES.TRACE"
+// published by the localizers after FLAG.FLAG-POSE
+#define PIPELINE_TRACE_CHANNEL "FLAG.TRACE"
+
+// first stage of a complete chain: the sweep's first velodyne packet
+#define PIPELINE_TRACE_FIRST_STAGE "packet_received"
+
+// stage recorded for data dropped from a queue before processing
+#define PIPELINE_TRACE_DROPPED "dropped"
+
+#define PIPELINE_TRACE_MAX_STAGES 16
+
+static inline void pipeline_trace_init(pipeline_trace_t *trace, int64_t utime, const char *source)
+{
+    memset(trace, 0, sizeof(pipeline_trace_t));
+    trace->utime = utime;
+    trace->source = strdup(source);
+    trace->stage = calloc(PIPELINE_TRACE_MAX_STAGES, sizeof(char*));
+    trace->stage_utime = calloc(PIPELINE_TRACE_MAX_STAGES, sizeof(int64_t));
+}
+
+static inline void pipeline_trace_clear(pipeline_trace_t *trace)
+{
+    for (int i = 0; i < trace->nstages; i++)
+        free(trace->stage[i]);
+    free(trace->stage);
+    free(trace->stage_utime);
+    free(trace->source);
+    memset(trace, 0, sizeof(pipeline_trace_t));
+}
+
+// Stages beyond PIPELINE_TRACE_MAX_STAGES are dropped.
+static inline void pipeline_trace_stamp(pipeline_trace_t *trace, const char *stage, int64_t utime)
+{
+    if (trace->nstages >= PIPELINE_TRACE_MAX_STAGES)
+        return;
+
+    trace->stage[trace->nstages] = strdup(stage);
+    trace->stage_utime[trace->nstages] = utime;
+    trace->nstages++;
+}
+
+// Puts 'upstream's stages ahead of the ones in 'trace'.
+static inline void pipeline_trace_prepend(pipeline_trace_t *trace, const pipeline_trace_t *upstream)
+{
+    int n = imin(upstream->nstages, PIPELINE_TRACE_MAX_STAGES - trace->nstages);
+    if (n <= 0)
+        return;
+
+    memmove(&trace->stage[n], trace->stage, sizeof(char*) * trace->nstages);
+    memmove(&trace->stage_utime[n], trace->stage_utime, sizeof(int64_t) * trace->nstages);
+    for (int i = 0; i < n; i++) {
+        trace->stage[i] = strdup(upstream->stage[i]);
+        trace->stage_utime[i] = upstream->stage_utime[i];
+    }
+    trace->nstages += n;
+}
+
+// Traces in progress within one process, by data utime. Upstream
+// traces may arrive before or after the data they describe, so a
+// finished trace is held until its upstream trace has been merged in.
+// Held traces that never get one are published without it once
+// max_traces newer traces have been started; unfinished ones are
+// discarded then.
+struct pipeline_traces_entry
+{
+    pipeline_trace_t trace;
+    uint64_t seq;         // start order
+    int has_upstream;
+    int finished;
+};
+
+typedef struct pipeline_traces pipeline_traces_t;
+struct pipeline_traces
+{
+    pthread_mutex_t mutex;
+    const char *source;
+    lcm_t *lcm;
+    const char *channel;
+    zhash_t *traces;   // int64_t utime => struct pipeline_traces_entry*
+
+    // the last max_traces traces started, oldest first (a ring), so
+    // that the oldest can be evicted without searching. Entries whose
+    // trace has since been published are skipped.
+    int max_traces;
+    struct { int64_t utime; uint64_t seq; } *order;
+    int order_head, order_size;
+    uint64_t next_seq;
+};
+
+static inline pipeline_traces_t *pipeline_traces_create(const char *source, lcm_t *lcm, const char *channel)
+{
+    pipeline_traces_t *pt = calloc(1, sizeof(pipeline_traces_t));
+    pthread_mutex_init(&pt->mutex, NULL);
+    pt->source = source;
+    pt->lcm = lcm;
+    pt->channel = channel;
+    pt->traces = zhash_create(sizeof(int64_t), sizeof(struct pipeline_traces_entry*),
+                              zhash_uint64_hash, zhash_uint64_equals);
+    pt->max_traces = 100;
+    pt->order = calloc(pt->max_traces, sizeof(*pt->order));
+    return pt;
+}
+
+// Publishes and frees (if non-NULL) an entry removed from
+// pt->traces. Called without pt->mutex held.
+static inline void pipeline_traces_emit(pipeline_traces_t *pt, struct pipeline_traces_entry *e)
+{
+    if (e == NULL)
+        return;
+
+    pipeline_trace_t_publish(pt->lcm, pt->channel, &e->trace);
+    pipeline_trace_clear(&e->trace);
+    free(e);
+}
+
+// with pt->mutex held. If starting a new trace evicts a finished one,
+// it is returned in *evicted for the caller to publish.
+static inline struct pipeline_traces_entry *pipeline_traces_get(pipeline_traces_t *pt, int64_t utime,
+                                                                struct pipeline_traces_entry **evicted)
+{
+    struct pipeline_traces_entry *e = NULL;
+    if (zhash_get(pt->traces, &utime, &e))
+        return e;
+
+    if (pt->order_size == pt->max_traces) {
+        int64_t oldest = pt->order[pt->order_head].utime;
+        uint64_t seq = pt->order[pt->order_head].seq;
+        pt->order_head = (pt->order_head + 1) % pt->max_traces;
+        pt->order_size--;
+
+        struct pipeline_traces_entry *old = NULL;
+        if (zhash_get(pt->traces, &oldest, &old) && old->seq == seq) {
+            zhash_remove(pt->traces, &oldest, NULL, NULL);
+            if (old->finished) {
+                *evicted = old;
+            } else {
+                pipeline_trace_clear(&old->trace);
+                free(old);
+            }
+        }
+    }
+
+    e = calloc(1, sizeof(struct pipeline_traces_entry));
+    pipeline_trace_init(&e->trace, utime, pt->source);
+    e->seq = pt->next_seq++;
+    zhash_put(pt->traces, &utime, &e, NULL, NULL);
+
+    int tail = (pt->order_head + pt->order_size) % pt->max_traces;
+    pt->order[tail].utime = utime;
+    pt->order[tail].seq = e->seq;
+    pt->order_size++;
+    return e;
+}
+
+static inline void pipeline_traces_stamp(pipeline_traces_t *pt, int64_t utime, const char *stage,
+                                         int64_t stage_utime)
+{
+    struct pipeline_traces_entry *evicted = NULL;
+
+    pthread_mutex_lock(&pt->mutex);
+    pipeline_trace_stamp(&pipeline_traces_get(pt, utime, &evicted)->trace, stage, stage_utime);
+    pthread_mutex_unlock(&pt->mutex);
+
+    pipeline_traces_emit(pt, evicted);
+}
+
+static inline void pipeline_traces_add_upstream(pipeline_traces_t *pt, const pipeline_trace_t *upstream)
+{
+    struct pipeline_traces_entry *evicted = NULL, *ready = NULL;
+
+    pthread_mutex_lock(&pt->mutex);
+    struct pipeline_traces_entry *e = pipeline_traces_get(pt, upstream->utime, &evicted);
+    if (!e->has_upstream) {
+        pipeline_trace_prepend(&e->trace, upstream);
+        e->has_upstream = 1;
+    }
+    if (e->finished) {
+        zhash_remove(pt->traces, &upstream->utime, NULL, NULL);
+        ready = e;
+    }
+    pthread_mutex_unlock(&pt->mutex);
+
+    pipeline_traces_emit(pt, evicted);
+    pipeline_traces_emit(pt, ready);
+}
+
+// Marks the trace for utime complete: it is published (and
+// forgotten) now if its upstream trace has been merged, otherwise
+// when that arrives.
+static inline void pipeline_traces_finish(pipeline_traces_t *pt, int64_t utime)
+{
+    struct pipeline_traces_entry *e = NULL, *ready = NULL;
+
+    pthread_mutex_lock(&pt->mutex);
+    if (zhash_get(pt->traces, &utime, &e)) {
+        e->finished = 1;
+        if (e->has_upstream) {
+            zhash_remove(pt->traces, &utime, NULL, NULL);
+            ready = e;
+        }
+    }
+    pthread_mutex_unlock(&pt->mutex);
+
+    pipeline_traces_emit(pt, ready);
+}
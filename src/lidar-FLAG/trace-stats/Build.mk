@@ -0,0 +1,18 @@
+SRCS = $(shell ls *.c)
+OBJS = $(SRCS:%.c=%.o)
+TARGET = $(BIN_PATH)/FLAG-trace-stats
+
+CFLAGS := $(CFLAGS_STD) $(CFLAGS_COMMON) $(CFLAGS_LCMTYPES)
+LDFLAGS := $(LDFLAGS_STD) $(LDFLAGS_COMMON) $(LDFLAGS_LCMTYPES)
+DEPS := $(DEPS_STD) $(DEPS_COMMON) $(DEPS_LCMTYPES)
+
+include $(BUILD_COMMON)
+
+all: $(TARGET)
+	@/bin/true
+
+$(TARGET): $(OBJS) $(DEPS)
+	@$(LD) -o $@ $^ $(LDFLAGS)
+
+clean:
+	@rm -rf *.o $(OBJS) $(TARGET)
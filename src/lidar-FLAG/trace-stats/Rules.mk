@@ -0,0 +1,15 @@
+.PHONY: trace_stats_clean trace_stats
+
+trace_stats:  common lcmtypes
+
+trace_stats:
+	@echo $@
+	@$(MAKE) -C $(ROOT_PATH)/src/lidar-FLAG/trace-stats -f Build.mk
+
+trace_stats_clean:
+	@echo $@
+	@$(MAKE) -C $(ROOT_PATH)/src/lidar-FLAG/trace-stats -f Build.mk clean
+
+all: trace_stats
+
+clean:  trace_stats_clean
@@ -0,0 +1,193 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "common/getopt.h"
+#include "common/instrument.h"
+#include "common/time_util.h"
+#include "common/zarray.h"
+
+#include "lcm/lcm.h"
+#include "lcmtypes/pipeline_trace_t.h"
+
+#include "lidar-FLAG/pipeline_trace.h"
+
+/**
+ * Latency of the FLAG pipeline, from the traces published by the
+ * localizers (see pipeline_trace.h):
+ *
+ *    ./FLAG-trace-stats                 (live, prints every 5 seconds)
+ *    ./FLAG-trace-stats --log run.lcm   (whole log, prints once)
+ *
+ * For each pair of consecutive stages it reports the p50/p99/max of
+ * the time between them ("a -> b"), plus the end-to-end latency of
+ * the traces that cover the whole chain from the velodyne packet
+ * ("total"), the number that lack the upstream stages ("incomplete")
+ * and the number that ended in a dropped queue entry.
+ */
+
+typedef struct state state_t;
+struct state
+{
+    lcm_t *lcm;
+    const char *channel;
+
+    instrument_window_t *window;
+    int64_t last_print_utime;
+};
+
+static void record(int64_t delta_us, const char *name)
+{
+    int id = instrument_span_id(name);
+    if (id >= 0)
+        instrument_span_record(id, imax64(0, delta_us) * 1000);
+}
+
+static void add_trace(const pipeline_trace_t *trace)
+{
+    if (trace->nstages < 2)
+        return;
+
+    char name[256];
+    for (int i = 1; i < trace->nstages; i++) {
+        snprintf(name, sizeof(name), "%s -> %s", trace->stage[i-1], trace->stage[i]);
+        record(trace->stage_utime[i] - trace->stage_utime[i-1], name);
+    }
+
+    if (!strcmp(trace->stage[trace->nstages-1], PIPELINE_TRACE_DROPPED)) {
+        INSTRUMENT_COUNT("dropped", 1);
+        return;
+    }
+
+    // without the upstream stages the first-to-last time is not the
+    // end-to-end latency
+    if (strcmp(trace->stage[0], PIPELINE_TRACE_FIRST_STAGE)) {
+        INSTRUMENT_COUNT("incomplete", 1);
+        return;
+    }
+
+    snprintf(name, sizeof(name), "total (%s)", trace->source);
+    record(trace->stage_utime[trace->nstages-1] - trace->stage_utime[0], name);
+    INSTRUMENT_COUNT("traces", 1);
+}
+
+static void print_stats(state_t *state)
+{
+    zarray_t *spans = zarray_create(sizeof(instrument_span_stats_t));
+    zarray_t *counters = zarray_create(sizeof(instrument_counter_stats_t));
+    instrument_window_read(state->window, spans, counters);
+
+    printf("%-48s %8s %10s %10s %10s\n", "stage (ms)", "count", "p50", "p99", "max");
+    for (int i = 0; i < zarray_size(spans); i++) {
+        instrument_span_stats_t *s;
+        zarray_get_volatile(spans, i, &s);
+        printf("%-48s %8" PRId64 " %10.2f %10.2f %10.2f\n", s->name, s->count,
+               s->p50_ns / 1.0e6, s->p99_ns / 1.0e6, s->max_ns / 1.0e6);
+    }
+    for (int i = 0; i < zarray_size(counters); i++) {
+        instrument_counter_stats_t *c;
+        zarray_get_volatile(counters, i, &c);
+        printf("%-48s %8" PRId64 " (total %" PRId64 ")\n", c->name, c->delta, c->total);
+    }
+    printf("\n");
+
+    zarray_destroy(spans);
+    zarray_destroy(counters);
+}
+
+static void on_trace(const lcm_recv_buf_t *rbuf, const char *channel,
+                     const pipeline_trace_t *msg, void *user)
+{
+    add_trace(msg);
+}
+
+static int read_log(state_t *state, const char *path)
+{
+    lcm_eventlog_t *log = lcm_eventlog_create(path, "r");
+    if (log == NULL) {
+        printf("ERR: couldn't open %s\n", path);
+        return -1;
+    }
+
+    lcm_eventlog_event_t *ev;
+    while ((ev = lcm_eventlog_read_next_event(log)) != NULL) {
+        if (!strcmp(ev->channel, state->channel)) {
+            pipeline_trace_t trace;
+            if (pipeline_trace_t_decode(ev->data, 0, ev->datalen, &trace) >= 0) {
+                add_trace(&trace);
+                pipeline_trace_t_decode_cleanup(&trace);
+            }
+        }
+        lcm_eventlog_free_event(ev);
+    }
+
+    lcm_eventlog_destroy(log);
+    print_stats(state);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(gopt, '\0', "log", "", "Read traces from an LCM log instead of live");
+    getopt_add_string(gopt, 'c', "channel", PIPELINE_TRACE_CHANNEL, "Trace channel");
+    getopt_add_double(gopt, '\0', "period", "5", "Seconds between live reports");
+
+    if (!getopt_parse(gopt, argc, argv, 0) || getopt_get_bool(gopt, "help")) {
+        printf("Usage: %s [options]\n\n", argv[0]);
+        getopt_do_usage(gopt);
+        return 0;
+    }
+
+    state_t *state = calloc(1, sizeof(state_t));
+    state->channel = getopt_get_string(gopt, "channel");
+    state->window = instrument_window_create();
+
+    int res = 0;
+    if (strlen(getopt_get_string(gopt, "log")) > 0) {
+        res = read_log(state, getopt_get_string(gopt, "log"));
+    } else {
+        state->lcm = lcm_create(NULL);
+        pipeline_trace_t_subscribe(state->lcm, state->channel, on_trace, state);
+
+        int64_t period_us = getopt_get_double(gopt, "period") * 1e6;
+        state->last_print_utime = utime_now();
+        while (1) {
+            lcm_handle_timeout(state->lcm, 100);
+            if (utime_now() - state->last_print_utime >= period_us) {
+                state->last_print_utime = utime_now();
+                print_stats(state);
+            }
+        }
+    }
+
+    instrument_window_destroy(state->window);
+    free(state);
+    getopt_destroy(gopt);
+    return res;
+}
@@ -0,0 +1,160 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/zarray.h"
+#include "vx/vx.h"
+
+// Incremental rendering of an append-only pose history (double[3]).
+//
+// Poses are packed into line-strip vertex resources of chunk_size
+// points. Once a chunk is full it is sealed: the layer keeps a
+// reference to it, so every frame re-uses the same resource and
+// webvx, which only transmits resources it has not sent yet, sends
+// just the small open chunk. The buffer is only swapped when new
+// poses arrived, so an idle trajectory costs nothing per frame.
+
+#define TRAJECTORY_LAYER_CHUNK_SIZE 1024
+
+typedef struct trajectory_layer trajectory_layer_t;
+struct trajectory_layer {
+    vx_buffer_t *vb;
+    float color[4];
+    float line_width;
+
+    zarray_t *chunks;  // vx_resource_t*, sealed
+    zarray_t *open;    // float[3], starts with the last sealed point
+    int consumed;      // poses of the source already appended
+
+    int has_pose;
+    double last[3];    // drawn as the robot
+};
+
+static inline trajectory_layer_t *trajectory_layer_create(vx_world_t *vw, const char *name,
+                                                          const float color[4])
+{
+    trajectory_layer_t *tl = calloc(1, sizeof(trajectory_layer_t));
+    tl->vb = vx_world_get_buffer(vw, name);
+    memcpy(tl->color, color, sizeof(float)*4);
+    tl->line_width = 2;
+    tl->chunks = zarray_create(sizeof(vx_resource_t*));
+    tl->open = zarray_create(sizeof(float[3]));
+    return tl;
+}
+
+static inline void trajectory_layer_reset(trajectory_layer_t *tl)
+{
+    for (int i = 0; i < zarray_size(tl->chunks); i++) {
+        vx_resource_t *resc;
+        zarray_get(tl->chunks, i, &resc);
+        resc->decref(resc);
+    }
+    zarray_clear(tl->chunks);
+    zarray_clear(tl->open);
+    tl->consumed = 0;
+    tl->has_pose = 0;
+}
+
+static inline void trajectory_layer_destroy(trajectory_layer_t *tl)
+{
+    if (tl == NULL)
+        return;
+
+    trajectory_layer_reset(tl);
+    zarray_destroy(tl->chunks);
+    zarray_destroy(tl->open);
+    free(tl);
+}
+
+// Appends the poses added to the source since the last call and
+// redraws if there were any. lock protects poses; it is held only
+// while the new poses are copied. A source that shrank is assumed to
+// have been cleared and restarts the trajectory.
+static inline void trajectory_layer_update(trajectory_layer_t *tl, const zarray_t *poses,
+                                           pthread_mutex_t *lock)
+{
+    zarray_t *fresh = NULL;
+    int reset = 0;
+
+    pthread_mutex_lock(lock);
+    int size = zarray_size(poses);
+    if (size < tl->consumed) {
+        trajectory_layer_reset(tl);
+        reset = 1;
+    }
+    if (size > tl->consumed) {
+        fresh = zarray_copy_subset(poses, tl->consumed, size);
+        tl->consumed = size;
+    }
+    pthread_mutex_unlock(lock);
+
+    if (fresh == NULL) {
+        if (reset)
+            vx_buffer_swap(tl->vb);
+        return;
+    }
+
+    for (int i = 0; i < zarray_size(fresh); i++) {
+        zarray_get(fresh, i, tl->last);
+        float xyz[3] = { tl->last[0], tl->last[1], 0 };
+        zarray_add(tl->open, xyz);
+
+        if (zarray_size(tl->open) == TRAJECTORY_LAYER_CHUNK_SIZE) {
+            vx_resource_t *resc = vx_resource_make_attr_f32_copy((float*) tl->open->data,
+                                                                 3*zarray_size(tl->open), 3);
+            vx_resource_incref(resc);
+            zarray_add(tl->chunks, &resc);
+
+            // keep the strip continuous across chunks
+            zarray_clear(tl->open);
+            zarray_add(tl->open, xyz);
+        }
+    }
+    tl->has_pose = 1;
+    zarray_destroy(fresh);
+
+    for (int i = 0; i < zarray_size(tl->chunks); i++) {
+        vx_resource_t *resc;
+        zarray_get(tl->chunks, i, &resc);
+        vx_buffer_add_back(tl->vb, vxo_line_strip(resc, tl->color, tl->line_width), NULL);
+    }
+
+    if (zarray_size(tl->open) > 1) {
+        vx_resource_t *resc = vx_resource_make_attr_f32_copy((float*) tl->open->data,
+                                                             3*zarray_size(tl->open), 3);
+        vx_buffer_add_back(tl->vb, vxo_line_strip(resc, tl->color, tl->line_width), NULL);
+    }
+
+    vx_buffer_add_back(tl->vb,
+                       vxo_depth_test(0,
+                                      vxo_matrix_xyt(tl->last),
+                                      vxo_robot_solid(tl->color),
+                                      NULL),
+                       NULL);
+    vx_buffer_swap(tl->vb);
+}
@@ -0,0 +1,626 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "common/c5.h"
+#include "common/doubles.h"
+#include "common/image_u8.h"
+#include "common/stype.h"
+#include "common/gridmap.h"
+#include "common/gridmap_util.h"
+
+#include "vx/vx.h"
+#include "vx/vxo_generic.h"
+
+#include "lcmtypes/grid_map_t.h"
+#include "lcmtypes/global_world_state_t.h"
+
+// Tiled store for the global world map displayed by the FLAG tools.
+//
+// The map is cut into square tiles of tile_size pixels, each
+// compressed with c5, behind an index. The file is mmap'd, so opening
+// it costs nothing; a tile is only read and decompressed when it is
+// displayed. Layout (native byte order):
+//
+//   struct world_tiles_header
+//   struct world_tiles_entry index[ntiles_x * ntiles_y]   (row major, ty*ntiles_x + tx)
+//   c5 tile data, followed by C5_PAD bytes of padding
+//
+// Tiles whose pixels all have the same value are not stored (their
+// entry has length 0 and gives the value). Pixel (x, y) of tile
+// (tx, ty) is map pixel (tx*tile_size + x, ty*tile_size + y); pixels
+// beyond the map's edge are 0.
+//
+// world_tiles_open() also accepts the legacy global_world_state_t
+// files, tiling them in memory on load; see
+// world_tiles_create_from_gws().
+
+#define WORLD_TILES_MAGIC 0x46575449 // "FWTI"
+#define WORLD_TILES_VERSION 1
+
+#define WORLD_TILES_DEFAULT_TILE_SIZE 256
+
+struct world_tiles_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tile_size;
+    uint32_t width, height;     // of the whole map, in pixels
+    uint32_t ntiles_x, ntiles_y;
+    uint32_t reserved;
+
+    double   x0, y0;
+    double   meters_per_pixel;
+
+    uint64_t index_offset;
+    uint64_t file_length;
+};
+
+struct world_tiles_entry
+{
+    uint64_t offset;
+    uint32_t length;  // of the compressed tile; 0 if uniformly 'fill'
+    uint32_t fill;
+};
+
+typedef struct world_tiles world_tiles_t;
+struct world_tiles
+{
+    const struct world_tiles_header *hdr;
+    const struct world_tiles_entry *index;
+
+    void  *data;
+    size_t datalen;
+    int    mapped; // munmap (rather than free) data
+};
+
+// Returns non-zero on error.
+static inline int world_tiles_bind(world_tiles_t *wt)
+{
+    const struct world_tiles_header *hdr = wt->data;
+
+    if (wt->datalen < sizeof(*hdr) ||
+        hdr->magic != WORLD_TILES_MAGIC ||
+        hdr->version != WORLD_TILES_VERSION ||
+        hdr->file_length != wt->datalen ||
+        hdr->tile_size == 0)
+        return -1;
+
+    uint64_t ntiles = (uint64_t) hdr->ntiles_x * hdr->ntiles_y;
+    if (hdr->index_offset + ntiles * sizeof(struct world_tiles_entry) > wt->datalen)
+        return -1;
+
+    const struct world_tiles_entry *index =
+        (const struct world_tiles_entry*) ((const uint8_t*) wt->data + hdr->index_offset);
+
+    // uc5 may read up to C5_PAD bytes beyond its input.
+    for (uint64_t i = 0; i < ntiles; i++) {
+        if (index[i].length > 0 && index[i].offset + index[i].length + C5_PAD > wt->datalen)
+            return -1;
+    }
+
+    wt->hdr = hdr;
+    wt->index = index;
+    return 0;
+}
+
+// Tiles a width x height map whose pixels are produced a band of
+// tile_size rows at a time: read_band(band, y, nrows, user) fills
+// band (width x nrows, row major) with rows y .. y+nrows-1 and
+// returns non-zero on error. Only one band of the map is ever
+// uncompressed. Returns NULL on error.
+static inline world_tiles_t *world_tiles_create_banded(uint32_t width, uint32_t height,
+                                                       double x0, double y0, double meters_per_pixel,
+                                                       int tile_size,
+                                                       int (*read_band)(uint8_t *band, uint32_t y,
+                                                                        uint32_t nrows, void *user),
+                                                       void *user)
+{
+    uint32_t ntiles_x = (width + tile_size - 1) / tile_size;
+    uint32_t ntiles_y = (height + tile_size - 1) / tile_size;
+    uint64_t ntiles = (uint64_t) ntiles_x * ntiles_y;
+    uint64_t index_offset = sizeof(struct world_tiles_header);
+    uint64_t data_offset = index_offset + ntiles * sizeof(struct world_tiles_entry);
+    size_t alloc = data_offset + C5_PAD + 4096;
+    size_t pos = data_offset;
+    uint8_t *data = calloc(1, alloc);
+    struct world_tiles_entry *index = calloc(ntiles > 0 ? ntiles : 1, sizeof(struct world_tiles_entry));
+    size_t tilelen = (size_t) tile_size * tile_size;
+    uint8_t *band = malloc((size_t) width * tile_size + 1);
+    uint8_t *tile = malloc(tilelen + C5_PAD);
+    uint8_t *c = malloc(tilelen * 2 + C5_PAD);
+    world_tiles_t *wt = NULL;
+
+    for (uint32_t ty = 0; ty < ntiles_y; ty++) {
+        uint32_t h = height - ty*tile_size;
+        if (h > tile_size)
+            h = tile_size;
+        if (read_band(band, ty*tile_size, h, user))
+            goto cleanup;
+
+        for (uint32_t tx = 0; tx < ntiles_x; tx++) {
+            struct world_tiles_entry *entry = &index[ty*ntiles_x + tx];
+            memset(tile, 0, tilelen);
+            uint32_t w = width - tx*tile_size;
+            if (w > tile_size)
+                w = tile_size;
+            for (uint32_t y = 0; y < h; y++)
+                memcpy(&tile[(size_t) y*tile_size], &band[(size_t) y*width + (size_t) tx*tile_size], w);
+
+            int uniform = 1;
+            for (size_t i = 1; i < tilelen && uniform; i++)
+                uniform = (tile[i] == tile[0]);
+            if (uniform) {
+                entry->fill = tile[0];
+                continue;
+            }
+
+            int32_t clen = 0;
+            c5(tile, tilelen, c, &clen);
+            while (pos + clen + C5_PAD > alloc) {
+                alloc *= 2;
+                data = realloc(data, alloc);
+            }
+            memcpy(&data[pos], c, clen);
+            entry->offset = pos;
+            entry->length = clen;
+            pos += clen;
+        }
+    }
+
+    // trailing pad for uc5
+    memset(&data[pos], 0, C5_PAD);
+    pos += C5_PAD;
+
+    struct world_tiles_header *hdr = (struct world_tiles_header*) data;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = WORLD_TILES_MAGIC;
+    hdr->version = WORLD_TILES_VERSION;
+    hdr->tile_size = tile_size;
+    hdr->width = width;
+    hdr->height = height;
+    hdr->ntiles_x = ntiles_x;
+    hdr->ntiles_y = ntiles_y;
+    hdr->x0 = x0;
+    hdr->y0 = y0;
+    hdr->meters_per_pixel = meters_per_pixel;
+    hdr->index_offset = index_offset;
+    hdr->file_length = pos;
+    memcpy(&data[index_offset], index, ntiles * sizeof(struct world_tiles_entry));
+
+    wt = calloc(1, sizeof(world_tiles_t));
+    wt->data = realloc(data, pos);
+    wt->datalen = pos;
+    data = NULL;
+    int res = world_tiles_bind(wt);
+    assert(!res);
+    (void) res;
+
+  cleanup:
+    free(data);
+    free(index);
+    free(band);
+    free(tile);
+    free(c);
+    return wt;
+}
+
+static inline int world_tiles_read_band_raw(uint8_t *band, uint32_t y, uint32_t nrows, void *user)
+{
+    const grid_map_t *gm = user;
+    memcpy(band, &gm->data[(size_t) y * gm->width], (size_t) nrows * gm->width);
+    return 0;
+}
+
+// Tiles an (uncompressed) grid map.
+static inline world_tiles_t *world_tiles_create(const grid_map_t *gm, int tile_size)
+{
+    assert(gm->encoding == GRID_MAP_T_ENCODING_NONE);
+    return world_tiles_create_banded(gm->width, gm->height, gm->x0, gm->y0, gm->meters_per_pixel,
+                                     tile_size, world_tiles_read_band_raw, (void*) gm);
+}
+
+struct world_tiles_gzip
+{
+    z_stream strm;
+    uint32_t width;
+};
+
+// inflates a GZIP-encoded grid map's pixels in order
+static inline int world_tiles_read_band_gzip(uint8_t *band, uint32_t y, uint32_t nrows, void *user)
+{
+    struct world_tiles_gzip *gz = user;
+
+    gz->strm.next_out = band;
+    gz->strm.avail_out = (size_t) nrows * gz->width;
+    while (gz->strm.avail_out > 0) {
+        int res = inflate(&gz->strm, Z_NO_FLUSH);
+        if (res == Z_STREAM_END)
+            return gz->strm.avail_out > 0;
+        if (res != Z_OK)
+            return -1;
+    }
+    return 0;
+}
+
+// legacy format: an stype-encoded global_world_state_t. A GZIP map is
+// inflated band by band as it is tiled, so the whole map is never
+// uncompressed at once.
+static inline world_tiles_t *world_tiles_create_from_gws(const char *path, int tile_size)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0L, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+
+    world_tiles_t *wt = NULL;
+    uint8_t *buf = malloc(len);
+    size_t sz = fread(buf, 1, len, fp);
+    fclose(fp);
+
+    if (sz != len)
+        goto cleanup;
+
+    uint32_t pos = 0;
+    global_world_state_t *gws = stype_decode_object(buf, &pos, len, NULL);
+    if (gws == NULL)
+        goto cleanup;
+    printf("NFO: Loaded global_world_state_t from %s - %ld bytes\n", path, len);
+
+    const grid_map_t *gm = &gws->global_map;
+    switch (gm->encoding) {
+        case GRID_MAP_T_ENCODING_NONE:
+            if ((size_t) gm->datalen >= (size_t) gm->width * gm->height)
+                wt = world_tiles_create(gm, tile_size);
+            break;
+        case GRID_MAP_T_ENCODING_GZIP: {
+            struct world_tiles_gzip gz;
+            memset(&gz, 0, sizeof(gz));
+            gz.width = gm->width;
+            gz.strm.next_in = (uint8_t*) gm->data;
+            gz.strm.avail_in = gm->datalen;
+            // zlib or gzip header, detected automatically
+            if (inflateInit2(&gz.strm, 15 + 32) != Z_OK)
+                break;
+            wt = world_tiles_create_banded(gm->width, gm->height, gm->x0, gm->y0, gm->meters_per_pixel,
+                                           tile_size, world_tiles_read_band_gzip, &gz);
+            inflateEnd(&gz.strm);
+            break;
+        }
+        default:
+            printf("ERR: encoding type %d not supported\n", gm->encoding);
+            break;
+    }
+    if (wt == NULL)
+        printf("ERR: unable to decode the map in %s\n", path);
+    global_world_state_t_destroy(gws);
+
+  cleanup:
+    free(buf);
+    return wt;
+}
+
+// Opens a tiled world map (mmap'd read-only) or, failing that, a
+// legacy global_world_state_t file. Returns NULL on error.
+static inline world_tiles_t *world_tiles_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    uint32_t magic = 0;
+    struct stat st;
+    if (fstat(fd, &st) || read(fd, &magic, sizeof(magic)) != sizeof(magic) ||
+        magic != WORLD_TILES_MAGIC) {
+        close(fd);
+        return world_tiles_create_from_gws(path, WORLD_TILES_DEFAULT_TILE_SIZE);
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    world_tiles_t *wt = calloc(1, sizeof(world_tiles_t));
+    wt->data = data;
+    wt->datalen = st.st_size;
+    wt->mapped = 1;
+
+    if (world_tiles_bind(wt)) {
+        fprintf(stderr, "world_tiles: %s is corrupt or of an unsupported version\n", path);
+        munmap(data, st.st_size);
+        free(wt);
+        return NULL;
+    }
+
+    return wt;
+}
+
+// Returns non-zero on error.
+static inline int world_tiles_write(const world_tiles_t *wt, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+
+    size_t res = fwrite(wt->data, 1, wt->datalen, f);
+    if (fclose(f) || res != wt->datalen)
+        return -1;
+    return 0;
+}
+
+static inline void world_tiles_destroy(world_tiles_t *wt)
+{
+    if (wt == NULL)
+        return;
+
+    if (wt->mapped)
+        munmap(wt->data, wt->datalen);
+    else
+        free(wt->data);
+    free(wt);
+}
+
+// Decompresses tile 'tile' (= ty*ntiles_x + tx) into a tile_size x
+// tile_size image. Returns NULL if the tile is corrupt.
+static inline image_u8_t *world_tiles_decode(const world_tiles_t *wt, int tile)
+{
+    const struct world_tiles_entry *entry = &wt->index[tile];
+    int tile_size = wt->hdr->tile_size;
+    int tilelen = tile_size * tile_size;
+
+    image_u8_t *im = image_u8_create_alignment(tile_size, tile_size, 1);
+
+    if (entry->length == 0) {
+        memset(im->buf, entry->fill, tilelen);
+        return im;
+    }
+
+    const uint8_t *in = (const uint8_t*) wt->data + entry->offset;
+    if (uc5_length(in, entry->length) != tilelen) {
+        image_u8_destroy(im);
+        return NULL;
+    }
+
+    uint8_t *out = malloc(tilelen + C5_PAD);
+    int outlen = 0;
+    uc5(in, entry->length, out, &outlen);
+    memcpy(im->buf, out, tilelen);
+    free(out);
+
+    return im;
+}
+
+////////////////////////////////////////////////////////////
+// Displays the tiles within 'radius' of a position, keeping the
+// most recently displayed 'capacity' tiles uploaded. (capacity is
+// raised to at least twice the number of tiles in view.)
+
+struct world_tiles_cache_entry
+{
+    int tile;
+    vx_object_t *vxo; // we hold a reference; NULL if transparent
+    uint64_t last_use;
+};
+
+typedef struct world_tiles_layer world_tiles_layer_t;
+struct world_tiles_layer
+{
+    const world_tiles_t *wt;
+    vx_buffer_t *vb;
+
+    double radius;  // meters; <= 0 displays every tile
+
+    struct world_tiles_cache_entry *cache;
+    int ncache, capacity;
+    uint64_t clock;
+
+    // what's currently drawn
+    int *visible;
+    int nvisible;
+    double map_to_world[3];
+    int drawn;
+};
+
+static inline world_tiles_layer_t *world_tiles_layer_create(vx_world_t *vw, const char *name,
+                                                            const world_tiles_t *wt,
+                                                            double radius, int capacity)
+{
+    uint64_t ntiles = (uint64_t) wt->hdr->ntiles_x * wt->hdr->ntiles_y;
+    uint64_t inview = ntiles;
+    if (radius > 0) {
+        uint64_t side = 2 * ceil(radius / (wt->hdr->tile_size * wt->hdr->meters_per_pixel)) + 1;
+        if (side * side < inview)
+            inview = side * side;
+    }
+    if (capacity < 2 * inview)
+        capacity = 2 * inview;
+
+    world_tiles_layer_t *wl = calloc(1, sizeof(world_tiles_layer_t));
+    wl->wt = wt;
+    wl->vb = vx_world_get_buffer(vw, name);
+    wl->radius = radius;
+    wl->capacity = capacity > 0 ? capacity : 1;
+    wl->cache = calloc(wl->capacity, sizeof(struct world_tiles_cache_entry));
+    wl->visible = calloc(ntiles + 1, sizeof(int));
+    return wl;
+}
+
+static inline void world_tiles_layer_destroy(world_tiles_layer_t *wl)
+{
+    if (wl == NULL)
+        return;
+
+    for (int i = 0; i < wl->ncache; i++) {
+        if (wl->cache[i].vxo)
+            wl->cache[i].vxo->decref(wl->cache[i].vxo);
+    }
+    free(wl->cache);
+    free(wl->visible);
+    free(wl);
+}
+
+// Returns the displayable object for a tile, decompressing and
+// uploading it if it's not in the cache. (NULL if it's transparent.)
+static inline vx_object_t *world_tiles_layer_get(world_tiles_layer_t *wl, int tile)
+{
+    wl->clock++;
+
+    for (int i = 0; i < wl->ncache; i++) {
+        if (wl->cache[i].tile == tile) {
+            wl->cache[i].last_use = wl->clock;
+            return wl->cache[i].vxo;
+        }
+    }
+
+    // evict the least recently used tile.
+    struct world_tiles_cache_entry *entry;
+    if (wl->ncache < wl->capacity) {
+        entry = &wl->cache[wl->ncache++];
+    } else {
+        entry = &wl->cache[0];
+        for (int i = 1; i < wl->ncache; i++) {
+            if (wl->cache[i].last_use < entry->last_use)
+                entry = &wl->cache[i];
+        }
+        if (entry->vxo)
+            entry->vxo->decref(entry->vxo);
+    }
+
+    entry->tile = tile;
+    entry->last_use = wl->clock;
+    entry->vxo = NULL;
+
+    const struct world_tiles_entry *index = &wl->wt->index[tile];
+    if (index->length == 0 && index->fill == 0)
+        return NULL;
+
+    image_u8_t *im = world_tiles_decode(wl->wt, tile);
+    if (im == NULL)
+        return NULL;
+
+    vx_resource_t *tex = vx_resource_make_texture_u8_copy(im, 0);
+    image_u8_destroy(im);
+
+    entry->vxo = vxo_image_tile(tex,
+                                vx_nada,
+                                vx_gray,
+                                vx_maroon,
+                                vx_orange);
+    vx_object_incref(entry->vxo);
+    return entry->vxo;
+}
+
+// Displays the tiles around world position xy (or around the map's
+// center when xy is NULL). map_to_world positions the map in the
+// world.
+// The buffer is only redrawn when the set of tiles or map_to_world
+// changes.
+static inline void world_tiles_layer_update(world_tiles_layer_t *wl, const double map_to_world[3],
+                                            const double *xy)
+{
+    const struct world_tiles_header *hdr = wl->wt->hdr;
+    double tile_meters = hdr->tile_size * hdr->meters_per_pixel;
+
+    int tx0 = 0, ty0 = 0, tx1 = hdr->ntiles_x - 1, ty1 = hdr->ntiles_y - 1;
+
+    if (wl->radius > 0) {
+        double map_xy[2] = { hdr->x0 + hdr->width * hdr->meters_per_pixel / 2,
+                             hdr->y0 + hdr->height * hdr->meters_per_pixel / 2 };
+        if (xy != NULL) {
+            double world_to_map[3];
+            doubles_xyt_inv(map_to_world, world_to_map);
+            doubles_xyt_transform_xy(world_to_map, xy, map_xy);
+        }
+
+        double fx0 = floor((map_xy[0] - wl->radius - hdr->x0) / tile_meters);
+        double fy0 = floor((map_xy[1] - wl->radius - hdr->y0) / tile_meters);
+        double fx1 = floor((map_xy[0] + wl->radius - hdr->x0) / tile_meters);
+        double fy1 = floor((map_xy[1] + wl->radius - hdr->y0) / tile_meters);
+
+        tx0 = fmax(tx0, fx0);
+        ty0 = fmax(ty0, fy0);
+        tx1 = fmin(tx1, fx1);
+        ty1 = fmin(ty1, fy1);
+    }
+
+    int nvisible = 0;
+    int changed = !wl->drawn || memcmp(map_to_world, wl->map_to_world, sizeof(wl->map_to_world));
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            int tile = ty * hdr->ntiles_x + tx;
+            if (nvisible >= wl->nvisible || wl->visible[nvisible] != tile)
+                changed = 1;
+            wl->visible[nvisible++] = tile;
+        }
+    }
+
+    if (nvisible != wl->nvisible)
+        changed = 1;
+    wl->nvisible = nvisible;
+
+    if (!changed)
+        return;
+
+    memcpy(wl->map_to_world, map_to_world, sizeof(wl->map_to_world));
+    wl->drawn = 1;
+
+    for (int i = 0; i < nvisible; i++) {
+        int tile = wl->visible[i];
+        vx_object_t *vxo = world_tiles_layer_get(wl, tile);
+        if (vxo == NULL)
+            continue;
+
+        int tx = tile % hdr->ntiles_x, ty = tile / hdr->ntiles_x;
+
+        vx_buffer_add_back(wl->vb,
+                           vxo_depth_test(0,
+                                          vxo_matrix_xyt(map_to_world),
+                                          vxo_chain(vxo_matrix_translate(hdr->x0 + tx * tile_meters,
+                                                                         hdr->y0 + ty * tile_meters, 0),
+                                                    vxo_matrix_scale(hdr->meters_per_pixel),
+                                                    vxo,
+                                                    NULL),
+                                          NULL),
+                           NULL);
+    }
+
+    vx_buffer_swap(wl->vb);
+}
@@ -2,7 +2,7 @@ SRCS = $(shell ls *.c)
 OBJS = $(SRCS:%.c=%.o)
 TARGET = $(BIN_PATH)/velodyne-to-corner
 
-CFLAGS := $(CFLAGS_STD) $(CFLAGS_COMMON) $(CFLAGS_VX) $(CFLAGS_LCMTYPES) $(CFLAGS_APRIL_VELODYNE)
+CFLAGS := $(CFLAGS_STD) -O3 $(CFLAGS_COMMON) $(CFLAGS_VX) $(CFLAGS_LCMTYPES) $(CFLAGS_APRIL_VELODYNE)
 LDFLAGS := $(LDFLAGS_STD) $(LDFLAGS_COMMON) $(LDFLAGS_VX) $(LDFLAGS_LCMTYPES) $(LDFLAGS_APRIL_VELODYNE)
 DEPS := $(DEPS_STD) $(DEPS_COMMON) $(DEPS_VX) $(DEPS_LCMTYPES) $(DEPS_APRIL_VELODYNE)
 
@@ -80,6 +80,7 @@ contourExtractor_t *contourExtractor_create()
     contourExtractor->alwaysAcceptDistance = 0.15;
 
     contourExtractor->contours = zarray_create(sizeof(zarray_t*));
+    contourExtractor->arena = arena_create(0);
     contourExtractor->extract = extract_contours;
     contourExtractor->clear = clear_contours;
 
@@ -93,11 +94,12 @@ void contourExtractor_destroy(contourExtractor_t* contourExtractor)
     if(contourExtractor) {
         contourExtractor->clear(contourExtractor);
         zarray_destroy(contourExtractor->contours);
+        arena_destroy(contourExtractor->arena);
         free(contourExtractor);
     }
 }
 
-// points: (x,y, height)
+// points: (x, y, dt), dt is the capture time relative to the sweep
 void extract_contours(contourExtractor_t* contourExtractor, zarray_t *points)
 {
     if(!points)
@@ -107,7 +109,7 @@ void extract_contours(contourExtractor_t* contourExtractor, zarray_t *points)
 
     int npoints = zarray_size(points);
     zarray_t *contours = contourExtractor->contours;
-    zarray_t *joins = zarray_create(sizeof(join_t));
+    zarray_t *joins = zarray_create_arena(contourExtractor->arena, sizeof(join_t));
     float point_i[3];
     float point_j[3];
     for (int i = 0; i < npoints; i++) {
@@ -137,8 +139,8 @@ void extract_contours(contourExtractor_t* contourExtractor, zarray_t *points)
     // Perform joins
 
     // Who is the left/right neighbor of each point?  If no neighbor, -1.
-    int *left = calloc(npoints, sizeof(int));
-    int *right = calloc(npoints, sizeof(int));
+    int *left = arena_alloc(contourExtractor->arena, npoints * sizeof(int));
+    int *right = arena_alloc(contourExtractor->arena, npoints * sizeof(int));
 
     for (int i = 0; i < npoints; i++) {
         left[i] = -1;
@@ -193,31 +195,21 @@ void extract_contours(contourExtractor_t* contourExtractor, zarray_t *points)
         if (left[root] >=0)
             continue;
 
-        zarray_t *contour = zarray_create(sizeof(float[3]));
+        zarray_t *contour = zarray_create_arena(contourExtractor->arena, sizeof(float[3]));
         for (int child = root; child >= 0; child = right[child]) {
             float point[3];
             zarray_get(points, child, point);
             zarray_add(contour, point);
         }
 
-        if (zarray_size(contour) >= contourExtractor->minPointsPerContour) {
+        if (zarray_size(contour) >= contourExtractor->minPointsPerContour)
             zarray_add(contours, &contour);
-        } else {
-            zarray_destroy(contour);
-        }
     }
-
-    zarray_destroy(joins);
-    free(left);
-    free(right);
 }
 
 void clear_contours(contourExtractor_t* contourExtractor)
 {
-    for(int i = 0; i < zarray_size(contourExtractor->contours); i++) {
-        zarray_t *contour;
-        zarray_get(contourExtractor->contours, i, &contour);
-        zarray_destroy(contour);
-    }
+    // the contours live in the arena
     zarray_clear(contourExtractor->contours);
+    arena_reset(contourExtractor->arena);
 }
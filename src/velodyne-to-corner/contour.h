@@ -24,6 +24,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include "common/zarray.h"
+#include "common/arena.h"
 #include "common/floats.h"
 
 typedef struct contourExtractor contourExtractor_t;
@@ -56,6 +57,9 @@ struct contourExtractor {
     void (*clear)(contourExtractor_t* contourExtractor);
     zarray_t* contours;
 
+    // holds the contours and the extraction's temporaries until clear
+    arena_t *arena;
+
 };
 
 contourExtractor_t *contourExtractor_create();
@@ -0,0 +1,366 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/math_util.h"
+
+#include "cornerdetector.h"
+
+// Spatial hash from a grid cell to the most recently inserted line
+// endpoint in that cell. The remaining endpoints in the cell are
+// chained through impl->next.
+static inline uint32_t cell_hash(uint64_t key)
+{
+    // splitmix64 finalizer; plain xor/multiply of packed cell
+    // coordinates clusters badly for small grids.
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (uint32_t) key;
+}
+
+#define TNAME endpoint_hash
+#define TVALTYPE int32_t
+#define TKEYTYPE uint64_t
+#define TKEYHASH(pk) cell_hash(*(pk))
+#define TKEYEQUAL(pka, pkb) (*(pka) == *(pkb))
+#include "common/thash_impl.h"
+#undef TKEYEQUAL
+#undef TKEYHASH
+#undef TKEYTYPE
+#undef TVALTYPE
+#undef TNAME
+
+typedef struct candidate {
+    int a, b;
+    float gap;
+} candidate_t;
+
+typedef struct cornerDetector_impl {
+    endpoint_hash_t *hash;
+    zarray_t *next;       // int32_t, endpoint chain
+    zarray_t *candidates; // candidate_t
+    zarray_t *la, *lb;    // line2D_t, batch inputs
+    zarray_t *inter;      // float[2], batch outputs
+    zarray_t *ok;         // uint8_t, batch outputs
+    zarray_t *scored;     // cornerFeature_t, before suppression
+} cornerDetector_impl_t;
+
+void extract_corners(cornerDetector_t* cornerDetector, const zarray_t *lineFeatures);
+void clear_corners(cornerDetector_t* cornerDetector);
+
+cornerDetector_t *cornerDetector_create()
+{
+    cornerDetector_t *cornerDetector = calloc(1, sizeof(cornerDetector_t));
+
+    // two lines are paired only if one endpoint of each is within
+    // this distance (in meters).
+    cornerDetector->maxEndpointDistance = 0.5;
+
+    // maximum deviation (radian) from perpendicular
+    cornerDetector->maxAngleError = to_radians(5);
+
+    // the intersection must be this close to both lines
+    cornerDetector->maxExtension = 0.75;
+
+    // corners closer than this are merged
+    cornerDetector->minCornerSeparation = 0.3;
+
+    cornerDetector->fullSupportPoints = 10;
+    cornerDetector->minQuality = 0.05;
+    cornerDetector->minLineSigma = 0.02;
+
+    cornerDetector->corners = zarray_create(sizeof(cornerFeature_t));
+    cornerDetector->extract = extract_corners;
+    cornerDetector->clear = clear_corners;
+
+    cornerDetector_impl_t *impl = calloc(1, sizeof(cornerDetector_impl_t));
+    impl->hash = endpoint_hash_create();
+    impl->next = zarray_create(sizeof(int32_t));
+    impl->candidates = zarray_create(sizeof(candidate_t));
+    impl->la = zarray_create(sizeof(line2D_t));
+    impl->lb = zarray_create(sizeof(line2D_t));
+    impl->inter = zarray_create(sizeof(float[2]));
+    impl->ok = zarray_create(sizeof(uint8_t));
+    impl->scored = zarray_create(sizeof(cornerFeature_t));
+    cornerDetector->impl = impl;
+
+    return cornerDetector;
+}
+
+void cornerDetector_destroy(cornerDetector_t *cornerDetector)
+{
+    if(cornerDetector) {
+        cornerDetector->clear(cornerDetector);
+        zarray_destroy(cornerDetector->corners);
+
+        cornerDetector_impl_t *impl = cornerDetector->impl;
+        endpoint_hash_destroy(impl->hash);
+        zarray_destroy(impl->next);
+        zarray_destroy(impl->candidates);
+        zarray_destroy(impl->la);
+        zarray_destroy(impl->lb);
+        zarray_destroy(impl->inter);
+        zarray_destroy(impl->ok);
+        zarray_destroy(impl->scored);
+        free(impl);
+
+        free(cornerDetector);
+    }
+}
+
+static inline uint64_t cell_key(int32_t cx, int32_t cy)
+{
+    return (((uint64_t) (uint32_t) cx) << 32) | ((uint64_t) (uint32_t) cy);
+}
+
+static inline const float *endpoint(const lineFeature_t *lines, int e)
+{
+    return (e & 1) ? lines[e >> 1].p2 : lines[e >> 1].p1;
+}
+
+static int candidate_compare(const void *_a, const void *_b)
+{
+    const candidate_t *a = _a;
+    const candidate_t *b = _b;
+    if (a->a != b->a)
+        return a->a < b->a ? -1 : 1;
+    if (a->b != b->b)
+        return a->b < b->b ? -1 : 1;
+    if (a->gap != b->gap)
+        return a->gap < b->gap ? -1 : 1;
+    return 0;
+}
+
+static int corner_quality_compare(const void *_a, const void *_b)
+{
+    const cornerFeature_t *a = _a;
+    const cornerFeature_t *b = _b;
+    if (a->quality != b->quality)
+        return a->quality > b->quality ? -1 : 1;
+    return 0;
+}
+
+// Offset variance of a fit line: the point residual averaged down by
+// the number of points, plus a floor for systematic error.
+static float line_offset_variance(const cornerDetector_t *cornerDetector, const lineFeature_t *line)
+{
+    return line->error / line->npoints + sq(cornerDetector->minLineSigma);
+}
+
+// The corner c solves [na'; nb'] c = [da; db] for the line normals
+// n and offsets d, so cov(c) = N^-1 diag(va, vb) N^-T.
+static void corner_covariance(const cornerDetector_t *cornerDetector,
+                              const lineFeature_t *la, const lineFeature_t *lb,
+                              float cov[3])
+{
+    float na[2] = { -la->line2D.dy, la->line2D.dx };
+    float nb[2] = { -lb->line2D.dy, lb->line2D.dx };
+    float va = line_offset_variance(cornerDetector, la);
+    float vb = line_offset_variance(cornerDetector, lb);
+
+    float det2 = sq(na[0]*nb[1] - na[1]*nb[0]);
+
+    cov[0] = (va*nb[1]*nb[1] + vb*na[1]*na[1]) / det2;
+    cov[1] = -(va*nb[1]*nb[0] + vb*na[1]*na[0]) / det2;
+    cov[2] = (va*nb[0]*nb[0] + vb*na[0]*na[0]) / det2;
+}
+
+static float closest_endpoint_distance(const lineFeature_t *line, const float p[2])
+{
+    float d1 = floats_distance(line->p1, p, 2);
+    float d2 = floats_distance(line->p2, p, 2);
+    return d1 < d2 ? d1 : d2;
+}
+
+void extract_corners(cornerDetector_t* cornerDetector, const zarray_t *lineFeatures)
+{
+    cornerDetector_impl_t *impl = cornerDetector->impl;
+    int nlines = zarray_size(lineFeatures);
+    if (nlines < 2)
+        return;
+
+    const lineFeature_t *lines = (const lineFeature_t*) lineFeatures->data;
+    const float cell = cornerDetector->maxEndpointDistance;
+    const float maxDot = sin(cornerDetector->maxAngleError);
+
+    // Bucket every line endpoint. The cell size equals the pairing
+    // distance, so any partner endpoint lies in the 3x3 neighborhood.
+    endpoint_hash_clear(impl->hash);
+    zarray_clear(impl->next);
+    for (int e = 0; e < 2*nlines; e++) {
+        const float *p = endpoint(lines, e);
+        uint64_t key = cell_key(floorf(p[0] / cell), floorf(p[1] / cell));
+        int32_t head = -1;
+        endpoint_hash_get(impl->hash, &key, &head);
+        zarray_add(impl->next, &head);
+        endpoint_hash_put(impl->hash, &key, &e, NULL, NULL);
+    }
+    const int32_t *next = (const int32_t*) impl->next->data;
+
+    // Collect nearly perpendicular pairs with close endpoints.
+    zarray_clear(impl->candidates);
+    for (int e = 0; e < 2*nlines; e++) {
+        int a = e >> 1;
+        const float *p = endpoint(lines, e);
+        int32_t cx = floorf(p[0] / cell);
+        int32_t cy = floorf(p[1] / cell);
+
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                uint64_t key = cell_key(cx + dx, cy + dy);
+                int32_t f = -1;
+                if (!endpoint_hash_get(impl->hash, &key, &f))
+                    continue;
+
+                for (; f >= 0; f = next[f]) {
+                    int b = f >> 1;
+                    // each unordered pair is considered from its lower index only
+                    if (b <= a)
+                        continue;
+
+                    float gap = floats_distance(p, endpoint(lines, f), 2);
+                    if (gap > cornerDetector->maxEndpointDistance)
+                        continue;
+
+                    float dot = lines[a].line2D.dx*lines[b].line2D.dx +
+                        lines[a].line2D.dy*lines[b].line2D.dy;
+                    if (fabsf(dot) > maxDot)
+                        continue;
+
+                    candidate_t c = { .a = a, .b = b, .gap = gap };
+                    zarray_add(impl->candidates, &c);
+                }
+            }
+        }
+    }
+
+    // A pair can match through up to four endpoint combinations;
+    // keep the closest one.
+    zarray_sort(impl->candidates, candidate_compare);
+    int ncandidates = 0;
+    candidate_t *candidates = (candidate_t*) impl->candidates->data;
+    for (int i = 0; i < zarray_size(impl->candidates); i++) {
+        if (ncandidates > 0 &&
+            candidates[ncandidates-1].a == candidates[i].a &&
+            candidates[ncandidates-1].b == candidates[i].b)
+            continue;
+        candidates[ncandidates++] = candidates[i];
+    }
+    zarray_truncate(impl->candidates, ncandidates);
+    if (ncandidates == 0)
+        return;
+
+    // Intersect all surviving pairs in one batch.
+    zarray_ensure_capacity(impl->la, ncandidates);
+    zarray_ensure_capacity(impl->lb, ncandidates);
+    zarray_clear(impl->la);
+    zarray_clear(impl->lb);
+    for (int i = 0; i < ncandidates; i++) {
+        zarray_add(impl->la, &lines[candidates[i].a].line2D);
+        zarray_add(impl->lb, &lines[candidates[i].b].line2D);
+    }
+    zarray_ensure_capacity(impl->inter, ncandidates);
+    zarray_ensure_capacity(impl->ok, ncandidates);
+    impl->inter->size = ncandidates;
+    impl->ok->size = ncandidates;
+
+    float (*inter)[2] = (float(*)[2]) impl->inter->data;
+    uint8_t *ok = (uint8_t*) impl->ok->data;
+    intersectionWith_batch((const line2D_t*) impl->la->data,
+                           (const line2D_t*) impl->lb->data,
+                           ncandidates, inter, ok);
+
+    // Score the corners.
+    zarray_t *corners = impl->scored;
+    zarray_clear(corners);
+    for (int i = 0; i < ncandidates; i++) {
+        if (!ok[i])
+            continue;
+
+        const lineFeature_t *la = &lines[candidates[i].a];
+        const lineFeature_t *lb = &lines[candidates[i].b];
+
+        if (closest_endpoint_distance(la, inter[i]) > cornerDetector->maxExtension ||
+            closest_endpoint_distance(lb, inter[i]) > cornerDetector->maxExtension)
+            continue;
+
+        float dot = fabsf(la->line2D.dx*lb->line2D.dx + la->line2D.dy*lb->line2D.dy);
+        float angleScore = 1 - asinf(min(dot, 1.0f)) / cornerDetector->maxAngleError;
+        float gapScore = 1 - candidates[i].gap / cornerDetector->maxEndpointDistance;
+        float supportScore = min(la->npoints, lb->npoints) / (float) cornerDetector->fullSupportPoints;
+        if (supportScore > 1)
+            supportScore = 1;
+
+        cornerFeature_t corner;
+        corner.xy[0] = inter[i][0];
+        corner.xy[1] = inter[i][1];
+        corner.theta = atan2f(inter[i][1], inter[i][0]);
+        corner.quality = angleScore * gapScore * supportScore;
+        corner.lineA = candidates[i].a;
+        corner.lineB = candidates[i].b;
+        corner.npoints = la->npoints + lb->npoints;
+        corner.dt = (la->dt*la->npoints + lb->dt*lb->npoints) / corner.npoints;
+        corner_covariance(cornerDetector, la, lb, corner.cov);
+
+        if (corner.quality < cornerDetector->minQuality)
+            continue;
+
+        zarray_add(corners, &corner);
+    }
+
+    // Non-maximum suppression: best corners first, drop any corner
+    // within minCornerSeparation of one already accepted.
+    zarray_sort(corners, corner_quality_compare);
+    int first = zarray_size(cornerDetector->corners);
+    for (int i = 0; i < zarray_size(corners); i++) {
+        cornerFeature_t *corner;
+        zarray_get_volatile(corners, i, &corner);
+
+        bool duplicate = false;
+        for (int j = first; j < zarray_size(cornerDetector->corners); j++) {
+            cornerFeature_t *accepted;
+            zarray_get_volatile(cornerDetector->corners, j, &accepted);
+            if (floats_distance(accepted->xy, corner->xy, 2) < cornerDetector->minCornerSeparation) {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (!duplicate)
+            zarray_add(cornerDetector->corners, corner);
+    }
+}
+
+void clear_corners(cornerDetector_t* cornerDetector)
+{
+    zarray_clear(cornerDetector->corners);
+}
@@ -0,0 +1,107 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "common/zarray.h"
+#include "common/floats.h"
+
+#include "linefitter.h"
+
+typedef struct cornerFeature cornerFeature_t;
+//2D
+struct cornerFeature {
+    // intersection of the two supporting lines, in the sensor frame
+    float xy[2];
+
+    // bearing of the corner as seen from the sensor (radian)
+    float theta;
+
+    // [0, 1], higher is better. Combines how close the two lines are
+    // to perpendicular, how close their endpoints are, and how many
+    // points support them.
+    float quality;
+
+    // indices into the lineFeatures array the corner was built from
+    int lineA, lineB;
+
+    // total number of points in the two supporting lines
+    int npoints;
+
+    // position covariance [xx, xy, yy] in m^2, propagated from the
+    // fit residuals of the two lines
+    float cov[3];
+
+    // mean capture time of the supporting points, relative to the
+    // sweep (s)
+    float dt;
+};
+
+typedef struct cornerDetector cornerDetector_t;
+//2D
+struct cornerDetector {
+    // two lines are paired only if one endpoint of each is within
+    // this distance (in meters). Also the cell size of the endpoint
+    // hash.
+    double maxEndpointDistance;
+
+    // maximum deviation (radian) from perpendicular
+    double maxAngleError;
+
+    // the intersection must be within this distance (in meters) of
+    // the closest endpoint of both lines; rejects lines whose
+    // extensions meet far away from the observed geometry.
+    double maxExtension;
+
+    // corners closer than this (in meters) are the same corner; only
+    // the best one is kept.
+    double minCornerSeparation;
+
+    // line support (points) at which the support term of the quality
+    // saturates.
+    int fullSupportPoints;
+
+    // corners below this quality are dropped
+    double minQuality;
+
+    // lower bound (in meters) on the offset uncertainty of a line,
+    // however well it fits
+    double minLineSigma;
+
+    /** Given the lines produced by a lineFitter, find all pairs of
+     * nearly perpendicular lines with nearby endpoints, regardless
+     * of the order the lines were fit in, and emit one corner per
+     * physical corner.
+     **/
+    void (*extract)(cornerDetector_t* cornerDetector, const zarray_t* lineFeatures);
+    void (*clear)(cornerDetector_t* cornerDetector);
+    zarray_t* corners; //cornerFeature_t
+
+    // scratch space, reused between sweeps
+    void *impl;
+};
+
+cornerDetector_t *cornerDetector_create();
+void cornerDetector_destroy(cornerDetector_t *cornerDetector);
@@ -0,0 +1,107 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <string.h>
+
+#include "common/doubles.h"
+#include "common/floats.h"
+#include "deskew.h"
+
+static void deskew_update_matrix(deskew_t *d)
+{
+    float XYT[16];
+    float fxyt[3] = { d->rel_xyt[0], d->rel_xyt[1], d->rel_xyt[2] };
+    floats_xyt_to_mat44(fxyt, XYT);
+    floats_mat_AB(XYT, 4, 4,
+                  d->xform, 4, 4,
+                  d->M, 4, 4);
+}
+
+void deskew_init(deskew_t *d, const float xform[16])
+{
+    memset(d, 0, sizeof(deskew_t));
+    d->mode = DESKEW_START;
+    memcpy(d->xform, xform, sizeof(d->xform));
+    memcpy(d->M, xform, sizeof(d->M));
+}
+
+void deskew_packet(deskew_t *d, const double *xyt)
+{
+    d->packet_has_pose = (xyt != NULL);
+    if (xyt)
+        memcpy(d->packet_xyt, xyt, sizeof(d->packet_xyt));
+
+    switch (d->mode) {
+        case DESKEW_START:
+            if (xyt) {
+                memcpy(d->sweep_xyt, xyt, sizeof(d->sweep_xyt));
+                d->mode = DESKEW_ON;
+            } else {
+                d->mode = DESKEW_OFF;
+            }
+            memset(d->rel_xyt, 0, sizeof(d->rel_xyt));
+            break;
+
+        case DESKEW_ON:
+            // without a pose, keep the last relative pose
+            if (xyt)
+                doubles_xyt_inv_mul(d->sweep_xyt, xyt, d->rel_xyt);
+            break;
+
+        case DESKEW_OFF:
+            break;
+    }
+
+    deskew_update_matrix(d);
+}
+
+int deskew_sweep(deskew_t *d, float inv[3])
+{
+    int on = (d->mode == DESKEW_ON);
+
+    if (on) {
+        double dinv[3];
+        doubles_xyt_inv(d->rel_xyt, dinv);
+        for (int i = 0; i < 3; i++)
+            inv[i] = dinv[i];
+
+        // the frame the sweep was just moved into (the current
+        // packet's pose, or its estimate).
+        double xyt[3];
+        doubles_xyt_mul(d->sweep_xyt, d->rel_xyt, xyt);
+        memcpy(d->sweep_xyt, xyt, sizeof(xyt));
+    } else if (d->packet_has_pose) {
+        memcpy(d->sweep_xyt, d->packet_xyt, sizeof(d->sweep_xyt));
+        d->mode = DESKEW_ON;
+    } else {
+        // the next packet with a pose starts it; the rest of this
+        // packet is off by at most one packet of motion.
+        d->mode = DESKEW_START;
+    }
+
+    // the rest of the current packet is the start of the next sweep
+    memset(d->rel_xyt, 0, sizeof(d->rel_xyt));
+    deskew_update_matrix(d);
+
+    return on;
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#pragma once
+
+// Motion compensation for a spinning lidar. Every packet is moved into
+// the frame of the sensor at the start of its sweep, using the body
+// pose at the packet's time. When the sweep completes, its points are
+// re-expressed in the frame of the packet that completed it.
+//
+// Sweeps end partway through a packet, so the completing packet is
+// split: deskew_sweep() rebases the transform (in place, while
+// april_velodyne_on_packet() is still using it) so that the rest of
+// that packet starts the next sweep in the right frame.
+//
+// A sweep that starts without a pose is not motion compensated. A
+// pose missing later in a sweep reuses the last known relative pose.
+
+enum { DESKEW_START, DESKEW_ON, DESKEW_OFF };
+
+typedef struct deskew deskew_t;
+struct deskew
+{
+    int mode;              // DESKEW_* for the current sweep
+
+    double sweep_xyt[3];   // body pose at the start of the sweep
+    double rel_xyt[3];     // current packet relative to sweep_xyt
+    double packet_xyt[3];  // current packet's pose, if packet_has_pose
+    int packet_has_pose;
+
+    float xform[16];       // sensor to body
+    float M[16];           // xform moved by rel_xyt: pass to april_velodyne_on_packet()
+};
+
+void deskew_init(deskew_t *d, const float xform[16]);
+
+// Call before handing a packet to april_velodyne_on_packet(), with the
+// body pose at the packet's time, or NULL if it is unknown (or
+// de-skew is disabled). Updates d->M.
+void deskew_packet(deskew_t *d, const double *xyt);
+
+// Call from on_sweep. Returns 1 if the completed sweep was motion
+// compensated, with 'inv' the transform taking its points into the
+// frame of the current packet; 0 if its points were left in the
+// sensor frame. Then starts the next sweep at the current packet.
+int deskew_sweep(deskew_t *d, float inv[3]);
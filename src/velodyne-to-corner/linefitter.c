@@ -48,6 +48,7 @@ lineFitter_t *lineFitter_create()
     lineFitter->maxSpan = 1.5;
 
     lineFitter->lineFeatures = zarray_create(sizeof(lineFeature_t));
+    lineFitter->arena = arena_create(0);
     lineFitter->extract = extract_lines;
     lineFitter->clear = clear_lines;
     return lineFitter;
@@ -58,6 +59,7 @@ void lineFitter_destroy(lineFitter_t *lineFitter)
     if(lineFitter) {
         lineFitter->clear(lineFitter);
         zarray_destroy(lineFitter->lineFeatures);
+        arena_destroy(lineFitter->arena);
         free(lineFitter);
     }
 }
@@ -144,6 +146,25 @@ int intersectionWith(line2D_t *la, line2D_t *lb, float inter[2])
     return 1;
 }
 
+void intersectionWith_batch(const line2D_t *la, const line2D_t *lb, int n,
+                            float (*inter)[2], uint8_t *ok)
+{
+    // Same algebra as intersectionWith(), solved with Cramer's rule
+    // for the parameter along la.
+    for (int i = 0; i < n; i++) {
+        float det = lb[i].dx*la[i].dy - la[i].dx*lb[i].dy;
+        float b00 = lb[i].p[0] - la[i].p[0];
+        float b10 = lb[i].p[1] - la[i].p[1];
+
+        int parallel = fabsf(det) < 1e-6f;
+        float x00 = (lb[i].dx*b10 - lb[i].dy*b00) / (parallel ? 1.0f : det);
+
+        inter[i][0] = la[i].dx*x00 + la[i].p[0];
+        inter[i][1] = la[i].dy*x00 + la[i].p[1];
+        ok[i] = !parallel;
+    }
+}
+
 
 void fitLine(fitterSegment_t *S, zarray_t *points)
 {
@@ -199,9 +220,9 @@ void fitLine(fitterSegment_t *S, zarray_t *points)
     S->error /= S->nPoints;
 }
 
-fitterSegment_t *fitterSegment_create(zarray_t *points, int i, int j)
+fitterSegment_t *fitterSegment_create(lineFitter_t *lineFitter, zarray_t *points, int i, int j)
 {
-    fitterSegment_t *fitterSegment = calloc(1, sizeof(fitterSegment_t));
+    fitterSegment_t *fitterSegment = arena_calloc(lineFitter->arena, 1, sizeof(fitterSegment_t));
     float a[3];
     float b[3];
     zarray_get(points, i, a);
@@ -231,7 +252,7 @@ fitterSegment_t *fitterSegment_create(zarray_t *points, int i, int j)
 fitterSegment_t* joinSegments(lineFitter_t *lineFitter, zarray_t *points,
                               fitterSegment_t *seg1, fitterSegment_t *seg2)
 {
-    fitterSegment_t *outseg = calloc(1, sizeof(fitterSegment_t));
+    fitterSegment_t *outseg = arena_calloc(lineFitter->arena, 1, sizeof(fitterSegment_t));
     outseg->mX=seg1->mX+seg2->mX;
     outseg->mXX=seg1->mXX+seg2->mXX;
     outseg->mY=seg1->mY+seg2->mY;
@@ -304,7 +325,7 @@ fitterSegment_t* joinSegments(lineFitter_t *lineFitter, zarray_t *points,
 
 join_t *join_create(lineFitter_t* lineFitter, zarray_t *points, fitterSegment_t *lS, fitterSegment_t *rS)
 {
-    join_t *join = calloc(1, sizeof(join_t));
+    join_t *join = arena_calloc(lineFitter->arena, 1, sizeof(join_t));
     join->leftSeg = lS;
     join->rightSeg = rS;
     join->leftrightSeg = joinSegments(lineFitter, points, lS, rS);
@@ -339,6 +360,10 @@ void extract_lines(lineFitter_t* lineFitter, zarray_t *contours)
         zarray_t *points;
         zarray_get(contours, contour_idx, &points);
         int npoints = zarray_size(points);
+
+        // segments and joins are released at the end of the contour
+        arena_checkpoint_t cp = arena_checkpoint(lineFitter->arena);
+
         for (int i = 0; i < npoints-1; i++) {
             float a[3];
             float b[3];
@@ -346,7 +371,7 @@ void extract_lines(lineFitter_t* lineFitter, zarray_t *contours)
             zarray_get(points, i+1, b);
             if (floats_distance(a, b, 2) > lineFitter->maxSpan)
                 continue;
-            fitterSegment_t *fitterSegment = fitterSegment_create(points, i, i+1);
+            fitterSegment_t *fitterSegment = fitterSegment_create(lineFitter, points, i, i+1);
             fitterSegment->id = zarray_size(segments);
             //printf("dxy: %f, %f \n", fitterSegment->line2D.dx, fitterSegment->line2D.dy);
             //printf("error %f, %d \n", fitterSegment->error, fitterSegment->nPoints);
@@ -374,19 +399,11 @@ void extract_lines(lineFitter_t* lineFitter, zarray_t *contours)
         while(zmaxheap_size(joins) > 0) {
             join_t *j;
             zmaxheap_remove_max(joins, &j, NULL);
-            if(j->deleted) {
-                free(j->leftrightSeg);
-                free(j);
+            if(j->deleted)
                 continue;
-            }
             // if this join has too great error, we're done.
-            if (j->leftrightSeg->error > lineFitter->errorThresh) {
-                //Clear memory taken by joins later
-                //A join that is not freed must be pointed by a join pointer in a segment.
-                free(j->leftrightSeg);
-                free(j);
+            if (j->leftrightSeg->error > lineFitter->errorThresh)
                 break;
-            }
             // otherwise, this join is a keeper. We'll take
             // j.leftrightSeg (which is already the union of the left
             // and right segments) and create two new joins connecting
@@ -398,9 +415,7 @@ void extract_lines(lineFitter_t* lineFitter, zarray_t *contours)
             //Then the union left-right-seg becomes the left seg of this join.
             j->leftrightSeg->id = j->leftSeg->id;
             zarray_set(segments, j->leftSeg->id, &(j->leftrightSeg), NULL);
-            //remove j;
             //The left seg is replaced by the leftrightSeg
-            free(j->leftSeg);
             j->rightSeg->deleted = true;
 
             if(leftJoin != NULL) {
@@ -420,7 +435,6 @@ void extract_lines(lineFitter_t* lineFitter, zarray_t *contours)
                 j->leftrightSeg->rightJoin = newj;
                 zmaxheap_add(joins, &newj, -newj->leftrightSeg->error);
             }
-            free(j);
         }
 
         /* for (int i = 0; i < zarray_size(segments); i++) { */
@@ -443,19 +457,24 @@ void extract_lines(lineFitter_t* lineFitter, zarray_t *contours)
                 lineFeature.p2[1] = segment->p2[1];
                 memcpy(&(lineFeature.line2D), &(segment->line2D), sizeof(line2D_t));
                 lineFeature.normal = computeNormal(segment->p1, segment->p2);
+                lineFeature.error = segment->error;
+                lineFeature.dt = 0;
+                for (int idx = segment->pLo; idx <= segment->pHi; idx++) {
+                    float p[3];
+                    zarray_get(points, idx, p);
+                    lineFeature.dt += p[2];
+                }
+                lineFeature.dt /= (segment->pHi - segment->pLo + 1);
                 zarray_add(lineFitter->lineFeatures, &lineFeature);
             }
             assert(segment->id == i);
-            free(segment);
         }
         zarray_clear(segments);
-        //release memory of rest of joins
-        while(zmaxheap_size(joins) > 0) {
-            join_t *j;
-            zmaxheap_remove_max(joins, &j, NULL);
-            free(j->leftrightSeg);
-            free(j);
-        }
+        //drop the rest of the joins
+        while(zmaxheap_size(joins) > 0)
+            zmaxheap_remove_max(joins, NULL, NULL);
+
+        arena_restore(lineFitter->arena, cp);
     }
     zarray_destroy(segments);
     zmaxheap_destroy(joins);
@@ -27,6 +27,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 
 #include "common/zarray.h"
 #include "common/zmaxheap.h"
+#include "common/arena.h"
 #include "common/floats.h"
 
 
@@ -49,6 +50,12 @@ struct lineFeature {
 
     //Line normal in angle(radian);
     float normal;
+
+    // mean distance^2 (in meters) of the points from the line
+    float error;
+
+    // mean capture time of the points, relative to the sweep (s)
+    float dt;
 };
 
 
@@ -75,6 +82,9 @@ struct lineFitter {
     void (*extract)(lineFitter_t* lineFitter, zarray_t* contours);
     void (*clear)(lineFitter_t* lineFitter);
     zarray_t* lineFeatures; //lineFeature_t
+
+    // segments and joins, released after each contour
+    arena_t *arena;
 };
 
 typedef struct fitterSegment fitterSegment_t;
@@ -113,3 +123,9 @@ struct join {
 lineFitter_t *lineFitter_create();
 void lineFitter_destroy(lineFitter_t *lineFitter);
 int intersectionWith(line2D_t *la, line2D_t *lb, float inter[2]);
+
+// Batch version of intersectionWith(): intersect la[i] with lb[i] for
+// i in [0, n). ok[i] is set to 0 for (nearly) parallel lines. The
+// loop is branch-free so it can be vectorized.
+void intersectionWith_batch(const line2D_t *la, const line2D_t *lb, int n,
+                            float (*inter)[2], uint8_t *ok);
@@ -24,6 +24,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
@@ -40,6 +41,8 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/doubles.h"
 #include "common/floats.h"
 #include "common/http_advertiser.h"
+#include "common/instrument.h"
+#include "common/instrument_lcm.h"
 #include "common/image_u8.h"
 #include "common/getopt.h"
 #include "common/gridmap.h"
@@ -47,17 +50,23 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include "common/interpolator.h"
 #include "common/math_util.h"
 #include "common/time_util.h"
+#include "common/arena.h"
 #include "common/zarray.h"
 #include "common/zqueue.h"
 
 #include "velodyne/april_velodyne.h"
 
+#include "lidar-FLAG/pipeline_trace.h"
+
 #include "vx/vx.h"
 #include "vx/webvx.h"
 
 #include "contour.h"
 #include "linefitter.h"
-#include "lcmtypes/line_features_t.h"
+#include "cornerdetector.h"
+#include "deskew.h"
+#include "lidar-FLAG/corner_features.h"
+#include "lcmtypes/corner_features_t.h"
 
 #define SLAM_SLOPE to_radians(80)
 #define MIN_RANGE 0.4
@@ -75,6 +84,7 @@ typedef struct point_accumulator {
     float z_min;
     float z_max;
     float xy[2];
+    int64_t utime; // stamp of the packet the point came from
 } point_accumulator_t;
 
 typedef struct state {
@@ -92,14 +102,33 @@ typedef struct state {
 
     // Velodyne management
     april_velodyne_t *velo;
-    zqueue_t* velodyne_msgs;
+    zqueue_t* velodyne_msgs;  // struct queued_packet
     pthread_mutex_t velodyne_msgs_mutex;
 
+    // LCM receive time of the packet being processed and of the
+    // current sweep's first packet, for the pipeline trace (see
+    // pipeline_trace.h).
+    int64_t packet_recv_utime;
+    int64_t sweep_recv_utime;
+
     char *map_channel;
     zarray_t *laser_points;
 
+    // Motion compensation (see deskew.h), using the interpolated
+    // POSE. A finished sweep is expressed in the frame of the packet
+    // that completed it, which is the time the corners are stamped with.
+    bool deskew;
+    interpolator_t *pose_interp;
+    pthread_mutex_t pose_lock;
+    deskew_t dsk;
+
     contourExtractor_t *contourExtractor;
     lineFitter_t *lineFitter;
+    cornerDetector_t *cornerDetector;
+
+    // per-sweep temporaries, reset after each sweep
+    arena_t *sweep_arena;
+
     double slope;
     double intercept;
 
@@ -165,25 +194,58 @@ void signal_handler(int sig)
     exit(sig);
 }
 
+struct queued_packet
+{
+    raw_t *msg;
+    int64_t recv_utime;
+};
+
 static void velodyne_callback(const lcm_recv_buf_t* rbuf,
                               const char* channel,
                               const raw_t* msg,
                               void* user)
 {
     state_t* state = (state_t*)user;
-    raw_t* msg_copy = raw_t_copy(msg);;
+    struct queued_packet packet = { .msg = raw_t_copy(msg),
+                                    .recv_utime = rbuf->recv_utime };
+
+    INSTRUMENT_COUNT("v2c.packets", 1);
 
     pthread_mutex_lock(&state->velodyne_msgs_mutex);
-    zqueue_push(state->velodyne_msgs, &msg_copy);
+    zqueue_push(state->velodyne_msgs, &packet);
     while (zqueue_size(state->velodyne_msgs) > 90) {
-        raw_t *vmsg;
-        zqueue_pop(state->velodyne_msgs, &vmsg);
-        raw_t_destroy(vmsg);
+        struct queued_packet old;
+        zqueue_pop(state->velodyne_msgs, &old);
+        raw_t_destroy(old.msg);
+        INSTRUMENT_COUNT("v2c.packets_dropped", 1);
     }
     pthread_mutex_unlock(&state->velodyne_msgs_mutex);
 }
 
 
+static void on_pose(const lcm_recv_buf_t *rbuf,
+                    const char *channel, const pose_t *msg, void *user)
+{
+    state_t *state = user;
+    pthread_mutex_lock(&state->pose_lock);
+    interpolator_add(state->pose_interp, msg);
+    pthread_mutex_unlock(&state->pose_lock);
+}
+
+// Planar pose at utime. Returns 0 if no POSE is close enough.
+static int get_pose_xyt(state_t *state, int64_t utime, double xyt[3])
+{
+    pose_t pose;
+    pthread_mutex_lock(&state->pose_lock);
+    int ret = interpolator_get(state->pose_interp, utime, &pose);
+    pthread_mutex_unlock(&state->pose_lock);
+    if (ret == -2)
+        return 0;
+
+    doubles_quat_xyz_to_xyt(pose.orientation, pose.pos, xyt);
+    return 1;
+}
+
 uint64_t reverse(uint64_t orig)
 {
     uint64_t ret = 0;
@@ -197,7 +259,10 @@ uint64_t reverse(uint64_t orig)
     return ret;
 }
 
-static void render_data(state_t *state)
+// 'trace' holds the sweep's stamps so far; it is published (ahead of
+// the features, so downstream has it by the time they arrive) if
+// corner features are.
+static void render_data(state_t *state, pipeline_trace_t *trace)
 {
     if (zarray_size(state->pts) <= 0)
         return;
@@ -220,8 +285,8 @@ static void render_data(state_t *state)
 
     if (state->debug) {
         //vx_buffer_t *vb = vx_world_get_buffer(state->vw, "accumulated_points");
-        zarray_t *pts = zarray_create(sizeof(float[3]));
-        zarray_t *intensities = zarray_create(sizeof(float));
+        zarray_t *pts = zarray_create_arena(state->sweep_arena, sizeof(float[3]));
+        zarray_t *intensities = zarray_create_arena(state->sweep_arena, sizeof(float));
         if(1) {
             for(int i = 0; i < zarray_size(state->laser_points); i++) {
                 point_accumulator_t point;
@@ -238,7 +303,8 @@ static void render_data(state_t *state)
                     if(point.z_max < 0.6)
                         continue;
                 }
-                float xyz[3] = {point.xy[0], point.xy[1], 0};
+                float dt = (point.utime - state->msg->utime) * 1E-6;
+                float xyz[3] = {point.xy[0], point.xy[1], dt};
                 zarray_add(pts, xyz);
                 //float intensity = point.z_max;
                 float intensity = (point.z_max - point.z_min);
@@ -293,40 +359,38 @@ static void render_data(state_t *state)
                 state->lineFitter->extract(state->lineFitter, state->contourExtractor->contours);
                 //printf("Num of lines: %d\n", zarray_size(state->lineFitter->lineFeatures));
                 vx_buffer_t *vb = vx_world_get_buffer(state->vw, "lines");
+                state->cornerDetector->extract(state->cornerDetector,
+                                               state->lineFitter->lineFeatures);
+
+                int nlines = zarray_size(state->lineFitter->lineFeatures);
+                int ncorners = zarray_size(state->cornerDetector->corners);
+                uint8_t *in_corner = arena_calloc(state->sweep_arena, nlines, sizeof(uint8_t));
+                flag_corner_t *flag_corners = arena_calloc(state->sweep_arena, ncorners + 1, sizeof(flag_corner_t));
+                for(int i = 0; i < ncorners; i++) {
+                    cornerFeature_t *corner;
+                    zarray_get_volatile(state->cornerDetector->corners, i, &corner);
+                    in_corner[corner->lineA] = 1;
+                    in_corner[corner->lineB] = 1;
+                    vx_buffer_add_back(vb,
+                                       vxo_matrix_translate(corner->xy[0], corner->xy[1], 0.02),
+                                       vxo_matrix_scale(0.3),
+                                       vxo_square_solid(vx_green),
+                                       NULL);
+
+                    flag_corners[i] = (flag_corner_t) { .xy = { corner->xy[0], corner->xy[1] },
+                                                       .theta = corner->theta,
+                                                       .cov = { corner->cov[0], corner->cov[1], corner->cov[2] },
+                                                       .quality = corner->quality,
+                                                       .npoints = corner->npoints,
+                                                       .utime = state->msg->utime + (int64_t) (corner->dt * 1E6) };
+                }
+                corner_features_t *corner_features = corner_features_create_from(state->msg->utime,
+                                                                                 flag_corners, ncorners);
+
                 lineFeature_t line;
-                lineFeature_t lineNext;
-                float *color;
-                int skip = 3;
-                zarray_t *lines = zarray_create(sizeof(float[3]));
-                for(int i = 0; i< zarray_size(state->lineFitter->lineFeatures); i++) {
-                    color = vx_white;
+                for(int i = 0; i< nlines; i++) {
                     zarray_get(state->lineFitter->lineFeatures, i, &line);
-                    //TODO: Should not use min, it should mod.
-                    for(int j = i+1; j < i+1+skip; j++) {
-                        int idx_j = j % zarray_size(state->lineFitter->lineFeatures);
-                        zarray_get(state->lineFitter->lineFeatures, idx_j, &lineNext);
-                        //check normal
-                        if(fabs(mod2pi(lineNext.normal - line.normal)) < M_PI /2 + to_radians(5) &&
-                           fabs(mod2pi(lineNext.normal - line.normal)) > M_PI /2 - to_radians(5)) {
-                            //check distances
-                            if(floats_distance(line.p2, lineNext.p1, 2) < 0.5) {
-                                //TODO: We should check with same i, what is the best corner.
-                                //printf("i - j : %d - %d, %f \n", i, idx_j, to_degrees(mod2pi(lineNext.normal - line.normal)));
-                                color = vx_blue;
-                                float corner[2];
-                                if(intersectionWith(&line.line2D, &lineNext.line2D, corner)) {
-                                    vx_buffer_add_back(vb,
-                                                       vxo_matrix_translate(corner[0], corner[1], 0.02),
-                                                       vxo_matrix_scale(0.3),
-                                                       vxo_square_solid(vx_green),
-                                                       NULL);
-
-                                    float corner_theta[3] = {corner[0], corner[1], atan2(corner[1], corner[0])};
-                                    zarray_add(lines, corner_theta);
-                                }
-                            }
-                        }
-                    }
+                    float *color = in_corner[i] ? vx_blue : vx_white;
                     float line_points[6] = {line.p1[0], line.p1[1], 0, line.p2[0], line.p2[1], 0};
                     vx_resource_t *vr = vx_resource_make_attr_f32_copy(line_points,
                                                                        6,
@@ -342,21 +406,19 @@ static void render_data(state_t *state)
                 }
 
                 vx_buffer_swap(vb);
+                state->cornerDetector->clear(state->cornerDetector);
                 state->lineFitter->clear(state->lineFitter);
 
-                line_features_t line_features = {0};
-                line_features.utime = state->msg->utime;
-                line_features.lines_data_length = zarray_size(lines) * 3;
-                line_features.lines = (float*) lines->data;
                 //landmark select
-                line_features_t_publish(state->lcm, "LOCAL_LINE_FEATURES", &line_features);
-                printf("--------------------publish corner features:%d\n", zarray_size(lines));
-                zarray_destroy(lines);
+                pipeline_trace_stamp(trace, "features_published", utime_now());
+                pipeline_trace_t_publish(state->lcm, PIPELINE_TRACE_FEATURES_CHANNEL, trace);
+                corner_features_t_publish(state->lcm, "LOCAL_CORNER_FEATURES", corner_features);
+                printf("--------------------publish corner features:%d\n", ncorners);
+                corner_features_t_destroy(corner_features);
             }
             state->contourExtractor->clear(state->contourExtractor);
         }
-        zarray_destroy(pts);
-        zarray_destroy(intensities);
+        arena_reset(state->sweep_arena);
     }
     zarray_clear(pts);
     zarray_clear(intensities);
@@ -444,6 +506,7 @@ static void on_slice(const zarray_t *pts,
                 }
             } else {
                 //Different objects
+                point.utime = state->msg->utime;
                 zarray_add(state->laser_points, &point);
                 point.acc = 0;
                 point.z_min = 10000;
@@ -452,6 +515,7 @@ static void on_slice(const zarray_t *pts,
         }
     }
     if(point.acc) {
+        point.utime = state->msg->utime;
         zarray_add(state->laser_points, &point);
     }
 }
@@ -459,10 +523,51 @@ static void on_slice(const zarray_t *pts,
 static void on_sweep(void *user)
 {
     state_t *state = user;
+    INSTRUMENT_SPAN_BEGIN(ns_sweep);
+
+    // keyed like the corner features this sweep may produce
+    pipeline_trace_t trace;
+    pipeline_trace_init(&trace, state->msg->utime, "velodyne-to-corner");
+    pipeline_trace_stamp(&trace, PIPELINE_TRACE_FIRST_STAGE, state->sweep_recv_utime);
+    pipeline_trace_stamp(&trace, "sweep_complete", utime_now());
+
+    // the rest of the current packet starts the next sweep
+    state->sweep_recv_utime = state->packet_recv_utime;
+
+    // Points are in the frame of the first packet; move them into
+    // the frame of the current one. They now describe the scene at
+    // state->msg->utime, so restamp them too. This also rebases the
+    // transform for the rest of the packet.
+    float finv[3];
+    if (deskew_sweep(&state->dsk, finv)) {
+
+        for (int i = 0; i < zarray_size(state->laser_points); i++) {
+            point_accumulator_t *point;
+            zarray_get_volatile(state->laser_points, i, &point);
+            float xy[2];
+            floats_xyt_transform_xy(finv, point->xy, xy);
+            point->xy[0] = xy[0];
+            point->xy[1] = xy[1];
+            point->utime = state->msg->utime;
+        }
+
+        for (int i = 0; i < zarray_size(state->pts); i++) {
+            float *xyz;
+            zarray_get_volatile(state->pts, i, &xyz);
+            float xy[2];
+            floats_xyt_transform_xy(finv, xyz, xy);
+            xyz[0] = xy[0];
+            xyz[1] = xy[1];
+        }
+    }
 
     // Debugging
-    render_data(state);
+    render_data(state, &trace);
+    pipeline_trace_clear(&trace);
     zarray_clear(state->laser_points);
+
+    INSTRUMENT_SPAN_END("v2c.sweep", ns_sweep);
+    INSTRUMENT_COUNT("v2c.sweeps", 1);
 }
 
 void *process_velodyne_data(void* arg)
@@ -492,6 +597,8 @@ void *process_velodyne_data(void* arg)
             xform[i] = (float)xform_[i];
     }
 
+    deskew_init(&state->dsk, xform);
+
     while (1) {
         pthread_mutex_lock(&state->velodyne_msgs_mutex);
         if (zqueue_size(state->velodyne_msgs) <= delay) {
@@ -499,24 +606,31 @@ void *process_velodyne_data(void* arg)
             timeutil_usleep(10000);
             continue;
         }
-        zqueue_pop(state->velodyne_msgs, &state->msg);
+        struct queued_packet packet;
+        zqueue_pop(state->velodyne_msgs, &packet);
         pthread_mutex_unlock(&state->velodyne_msgs_mutex);
 
-        float M[16];
-        float XYT[16];
-        float fxyt[3] = {0, 0, 0};
-        floats_xyt_to_mat44(fxyt, XYT);
-        floats_mat_AB(XYT, 4, 4,
-                      xform, 4, 4,
-                      M, 4, 4);
+        state->msg = packet.msg;
+        state->packet_recv_utime = packet.recv_utime;
+        if (state->sweep_recv_utime == 0)
+            state->sweep_recv_utime = packet.recv_utime;
 
+        // De-skew: pose of this packet relative to the start of the sweep
+        double xyt[3];
+        int has_pose = state->deskew && get_pose_xyt(state, state->msg->utime, xyt);
+        deskew_packet(&state->dsk, has_pose ? xyt : NULL);
+
+        // includes on_sweep for the packet that completes a sweep,
+        // which updates dsk.M for the rest of the packet.
+        INSTRUMENT_SPAN_BEGIN(ns_packet);
         april_velodyne_on_packet(state->velo,
                                  state->msg->buf,
                                  state->msg->len,
-                                 M,
+                                 state->dsk.M,
                                  on_slice,
                                  on_sweep,
                                  state);
+        INSTRUMENT_SPAN_END("v2c.packet", ns_packet);
 
         raw_t_destroy(state->msg);
     }
@@ -547,6 +661,8 @@ void init_state(state_t* state, getopt_t *gopt)
     state->intensities = zarray_create(1*sizeof(float));
     state->contourExtractor = contourExtractor_create();
     state->lineFitter = lineFitter_create();
+    state->cornerDetector = cornerDetector_create();
+    state->sweep_arena = arena_create(0);
 
     // Initialize LCM/message
     state->lcm = lcm_create(NULL);
@@ -555,7 +671,7 @@ void init_state(state_t* state, getopt_t *gopt)
     state->laser_points = zarray_create(sizeof(point_accumulator_t));
 
     // Velodyne msg queue
-    state->velodyne_msgs = zqueue_create(sizeof(raw_t*));
+    state->velodyne_msgs = zqueue_create(sizeof(struct queued_packet));
     zqueue_ensure_capacity(state->velodyne_msgs, 100);
     if(!state->lcm) {
         printf("[ERROR] impossible to initialize LCM environment... quitting!");
@@ -564,6 +680,14 @@ void init_state(state_t* state, getopt_t *gopt)
 
     state->velo = april_velodyne_create();
 
+    state->deskew = !getopt_get_bool(gopt, "no-deskew");
+    pthread_mutex_init(&state->pose_lock, NULL);
+    state->pose_interp = interpolator_create(sizeof(pose_t), offsetof(pose_t, utime), 5.0, 100E3);
+    interpolator_add_field(state->pose_interp, INTERPOLATOR_DOUBLE_LINEAR,
+                           3, offsetof(pose_t, pos));
+    interpolator_add_field(state->pose_interp, INTERPOLATOR_DOUBLE_QUAT,
+                           4, offsetof(pose_t, orientation));
+
     // Initialize robot-specific config
     state->config = config_create_path(getopt_get_string(gopt, "config"));
 }
@@ -580,6 +704,9 @@ int main(int argc, char *argv[])
     getopt_add_bool(gopt, 'd', "debug", 0, "Debugging visualization");
     getopt_add_int(gopt, 'p', "port", "8899", "vx port");
     getopt_add_string(gopt, '\0', "lidar-channel", "VELODYNE_DATA", "Velodyne channel");
+    getopt_add_string(gopt, '\0', "pose-channel", "POSE", "Pose channel used to de-skew sweeps");
+    getopt_add_bool(gopt, '\0', "no-deskew", 0, "Do not motion-compensate sweeps");
+    getopt_add_double(gopt, '\0', "instrument-hz", "1", "INSTRUMENT report rate (0 = none)");
 
     if (!getopt_parse(gopt, argc, argv, 0)) {
         fprintf(stderr, "ERR: getopt_parse\n");
@@ -613,8 +740,14 @@ int main(int argc, char *argv[])
     vx_buffer_swap(vx_world_get_buffer(state->vw, "robot"));
 
 
+    if (getopt_get_double(gopt, "instrument-hz") > 0)
+        instrument_publisher_create(state->lcm, INSTRUMENT_CHANNEL, "velodyne-to-corner",
+                                    getopt_get_double(gopt, "instrument-hz"));
+
     // subscribe to velodyne data channel
     raw_t_subscribe(state->lcm, getopt_get_string(gopt, "lidar-channel"), velodyne_callback, state);
+    if (state->deskew)
+        pose_t_subscribe(state->lcm, getopt_get_string(gopt, "pose-channel"), on_pose, state);
     // run the loop
     while(1) {
         lcm_handle(state->lcm);
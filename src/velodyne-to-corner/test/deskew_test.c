@@ -0,0 +1,207 @@
+/* Copyright (C) 2013-2019, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*$LICENSE*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common/doubles.h"
+#include "common/floats.h"
+#include "common/zarray.h"
+#include "velodyne/april_velodyne.h"
+#include "../deskew.h"
+
+// Drives deskew through april_velodyne_on_packet() with synthetic
+// VLP-16 packets from a sensor that moves and turns inside a circular
+// wall. Every de-skewed sweep, put back in the world with the frame
+// deskew reports, must lie on the wall: this catches the packet that
+// completes a sweep using the old sweep's frame, and missing poses.
+
+#define WALL_R 30.0
+#define RPM_HZ 10.0
+#define PACKET_US 1330             // 12 blocks
+#define BLOCK_DEG (360.0 * RPM_HZ * PACKET_US / 12 / 1e6)
+
+static const float vert_deg[16] = { -15, 1, -13, 3, -11, 5, -9, 7, -7, 9, -5, 11, -3, 13, -1, 15 };
+
+// body pose at time t (seconds): driving an arc
+static void truth_xyt(double t, double xyt[3])
+{
+    xyt[0] = -8 + 4.0*t;
+    xyt[1] = 3 + 1.5*t;
+    xyt[2] = 0.3 + 0.6*t;
+}
+
+// range along the world direction 'ang' from p to the wall
+static double wall_dist(const double p[3], double ang)
+{
+    double u[2] = { cos(ang), sin(ang) };
+    double pu = p[0]*u[0] + p[1]*u[1];
+    double pp = p[0]*p[0] + p[1]*p[1];
+    return -pu + sqrt(pu*pu - pp + WALL_R*WALL_R);
+}
+
+// VLP-16 packet: 12 blocks of two 16-laser firings.
+static void make_packet(uint8_t *buf, int64_t utime, double *azimuth_deg)
+{
+    memset(buf, 0, 1206);
+    buf[1204] = VELO_FACTORY_STRONGEST_RETURN;
+    buf[1205] = VELO_FACTORY_VLP_16;
+
+    for (int b = 0; b < 12; b++) {
+        uint8_t *data = &buf[100*b];
+        double t = (utime + b * PACKET_US / 12.0) * 1e-6;
+        double xyt[3];
+        truth_xyt(t, xyt);
+
+        int raw = ((int) lround(*azimuth_deg * 100)) % 36000;
+        data[0] = 0xff;
+        data[1] = 0xee;
+        data[2] = raw & 0xff;
+        data[3] = raw >> 8;
+
+        for (int l = 0; l < 32; l++) {
+            // the library puts azimuth at -raw, and the second firing
+            // half a block further along.
+            double az = -(*azimuth_deg + (l >= 16 ? BLOCK_DEG / 2 : 0)) * M_PI / 180;
+            double c_psi = cos(vert_deg[l % 16] * M_PI / 180);
+            double range = wall_dist(xyt, xyt[2] + az) / c_psi;
+            int r = (int) lround(range / 0.002);
+            data[4 + 3*l + 0] = r & 0xff;
+            data[4 + 3*l + 1] = r >> 8;
+            data[4 + 3*l + 2] = 100;
+        }
+
+        *azimuth_deg = fmod(*azimuth_deg + BLOCK_DEG, 360);
+    }
+}
+
+struct sim
+{
+    deskew_t dsk;
+    zarray_t *pts;      // float[2] of the current sweep
+    int nsweeps;
+    int nchecked;
+    double maxerr;
+};
+
+static void on_slice(const zarray_t *pts, const zarray_t *ranges, const zarray_t *intensities,
+                     uint8_t mode, void *user)
+{
+    struct sim *sim = user;
+    for (int i = 0; i < zarray_size(pts); i++) {
+        float *xyz;
+        zarray_get_volatile(pts, i, &xyz);
+        float range;
+        zarray_get(ranges, i, &range);
+        if (range > 0)
+            zarray_add(sim->pts, xyz);
+    }
+}
+
+static void on_sweep(void *user)
+{
+    struct sim *sim = user;
+    float inv[3];
+    int on = deskew_sweep(&sim->dsk, inv);
+
+    // the first sweep starts mid-rotation, with an unknown theta step
+    if (on && sim->nsweeps > 0) {
+        float fsweep[3] = { sim->dsk.sweep_xyt[0], sim->dsk.sweep_xyt[1], sim->dsk.sweep_xyt[2] };
+        for (int i = 0; i < zarray_size(sim->pts); i++) {
+            float *xyz;
+            zarray_get_volatile(sim->pts, i, &xyz);
+            float local[2], world[2];
+            floats_xyt_transform_xy(inv, xyz, local);
+            floats_xyt_transform_xy(fsweep, local, world);
+            double err = fabs(sqrt(world[0]*world[0] + world[1]*world[1]) - WALL_R);
+            if (err > sim->maxerr)
+                sim->maxerr = err;
+        }
+        sim->nchecked++;
+    }
+
+    sim->nsweeps++;
+    zarray_clear(sim->pts);
+}
+
+// returns the worst distance from the wall over the checked sweeps
+static double run(int drop_every, int drop_first, int *nchecked)
+{
+    struct sim sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.pts = zarray_create(3*sizeof(float));
+
+    float xform[16];
+    float zero[3] = { 0, 0, 0 };
+    floats_xyt_to_mat44(zero, xform);
+    deskew_init(&sim.dsk, xform);
+
+    april_velodyne_t *velo = april_velodyne_create();
+    uint8_t buf[1206];
+    double azimuth = 123.4;
+
+    for (int p = 0; p < 3000; p++) {
+        int64_t utime = (int64_t) p * PACKET_US;
+        make_packet(buf, utime, &azimuth);
+
+        // pose at the middle of the packet, sometimes missing
+        double xyt[3];
+        truth_xyt((utime + PACKET_US / 2) * 1e-6, xyt);
+        int missing = (drop_every && p % drop_every < 3) || p < drop_first;
+        deskew_packet(&sim.dsk, missing ? NULL : xyt);
+
+        april_velodyne_on_packet(velo, buf, sizeof(buf), sim.dsk.M, on_slice, on_sweep, &sim);
+    }
+
+    april_velodyne_destroy(velo);
+    zarray_destroy(sim.pts);
+    *nchecked = sim.nchecked;
+    return sim.maxerr;
+}
+
+int main(int argc, char *argv[])
+{
+    int nchecked;
+
+    // one sweep moves the sensor about 0.4 m and turns it 3.4 degrees;
+    // within a packet, motion is a few millimeters.
+    double err = run(0, 0, &nchecked);
+    printf("all poses:         %3d sweeps, max wall error %.4f m\n", nchecked, err);
+    assert(nchecked > 30 && err < 0.02);
+
+    // three missing poses out of every 50 packets
+    err = run(50, 0, &nchecked);
+    printf("missing poses:     %3d sweeps, max wall error %.4f m\n", nchecked, err);
+    assert(nchecked > 30 && err < 0.05);
+
+    // no pose for the first sweep and a half: those sweeps are skipped
+    err = run(0, 110, &nchecked);
+    printf("late first pose:   %3d sweeps, max wall error %.4f m\n", nchecked, err);
+    assert(nchecked > 30 && err < 0.02);
+
+    printf("ok\n");
+    return 0;
+}